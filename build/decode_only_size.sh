@@ -0,0 +1,42 @@
+#!/bin/sh
+# Builds source/unit-test/decode_only_size.cpp twice, against a full zstd and as XCOMPRESSION_DECODE_ONLY against a
+# zstd without its compressor, then prints the size of the stripped executables and their time to the first decode.
+#
+#   build/decode_only_size.sh <zstd source> <xerr source> [input file]
+#
+# The sources are only read, the libraries and executables go to $OUT (/tmp/xcompression_size by default).
+set -e
+
+ZSTD=$(cd "$1" && pwd)
+XERR=$(cd "$2" && pwd)
+INPUT=${3:-README.md}
+OUT=${OUT:-/tmp/xcompression_size}
+CC=${CC:-cc}
+CXX=${CXX:-c++}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+rm -rf "$OUT"
+mkdir -p "$OUT/full" "$OUT/decode"
+
+# zstd at -O2 without the legacy formats, the decode-only archive leaves compress/ and dictBuilder/ out
+Archive()
+{
+    Dir=$1
+    shift
+    for Source in "$@"; do
+        $CC -O2 -DZSTD_LEGACY_SUPPORT=0 -c "$Source" -o "$Dir/$(basename "$Source").o"
+    done
+    ar rcs "$Dir/libzstd.a" "$Dir"/*.o
+}
+Archive "$OUT/full"   "$ZSTD"/lib/common/*.c "$ZSTD"/lib/compress/*.c "$ZSTD"/lib/dictBuilder/*.c "$ZSTD"/lib/decompress/*.c "$ZSTD"/lib/decompress/*.S
+Archive "$OUT/decode" "$ZSTD"/lib/common/*.c "$ZSTD"/lib/decompress/*.c "$ZSTD"/lib/decompress/*.S
+
+FLAGS="-std=c++20 -O2 -I$ZSTD -I$ZSTD/lib -I$XERR"
+$CXX $FLAGS                            "$ROOT/source/xcompression.cpp" "$ROOT/source/unit-test/decode_only_size.cpp" "$OUT/full/libzstd.a"   -pthread -o "$OUT/full/decode_only_size"
+$CXX $FLAGS -DXCOMPRESSION_DECODE_ONLY "$ROOT/source/xcompression.cpp" "$ROOT/source/unit-test/decode_only_size.cpp" "$OUT/decode/libzstd.a" -pthread -o "$OUT/decode/decode_only_size"
+strip "$OUT/full/decode_only_size" "$OUT/decode/decode_only_size"
+
+echo "zstd archive: full $(wc -c < "$OUT/full/libzstd.a") bytes, decode-only $(wc -c < "$OUT/decode/libzstd.a") bytes"
+"$OUT/full/decode_only_size" pack "$INPUT" "$OUT/input.zst"
+"$OUT/full/decode_only_size"   "$OUT/input.zst"
+"$OUT/decode/decode_only_size" "$OUT/input.zst"
@@ -0,0 +1,110 @@
+//-------------------------------------------------------------------------------------------------------------
+// Size and startup check for the decode-only build (see build/decode_only_size.sh).
+// Built twice from the same source: without XCOMPRESSION_DECODE_ONLY it can also pack a file into a block
+// mode frame, with it only decodes. Both report their own file size and the time to the first decode.
+//
+//      decode_only_size pack <input> <frame>       (full build only)
+//      decode_only_size <frame>
+//-------------------------------------------------------------------------------------------------------------
+#include "lib/zstd.h"
+#include "../../source/xcompression.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace
+{
+    std::vector<std::byte> ReadFile(const char* pFileName)
+    {
+        std::ifstream           File(pFileName, std::ios::binary);
+        std::vector<char>       Raw((std::istreambuf_iterator<char>(File)), std::istreambuf_iterator<char>());
+        std::vector<std::byte>  Data(Raw.size());
+        if (Raw.size()) std::memcpy(Data.data(), Raw.data(), Raw.size());
+        return Data;
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    int Pack(const char* pInput, const char* pOutput)
+    {
+        const auto Source = ReadFile(pInput);
+        if (Source.empty()) return 1;
+
+        // One frame for the whole file, zstd limits the target block size to 128KB
+        xcompression::fixed_block_compress Compressor;
+        if (auto Err = Compressor.Init(true, std::min<std::uint64_t>(Source.size(), 128 * 1024), Source, xcompression::fixed_block_compress::level::HIGH); Err)
+        {
+            std::printf("Init failed: %s\n", Err.m_pMessage);
+            return 1;
+        }
+
+        std::vector<std::byte>  Frame(Source.size());
+        std::uint64_t           FrameSize;
+        if (auto Err = Compressor.Pack(FrameSize, Frame); Err)
+        {
+            std::printf("Pack failed: %s\n", Err.m_pMessage);
+            return 1;
+        }
+
+        std::ofstream(pOutput, std::ios::binary).write(reinterpret_cast<const char*>(Frame.data()), static_cast<std::streamsize>(FrameSize));
+        std::printf("%zu -> %llu bytes\n", Source.size(), static_cast<unsigned long long>(FrameSize));
+        return 0;
+    }
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+#ifndef XCOMPRESSION_DECODE_ONLY
+    if (argc == 4 && std::strcmp(argv[1], "pack") == 0) return Pack(argv[2], argv[3]);
+    constexpr const char* pBuild = "full";
+#else
+    constexpr const char* pBuild = "decode-only";
+#endif
+
+    if (argc != 2)
+    {
+        std::printf("usage: %s <frame>\n", argv[0]);
+        return 1;
+    }
+
+    const auto Frame = ReadFile(argv[1]);
+    const auto Size  = ZSTD_getFrameContentSize(Frame.data(), Frame.size());
+    if (Size == ZSTD_CONTENTSIZE_ERROR || Size == ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        std::printf("%s is not a frame with a content size\n", argv[1]);
+        return 1;
+    }
+
+    // Everything the first decode costs: the decompressor, its zstd context and the output
+    const auto Start = std::chrono::steady_clock::now();
+
+    xcompression::fixed_block_decompress    Decompressor;
+    std::vector<std::byte>                  Output(static_cast<std::size_t>(Size));
+    std::uint32_t                           DecompressSize;
+    if (auto Err = Decompressor.Init(true, Size); Err)
+    {
+        std::printf("Init failed: %s\n", Err.m_pMessage);
+        return 1;
+    }
+    if (auto Err = Decompressor.Unpack(DecompressSize, Output, Frame); Err)
+    {
+        std::printf("Unpack failed: %s\n", Err.m_pMessage);
+        return 1;
+    }
+
+    const auto End = std::chrono::steady_clock::now();
+
+    std::error_code Error;
+    const auto      FileSize = std::filesystem::file_size(argv[0], Error);
+    std::printf("%s: executable %llu bytes, decoded %u bytes, first decode %.1f us\n"
+               , pBuild
+               , Error ? 0ull : static_cast<unsigned long long>(FileSize)
+               , DecompressSize
+               , std::chrono::duration<double, std::micro>(End - Start).count());
+    return 0;
+}
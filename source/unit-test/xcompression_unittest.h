@@ -1,8 +1,13 @@
 #include <vector>
 #include <array>
+#include <string>
 #include <iostream>
 #include <random>
 #include <cassert>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <cstring>
 
 namespace xcompression::unit_test
 {
@@ -381,6 +386,2567 @@ namespace xcompression::unit_test
 
     //-------------------------------------------------------------------------------------------------------------
 
+    void TestDynamicPageAligned(std::span<const std::byte> Source, const std::size_t PageSize)
+    {
+        const auto FileName = (std::filesystem::temp_directory_path() / "xcompression_pages.bin").string();
+
+        //
+        // Compress into pages and write them with direct I/O
+        //
+        std::size_t nPages = 0;
+        {
+            xcompression::dynamic_block_compress compressor;
+            if (auto err = compressor.Init(false, PageSize, Source, xcompression::dynamic_block_compress::level::MEDIUM); err)
+            {
+                std::cout << "Page mode (dynamic): compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            // Worst case every page holds a bit less than PageSize of source
+            xcompression::aligned_buffer pages;
+            if (auto err = pages.Init(PageSize * (Source.size() / (PageSize / 2) + 1)); err)
+            {
+                std::cout << "Page mode (dynamic): failed to allocate pages: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            auto Pages = pages.getSpan();
+            while (true)
+            {
+                std::uint64_t compressedSize;
+                auto err = compressor.PackPage(compressedSize, Pages.subspan(nPages * PageSize, PageSize));
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Page mode (dynamic): compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                nPages++;
+                if (err == false)
+                    break;
+            }
+
+            // Round up to the writer alignment (the tail is never read back)
+            const std::size_t WriteSize = (nPages * PageSize + xcompression::page_alignment_v - 1) & ~(xcompression::page_alignment_v - 1);
+
+            xcompression::direct_file_writer writer;
+            if (auto err = writer.Open(FileName.c_str()); err)
+            {
+                std::cout << "Page mode (dynamic): failed to open file: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+            if (auto err = writer.Write(Pages.subspan(0, WriteSize)); err)
+            {
+                std::cout << "Page mode (dynamic): failed to write pages: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+            if (auto err = writer.Close(); err)
+            {
+                std::cout << "Page mode (dynamic): failed to close file: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+        }
+
+        //
+        // Read the pages back and decompress them one by one
+        //
+        {
+            std::vector<std::byte> file(nPages * PageSize);
+            {
+                std::ifstream in(FileName, std::ios::binary);
+                in.read(reinterpret_cast<char*>(file.data()), file.size());
+                assert(in);
+            }
+            std::filesystem::remove(FileName);
+
+            xcompression::dynamic_block_decompress decompressor;
+            if (auto err = decompressor.Init(false, PageSize); err)
+            {
+                std::cout << "Page mode (dynamic): decompression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::vector<std::byte> rebuiltSource(Source.size());
+            std::size_t            Pos = 0;
+            for (std::size_t i = 0; i < nPages; ++i)
+            {
+                std::uint32_t pageDecompressedSize;
+                if (auto err = decompressor.UnpackPage(pageDecompressedSize, std::span(rebuiltSource.data() + Pos, rebuiltSource.size() - Pos), std::span(file.data() + i * PageSize, PageSize)); err)
+                {
+                    std::cout << "Page mode (dynamic): decompression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+                Pos += pageDecompressedSize;
+            }
+
+            if (Pos != Source.size() || false == std::equal(rebuiltSource.begin(), rebuiltSource.end(), Source.begin(), Source.end()))
+            {
+                std::cout << "Page mode (dynamic): Rebuilt data does not match original\n";
+                assert(false);
+            }
+
+            std::cout << "Page mode (dynamic): match original (number of pages " << nPages << " of " << PageSize << " bytes) \n";
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestArchive(std::span<const std::byte> Source)
+    {
+        const auto FileName = (std::filesystem::temp_directory_path() / "xcompression_archive.bin").string();
+
+        // Entries are slices of the source with different sizes, including an empty one
+        std::vector<std::pair<std::string, std::span<const std::byte>>> Entries;
+        for (std::size_t Offset = 0, Size = 0; Offset + Size <= Source.size(); Offset += Size, Size += 37)
+        {
+            Entries.emplace_back("asset/entry_" + std::to_string(Entries.size()), Source.subspan(Offset, Size));
+        }
+
+        //
+        // Build the archive
+        //
+        {
+            xcompression::archive_writer writer;
+            for (const auto& [Name, Data] : Entries)
+            {
+                if (auto err = writer.AddEntry(Name, Data); err)
+                {
+                    std::cout << "Archive: failed to add entry: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+            }
+
+            if (auto err = writer.Save(FileName.c_str(), xcompression::archive_writer::level::MEDIUM, 4); err)
+            {
+                std::cout << "Archive: failed to save: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+        }
+
+        //
+        // Read it back
+        //
+        {
+            xcompression::archive_reader reader;
+            if (auto err = reader.Open(FileName.c_str()); err)
+            {
+                std::cout << "Archive: failed to open: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::size_t TotalCompressed = 0;
+            for (const auto& [Name, Data] : Entries)
+            {
+                const auto* pEntry = reader.Find(Name);
+                assert(pEntry && pEntry->m_UncompressedSize == Data.size());
+
+                std::vector<std::byte> Extracted(pEntry->m_UncompressedSize);
+                if (auto err = reader.Extract(Extracted, *pEntry); err)
+                {
+                    std::cout << "Archive: failed to extract " << Name << ": " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                if (false == std::equal(Extracted.begin(), Extracted.end(), Data.begin(), Data.end()))
+                {
+                    std::cout << "Archive: entry " << Name << " does not match original\n";
+                    assert(false);
+                }
+
+                TotalCompressed += pEntry->m_CompressedSize;
+            }
+
+            assert(reader.Find("asset/missing") == nullptr);
+
+            std::cout << "Archive: match original (number of entries " << Entries.size() << ", compressed size " << TotalCompressed << ") \n";
+        }
+
+        //
+        // A corrupted file must fail to open and release its mapping (the reader stays reusable)
+        //
+        {
+            std::filesystem::resize_file(FileName, std::filesystem::file_size(FileName) - 1);
+
+            xcompression::archive_reader reader;
+            if (auto err = reader.Open(FileName.c_str()); !err) assert(false);
+            assert(reader.m_pMapping == nullptr && reader.m_MappingSize == 0);
+        }
+
+        std::filesystem::remove(FileName);
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestBlockCache(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        struct frame
+        {
+            std::vector<std::byte>  m_Data;
+            std::size_t             m_Offset;
+            std::size_t             m_Size;
+            bool                    m_bStored;
+        };
+        std::vector<frame> Frames;
+
+        //
+        // Compress in streaming mode, remembering where each frame goes
+        //
+        {
+            std::vector<std::byte>              compressed(Source.size());
+            xcompression::fixed_block_compress  compressor;
+            if (auto err = compressor.Init(false, BlockSize, Source, xcompression::fixed_block_compress::level::MEDIUM); err)
+            {
+                std::cout << "Block cache: compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            while (compressor.m_Position < Source.size())
+            {
+                const std::size_t lastPosition = compressor.m_Position;
+                std::uint64_t     compressedSize;
+                auto err = compressor.Pack(compressedSize, compressed);
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE && err.getState<xcompression::state>() != xcompression::state::INCOMPRESSIBLE)
+                {
+                    std::cout << "Block cache: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                const std::size_t Size = compressor.m_Position - lastPosition;
+                if (err && err.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE)
+                    Frames.push_back({ { Source.begin() + lastPosition, Source.begin() + compressor.m_Position }, lastPosition, Size, true });
+                else
+                    Frames.push_back({ { compressed.begin(), compressed.begin() + compressedSize }, lastPosition, Size, false });
+            }
+        }
+
+        //
+        // Hammer the cache from several threads with a budget smaller than the data
+        //
+        xcompression::block_cache cache;
+        if (auto err = cache.Init(BlockSize * 8, BlockSize, 4); err)
+        {
+            std::cout << "Block cache: init failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        {
+            std::vector<std::jthread> Threads;
+            for (int t = 0; t < 4; ++t)
+            {
+                Threads.emplace_back([&, t]
+                {
+                    std::mt19937 gen(t);
+                    for (int i = 0; i < 2000; ++i)
+                    {
+                        // Skew the accesses so some frames are hot
+                        const std::size_t  iFrame = (gen() % 4) ? gen() % 4 : gen() % Frames.size();
+                        const auto&        Frame  = Frames[iFrame];
+
+                        xcompression::block_cache::block Block;
+                        if (auto err = cache.Get(Block, { 7, iFrame }, Frame.m_Data, Frame.m_bStored); err)
+                        {
+                            std::cout << "Block cache: get failed: " << err.m_pMessage << "\n";
+                            assert(false);
+                        }
+
+                        if (false == std::equal(Block->begin(), Block->end(), Source.begin() + Frame.m_Offset, Source.begin() + Frame.m_Offset + Frame.m_Size))
+                        {
+                            std::cout << "Block cache: block does not match original\n";
+                            assert(false);
+                        }
+                    }
+                });
+            }
+        }
+
+        const auto Stats = cache.getStats();
+        assert(Stats.m_Hits + Stats.m_Misses + Stats.m_Coalesced == 4 * 2000);
+        assert(Stats.m_Evictions > 0);
+
+        //
+        // A frame header claiming a huge content size must be rejected before anything is allocated
+        //
+        {
+            // Magic, single segment with an 8 byte content size of 1TB, then an empty last raw block
+            const std::array<std::byte, 17> Forged = { std::byte{ 0x28 }, std::byte{ 0xB5 }, std::byte{ 0x2F }, std::byte{ 0xFD }, std::byte{ 0xE0 }
+                                                     , std::byte{ 0 }, std::byte{ 0 }, std::byte{ 0 }, std::byte{ 0 }, std::byte{ 0 }, std::byte{ 1 }, std::byte{ 0 }, std::byte{ 0 }
+                                                     , std::byte{ 1 }, std::byte{ 0 }, std::byte{ 0 }, std::byte{ 0 } };
+
+            xcompression::block_cache::block Block;
+            if (auto err = cache.Get(Block, { 8, 0 }, Forged); !err) assert(false);
+            assert(!Block);
+        }
+
+        std::cout << "Block cache: match original (hits " << Stats.m_Hits << ", misses " << Stats.m_Misses << ", coalesced " << Stats.m_Coalesced << ", evictions " << Stats.m_Evictions << ") \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestSmallMessage(std::span<const std::byte> Source)
+    {
+        std::size_t TotalSize       = 0;
+        std::size_t TotalCompressed = 0;
+        int         nMessages       = 0;
+
+        // Messages of 50 to 500 bytes taken from the source
+        std::vector<std::byte> compressed(512);
+        std::vector<std::byte> decompressed(512);
+        for (std::size_t Offset = 0, Size = 50; Offset + Size <= Source.size(); Offset += Size, Size = 50 + (Size * 7) % 450)
+        {
+            const auto Message = Source.subspan(Offset, Size);
+
+            std::uint64_t compressedSize;
+            if (auto err = xcompression::small_message::Pack(compressedSize, compressed, Message); err)
+            {
+                if (err.getState<xcompression::state>() != xcompression::state::INCOMPRESSIBLE)
+                {
+                    std::cout << "Small message: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                TotalSize       += Size;
+                TotalCompressed += Size;
+                nMessages++;
+                continue;
+            }
+
+            // The receiver knows the size of the message
+            if (auto err = xcompression::small_message::Unpack(std::span(decompressed.data(), Size), std::span(compressed.data(), compressedSize)); err)
+            {
+                std::cout << "Small message: decompression failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            if (false == std::equal(Message.begin(), Message.end(), decompressed.begin()))
+            {
+                std::cout << "Small message: decompressed data does not match original\n";
+                assert(false);
+            }
+
+            TotalSize       += Size;
+            TotalCompressed += compressedSize;
+            nMessages++;
+        }
+
+        std::cout << "Small message: match original (number of messages " << nMessages << ", size " << TotalSize << ", compressed size " << TotalCompressed << ") \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestJobService(std::span<const std::byte> Source)
+    {
+        xcompression::job_service service;
+        if (auto err = service.Init(2, 4); err)
+        {
+            std::cout << "Job service: init failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        //
+        // Compress slices of the source, half with futures and half with callbacks
+        //
+        constexpr std::size_t               nJobs       = 16;
+        std::array<std::future<xcompression::job_service::result>, nJobs> Futures;
+        std::array<xcompression::job_service::result, nJobs>              Results;
+        std::atomic<int>                    nCallbacks  = 0;
+        const std::size_t                   SliceSize   = Source.size() / nJobs;
+
+        for (std::size_t i = 0; i < nJobs; ++i)
+        {
+            xcompression::job_service::job Job;
+            Job.m_Source   = Source.subspan(i * SliceSize, SliceSize);
+            Job.m_Priority = (i & 2) ? xcompression::job_service::priority::HIGH : xcompression::job_service::priority::LOW;
+            if (i & 1) Job.m_Callback = [&, i](xcompression::job_service::result&& Result) { Results[i] = std::move(Result); nCallbacks++; };
+
+            if (auto err = service.Submit(std::move(Job), (i & 1) ? nullptr : &Futures[i]); err)
+            {
+                std::cout << "Job service: submit failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+        }
+
+        for (std::size_t i = 0; i < nJobs; i += 2) Results[i] = Futures[i].get();
+        while (nCallbacks != nJobs / 2) std::this_thread::yield();
+
+        //
+        // Decompress them back through the service
+        //
+        std::size_t TotalCompressed = 0;
+        for (std::size_t i = 0; i < nJobs; ++i)
+        {
+            const auto Slice = Source.subspan(i * SliceSize, SliceSize);
+            auto&      Result = Results[i];
+
+            if (Result.m_Error)
+            {
+                assert(Result.m_Error.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE);
+                TotalCompressed += Slice.size();
+                continue;
+            }
+
+            TotalCompressed += Result.m_Size;
+
+            xcompression::job_service::job Job;
+            Job.m_Operation = xcompression::job_service::operation::DECOMPRESS;
+            Job.m_Source    = Result.m_Data;
+
+            std::future<xcompression::job_service::result> Future;
+            if (auto err = service.Submit(std::move(Job), &Future); err)
+            {
+                std::cout << "Job service: submit failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            const auto Decompressed = Future.get();
+            if (Decompressed.m_Error || false == std::equal(Decompressed.m_Data.begin(), Decompressed.m_Data.end(), Slice.begin(), Slice.end()))
+            {
+                std::cout << "Job service: decompressed data does not match original\n";
+                assert(false);
+            }
+        }
+
+        //
+        // A frame bigger than the job allows must fail instead of allocating
+        //
+        for (const auto& Result : Results)
+        {
+            if (Result.m_Error) continue;
+
+            xcompression::job_service::job Job;
+            Job.m_Operation           = xcompression::job_service::operation::DECOMPRESS;
+            Job.m_Source              = Result.m_Data;
+            Job.m_MaxDecompressedSize = SliceSize - 1;
+
+            std::future<xcompression::job_service::result> Future;
+            if (auto err = service.Submit(std::move(Job), &Future); err) assert(false);
+
+            const auto Decompressed = Future.get();
+            assert(Decompressed.m_Error && Decompressed.m_Data.empty());
+            break;
+        }
+
+        //
+        // Back-pressure: without waiting, submitting eventually reports a full queue
+        //
+        bool bSawFull = false;
+        for (int i = 0; i < 1000 && bSawFull == false; ++i)
+        {
+            xcompression::job_service::job Job;
+            Job.m_Source = Source;
+            Job.m_Level  = xcompression::job_service::level::HIGH;
+            Job.m_Callback = [](xcompression::job_service::result&&) {};
+            if (auto err = service.Submit(std::move(Job), nullptr, false); err)
+            {
+                assert(err.getState<xcompression::state>() == xcompression::state::NOT_DONE);
+                bSawFull = true;
+            }
+        }
+        assert(bSawFull);
+
+        service.Shutdown();
+
+        std::cout << "Job service: match original (number of jobs " << nJobs << ", compressed size " << TotalCompressed << ") \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestSinkDecompress(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        //
+        // Compress in streaming mode
+        //
+        std::vector<std::pair<std::vector<std::byte>, bool>> Chunks;
+        {
+            std::vector<std::byte>              compressed(Source.size());
+            xcompression::fixed_block_compress  compressor;
+            if (auto err = compressor.Init(false, BlockSize, Source, xcompression::fixed_block_compress::level::MEDIUM); err)
+            {
+                std::cout << "Sink decompress: compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            while (compressor.m_Position < Source.size())
+            {
+                const std::size_t lastPosition = compressor.m_Position;
+                std::uint64_t     compressedSize;
+                auto err = compressor.Pack(compressedSize, compressed);
+                if (err && err.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE)
+                    Chunks.emplace_back(std::vector<std::byte>{ Source.begin() + lastPosition, Source.begin() + compressor.m_Position }, true);
+                else if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Sink decompress: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+                else
+                    Chunks.emplace_back(std::vector<std::byte>{ compressed.begin(), compressed.begin() + compressedSize }, false);
+            }
+        }
+
+        //
+        // Decompress into a buffer chain, counting how many vectored writes reach it
+        //
+        struct counting_sink final : xcompression::output_sink
+        {
+            xerr Write(std::span<const std::span<const std::byte>> Buffers) noexcept override
+            {
+                m_nWrites++;
+                return m_Chain.Write(Buffers);
+            }
+
+            xcompression::buffer_chain_sink m_Chain{ 256 };
+            int                             m_nWrites = 0;
+        } Sink;
+
+        {
+            xcompression::sink_decompress decompressor;
+            if (auto err = decompressor.Init(Sink, BlockSize, 8); err)
+            {
+                std::cout << "Sink decompress: init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            for (const auto& [Chunk, bStored] : Chunks)
+            {
+                if (auto err = decompressor.Unpack(Chunk, bStored); err)
+                {
+                    std::cout << "Sink decompress: decompression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+            }
+
+            if (auto err = decompressor.Flush(); err)
+            {
+                std::cout << "Sink decompress: flush failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+        }
+
+        std::vector<std::byte> rebuiltSource;
+        for (const auto& Segment : Sink.m_Chain.m_Segments) rebuiltSource.insert(rebuiltSource.end(), Segment.begin(), Segment.end());
+
+        if (false == std::equal(rebuiltSource.begin(), rebuiltSource.end(), Source.begin(), Source.end()))
+        {
+            std::cout << "Sink decompress: Rebuilt data does not match original\n";
+            assert(false);
+        }
+        assert(Sink.m_nWrites < static_cast<int>(Chunks.size()));
+
+        std::cout << "Sink decompress: match original (number of chunks " << Chunks.size() << ", number of writes " << Sink.m_nWrites << ") \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestStaticWorkspace(std::span<const std::byte> Source)
+    {
+        const auto HighSize = xcompression::fixed_block_compress::EstimateWorkspace(Source.size(), xcompression::fixed_block_compress::level::HIGH);
+        const auto FastSize = xcompression::fixed_block_compress::EstimateWorkspace(Source.size(), xcompression::fixed_block_compress::level::FAST);
+        assert(FastSize <= HighSize);
+
+        //
+        // A workspace too small for anything must fail
+        //
+        {
+            std::array<std::uint64_t, 128>      Tiny;
+            xcompression::fixed_block_compress  compressor;
+            auto err = compressor.Init(true, Source.size(), Source, std::as_writable_bytes(std::span(Tiny)), xcompression::fixed_block_compress::level::HIGH);
+            assert(err);
+        }
+
+        //
+        // HIGH with only the memory of FAST gets clamped to fit
+        //
+        xcompression::aligned_buffer CompressWorkspace;
+        if (auto err = CompressWorkspace.Init(FastSize); err)
+        {
+            std::cout << "Static workspace: failed to allocate: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        std::vector<std::byte>  compressed(Source.size());
+        std::uint64_t           compressedSize;
+        {
+            xcompression::fixed_block_compress compressor;
+            if (auto err = compressor.Init(true, Source.size(), Source, CompressWorkspace.getSpan().first(FastSize), xcompression::fixed_block_compress::level::HIGH); err)
+            {
+                std::cout << "Static workspace: compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            if (auto err = compressor.Pack(compressedSize, compressed); err)
+            {
+                std::cout << "Static workspace: compression failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+        }
+
+        //
+        // Decompress with a static context as well
+        //
+        const auto DecompressSize = xcompression::fixed_block_decompress::EstimateWorkspace(Source.size());
+        xcompression::aligned_buffer DecompressWorkspace;
+        if (auto err = DecompressWorkspace.Init(DecompressSize); err)
+        {
+            std::cout << "Static workspace: failed to allocate: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        std::vector<std::byte> decompressed(Source.size());
+        {
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(true, Source.size(), DecompressWorkspace.getSpan()); err)
+            {
+                std::cout << "Static workspace: decompression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::uint32_t decompressedSize;
+            if (auto err = decompressor.Unpack(decompressedSize, decompressed, std::span(compressed.data(), compressedSize)); err)
+            {
+                std::cout << "Static workspace: decompression failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+        }
+
+        if (false == std::equal(decompressed.begin(), decompressed.end(), Source.begin(), Source.end()))
+        {
+            std::cout << "Static workspace: Decompressed data does not match original\n";
+            assert(false);
+        }
+
+        std::cout << "Static workspace: match original (HIGH needs " << HighSize << " bytes, ran in " << FastSize << " bytes, decompression " << DecompressSize << " bytes, compressed size " << compressedSize << ") \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestFixedHistoryStreaming(std::span<const std::byte> Source, const std::size_t BlockSize, const std::uint32_t SyncInterval)
+    {
+        struct chunk
+        {
+            std::vector<std::byte>  m_Data;
+            std::uint64_t           m_SourceOffset;
+            bool                    m_bSyncPoint;
+        };
+
+        std::vector<chunk>  Chunks              = {};
+        std::size_t         TotalSizeCompress   = 0;
+
+        //
+        // Compress (chunks never come back INCOMPRESSIBLE in history mode)
+        //
+        {
+            xcompression::fixed_block_compress compressor;
+            if (auto err = compressor.Init(false, BlockSize, Source, xcompression::fixed_block_compress::level::MEDIUM, SyncInterval); err)
+            {
+                std::cout << "History streaming: compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::vector<std::byte>  compressed(BlockSize * 2 + 64);
+            std::uint64_t           compressedSize;
+            while (true)
+            {
+                const auto  Offset      = compressor.m_Position;
+                const bool  bSyncPoint  = compressor.isSyncPoint();
+                auto        err         = compressor.Pack(compressedSize, compressed);
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "History streaming: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                if (compressedSize > 0)
+                {
+                    Chunks.push_back({ { compressed.begin(), compressed.begin() + compressedSize }, Offset, bSyncPoint });
+                    TotalSizeCompress += compressedSize;
+                }
+
+                if (err == false)
+                    break;
+            }
+        }
+
+        //
+        // Decompress from the chunk at First (which must be a sync point) to the end, double buffered
+        //
+        auto Decompress = [&](std::size_t First)
+        {
+            assert(Chunks[First].m_bSyncPoint);
+
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(false, BlockSize, SyncInterval); err)
+            {
+                std::cout << "History streaming: decompression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::array              buffer          = { std::vector<std::byte>(BlockSize), std::vector<std::byte>(BlockSize) };
+            int                     useBuffer       = 0;
+            std::vector<std::byte>  rebuiltSource   = {};
+            for (std::size_t i = First; i < Chunks.size(); ++i)
+            {
+                std::vector<std::byte>& currentBuffer = buffer[useBuffer & 1];
+                std::uint32_t           blockDecompressedSize;
+
+                auto err = decompressor.Unpack(blockDecompressedSize, currentBuffer, Chunks[i].m_Data);
+                while (err && err.getState<xcompression::state>() == xcompression::state::NOT_DONE)
+                {
+                    rebuiltSource.insert(rebuiltSource.end(), currentBuffer.begin(), currentBuffer.begin() + blockDecompressedSize);
+                    err = decompressor.Unpack(blockDecompressedSize, currentBuffer, Chunks[i].m_Data);
+                }
+
+                if (err)
+                {
+                    std::cout << "History streaming: decompression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                rebuiltSource.insert(rebuiltSource.end(), currentBuffer.begin(), currentBuffer.begin() + blockDecompressedSize);
+                useBuffer++;
+            }
+
+            if (false == std::equal(rebuiltSource.begin(), rebuiltSource.end(), Source.begin() + Chunks[First].m_SourceOffset, Source.end()))
+            {
+                std::cout << "History streaming: Rebuilt data does not match original\n";
+                assert(false);
+            }
+        };
+
+        Decompress(0);
+
+        // Seek: start decoding at the second sync point with a fresh decompressor
+        if (Chunks.size() > SyncInterval) Decompress(SyncInterval);
+
+        std::cout << "History streaming: match original ( with compression size : " << TotalSizeCompress << ", " << Chunks.size() << " chunks, a sync point every " << SyncInterval << " ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestChunkRanges(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        static_assert(std::input_iterator<xcompression::fixed_block_pack_range::iterator>);
+        static_assert(std::input_iterator<xcompression::fixed_block_unpack_range::iterator>);
+
+        for (const std::uint32_t SyncInterval : { 1u, 4u })
+        {
+            //
+            // Compress, keeping a copy of every chunk (they only live until the next increment)
+            //
+            xcompression::fixed_block_compress compressor;
+            if (auto err = compressor.Init(false, BlockSize, Source, xcompression::fixed_block_compress::level::MEDIUM, SyncInterval); err)
+            {
+                std::cout << "Chunk ranges: compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            xcompression::fixed_block_pack_range PackRange;
+            if (auto err = PackRange.Init(compressor); err)
+            {
+                std::cout << "Chunk ranges: pack range init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::vector<std::vector<std::byte>>     Storage;
+            std::vector<xcompression::stream_chunk> Chunks;
+            std::uint64_t                           NextOffset          = 0;
+            std::size_t                             TotalSizeCompress   = 0;
+            for (const auto& Chunk : PackRange)
+            {
+                assert(Chunk.m_SourceOffset == NextOffset);
+                NextOffset += Chunk.m_SourceSize;
+
+                Storage.emplace_back(Chunk.m_Data.begin(), Chunk.m_Data.end());
+                Chunks.push_back(Chunk);
+                TotalSizeCompress += Chunk.m_Data.size();
+            }
+
+            if (PackRange.getError())
+            {
+                std::cout << "Chunk ranges: compression failed: " << PackRange.getError().m_pMessage << "\n";
+                assert(false);
+            }
+            assert(NextOffset == Source.size());
+
+            for (std::size_t i = 0; i < Chunks.size(); ++i)
+                Chunks[i].m_Data = Storage[i];
+
+            //
+            // Decompress
+            //
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(false, BlockSize, SyncInterval); err)
+            {
+                std::cout << "Chunk ranges: decompression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            xcompression::fixed_block_unpack_range UnpackRange;
+            if (auto err = UnpackRange.Init(decompressor, Chunks); err)
+            {
+                std::cout << "Chunk ranges: unpack range init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::vector<std::byte> rebuiltSource;
+            for (const auto Decoded : UnpackRange)
+                rebuiltSource.insert(rebuiltSource.end(), Decoded.begin(), Decoded.end());
+
+            if (UnpackRange.getError())
+            {
+                std::cout << "Chunk ranges: decompression failed: " << UnpackRange.getError().m_pMessage << "\n";
+                assert(false);
+            }
+
+            if (false == std::equal(rebuiltSource.begin(), rebuiltSource.end(), Source.begin(), Source.end()))
+            {
+                std::cout << "Chunk ranges: Rebuilt data does not match original\n";
+                assert(false);
+            }
+
+            std::cout << "Chunk ranges: match original ( with compression size : " << TotalSizeCompress << ", " << Chunks.size() << " chunks, sync interval " << SyncInterval << " ) \n";
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestScatterGather(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        // Split the source in uneven fragments (some smaller than a byte of output, some larger than a block)
+        std::vector<std::span<const std::byte>> Segments;
+        for (std::size_t Offset = 0, i = 0; Offset < Source.size(); ++i)
+        {
+            const std::size_t Sizes[] = { 1, 37, 250, 0, 3, 129, 64 };
+            const auto        Size    = std::min(Sizes[i % std::size(Sizes)], Source.size() - Offset);
+            Segments.push_back(Source.subspan(Offset, Size));
+            Offset += Size;
+        }
+
+        //
+        // Fixed streaming: the chunks must be the same as with the contiguous source
+        //
+        for (const std::uint32_t SyncInterval : { 1u, 4u })
+        {
+            xcompression::fixed_block_compress Contiguous;
+            xcompression::fixed_block_compress Gathered;
+            if (auto err = Contiguous.Init(false, BlockSize, Source, xcompression::fixed_block_compress::level::MEDIUM, SyncInterval); err) assert(false);
+            if (auto err = Gathered.Init(false, BlockSize, std::span<const std::span<const std::byte>>(Segments), xcompression::fixed_block_compress::level::MEDIUM, SyncInterval); err)
+            {
+                std::cout << "Scatter-gather: compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            xcompression::fixed_block_pack_range ContiguousRange;
+            xcompression::fixed_block_pack_range GatheredRange;
+            if (auto err = ContiguousRange.Init(Contiguous); err) assert(false);
+            if (auto err = GatheredRange.Init(Gathered); err) assert(false);
+
+            auto I = ContiguousRange.begin();
+            for (const auto& Chunk : GatheredRange)
+            {
+                assert(I != ContiguousRange.end());
+                if (Chunk.m_bStored != I->m_bStored || false == std::equal(Chunk.m_Data.begin(), Chunk.m_Data.end(), I->m_Data.begin(), I->m_Data.end()))
+                {
+                    std::cout << "Scatter-gather: fixed chunk at " << Chunk.m_SourceOffset << " does not match the contiguous one\n";
+                    assert(false);
+                }
+                ++I;
+            }
+            assert(I == ContiguousRange.end());
+            assert(!GatheredRange.getError() && !ContiguousRange.getError());
+        }
+
+        //
+        // Fixed block mode: one frame over every fragment
+        //
+        {
+            xcompression::fixed_block_compress Contiguous;
+            xcompression::fixed_block_compress Gathered;
+            if (auto err = Contiguous.Init(true, Source.size(), Source, xcompression::fixed_block_compress::level::MEDIUM); err) assert(false);
+            if (auto err = Gathered.Init(true, Source.size(), std::span<const std::span<const std::byte>>(Segments), xcompression::fixed_block_compress::level::MEDIUM); err) assert(false);
+
+            std::vector<std::byte>  A(Source.size()), B(Source.size());
+            std::uint64_t           SizeA, SizeB;
+            auto                    ErrA = Contiguous.Pack(SizeA, A);
+            auto                    ErrB = Gathered.Pack(SizeB, B);
+            if (ErrB || ErrA || SizeA != SizeB || false == std::equal(A.begin(), A.begin() + SizeA, B.begin()))
+            {
+                std::cout << "Scatter-gather: block mode frame does not match the contiguous one\n";
+                assert(false);
+            }
+        }
+
+        //
+        // Dynamic streaming: the size search crosses the fragments
+        //
+        std::size_t TotalSizeCompress = 0;
+        std::size_t nBlocks           = 0;
+        {
+            xcompression::dynamic_block_compress Contiguous;
+            xcompression::dynamic_block_compress Gathered;
+            if (auto err = Contiguous.Init(false, BlockSize, Source, xcompression::dynamic_block_compress::level::MEDIUM); err) assert(false);
+            if (auto err = Gathered.Init(false, BlockSize, std::span<const std::span<const std::byte>>(Segments), xcompression::dynamic_block_compress::level::MEDIUM); err)
+            {
+                std::cout << "Scatter-gather: dynamic compression init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::vector<std::byte> A(Source.size()), B(Source.size()), Stored(BlockSize);
+            while (true)
+            {
+                const auto      Position = Gathered.m_Position;
+                std::uint64_t   SizeA, SizeB;
+                auto            ErrA     = Contiguous.Pack(SizeA, A);
+                auto            ErrB     = Gathered.Pack(SizeB, B);
+
+                assert(ErrA.getState<xcompression::state>() == ErrB.getState<xcompression::state>());
+                assert(Contiguous.m_Position == Gathered.m_Position);
+
+                if (ErrB && ErrB.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE)
+                {
+                    // The raw chunk straddles fragments, gather it back
+                    const auto Size = Gathered.CopySource(std::span(Stored).first(Gathered.m_Position - Position), Position);
+                    assert(std::equal(Stored.begin(), Stored.begin() + Size, Source.begin() + Position));
+                    TotalSizeCompress += Size;
+                    nBlocks++;
+                    continue;
+                }
+
+                if (ErrB && ErrB.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Scatter-gather: dynamic compression failed: " << ErrB.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                if (SizeA != SizeB || false == std::equal(A.begin(), A.begin() + SizeA, B.begin()))
+                {
+                    std::cout << "Scatter-gather: dynamic block at " << Position << " does not match the contiguous one\n";
+                    assert(false);
+                }
+
+                if (SizeB) nBlocks++;
+                TotalSizeCompress += SizeB;
+
+                if (ErrB == false)
+                    break;
+            }
+        }
+
+        std::cout << "Scatter-gather: match contiguous ( " << Segments.size() << " fragments, dynamic compressed size " << TotalSizeCompress << " in " << nBlocks << " blocks ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestDedup(std::span<const std::byte> Source)
+    {
+        // A series of snapshots: the base, the base with an insertion, then with a deletion as well
+        std::vector<std::vector<std::byte>> Snapshots;
+        Snapshots.emplace_back();
+        for (int i = 0; i < 4; ++i)
+        {
+            Snapshots.back().insert(Snapshots.back().end(), Source.begin(), Source.end());
+            Snapshots.back().push_back(std::byte(i));
+        }
+
+        Snapshots.push_back(Snapshots.back());
+        Snapshots.back().insert(Snapshots.back().begin() + 3000, 17, std::byte{ 'x' });
+
+        Snapshots.push_back(Snapshots.back());
+        Snapshots.back().erase(Snapshots.back().begin() + 6000, Snapshots.back().begin() + 6100);
+
+        xcompression::dedup_compress compressor;
+        if (auto err = compressor.Init(xcompression::dedup_compress::level::MEDIUM, 64, 256, 1024); err)
+        {
+            std::cout << "Dedup: init failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        xcompression::chunk_store   Store;
+        std::vector<std::size_t>    StreamSizes;
+        for (const auto& Snapshot : Snapshots)
+        {
+            std::vector<std::byte> Stream;
+            if (auto err = compressor.Pack(Stream, Snapshot); err)
+            {
+                std::cout << "Dedup: compression failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+            StreamSizes.push_back(Stream.size());
+
+            std::vector<std::byte> Decoded;
+            if (auto err = xcompression::dedup_decompress::Unpack(Decoded, Store, Stream, 1024); err)
+            {
+                std::cout << "Dedup: decompression failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            if (false == std::equal(Decoded.begin(), Decoded.end(), Snapshot.begin(), Snapshot.end()))
+            {
+                std::cout << "Dedup: Decoded snapshot does not match original\n";
+                assert(false);
+            }
+        }
+
+        // Edits only cost the chunks around them
+        assert(StreamSizes[1] * 2 < StreamSizes[0]);
+        assert(StreamSizes[2] * 2 < StreamSizes[0]);
+
+        // A decoder that has not seen the earlier snapshots can not resolve the references
+        {
+            std::vector<std::byte> Stream, Decoded;
+            if (auto err = compressor.Pack(Stream, Snapshots[2]); err) assert(false);
+
+            xcompression::chunk_store Empty;
+            auto err = xcompression::dedup_decompress::Unpack(Decoded, Empty, Stream, 1024);
+            assert(err);
+        }
+
+        // Records bigger than the chunker allows are rejected before decoding them
+        {
+            xcompression::dedup_compress Fresh;
+            if (auto err = Fresh.Init(xcompression::dedup_compress::level::MEDIUM, 64, 256, 1024); err) assert(false);
+
+            std::vector<std::byte> Stream, Decoded;
+            if (auto err = Fresh.Pack(Stream, Snapshots[0]); err) assert(false);
+
+            // Every chunk is at least 64 bytes
+            xcompression::chunk_store Empty;
+            auto err = xcompression::dedup_decompress::Unpack(Decoded, Empty, Stream, 32);
+            assert(err && std::string_view(err.m_pMessage).find("Corrupted dedup stream") != std::string_view::npos);
+
+            xcompression::dedup::record Record;
+            std::memcpy(&Record, Stream.data(), sizeof(Record));
+            Record.m_Size = 0xffffffffu;
+            std::memcpy(Stream.data(), &Record, sizeof(Record));
+
+            Decoded.clear();
+            err = xcompression::dedup_decompress::Unpack(Decoded, Empty, Stream);
+            assert(err && std::string_view(err.m_pMessage).find("Corrupted dedup stream") != std::string_view::npos && Decoded.empty());
+        }
+
+        const auto& Stats = compressor.getStats();
+        std::cout << "Dedup: match original (stream sizes " << StreamSizes[0] << ", " << StreamSizes[1] << ", " << StreamSizes[2]
+                  << ", duplicate chunks " << Stats.m_nDuplicates << " of " << Stats.m_nChunks << ", store " << Store.m_Bytes << " bytes) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestCompressMemo(std::span<const std::byte> Source)
+    {
+        const auto Directory = (std::filesystem::temp_directory_path() / "xcompression_memo").string();
+        std::filesystem::remove_all(Directory);
+
+        // A few assets, plus one that can not be compressed
+        std::vector<std::span<const std::byte>> Assets = { Source, Source.first(1000), Source.subspan(500, 1200) };
+        std::vector<std::byte>                  Noise(300);
+        {
+            std::mt19937 gen(7);
+            for (auto& B : Noise) B = std::byte(static_cast<unsigned char>(gen()));
+            Assets.push_back(Noise);
+        }
+
+        // One asset bigger than the zstd maximum block size (128KB)
+        std::vector<std::byte> Large;
+        while (Large.size() < 300 * 1024) Large.insert(Large.end(), Source.begin(), Source.begin() + std::min<std::size_t>(Source.size(), 4096));
+        Assets.push_back(Large);
+
+        auto Check = [&](xcompression::compress_memo& Memo, std::span<const std::byte> Asset)
+        {
+            xcompression::compress_memo::block Compressed;
+            auto err = Memo.Pack(Compressed, Asset, xcompression::compress_memo::level::HIGH);
+            if (err)
+            {
+                if (err.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE)
+                {
+                    assert(!Compressed);
+                    return;
+                }
+                std::cout << "Compress memo: compression failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(true, Asset.size()); err) assert(false);
+
+            std::vector<std::byte>  decompressed(Asset.size());
+            std::uint32_t           decompressedSize;
+            if (auto err = decompressor.Unpack(decompressedSize, decompressed, *Compressed); err || decompressedSize != Asset.size()
+                || false == std::equal(decompressed.begin(), decompressed.end(), Asset.begin(), Asset.end()))
+            {
+                std::cout << "Compress memo: Decompressed data does not match original\n";
+                assert(false);
+            }
+        };
+
+        //
+        // First build: everything is a miss, the second pass is served from memory
+        //
+        {
+            xcompression::compress_memo Memo;
+            if (auto err = Memo.Init(1024 * 1024, Directory); err)
+            {
+                std::cout << "Compress memo: init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            for (int Pass = 0; Pass < 2; ++Pass)
+                for (const auto& Asset : Assets) Check(Memo, Asset);
+
+            const auto Stats = Memo.getStats();
+            assert(Stats.m_Misses == Assets.size());
+            assert(Stats.m_Hits == Assets.size() && Stats.m_DiskHits == 0);
+        }
+
+        //
+        // Next build (new process): everything comes from the cache directory, nothing is compressed again
+        //
+        xcompression::compress_memo::stats Stats;
+        {
+            xcompression::compress_memo Memo;
+            if (auto err = Memo.Init(1024 * 1024, Directory); err) assert(false);
+
+            for (const auto& Asset : Assets) Check(Memo, Asset);
+
+            Stats = Memo.getStats();
+            assert(Stats.m_Misses == 0);
+            assert(Stats.m_DiskHits == Assets.size());
+        }
+
+        std::filesystem::remove_all(Directory);
+
+        std::cout << "Compress memo: match original (hits " << Stats.m_Hits << ", disk hits " << Stats.m_DiskHits << ", misses " << Stats.m_Misses
+                  << ", saved " << Stats.m_SavedNanoseconds / 1000 << " us of compression) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestPerfCounters(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        using stage = xcompression::perf_counters::stage;
+
+        // Counters may be unavailable (permissions, virtual machines), the calls, bytes and time must still be there
+        xcompression::perf_counters Perf;
+        if (auto err = Perf.Init(); err)
+        {
+            std::cout << "Perf counters: init failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        //
+        // Dynamic streaming: exercises INIT, SEARCH and COMPRESS
+        //
+        {
+            xcompression::dynamic_block_compress compressor;
+            compressor.m_pPerf = &Perf;
+            if (auto err = compressor.Init(false, BlockSize, Source, xcompression::dynamic_block_compress::level::MEDIUM); err) assert(false);
+
+            std::vector<std::byte>  compressed(Source.size());
+            std::uint64_t           compressedSize;
+            while (true)
+            {
+                auto err = compressor.Pack(compressedSize, compressed);
+                if (err && err.getState<xcompression::state>() != xcompression::state::INCOMPRESSIBLE && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Perf counters: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+                if (err == false) break;
+            }
+        }
+
+        //
+        // Fixed block mode round trip: DECOMPRESS bytes must add up to the source
+        //
+        {
+            xcompression::fixed_block_compress compressor;
+            compressor.m_pPerf = &Perf;
+            if (auto err = compressor.Init(true, Source.size(), Source); err) assert(false);
+
+            std::vector<std::byte>  compressed(Source.size());
+            std::uint64_t           compressedSize;
+            if (auto err = compressor.Pack(compressedSize, compressed); err) assert(false);
+
+            xcompression::fixed_block_decompress decompressor;
+            decompressor.m_pPerf = &Perf;
+            if (auto err = decompressor.Init(true, Source.size()); err) assert(false);
+
+            std::vector<std::byte>  decompressed(Source.size());
+            std::uint32_t           decompressedSize;
+            if (auto err = decompressor.Unpack(decompressedSize, decompressed, { compressed.data(), compressedSize }); err
+                || false == std::equal(decompressed.begin(), decompressed.end(), Source.begin(), Source.end()))
+            {
+                std::cout << "Perf counters: Decompressed data does not match original\n";
+                assert(false);
+            }
+        }
+
+        assert(Perf.getTotals(stage::INIT).m_Calls == 3);
+        assert(Perf.getTotals(stage::SEARCH).m_Calls > 0);
+        assert(Perf.getTotals(stage::COMPRESS).m_Calls > 0);
+        assert(Perf.getTotals(stage::DECOMPRESS).m_Calls == 1);
+        assert(Perf.getTotals(stage::DECOMPRESS).m_Bytes == Source.size());
+        assert(Perf.getTotals(stage::COMPRESS).m_Sample.m_Nanoseconds > 0);
+
+        std::cout << "Perf counters: recorded (cycles " << (Perf.isAvailable(xcompression::perf_counters::counter::CYCLES) ? "available" : "unavailable") << ")\n"
+                  << Perf.getReport();
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestRecompressor(void)
+    {
+        constexpr std::size_t   FrameSize   = 8 * 1024;
+        constexpr std::size_t   nFrames     = 8;
+
+        // Text-like data that FAST leaves room to improve on
+        std::vector<std::byte> Source;
+        {
+            constexpr std::array<std::string_view, 12> Words{ "alpha ", "beta ", "gamma ", "delta ", "epsilon ", "zeta ", "eta ", "theta ", "iota ", "kappa ", "lambda ", "\n" };
+            std::mt19937 gen(39);
+            while (Source.size() < FrameSize * nFrames)
+            {
+                const auto W = Words[gen() % Words.size()];
+                for (char C : W) Source.push_back(std::byte(C));
+            }
+            Source.resize(FrameSize * nFrames);
+        }
+
+        // Ingest: one FAST block mode frame per piece, stored back to back
+        std::vector<std::vector<std::byte>> Frames;
+        std::vector<std::byte>              Blob;
+        for (std::size_t i = 0; i < nFrames; ++i)
+        {
+            const auto Piece = std::span(Source).subspan(i * FrameSize, FrameSize);
+
+            xcompression::fixed_block_compress compressor;
+            if (auto err = compressor.Init(true, FrameSize, Piece, xcompression::fixed_block_compress::level::FAST); err) assert(false);
+
+            std::vector<std::byte>  compressed(FrameSize);
+            std::uint64_t           compressedSize;
+            if (auto err = compressor.Pack(compressedSize, compressed); err)
+            {
+                std::cout << "Recompressor: ingest failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+            compressed.resize(compressedSize);
+            Blob.insert(Blob.end(), compressed.begin(), compressed.end());
+            Frames.push_back(std::move(compressed));
+        }
+
+        // A blob of frames is read as a single stream
+        auto Check = [&](std::span<const std::byte> Data, const char* pWhat)
+        {
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(false, FrameSize); err) assert(false);
+
+            std::vector<std::byte>  decompressed;
+            std::vector<std::byte>  buffer(FrameSize);
+            std::uint32_t           decompressedSize;
+            while (true)
+            {
+                auto err = decompressor.Unpack(decompressedSize, buffer, Data);
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Recompressor: " << pWhat << " decompression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+                decompressed.insert(decompressed.end(), buffer.begin(), buffer.begin() + decompressedSize);
+                if (err == false) break;
+            }
+
+            if (false == std::equal(decompressed.begin(), decompressed.end(), Source.begin(), Source.end()))
+            {
+                std::cout << "Recompressor: " << pWhat << " does not match original\n";
+                assert(false);
+            }
+        };
+
+        // The CPU cap must be a share of one core
+        {
+            xcompression::recompressor Invalid;
+            if (auto err = Invalid.Init(xcompression::recompressor::level::HIGH, 0); !err) assert(false);
+            if (auto err = Invalid.Init(xcompression::recompressor::level::HIGH, 101); !err) assert(false);
+        }
+
+        xcompression::recompressor Recompressor;
+        if (auto err = Recompressor.Init(xcompression::recompressor::level::HIGH, 50); err)
+        {
+            std::cout << "Recompressor: init failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        //
+        // Whole blob on the calling thread
+        //
+        std::vector<std::byte> Upgraded;
+        if (auto err = Recompressor.Upgrade(Upgraded, Blob); err)
+        {
+            std::cout << "Recompressor: upgrade failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+        assert(Upgraded.size() < Blob.size());
+        Check(Upgraded, "upgraded blob");
+
+        //
+        // Background: frames are replaced one by one, the blob is readable after every replacement
+        //
+        std::size_t nReplaced = 0;
+        if (auto err = Recompressor.Submit(Blob, [&](const xcompression::recompressor::frame& Frame)
+            {
+                assert(Frame.m_Error == false);
+                assert(Frame.m_SourceSize == Frames[nReplaced].size());
+                Frames[nReplaced++].assign(Frame.m_Data.begin(), Frame.m_Data.end());
+
+                std::vector<std::byte> Partial;
+                for (const auto& F : Frames) Partial.insert(Partial.end(), F.begin(), F.end());
+                Check(Partial, "partially upgraded blob");
+            }); err) assert(false);
+
+        Recompressor.Wait();
+        assert(nReplaced == nFrames);
+
+        const auto Stats = Recompressor.getStats();
+        assert(Stats.m_nFrames == nFrames * 2);
+        assert(Stats.m_OutputBytes < Stats.m_InputBytes);
+
+        std::cout << "Recompressor: match original (FAST size " << Blob.size() << ", HIGH size " << Upgraded.size() << ", "
+                  << Stats.m_nUpgraded << " of " << Stats.m_nFrames << " frames upgraded, background busy " << Stats.m_BusyNanoseconds / 1000
+                  << " us, throttled " << Stats.m_ThrottledNanoseconds / 1000 << " us) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestParallelStreaming(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        struct chunk
+        {
+            std::vector<std::byte>  m_Data;
+            bool                    m_bStored;
+
+            bool operator == (const chunk&) const = default;
+        };
+
+        // Collects the chunk sequence of any compressor with the streaming Pack contract
+        auto Collect = [&](auto& Compressor)
+        {
+            std::vector<chunk>      Chunks;
+            std::vector<std::byte>  compressed(BlockSize);
+            std::uint64_t           compressedSize;
+            while (true)
+            {
+                const auto  Offset  = Compressor.m_Position;
+                xerr        err     = Compressor.Pack(compressedSize, compressed);
+                if (err && err.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE)
+                {
+                    Chunks.push_back({ { Source.begin() + Offset, Source.begin() + Compressor.m_Position }, true });
+                    continue;
+                }
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Parallel streaming: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                if (compressedSize > 0) Chunks.push_back({ { compressed.begin(), compressed.begin() + compressedSize }, false });
+                if (err == false) break;
+            }
+            return Chunks;
+        };
+
+        std::vector<chunk> Expected;
+        {
+            xcompression::fixed_block_compress compressor;
+            if (auto err = compressor.Init(false, BlockSize, Source, xcompression::fixed_block_compress::level::MEDIUM); err) assert(false);
+            Expected = Collect(compressor);
+        }
+
+        // Same output for any thread count and window, contiguous or scattered
+        std::vector<std::span<const std::byte>> Fragments;
+        for (std::size_t Offset = 0; Offset < Source.size(); Offset += 77)
+            Fragments.push_back(Source.subspan(Offset, std::min<std::size_t>(77, Source.size() - Offset)));
+
+        std::size_t nStored = 0;
+        for (const auto& E : Expected) nStored += E.m_bStored;
+
+        for (std::uint32_t nThreads : { 1u, 2u, 4u, 0u })
+        {
+            for (std::uint32_t MaxAhead : { 1u, 3u, 0u })
+            {
+                for (bool bScattered : { false, true })
+                {
+                    xcompression::fixed_block_parallel_compress compressor;
+                    auto err = bScattered
+                        ? compressor.Init(BlockSize, std::span<const std::span<const std::byte>>(Fragments), xcompression::fixed_block_compress::level::MEDIUM, nThreads, MaxAhead)
+                        : compressor.Init(BlockSize, Source, xcompression::fixed_block_compress::level::MEDIUM, nThreads, MaxAhead);
+                    if (err)
+                    {
+                        std::cout << "Parallel streaming: init failed: " << err.m_pMessage << "\n";
+                        assert(false);
+                    }
+
+                    if (Collect(compressor) != Expected)
+                    {
+                        std::cout << "Parallel streaming: chunks differ from single thread (" << nThreads << " threads, " << MaxAhead << " ahead)\n";
+                        assert(false);
+                    }
+                }
+            }
+        }
+
+        std::cout << "Parallel streaming: match single thread ( " << Expected.size() << " chunks, " << nStored << " incompressible ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestLatencyStreaming(std::span<const std::byte> Source)
+    {
+        using clock = xcompression::latency_compress::clock;
+
+        constexpr std::size_t   RecordSize  = 64;
+        constexpr std::size_t   BlockSize   = 4096;
+        constexpr auto          MaxDelay    = std::chrono::microseconds(2000);
+
+        struct vector_sink final : xcompression::output_sink
+        {
+            xerr Write(std::span<const std::span<const std::byte>> Buffers) noexcept override
+            {
+                for (const auto& B : Buffers) m_Data.insert(m_Data.end(), B.begin(), B.end());
+                return {};
+            }
+
+            std::vector<std::byte> m_Data;
+        };
+
+        // Everything sent so far must decode to everything written before the last flush
+        auto Check = [&](std::span<const std::byte> Compressed, std::size_t Size)
+        {
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(false, BlockSize, 256); err) assert(false);
+
+            std::vector<std::byte>  decompressed;
+            std::vector<std::byte>  buffer(BlockSize);
+            std::uint32_t           decompressedSize;
+            while (Compressed.size())
+            {
+                auto err = decompressor.Unpack(decompressedSize, buffer, Compressed);
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Latency streaming: decompression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+                decompressed.insert(decompressed.end(), buffer.begin(), buffer.begin() + decompressedSize);
+                if (err == false) break;
+            }
+
+            if (decompressed.size() != Size || false == std::equal(decompressed.begin(), decompressed.end(), Source.begin()))
+            {
+                std::cout << "Latency streaming: flushed data does not match original\n";
+                assert(false);
+            }
+        };
+
+        vector_sink                     Sink;
+        xcompression::latency_compress  Stream;
+        if (auto err = Stream.Init(Sink, MaxDelay, 1024); err)
+        {
+            std::cout << "Latency streaming: init failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        // Records arrive every 300us (simulated clock), with a timer armed at the deadline
+        const auto  Start   = clock::now();
+        auto        Now     = Start;
+        std::size_t Written = 0;
+        std::size_t Flushed = 0;
+        for (std::size_t i = 0; Written < Source.size(); ++i)
+        {
+            const auto Record = Source.subspan(Written, std::min(RecordSize, Source.size() - Written));
+            Now = Start + std::chrono::microseconds(300 * i);
+
+            if (const auto Deadline = Stream.getDeadline(); Deadline <= Now)
+            {
+                if (auto err = Stream.Poll(Deadline); err) assert(false);
+            }
+            if (Stream.getStats().m_nFlushes != Flushed) Check(Sink.m_Data, Written);
+            Flushed = Stream.getStats().m_nFlushes;
+
+            if (auto err = Stream.Write(Record, Now); err) assert(false);
+            Written += Record.size();
+
+            assert(Stream.getDeadline() == clock::time_point::max() || Stream.getDeadline() <= Now + MaxDelay);
+            if (Stream.getStats().m_nFlushes != Flushed) Check(Sink.m_Data, Written);
+            Flushed = Stream.getStats().m_nFlushes;
+        }
+
+        if (auto err = Stream.Close(Now); err) assert(false);
+        Check(Sink.m_Data, Source.size());
+
+        const auto& Stats = Stream.getStats();
+        assert(Stats.m_InputBytes == Source.size());
+        assert(Stats.m_OutputBytes == Sink.m_Data.size() && Stats.m_OutputBytes < Stats.m_InputBytes);
+        assert(Stats.m_nDeadlineFlushes > 0 && Stats.m_nDeadlineFlushes < Stats.m_nFlushes);
+        assert(Stats.m_MaxMicroseconds <= static_cast<std::uint64_t>(MaxDelay.count()));
+        assert(Stats.getPercentileMicroseconds(99) <= Stats.m_MaxMicroseconds);
+
+        std::cout << "Latency streaming: match original ( compressed size " << Stats.m_OutputBytes << ", " << Stats.m_nFlushes << " flushes, "
+                  << Stats.m_nDeadlineFlushes << " on deadline, p50 " << Stats.getPercentileMicroseconds(50) << " us, p99 "
+                  << Stats.getPercentileMicroseconds(99) << " us ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestOutputDraining(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        struct chunk
+        {
+            std::vector<std::byte>  m_Data;
+            bool                    m_bStored;
+
+            bool operator == (const chunk&) const = default;
+        };
+
+        // Packs everything through an output buffer of OutputSize bytes, gluing the drained pieces back into chunks
+        auto Collect = [&](xcompression::fixed_block_compress& Compressor, std::size_t OutputSize)
+        {
+            std::vector<chunk>      Chunks;
+            std::vector<std::byte>  Current;
+            std::vector<std::byte>  Output(OutputSize);
+            std::uint64_t           OutSize;
+            while (true)
+            {
+                const auto  Offset  = Compressor.m_Position;
+                auto        err     = Compressor.Pack(OutSize, Output);
+                if (err && err.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE)
+                {
+                    assert(Compressor.isDraining() == false);
+                    Chunks.push_back({ { Source.begin() + Offset, Source.begin() + Compressor.m_Position }, true });
+                    Current.clear();
+                    if (Compressor.m_bBlockSizeIsOutputSize) break;
+                    continue;
+                }
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Output draining: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+
+                assert(OutSize <= OutputSize);
+                Current.insert(Current.end(), Output.begin(), Output.begin() + OutSize);
+                if (Compressor.isDraining()) continue;
+
+                if (Current.size()) Chunks.push_back({ std::move(Current), false });
+                Current.clear();
+                if (err == false) break;
+            }
+            return Chunks;
+        };
+
+        std::size_t nConfigurations = 0;
+        auto Compare = [&](auto&& InitFunc, const char* pWhat)
+        {
+            xcompression::fixed_block_compress Reference;
+            if (auto err = InitFunc(Reference); err) assert(false);
+            const auto Expected = Collect(Reference, Source.size() * 2 + 64);
+
+            for (std::size_t OutputSize : { 1, 7, 64 })
+            {
+                xcompression::fixed_block_compress compressor;
+                if (auto err = InitFunc(compressor); err) assert(false);
+                if (Collect(compressor, OutputSize) != Expected)
+                {
+                    std::cout << "Output draining: " << pWhat << " differs with a " << OutputSize << " byte buffer\n";
+                    assert(false);
+                }
+            }
+            nConfigurations++;
+        };
+
+        // Block mode on a large input (the buffer is a tiny fraction of the frame)
+        std::vector<std::byte> Large;
+        for (int i = 0; i < 64; ++i) Large.insert(Large.end(), Source.begin(), Source.end());
+
+        {
+            xcompression::fixed_block_compress Reference;
+            if (auto err = Reference.Init(true, 64 * 1024, Large); err) assert(false);
+            std::vector<std::byte>  Expected(Large.size());
+            std::uint64_t           ExpectedSize;
+            if (auto err = Reference.Pack(ExpectedSize, Expected); err) assert(false);
+            Expected.resize(ExpectedSize);
+
+            xcompression::fixed_block_compress compressor;
+            if (auto err = compressor.Init(true, 64 * 1024, Large); err) assert(false);
+
+            std::vector<std::byte>  Drained;
+            std::vector<std::byte>  Output(64);
+            std::uint64_t           OutSize;
+            std::size_t             nCalls = 0;
+            while (true)
+            {
+                auto err = compressor.Pack(OutSize, Output);
+                nCalls++;
+                Drained.insert(Drained.end(), Output.begin(), Output.begin() + OutSize);
+                if (err == false) break;
+                assert(err.getState<xcompression::state>() == xcompression::state::NOT_DONE && compressor.isDraining());
+                assert(compressor.m_Position == 0);
+            }
+
+            // Once the frame is out there is nothing left to return (and nothing more to index)
+            if (auto err = compressor.Pack(OutSize, Output); err || OutSize != 0) assert(false);
+
+            if (Drained != Expected)
+            {
+                std::cout << "Output draining: block mode frame differs from the single call one\n";
+                assert(false);
+            }
+
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(true, Large.size()); err) assert(false);
+            std::vector<std::byte>  decompressed(Large.size());
+            std::uint32_t           decompressedSize;
+            if (auto err = decompressor.Unpack(decompressedSize, decompressed, Drained); err || decompressed != Large)
+            {
+                std::cout << "Output draining: Decompressed data does not match original\n";
+                assert(false);
+            }
+
+            std::cout << "Output draining: block mode frame of " << Drained.size() << " bytes drained in " << nCalls << " calls of 64 bytes\n";
+        }
+
+        // Dynamic block mode drains the same way
+        {
+            using dynamic_level = xcompression::dynamic_block_compress::level;
+
+            xcompression::dynamic_block_compress Reference;
+            if (auto err = Reference.Init(true, Large.size(), Large, dynamic_level::MEDIUM); err) assert(false);
+            std::vector<std::byte>  Expected(Large.size());
+            std::uint64_t           ExpectedSize;
+            if (auto err = Reference.Pack(ExpectedSize, Expected); err) assert(false);
+            Expected.resize(ExpectedSize);
+
+            xcompression::dynamic_block_compress compressor;
+            if (auto err = compressor.Init(true, Large.size(), Large, dynamic_level::MEDIUM); err) assert(false);
+
+            std::vector<std::byte>  Drained;
+            std::vector<std::byte>  Output(64);
+            std::uint64_t           OutSize;
+            while (true)
+            {
+                auto err = compressor.Pack(OutSize, Output);
+                Drained.insert(Drained.end(), Output.begin(), Output.begin() + OutSize);
+                if (err == false) break;
+                assert(err.getState<xcompression::state>() == xcompression::state::NOT_DONE && compressor.isDraining());
+                assert(compressor.m_Position == 0);
+            }
+
+            // Once the frame is out there is nothing left to return
+            if (auto err = compressor.Pack(OutSize, Output); err || OutSize != 0) assert(false);
+
+            xcompression::dynamic_block_decompress decompressor;
+            if (auto err = decompressor.Init(true, Large.size()); err) assert(false);
+            std::vector<std::byte>  decompressed(Large.size());
+            std::uint32_t           decompressedSize;
+            if (Drained != Expected || decompressor.Unpack(decompressedSize, decompressed, Drained) || decompressed != Large)
+            {
+                std::cout << "Output draining: dynamic block mode frame differs from the single call one\n";
+                assert(false);
+            }
+        }
+
+        std::vector<std::span<const std::byte>> Fragments;
+        for (std::size_t Offset = 0; Offset < Source.size(); Offset += 53)
+            Fragments.push_back(Source.subspan(Offset, std::min<std::size_t>(53, Source.size() - Offset)));
+        const std::span<const std::span<const std::byte>> Segments(Fragments);
+
+        using level = xcompression::fixed_block_compress::level;
+        Compare([&](auto& C) { return C.Init(true,  Source.size(), Source, level::MEDIUM); },       "block mode");
+        Compare([&](auto& C) { return C.Init(true,  Source.size(), Segments, level::MEDIUM); },     "scatter-gather block mode");
+        Compare([&](auto& C) { return C.Init(true,  64, Source.first(64), level::MEDIUM); },        "incompressible block mode");
+        Compare([&](auto& C) { return C.Init(false, BlockSize, Source, level::MEDIUM); },           "streaming mode");
+        Compare([&](auto& C) { return C.Init(false, BlockSize, Segments, level::MEDIUM); },         "scatter-gather streaming mode");
+        Compare([&](auto& C) { return C.Init(false, BlockSize, Source, level::MEDIUM, 4); },        "history streaming mode");
+
+        std::cout << "Output draining: match single call ( " << nConfigurations << " configurations with 1, 7 and 64 byte buffers ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestRingCompress(std::span<const std::byte> Source, const std::size_t BlockSize)
+    {
+        using level = xcompression::ring_compress::level;
+
+        struct collector
+        {
+            std::vector<std::byte>  m_Data;         // Everything the chunks decode to, in order
+            std::uint64_t           m_Offset = 0;
+            std::size_t             m_BlockSize;
+
+            void operator()(const xcompression::stream_chunk& Chunk)
+            {
+                assert(Chunk.m_SourceOffset == m_Offset && Chunk.m_SourceSize <= m_BlockSize);
+                m_Offset += Chunk.m_SourceSize;
+
+                if (Chunk.m_bStored)
+                {
+                    m_Data.insert(m_Data.end(), Chunk.m_Data.begin(), Chunk.m_Data.end());
+                    return;
+                }
+
+                xcompression::fixed_block_decompress decompressor;
+                if (auto err = decompressor.Init(false, m_BlockSize); err) assert(false);
+
+                std::vector<std::byte>  buffer(m_BlockSize);
+                std::uint32_t           decompressedSize;
+                std::size_t             Total = 0;
+                while (true)
+                {
+                    auto err = decompressor.Unpack(decompressedSize, buffer, Chunk.m_Data);
+                    if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                    {
+                        std::cout << "Ring compress: decompression failed: " << err.m_pMessage << "\n";
+                        assert(false);
+                    }
+                    m_Data.insert(m_Data.end(), buffer.begin(), buffer.begin() + decompressedSize);
+                    Total += decompressedSize;
+                    if (err == false) break;
+                }
+                assert(Total == Chunk.m_SourceSize);
+            }
+        };
+
+        // Single producer: the chunks decode to exactly what was written, Flush delivers a partial chunk
+        {
+            collector                   Collector{ {}, 0, BlockSize };
+            xcompression::ring_compress Ring;
+            if (auto err = Ring.Init(1024, BlockSize, [&](const xcompression::stream_chunk& Chunk) { Collector(Chunk); }, xcompression::ring_compress::producers::SINGLE, level::MEDIUM); err)
+            {
+                std::cout << "Ring compress: init failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+
+            std::size_t Written = 0;
+            for (std::size_t i = 0; Written < Source.size(); ++i)
+            {
+                const auto Record = Source.subspan(Written, std::min<std::size_t>(1 + (i * 37) % 97, Source.size() - Written));
+                while (true)
+                {
+                    auto err = Ring.Write(Record);
+                    if (!err) break;
+                    assert(err.getState<xcompression::state>() == xcompression::state::NOT_DONE);
+                    std::this_thread::yield();
+                }
+                Written += Record.size();
+
+                if (i == 10)
+                {
+                    Ring.Flush();
+                    if (Collector.m_Data.size() != Written || false == std::equal(Collector.m_Data.begin(), Collector.m_Data.end(), Source.begin()))
+                    {
+                        std::cout << "Ring compress: flush did not deliver everything committed\n";
+                        assert(false);
+                    }
+                }
+            }
+
+            // A record just over the limit is an error, not a full ring (retrying it would never end)
+            {
+                const std::vector<std::byte> Oversized(Ring.getMaxRecordSize() + 1);
+                assert(Ring.getMaxRecordSize() == 1024 / 2 - 16);
+                assert(Ring.Reserve(Oversized.size()).data() == nullptr);
+
+                auto err = Ring.Write(Oversized);
+                assert(err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE);
+
+                const std::vector<std::byte> Largest(Ring.getMaxRecordSize());
+                Ring.Flush();
+                if (auto err = Ring.Write(Largest); err) assert(false);
+                Ring.Flush();
+                Collector.m_Data.resize(Collector.m_Data.size() - Largest.size());
+            }
+            Ring.Shutdown();
+
+            if (Collector.m_Data.size() != Source.size() || false == std::equal(Collector.m_Data.begin(), Collector.m_Data.end(), Source.begin()))
+            {
+                std::cout << "Ring compress: single producer data does not match original\n";
+                assert(false);
+            }
+        }
+
+        // Several producers on a small ring: each record is { producer, size, payload }, every producer sends all of Source
+        constexpr std::size_t   nProducers = 4;
+        collector               Collector{ {}, 0, BlockSize };
+        xcompression::ring_compress::stats Stats;
+        {
+            xcompression::ring_compress Ring;
+            if (auto err = Ring.Init(512, BlockSize, [&](const xcompression::stream_chunk& Chunk) { Collector(Chunk); }); err) assert(false);
+
+            std::vector<std::jthread> Producers;
+            for (std::size_t p = 0; p < nProducers; ++p)
+            {
+                Producers.emplace_back([&Ring, Source, p]()
+                {
+                    std::size_t Written = 0;
+                    for (std::size_t i = 0; Written < Source.size(); ++i)
+                    {
+                        const auto Payload = Source.subspan(Written, std::min<std::size_t>(1 + (i * 31 + p * 7) % 97, Source.size() - Written));
+                        Written += Payload.size();
+
+                        if (p == 0)
+                        {
+                            // Through Write
+                            std::vector<std::byte> Record{ std::byte(p), std::byte(Payload.size()) };
+                            Record.insert(Record.end(), Payload.begin(), Payload.end());
+                            while (true)
+                            {
+                                auto err = Ring.Write(Record);
+                                if (!err) break;
+                                assert(err.getState<xcompression::state>() == xcompression::state::NOT_DONE);
+                                std::this_thread::yield();
+                            }
+                            continue;
+                        }
+
+                        // In place, reserving the largest record and committing what was used
+                        std::span<std::byte> Reservation;
+                        while ((Reservation = Ring.Reserve(2 + 97)).data() == nullptr) std::this_thread::yield();
+                        Reservation[0] = std::byte(p);
+                        Reservation[1] = std::byte(Payload.size());
+                        std::memcpy(&Reservation[2], Payload.data(), Payload.size());
+                        Ring.Commit(Reservation, 2 + Payload.size());
+                    }
+                });
+            }
+            Producers.clear();
+
+            Ring.Flush();
+            Stats = Ring.getStats();
+        }
+
+        std::array<std::vector<std::byte>, nProducers> Received;
+        for (std::size_t Offset = 0; Offset < Collector.m_Data.size(); )
+        {
+            const auto p    = static_cast<std::size_t>(Collector.m_Data[Offset]);
+            const auto Size = static_cast<std::size_t>(Collector.m_Data[Offset + 1]);
+            assert(p < nProducers && Offset + 2 + Size <= Collector.m_Data.size());
+            Received[p].insert(Received[p].end(), Collector.m_Data.begin() + Offset + 2, Collector.m_Data.begin() + Offset + 2 + Size);
+            Offset += 2 + Size;
+        }
+
+        for (const auto& R : Received)
+        {
+            if (R.size() != Source.size() || false == std::equal(R.begin(), R.end(), Source.begin()))
+            {
+                std::cout << "Ring compress: a producer's records are missing or out of order\n";
+                assert(false);
+            }
+        }
+
+        assert(Stats.m_InputBytes == Collector.m_Data.size());
+        assert(Stats.m_nChunks >= Stats.m_InputBytes / BlockSize);
+
+        std::cout << "Ring compress: match original ( " << nProducers << " producers, " << Stats.m_nChunks << " chunks, " << Stats.m_nStored << " stored, "
+                  << Stats.m_InputBytes << " -> " << Stats.m_OutputBytes << " bytes, " << Stats.m_nFull << " full reservations ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestCompressedLog(std::span<const std::byte> Source)
+    {
+        constexpr std::size_t FrameSize = 256;
+
+        auto Check = [&](xcompression::compressed_log& Log, std::span<const std::byte> Expected, const char* pWhat)
+        {
+            std::vector<std::byte> Data(Expected.size());
+            if (auto err = Log.Read(Data, Log.getBegin()); err || Log.getEnd() - Log.getBegin() != Expected.size() || false == std::equal(Data.begin(), Data.end(), Expected.begin()))
+            {
+                std::cout << "Compressed log: " << pWhat << " does not match original\n";
+                assert(false);
+            }
+        };
+
+        // Appends of every size, some straddling frames
+        xcompression::compressed_log Log;
+        if (auto err = Log.Init(FrameSize); err)
+        {
+            std::cout << "Compressed log: init failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        std::size_t Written = 0;
+        for (std::size_t i = 0; Written < Source.size(); ++i)
+        {
+            const auto Size = std::min<std::size_t>((i * 53) % 600, Source.size() - Written);
+            if (auto err = Log.Append(Source.subspan(Written, Size)); err) assert(false);
+            Written += Size;
+        }
+        Check(Log, Source, "appended data");
+        assert(Log.m_Frames.size() == Source.size() / FrameSize && Log.m_Tail.size() == Source.size() % FrameSize);
+
+        // Random reads across frames and the tail
+        for (std::size_t Offset = 0; Offset < Source.size(); Offset += 97)
+        {
+            std::vector<std::byte> Data(std::min<std::size_t>(300, Source.size() - Offset));
+            if (auto err = Log.Read(Data, Offset); err || false == std::equal(Data.begin(), Data.end(), Source.begin() + Offset))
+            {
+                std::cout << "Compressed log: read at " << Offset << " does not match original\n";
+                assert(false);
+            }
+        }
+
+        // Truncating keeps the offsets, whole frames go
+        const auto nFrames = Log.m_Frames.size();
+        Log.TruncateFront(FrameSize * 2 + 10);
+        assert(Log.getBegin() == FrameSize * 2 && Log.m_Frames.size() == nFrames - 2);
+        Check(Log, Source.subspan(FrameSize * 2), "truncated log");
+
+        std::byte Dropped;
+        if (auto err = Log.Read(std::span(&Dropped, 1), 0); !err) assert(false);
+
+        // Splicing two logs, the second one with a different frame size and an open tail
+        xcompression::compressed_log Second;
+        if (auto err = Second.Init(100, xcompression::compressed_log::level::FAST); err) assert(false);
+        if (auto err = Second.Append(Source.first(1000)); err) assert(false);
+        Second.TruncateFront(300);
+
+        const auto CompressedSize = Log.getCompressedSize() + Second.getCompressedSize();
+        if (auto err = Log.Concatenate(Second); err) assert(false);
+        assert(Second.getEnd() == Second.getBegin() && Second.getCompressedSize() == 0);
+
+        std::vector<std::byte> Expected(Source.begin() + FrameSize * 2, Source.end());
+        Expected.insert(Expected.end(), Source.begin() + 300, Source.begin() + 1000);
+        Check(Log, Expected, "concatenated log");
+
+        // The frames written out are a zstd stream that loads back without decoding
+        if (auto err = Log.Flush(); err) assert(false);
+        assert(Log.getCompressedSize() > CompressedSize);
+
+        struct vector_sink final : xcompression::output_sink
+        {
+            xerr Write(std::span<const std::span<const std::byte>> Buffers) noexcept override
+            {
+                for (const auto& B : Buffers) m_Data.insert(m_Data.end(), B.begin(), B.end());
+                return {};
+            }
+
+            std::vector<std::byte> m_Data;
+        };
+
+        vector_sink Sink;
+        if (auto err = Log.Write(Sink); err) assert(false);
+        assert(Sink.m_Data.size() == Log.getCompressedSize());
+
+        xcompression::compressed_log Loaded;
+        if (auto err = Loaded.Init(FrameSize); err) assert(false);
+        if (auto err = Loaded.Load(Sink.m_Data, Log.getBegin()); err)
+        {
+            std::cout << "Compressed log: load failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+        assert(Loaded.getBegin() == Log.getBegin() && Loaded.getEnd() == Log.getEnd() && Loaded.m_Frames.size() == Log.m_Frames.size());
+        Check(Loaded, Expected, "loaded log");
+
+        // Frames bigger than the loading log allows are rejected
+        xcompression::compressed_log Small;
+        if (auto err = Small.Init(FrameSize / 2); err) assert(false);
+        if (auto err = Small.Load(Sink.m_Data, Log.getBegin()); !err) assert(false);
+
+        std::cout << "Compressed log: match original ( " << Log.m_Frames.size() << " frames, " << Expected.size() << " -> " << Log.getCompressedSize() << " bytes ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestAutotuner(std::span<const std::byte> Source)
+    {
+        using autotuner = xcompression::autotuner;
+
+        std::vector<std::byte> Text;
+        for (int i = 0; Text.size() < 16 * 1024; ++i)
+        {
+            const auto Line = "record " + std::to_string(i % 97) + " key=" + std::to_string((i * 7919) % 1000) + "\n";
+            for (char c : Line) Text.push_back(std::byte(c));
+        }
+
+        const std::span<const std::byte>    Files[]      = { Source, Text };
+        const std::uint64_t                 BlockSizes[] = { 2 * 1024, 8 * 1024 };
+
+        autotuner::options Options;
+        Options.m_BlockSizes = BlockSizes;
+
+        autotuner Tuner;
+        if (auto err = Tuner.Run(Files, Options); err)
+        {
+            std::cout << "Autotuner: run failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+
+        // 2 families, streaming with every block size, block mode with both (they are in the zstd range), 3 levels
+        assert(Tuner.m_Results.size() == 2 * 3 * (2 + 2));
+
+        const auto Front = Tuner.getParetoFront();
+        assert(Front.empty() == false);
+        for (const auto& A : Front)
+        {
+            for (const auto& B : Tuner.m_Results)
+            {
+                if (B.m_bPruned) continue;
+                assert(false == (B.m_Ratio >= A.m_Ratio && B.m_CompressMBs >= A.m_CompressMBs && B.m_DecompressMBs >= A.m_DecompressMBs
+                              && (B.m_Ratio > A.m_Ratio || B.m_CompressMBs > A.m_CompressMBs || B.m_DecompressMBs > A.m_DecompressMBs)));
+            }
+        }
+
+        // No constraint: the best ratio that was measured
+        autotuner::config Config;
+        if (auto err = Tuner.Recommend(Config, {}); err) assert(false);
+
+        double BestRatio = 0;
+        for (const auto& R : Tuner.m_Results) if (R.m_bPruned == false) BestRatio = std::max(BestRatio, R.m_Ratio);
+        assert(std::find_if(Tuner.m_Results.begin(), Tuner.m_Results.end(), [&](const autotuner::result& R) { return R.m_Config == Config; })->m_Ratio == BestRatio);
+
+        // Impossible constraints
+        autotuner::config Unused;
+        if (auto err = Tuner.Recommend(Unused, { .m_MinDecompressMBs = 1e12 }); !err) assert(false);
+
+        // The config survives a save and load, and drives Init
+        autotuner::config Loaded;
+        if (auto err = Loaded.fromString(Config.toString()); err || !(Loaded == Config)) assert(false);
+        if (auto err = Loaded.fromString("fixed streaming turbo 100"); !err) assert(false);
+
+        xcompression::fixed_block_compress compressor;
+        if (auto err = autotuner::config{ autotuner::family::FIXED, false, autotuner::level::FAST, 512 }.Init(compressor, Source); err) assert(false);
+        assert(compressor.m_BlockSize == 512);
+
+        std::cout << "Autotuner: " << Tuner.m_Results.size() << " configs, " << std::count_if(Tuner.m_Results.begin(), Tuner.m_Results.end(), [](const autotuner::result& R) { return R.m_bPruned; })
+                  << " pruned, " << Front.size() << " on the Pareto front, best ratio \"" << Config.toString() << "\" \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestLazyDecompressInit(std::span<const std::byte> Source)
+    {
+        std::vector<std::byte> Compressed(Source.size());
+        std::uint64_t          CompressedSize;
+        {
+            xcompression::fixed_block_compress compressor;
+            if (auto err = compressor.Init(true, Source.size(), Source, xcompression::fixed_block_compress::level::MEDIUM); err) assert(false);
+            if (auto err = compressor.Pack(CompressedSize, Compressed); err)
+            {
+                std::cout << "Lazy decompress init: compression failed: " << err.m_pMessage << "\n";
+                assert(false);
+            }
+        }
+
+        // Many decoders that are set up but not all used, like the readers of an archive at startup
+        constexpr int                                           DecoderCount = 64;
+        std::vector<xcompression::fixed_block_decompress>       Decoders(DecoderCount);
+
+        const auto InitStart = std::chrono::steady_clock::now();
+        for (auto& D : Decoders)
+        {
+            if (auto err = D.Init(true, Source.size()); err) assert(false);
+        }
+        const auto InitTime = std::chrono::steady_clock::now() - InitStart;
+
+        for (auto& D : Decoders) assert(D.m_pDCTX == nullptr);
+
+        // The first Unpack creates the context, the next ones reuse it
+        std::vector<std::byte> Decompressed(Source.size());
+        std::uint32_t          DecompressedSize;
+        const auto             DecodeStart = std::chrono::steady_clock::now();
+        if (auto err = Decoders[0].Unpack(DecompressedSize, Decompressed, std::span(Compressed.data(), CompressedSize)); err)
+        {
+            std::cout << "Lazy decompress init: first Unpack failed: " << err.m_pMessage << "\n";
+            assert(false);
+        }
+        const auto DecodeTime = std::chrono::steady_clock::now() - DecodeStart;
+
+        void* const pContext = Decoders[0].m_pDCTX;
+        assert(pContext != nullptr);
+        assert(Decoders[1].m_pDCTX == nullptr);
+
+        if (DecompressedSize != Source.size() || false == std::equal(Decompressed.begin(), Decompressed.end(), Source.begin(), Source.end()))
+        {
+            std::cout << "Lazy decompress init: decompressed data does not match original\n";
+            assert(false);
+        }
+
+        std::fill(Decompressed.begin(), Decompressed.end(), std::byte{ 0 });
+        if (auto err = Decoders[0].Unpack(DecompressedSize, Decompressed, std::span(Compressed.data(), CompressedSize)); err) assert(false);
+        assert(Decoders[0].m_pDCTX == pContext);
+        assert(std::equal(Decompressed.begin(), Decompressed.end(), Source.begin(), Source.end()));
+
+        std::cout << "Lazy decompress init: " << std::chrono::duration<double, std::micro>(InitTime).count() / DecoderCount << "us per Init, "
+                  << std::chrono::duration<double, std::micro>(DecodeTime).count() << "us to first decode\n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestIncrementalDecompress(std::span<const std::byte> Source)
+    {
+        using budget = xcompression::incremental_decompress::budget;
+
+        // Large enough that a time budget takes many calls
+        std::vector<std::byte> Data;
+        for (int i = 0; Data.size() < 512 * 1024; ++i)
+        {
+            if (i % 16 == 0) Data.insert(Data.end(), Source.begin(), Source.end());
+            const auto Line = "asset " + std::to_string(i % 331) + " lod=" + std::to_string((i * 31) % 7) + "\n";
+            for (char c : Line) Data.push_back(std::byte(c));
+        }
+
+        constexpr std::uint64_t BlockSize    = 4 * 1024;
+        constexpr std::uint32_t SyncInterval = 4;
+
+        xcompression::fixed_block_compress compressor;
+        if (auto err = compressor.Init(false, BlockSize, Data, xcompression::fixed_block_compress::level::MEDIUM, SyncInterval); err) assert(false);
+
+        xcompression::fixed_block_pack_range PackRange;
+        if (auto err = PackRange.Init(compressor); err) assert(false);
+
+        std::vector<std::vector<std::byte>>     Storage;
+        std::vector<xcompression::stream_chunk> Chunks;
+        for (const auto& Chunk : PackRange)
+        {
+            Storage.emplace_back(Chunk.m_Data.begin(), Chunk.m_Data.end());
+            Chunks.push_back(Chunk);
+        }
+        if (PackRange.getError()) assert(false);
+        for (std::size_t i = 0; i < Chunks.size(); ++i) Chunks[i].m_Data = Storage[i];
+
+        //
+        // Byte budget: every call decodes exactly the budget, the last one the rest
+        //
+        {
+            std::vector<std::byte>              Output(Data.size());
+            xcompression::incremental_decompress Stream;
+            if (auto err = Stream.Init(Chunks, Output, BlockSize * SyncInterval); err) assert(false);
+
+            int nCalls = 0;
+            for (;;)
+            {
+                std::uint64_t   Decoded;
+                auto            err = Stream.Unpack(Decoded, budget{ .m_Bytes = 1000 });
+                nCalls++;
+                if (!err)
+                {
+                    assert(Decoded <= 1000);
+                    break;
+                }
+                if (err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Incremental decompress: byte budget failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+                assert(Decoded == 1000);
+                assert(Stream.getPosition() == nCalls * 1000ull);
+            }
+
+            assert(Stream.isDone() && Stream.getPosition() == Data.size());
+            if (Output != Data)
+            {
+                std::cout << "Incremental decompress: byte budget output does not match original\n";
+                assert(false);
+            }
+        }
+
+        //
+        // Time budget, and a block mode frame as a single chunk
+        //
+        int nTimedCalls = 0;
+        {
+            std::vector<std::byte>              Output(Data.size());
+            xcompression::incremental_decompress Stream;
+            Stream.m_SliceSize = 8 * 1024;
+            if (auto err = Stream.Init(Chunks, Output, BlockSize * SyncInterval); err) assert(false);
+
+            xerr err;
+            do
+            {
+                std::uint64_t Decoded;
+                err = Stream.Unpack(Decoded, budget{ .m_Time = std::chrono::microseconds(20) });
+                assert(Decoded > 0);
+                nTimedCalls++;
+            } while (err && err.getState<xcompression::state>() == xcompression::state::NOT_DONE);
+
+            assert(!err && Output == Data);
+        }
+        {
+            std::vector<std::byte> Frame(Data.size());
+            std::uint64_t          FrameSize;
+            {
+                xcompression::fixed_block_compress BlockCompressor;
+                if (auto err = BlockCompressor.Init(true, 64 * 1024, Data, xcompression::fixed_block_compress::level::MEDIUM); err) assert(false);
+                if (auto err = BlockCompressor.Pack(FrameSize, Frame); err) assert(false);
+            }
+
+            const xcompression::stream_chunk    Chunk = { std::span(Frame.data(), FrameSize), 0, Data.size(), false };
+            std::vector<std::byte>              Output(Data.size());
+            xcompression::incremental_decompress Stream;
+            if (auto err = Stream.Init(std::span(&Chunk, 1), Output, Data.size()); err) assert(false);
+
+            std::uint64_t Decoded;
+            while (Stream.Unpack(Decoded, budget{ .m_Bytes = 777 }))
+                assert(Decoded == 777);
+
+            assert(Stream.isDone() && Output == Data);
+        }
+
+        //
+        // Scheduler: the shares follow the priorities and every stream completes
+        //
+        {
+            constexpr std::uint32_t                 Priorities[] = { 1, 2, 4 };
+            std::vector<std::byte>                  Outputs[3];
+            xcompression::incremental_decompress    Streams[3];
+            xcompression::decompress_scheduler      Scheduler;
+
+            for (int i = 0; i < 3; ++i)
+            {
+                Outputs[i].resize(Data.size());
+                if (auto err = Streams[i].Init(Chunks, Outputs[i], BlockSize * SyncInterval); err) assert(false);
+                Scheduler.Add(Streams[i], Priorities[i]);
+            }
+            assert(Scheduler.m_Streams.front().m_Priority == 4);
+
+            if (auto err = Scheduler.Run(budget{ .m_Bytes = 7000 }); err.getState<xcompression::state>() != xcompression::state::NOT_DONE) assert(false);
+            assert(Scheduler.m_LastBytes == 7000);
+            assert(Streams[0].getPosition() == 1000 && Streams[1].getPosition() == 2000 && Streams[2].getPosition() == 4000);
+
+            // The highest priority finishes first, its share then goes to the others
+            int nRuns = 1;
+            while (Scheduler.Run(budget{ .m_Bytes = 64 * 1024 }))
+            {
+                nRuns++;
+                if (Streams[2].isDone() == false) assert(Streams[0].isDone() == false && Streams[1].isDone() == false);
+            }
+            assert(Scheduler.empty() && Scheduler.m_pFailed == nullptr);
+            for (const auto& Output : Outputs) assert(Output == Data);
+
+            // A damaged stream fails alone and the others carry on
+            std::vector<xcompression::stream_chunk> Damaged     = Chunks;
+            std::vector<std::byte>                  Garbage(Storage[3].size(), std::byte{ 0x5A });
+            Damaged[3].m_Data = Garbage;
+            Damaged[3].m_bStored = false;
+
+            std::vector<std::byte> Output(Data.size());
+            if (auto err = Streams[0].Init(Damaged, Output, BlockSize * SyncInterval); err) assert(false);
+            if (auto err = Streams[1].Init(Chunks, Outputs[1], BlockSize * SyncInterval); err) assert(false);
+            Scheduler.Add(Streams[0]);
+            Scheduler.Add(Streams[1]);
+
+            xerr err;
+            while ((err = Scheduler.Run(budget{ .m_Time = std::chrono::microseconds(100) })) && err.getState<xcompression::state>() == xcompression::state::NOT_DONE) {}
+            assert(err && Scheduler.m_pFailed == &Streams[0]);
+            while (Scheduler.Run({})) {}
+            assert(Streams[1].isDone() && Outputs[1] == Data);
+
+            std::cout << "Incremental decompress: match original ( " << Chunks.size() << " chunks, " << nTimedCalls << " calls of 20us, "
+                      << nRuns << " scheduler runs of 64KB for 3 streams ) \n";
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestChecksum(std::span<const std::byte> Source)
+    {
+        std::vector<std::byte> Data;
+        for (int i = 0; Data.size() < 1024 * 1024; ++i)
+        {
+            if (i % 64 == 0) Data.insert(Data.end(), Source.begin(), Source.end());
+            const auto Line = "block " + std::to_string(i % 503) + " crc=" + std::to_string((i * 7919) % 10007) + "\n";
+            for (char c : Line) Data.push_back(std::byte(c));
+        }
+
+        constexpr std::uint64_t BlockSize = 16 * 1024;
+
+        // Dynamic streaming frames, with or without checksums. Incompressible chunks are kept raw and flagged
+        using frames = std::vector<std::pair<bool, std::vector<std::byte>>>;
+        auto Compress = [&](bool bChecksum)
+        {
+            frames Frames;
+            std::vector<std::byte>              Buffer(Data.size());
+
+            xcompression::dynamic_block_compress compressor;
+            compressor.m_bChecksum = bChecksum;
+            if (auto err = compressor.Init(false, BlockSize, Data, xcompression::dynamic_block_compress::level::MEDIUM); err) assert(false);
+
+            for (;;)
+            {
+                const auto      Position = compressor.m_Position;
+                std::uint64_t   CompressedSize;
+                auto            err = compressor.Pack(CompressedSize, Buffer);
+                if (err && err.getState<xcompression::state>() == xcompression::state::INCOMPRESSIBLE)
+                {
+                    Frames.emplace_back(true, std::vector<std::byte>(Data.begin() + Position, Data.begin() + compressor.m_Position));
+                    continue;
+                }
+                if (err && err.getState<xcompression::state>() != xcompression::state::NOT_DONE)
+                {
+                    std::cout << "Checksum: compression failed: " << err.m_pMessage << "\n";
+                    assert(false);
+                }
+                if (CompressedSize) Frames.emplace_back(false, std::vector<std::byte>(Buffer.begin(), Buffer.begin() + CompressedSize));
+                if (!err) break;
+            }
+            return Frames;
+        };
+
+        auto Decompress = [&](const frames& Frames, bool bVerify, std::vector<std::byte>& Output) -> xerr
+        {
+            xcompression::dynamic_block_decompress decompressor;
+            decompressor.m_bVerifyChecksum = bVerify;
+            if (auto err = decompressor.Init(false, BlockSize); err) return err;
+
+            Output.resize(Data.size());
+            std::uint64_t Pos = 0;
+            for (const auto& [bStored, Frame] : Frames)
+            {
+                if (bStored)
+                {
+                    std::memcpy(Output.data() + Pos, Frame.data(), Frame.size());
+                    Pos += Frame.size();
+                    continue;
+                }
+
+                std::uint32_t DecompressSize;
+                if (auto err = decompressor.Unpack(DecompressSize, std::span(Output).subspan(Pos), Frame); err) return err;
+                Pos += DecompressSize;
+            }
+            Output.resize(Pos);
+            return {};
+        };
+
+        const auto Plain   = Compress(false);
+        const auto Checked = Compress(true);
+
+        std::size_t PlainSize = 0, CheckedSize = 0;
+        for (const auto& F : Plain)   PlainSize   += F.second.size();
+        for (const auto& F : Checked) CheckedSize += F.second.size();
+        assert(CheckedSize > PlainSize);
+
+        std::vector<std::byte> Output;
+        if (auto err = Decompress(Checked, true, Output); err || Output != Data)
+        {
+            std::cout << "Checksum: verified decompression does not match original\n";
+            assert(false);
+        }
+
+        // Verification cost, best of a few runs of each
+        double Seconds[2] = { 1e9, 1e9 };
+        for (int r = 0; r < 5; ++r)
+        {
+            for (int v = 0; v < 2; ++v)
+            {
+                const auto Start = std::chrono::steady_clock::now();
+                if (auto err = Decompress(v ? Checked : Plain, v == 1, Output); err) assert(false);
+                Seconds[v] = std::min(Seconds[v], std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
+            }
+        }
+
+        // Damage the checksum of one frame: caught only when verifying
+        auto        Damaged = Checked;
+        std::size_t iFrame  = Damaged.size() / 2;
+        while (Damaged[iFrame].first) iFrame++;
+        Damaged[iFrame].second.back() ^= std::byte{ 0x01 };
+        if (auto err = Decompress(Damaged, false, Output); err || Output != Data) assert(false);
+        if (auto err = Decompress(Damaged, true, Output); !err || std::string_view(err.m_pMessage).find("Checksum mismatch") == std::string_view::npos)
+        {
+            std::cout << "Checksum: damaged frame was not detected\n";
+            assert(false);
+        }
+
+        // Fixed block mode frames are always verified when they carry a checksum
+        {
+            std::vector<std::byte> Frame(Data.size());
+            std::uint64_t          FrameSize;
+
+            xcompression::fixed_block_compress compressor;
+            compressor.m_bChecksum = true;
+            if (auto err = compressor.Init(true, BlockSize, Data, xcompression::fixed_block_compress::level::FAST); err) assert(false);
+            if (auto err = compressor.Pack(FrameSize, Frame); err) assert(false);
+
+            Frame[FrameSize - 2] ^= std::byte{ 0x80 };
+
+            std::vector<std::byte>                  Decoded(Data.size());
+            std::uint32_t                           DecompressSize;
+            xcompression::fixed_block_decompress    decompressor;
+            if (auto err = decompressor.Init(true, Data.size()); err) assert(false);
+            if (auto err = decompressor.Unpack(DecompressSize, Decoded, std::span(Frame.data(), FrameSize)); !err || std::string_view(err.m_pMessage).find("Checksum mismatch") == std::string_view::npos)
+            {
+                std::cout << "Checksum: damaged block mode frame was not detected\n";
+                assert(false);
+            }
+        }
+
+        std::cout << "Checksum: match original ( " << Checked.size() << " frames, " << PlainSize << " -> " << CheckedSize << " bytes, decompression "
+                  << Data.size() / Seconds[0] / (1024 * 1024) << " MB/s, verified " << Data.size() / Seconds[1] / (1024 * 1024) << " MB/s ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
+    void TestBlockIndex(void)
+    {
+        using block_index = xcompression::block_index;
+
+        // A log where every user shows up all the time except "alice", which is in two records
+        std::string Log;
+        for (int i = 0; i < 20000; ++i)
+        {
+            const auto User = (i == 7000 || i == 15000) ? std::string("alice") : "u" + std::to_string((i * 7) % 50);
+            Log += "ts=" + std::to_string(1000 + i) + " user=" + User + " op=read\n";
+        }
+        const auto Data = std::as_bytes(std::span(Log));
+
+        // Keys are the users, the field is the timestamp. A line belongs to the block it starts in: the one cut at
+        // the start of a block was done by the previous block, the one cut at the end is finished from Following
+        auto Extractor = [bLineStart = true](std::span<const std::byte> Block, std::span<const std::byte> Following, block_index& Index) mutable
+        {
+            const std::string_view Text(reinterpret_cast<const char*>(Block.data()), Block.size() + Following.size());
+
+            std::size_t Pos = bLineStart ? 0 : Text.find('\n') + 1;
+            bLineStart = Block.size() && Block.back() == std::byte{ '\n' };
+
+            while (Pos < Block.size())
+            {
+                auto End = Text.find('\n', Pos);
+                if (End == std::string_view::npos) End = Text.size();
+
+                const auto Line = Text.substr(Pos, End - Pos);
+                if (const auto u = Line.find("user="); u != std::string_view::npos)
+                    Index.AddKey(Line.substr(u + 5, Line.find(' ', u) - (u + 5)));
+                if (Line.starts_with("ts="))
+                {
+                    std::int64_t Value = 0;
+                    for (std::size_t i = 3; i < Line.size() && Line[i] >= '0' && Line[i] <= '9'; ++i) Value = Value * 10 + (Line[i] - '0');
+                    Index.AddValue(Value);
+                }
+                Pos = End + 1;
+            }
+        };
+
+        // Offsets where the lines holding What start
+        auto RecordStarts = [&](std::string_view What)
+        {
+            std::vector<std::uint64_t> Starts;
+            for (auto Pos = Log.find(What); Pos != std::string::npos; Pos = Log.find(What, Pos + 1))
+                Starts.push_back(Log.rfind('\n', Pos) + 1);
+            return Starts;
+        };
+
+        // Every record is in a block that was handed out
+        auto AllFound = [](const std::vector<std::uint64_t>& Starts, const std::vector<std::pair<std::uint64_t, std::uint64_t>>& Blocks)
+        {
+            return std::all_of(Starts.begin(), Starts.end(), [&](std::uint64_t Start)
+            {
+                return std::any_of(Blocks.begin(), Blocks.end(), [&](const auto& B) { return Start >= B.first && Start < B.first + B.second; });
+            });
+        };
+
+        constexpr std::uint64_t BlockSize = 4 * 1024;
+        block_index::stats      KeyStats, RangeStats;
+        std::uint64_t           IndexSize = 0;
+
+        for (const std::uint32_t SyncInterval : { 1u, 4u })
+        {
+            block_index Index;
+            if (auto err = Index.Init(Extractor); err) assert(false);
+
+            xcompression::fixed_block_compress compressor;
+            compressor.m_pIndex = &Index;
+            if (auto err = compressor.Init(false, BlockSize, Data, xcompression::fixed_block_compress::level::FAST, SyncInterval); err) assert(false);
+
+            xcompression::fixed_block_pack_range PackRange;
+            if (auto err = PackRange.Init(compressor); err) assert(false);
+
+            std::vector<std::vector<std::byte>>     Storage;
+            std::vector<xcompression::stream_chunk> Chunks;
+            for (const auto& Chunk : PackRange)
+            {
+                Storage.emplace_back(Chunk.m_Data.begin(), Chunk.m_Data.end());
+                Chunks.push_back(Chunk);
+            }
+            if (PackRange.getError()) assert(false);
+            for (std::size_t i = 0; i < Chunks.size(); ++i) Chunks[i].m_Data = Storage[i];
+
+            assert(Index.m_Summaries.size() == Chunks.size());
+
+            // Save and load, queries run on the loaded copy
+            xcompression::buffer_chain_sink Sink;
+            if (auto err = Index.Write(Sink); err) assert(false);
+
+            std::vector<std::byte> Frame;
+            for (const auto& Segment : Sink.m_Segments) Frame.insert(Frame.end(), Segment.begin(), Segment.end());
+            IndexSize = Frame.size();
+
+            block_index Loaded;
+            if (auto err = Loaded.Load(Frame); err) assert(false);
+            if (auto err = Loaded.Load(std::span(Frame).first(Frame.size() - 1)); !err) assert(false);
+            if (auto err = Loaded.Load(Frame); err) assert(false);
+            assert(Loaded.m_Summaries.size() == Index.m_Summaries.size() && Loaded.m_Bloom == Index.m_Bloom);
+
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(false, BlockSize, SyncInterval); err) assert(false);
+
+            // Key query: both records are found, every block handed out is the original input
+            const std::string_view                              Keys[]  = { "alice" };
+            std::vector<std::pair<std::uint64_t, std::uint64_t>> Blocks;
+            auto Collect = [&](std::span<const std::byte> Block, std::uint64_t SourceOffset)
+            {
+                assert(std::equal(Block.begin(), Block.end(), Data.begin() + SourceOffset));
+                Blocks.emplace_back(SourceOffset, Block.size());
+                return true;
+            };
+
+            auto err = Loaded.Query(KeyStats, decompressor, Chunks, { .m_Keys = Keys }, Collect);
+            if (err || AllFound(RecordStarts("user=alice "), Blocks) == false)
+            {
+                std::cout << "Block index: key query missed a record\n";
+                assert(false);
+            }
+            assert(KeyStats.m_nCandidates < KeyStats.m_nBlocks / 4 && KeyStats.m_nDecoded < KeyStats.m_nBlocks / 2);
+
+            // Range query: the blocks handed out hold every timestamp of the range
+            std::vector<std::uint64_t> InRange;
+            for (int ts = 5000; ts <= 5099; ++ts) InRange.push_back(RecordStarts("ts=" + std::to_string(ts) + " ").front());
+
+            Blocks.clear();
+            err = Loaded.Query(RangeStats, decompressor, Chunks, { .m_bRange = true, .m_Min = 5000, .m_Max = 5099 }, Collect);
+            assert(!err && AllFound(InRange, Blocks));
+            assert(RangeStats.m_nCandidates <= 3);
+        }
+
+        // Default keys (every word) and block mode
+        {
+            block_index Index;
+            if (auto err = Index.Init(); err) assert(false);
+
+            std::vector<std::byte>              Frame(Data.size());
+            std::uint64_t                       FrameSize;
+            xcompression::fixed_block_compress  compressor;
+            compressor.m_pIndex = &Index;
+            if (auto err = compressor.Init(true, 16 * 1024, Data, xcompression::fixed_block_compress::level::FAST); err) assert(false);
+            if (auto err = compressor.Pack(FrameSize, Frame); err) assert(false);
+
+            // Calling again once the frame is complete must not index anything more
+            std::uint64_t ExtraSize;
+            if (auto err = compressor.Pack(ExtraSize, Frame); err || ExtraSize != 0) assert(false);
+
+            assert(Index.m_Summaries.size() == 1 && Index.m_Summaries[0].m_SourceSize == Data.size());
+            assert(Index.mayContain(0, "alice") && Index.mayContain(0, "read") && Index.mayContain(0, "u49"));
+
+            const xcompression::stream_chunk     Chunk = { std::span(Frame.data(), FrameSize), 0, Data.size(), false };
+            xcompression::fixed_block_decompress decompressor;
+            if (auto err = decompressor.Init(true, Data.size()); err) assert(false);
+
+            block_index::stats      Stats;
+            const std::string_view  Keys[]  = { "alice" };
+            bool                    bCalled = false;
+            if (auto err = Index.Query(Stats, decompressor, std::span(&Chunk, 1), { .m_Keys = Keys }, [&](std::span<const std::byte> Block, std::uint64_t)
+                { bCalled = std::equal(Block.begin(), Block.end(), Data.begin(), Data.end()); return true; }); err || !bCalled) assert(false);
+        }
+
+        std::cout << "Block index: match original ( " << KeyStats.m_nBlocks << " blocks, key query decoded " << KeyStats.m_nDecoded
+                  << ", range query decoded " << RangeStats.m_nDecoded << ", index " << IndexSize << " bytes ) \n";
+    }
+
+    //-------------------------------------------------------------------------------------------------------------
+
     void RunAllUnitTest()
     {
         constexpr auto SourceSize = 2221;
@@ -423,5 +2989,29 @@ namespace xcompression::unit_test
         if (true) TestFixedBlock(source);
         if (true) TestDynamicBlock(source);
         if (true) TestDynamicInputDrivenStreaming(source, BlockSize);
+        if (true) TestDynamicPageAligned(source, 512);
+        if (true) TestArchive(source);
+        if (true) TestBlockCache(source, BlockSize);
+        if (true) TestJobService(source);
+        if (true) TestSmallMessage(source);
+        if (true) TestSinkDecompress(source, BlockSize);
+        if (true) TestStaticWorkspace(source);
+        if (true) TestFixedHistoryStreaming(source, BlockSize, 4);
+        if (true) TestChunkRanges(source, BlockSize);
+        if (true) TestScatterGather(source, BlockSize);
+        if (true) TestDedup(source);
+        if (true) TestCompressMemo(source);
+        if (true) TestPerfCounters(source, BlockSize);
+        if (true) TestRecompressor();
+        if (true) TestParallelStreaming(source, BlockSize);
+        if (true) TestLatencyStreaming(source);
+        if (true) TestOutputDraining(source, BlockSize);
+        if (true) TestRingCompress(source, BlockSize);
+        if (true) TestCompressedLog(source);
+        if (true) TestAutotuner(source);
+        if (true) TestLazyDecompressInit(source);
+        if (true) TestIncrementalDecompress(source);
+        if (true) TestChecksum(source);
+        if (true) TestBlockIndex();
     }
 }
@@ -1,9 +1,55 @@
 #define ZSTD_STATIC_LINKING_ONLY
 #include "lib/zstd.h"
+#include "lib/zstd_errors.h"
+#define XXH_STATIC_LINKING_ONLY
+#include "lib/common/xxhash.h"
 #include "xcompression.h"
 #include <cassert>
 #include <cstring>
+#include <cstdio>
 #include <iostream>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <unordered_map>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <charconv>
+
+#ifdef _WIN32
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <winsock2.h>
+    #include <windows.h>
+    #pragma comment(lib, "ws2_32.lib")
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <sys/socket.h>
+    #include <cerrno>
+    #if defined(__linux__)
+        #include <linux/perf_event.h>
+        #include <sys/syscall.h>
+        #include <sys/ioctl.h>
+        #include <sys/resource.h>
+    #endif
+#endif
 
 //-------------------------------------------------------------------------------------------------------
 // Add libz libraries
@@ -55,74 +101,474 @@ namespace xcompression
     }
 
     //-------------------------------------------------------------------------------------------------------
-    xerr fixed_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel) noexcept
+    // Data that was damaged but still decodes is only caught by the frame checksum, report it as such
+    xerr DecompressError(size_t result) noexcept
     {
-        assert(!m_pCCTX);
-        assert(BlockSize > 0);
-        assert(SourceUncompress.data());
+        PrintError(result);
+        if (ZSTD_getErrorCode(result) == ZSTD_error_checksum_wrong)
+            return xerr::create_f<state, "Checksum mismatch, the data is corrupted">();
+        return xerr::create_f<state, "Decompression failed">();
+    }
 
-        auto pCCTX = ZSTD_createCCtx();
-        if (!pCCTX) return xerr::create_f<state,"Error ZSTD_createCCtx">();
+    //-------------------------------------------------------------------------------------------------------
+    // Maps the library compression levels to zstd levels
+    //-------------------------------------------------------------------------------------------------------
+    template< typename T_LEVEL >
+    int ZstdLevel(T_LEVEL CompressionLevel) noexcept
+    {
+        switch (CompressionLevel)
+        {
+        case T_LEVEL::FAST:   return 1;
+        case T_LEVEL::MEDIUM: return ZSTD_CLEVEL_DEFAULT;
+        case T_LEVEL::HIGH:   return ZSTD_maxCLevel();
+        default:              return ZSTD_CLEVEL_DEFAULT;
+        }
+    }
 
-        // Reset context to ensure clean state
-        if (ZSTD_isError(ZSTD_CCtx_reset(pCCTX, ZSTD_reset_session_and_parameters)))
+    //-------------------------------------------------------------------------------------------------------
+    // Decompression context owned by the calling thread, created on first use
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        struct thread_dctx
+        {
+            ~thread_dctx(void) noexcept { if (m_pDCTX) ZSTD_freeDCtx(m_pDCTX); }
+            ZSTD_DCtx* m_pDCTX = nullptr;
+        };
+
+        ZSTD_DCtx* getThreadDCtx(void) noexcept
         {
-            ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(pCCTX));
-            return xerr::create_f<state, "Error ZSTD_CCtx_reset">();
+            thread_local thread_dctx ThreadDCtx;
+            if (!ThreadDCtx.m_pDCTX) ThreadDCtx.m_pDCTX = ZSTD_createDCtx();
+            return ThreadDCtx.m_pDCTX;
         }
+    }
 
-        // Set compression parameters
-        int cLevel;
-        switch (CompressionLevel)
+    //-------------------------------------------------------------------------------------------------------
+    // Context setup shared by the heap and the static workspace versions of Init
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+#ifndef XCOMPRESSION_DECODE_ONLY
+        //---------------------------------------------------------------------------------------------------
+        // pCParams: explicit parameters (picked to fit a memory budget), nullptr to let zstd choose from the level
+        xerr SetupCompressContext(ZSTD_CCtx* pCCTX, bool bTargetBlockSize, std::uint64_t BlockSize, std::uint64_t SourceSize, int cLevel, const ZSTD_compressionParameters* pCParams, bool bChecksum = false) noexcept
         {
-        case level::FAST: cLevel = 1; break;
-        case level::MEDIUM: cLevel = ZSTD_CLEVEL_DEFAULT; break;
-        case level::HIGH: cLevel = ZSTD_maxCLevel(); break;
-        default: cLevel = ZSTD_CLEVEL_DEFAULT; break;
+            // Reset context to ensure clean state
+            if (ZSTD_isError(ZSTD_CCtx_reset(pCCTX, ZSTD_reset_session_and_parameters)))
+                return xerr::create_f<state, "Error ZSTD_CCtx_reset">();
+
+            // Set compression parameters
+            if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_compressionLevel, cLevel); ZSTD_isError(err))
+            {
+                PrintError(err);
+                return xerr::create_f<state, "Error setting compression level">();
+            }
+
+            if (pCParams)
+            {
+                const std::pair<ZSTD_cParameter, int> Params[] =
+                { { ZSTD_c_windowLog,       static_cast<int>(pCParams->windowLog)    }
+                , { ZSTD_c_chainLog,        static_cast<int>(pCParams->chainLog)     }
+                , { ZSTD_c_hashLog,         static_cast<int>(pCParams->hashLog)      }
+                , { ZSTD_c_searchLog,       static_cast<int>(pCParams->searchLog)    }
+                , { ZSTD_c_minMatch,        static_cast<int>(pCParams->minMatch)     }
+                , { ZSTD_c_targetLength,    static_cast<int>(pCParams->targetLength) }
+                , { ZSTD_c_strategy,        static_cast<int>(pCParams->strategy)     }
+                };
+                for (const auto& [Param, Value] : Params)
+                {
+                    if (auto err = ZSTD_CCtx_setParameter(pCCTX, Param, Value); ZSTD_isError(err))
+                    {
+                        PrintError(err);
+                        return xerr::create_f<state, "Error setting compression parameters">();
+                    }
+                }
+            }
+
+            // Set the target compressed block size
+            if (bTargetBlockSize)
+            {
+                if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_targetCBlockSize, static_cast<int>(BlockSize)); ZSTD_isError(err))
+                {
+                    PrintError(err);
+                    return xerr::create_f<state, "Error setting target block size">();
+                }
+            }
+
+            // Set source size hint
+            if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_srcSizeHint, static_cast<int>(SourceSize)); ZSTD_isError(err))
+            {
+                PrintError(err);
+                return xerr::create_f<state, "Error setting source size hint">();
+            }
+
+            // Disable multi-threading for synchronous operation
+            if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_nbWorkers, 0); ZSTD_isError(err))
+            {
+                PrintError(err);
+                return xerr::create_f<state, "Error disabling multi-threading">();
+            }
+
+            // Checksums are off unless asked for. When on, every frame ends with 4 bytes of the XXH64 of its
+            // content, hashed as the input is compressed and checked by the decoder as the output is produced
+            if (auto Err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_checksumFlag, bChecksum ? 1 : 0); ZSTD_isError(Err))
+            {
+                PrintError(Err);
+                return xerr::create_f<state, "Error setting checksumFlag">();
+            }
+
+            return {};
         }
-        if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_compressionLevel, cLevel); ZSTD_isError(err))
+#endif
+
+        //---------------------------------------------------------------------------------------------------
+        int DecompressWindowLog(std::uint64_t BlockSize) noexcept
         {
-            PrintError(err);
-            ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(pCCTX));
-            return xerr::create_f<state, "Error setting compression level">();
+            // Next power of 2 >= BlockSize, clamped to valid range
+            BlockSize = std::min<std::uint64_t>(BlockSize, std::uint64_t{ 1 } << 30);
+            return std::min(std::max(Log2IntRoundUp(static_cast<int>(BlockSize)), ZSTD_WINDOWLOG_MIN), ZSTD_WINDOWLOG_MAX);
         }
 
-        // Set block size for block mode
-        if (bBlockSizeIsOutputSize)
+#ifndef XCOMPRESSION_DECODE_ONLY
+        //---------------------------------------------------------------------------------------------------
+        // History mode keeps a frame open across SyncInterval chunks so the window can not come from the
+        // frame content size any more. Cap it to the history the decoder is told about (BlockSize * SyncInterval).
+        xerr LimitHistoryWindow(ZSTD_CCtx* pCCTX, std::uint64_t HistorySize, std::uint64_t SourceSize, int cLevel, const ZSTD_compressionParameters* pCParams) noexcept
         {
-            if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_targetCBlockSize, static_cast<int>(BlockSize)); ZSTD_isError(err))
+            const int LevelWindowLog = static_cast<int>(pCParams ? pCParams->windowLog : ZSTD_getCParams(cLevel, SourceSize, 0).windowLog);
+            const int WindowLog      = std::max(std::min(LevelWindowLog, DecompressWindowLog(HistorySize)), ZSTD_WINDOWLOG_MIN);
+
+            if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_windowLog, WindowLog); ZSTD_isError(err))
             {
                 PrintError(err);
-                ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(pCCTX));
-                return xerr::create_f<state, "Error setting target block size">();
+                return xerr::create_f<state, "Error setting history window">();
+            }
+
+            return {};
+        }
+#endif
+
+        //---------------------------------------------------------------------------------------------------
+        xerr SetupDecompressContext(ZSTD_DCtx* pDCTX, std::uint64_t BlockSize, bool bIgnoreChecksum) noexcept
+        {
+            // Reset context to ensure clean state
+            if (ZSTD_isError(ZSTD_DCtx_reset(pDCTX, ZSTD_reset_session_and_parameters)))
+                return xerr::create_f<state, "Error ZSTD_DCtx_reset">();
+
+            // Set max window size
+            const int windowLog = DecompressWindowLog(BlockSize);
+            if (ZSTD_isError(ZSTD_DCtx_setParameter(pDCTX, ZSTD_d_windowLogMax, windowLog)))
+            {
+                PrintError(windowLog);
+                return xerr::create_f<state, "Error setting windowLogMax">();
+            }
+
+            // Reduce buffering by ignoring checksums (optional, for performance)
+            if (bIgnoreChecksum && ZSTD_isError(ZSTD_DCtx_setParameter(pDCTX, ZSTD_d_forceIgnoreChecksum, 1)))
+            {
+                PrintError(1);
+                return xerr::create_f<state, "Error setting forceIgnoreChecksum">();
+            }
+
+            return {};
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // Heap decompressors create their context on the first Unpack, so a decompressor that is never used costs nothing
+        template< typename T_DECOMPRESS >
+        xerr CreateDecompressContext(T_DECOMPRESS& Decompress, std::uint64_t WindowSize, bool bIgnoreChecksum) noexcept
+        {
+            if (Decompress.m_pDCTX) return {};
+
+            perf_counters::scope Perf(Decompress.m_pPerf, perf_counters::stage::INIT);
+
+            auto pDCTX = ZSTD_createDCtx();
+            if (!pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+
+            if (auto Err = SetupDecompressContext(pDCTX, WindowSize, bIgnoreChecksum); Err)
+            {
+                ZSTD_freeDCtx(pDCTX);
+                return Err;
+            }
+
+            Decompress.m_pDCTX = pDCTX;
+            return {};
+        }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+        //---------------------------------------------------------------------------------------------------
+        // Picks the compression parameters that fit in Budget bytes (streaming buffers included).
+        // It lowers the level first and then the window. Returns false if nothing fits.
+        bool FitCompressParams(ZSTD_compressionParameters& CParams, int& cLevel, std::uint64_t SourceSize, std::size_t Budget) noexcept
+        {
+            for (; cLevel > 1; --cLevel)
+            {
+                CParams = ZSTD_getCParams(cLevel, SourceSize, 0);
+                if (ZSTD_estimateCStreamSize_usingCParams(CParams) <= Budget) return true;
+            }
+
+            cLevel  = 1;
+            CParams = ZSTD_getCParams(cLevel, SourceSize, 0);
+            while (ZSTD_estimateCStreamSize_usingCParams(CParams) > Budget)
+            {
+                if (CParams.windowLog <= ZSTD_WINDOWLOG_MIN) return false;
+
+                // Shrinking the window lets zstd shrink the tables with it
+                CParams.windowLog--;
+                CParams = ZSTD_adjustCParams(CParams, 1ull << CParams.windowLog, 0);
+            }
+
+            return true;
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        std::uint64_t EstimateCompressWorkspace(std::uint64_t SourceSize, int cLevel) noexcept
+        {
+            return ZSTD_estimateCStreamSize_usingCParams(ZSTD_getCParams(cLevel, SourceSize, 0));
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // Points a compressor at its input. A single segment is kept in m_Src so the list itself does not
+        // need to outlive Init, otherwise the segments are read in order as one logical buffer.
+        template< typename T_COMPRESS >
+        void SetSource(T_COMPRESS& Compress, std::span<const std::span<const std::byte>> Segments) noexcept
+        {
+            Compress.m_SourceSize = 0;
+            for (const auto& Segment : Segments) Compress.m_SourceSize += Segment.size();
+
+            if (Segments.size() == 1)
+            {
+                Compress.m_Src      = Segments[0];
+                Compress.m_Segments = {};
+            }
+            else
+            {
+                Compress.m_Src      = {};
+                Compress.m_Segments = Segments;
+            }
+
+            Compress.m_iSegment    = 0;
+            Compress.m_SegmentBase = 0;
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // Compresses Size input bytes starting Skip bytes after m_Position, ending with End. Scatter-gather inputs are fed
+        // one segment at a time (ZSTD_e_continue), so nothing is copied into a staging buffer. bPledge stores
+        // Size in the frame header first (frames that start and end here), that keeps the frame and its window
+        // the same as with contiguous input. Returns the zstd code of the last call, Consumed is the input zstd took.
+        template< typename T_COMPRESS >
+        std::size_t CompressRange(T_COMPRESS& Compress, ZSTD_outBuffer& Out, std::uint64_t Size, ZSTD_EndDirective End, bool bPledge, std::uint64_t& Consumed, std::uint64_t Skip = 0) noexcept
+        {
+            auto*      pCCTX = static_cast<ZSTD_CCtx*>(Compress.m_pCCTX);
+            const auto Start = Compress.m_Position + Skip;
+            assert(Start + Size <= Compress.m_SourceSize);
+
+            Consumed = 0;
+
+            if (Compress.m_Segments.empty() || Size == 0)
+            {
+                ZSTD_inBuffer in = { Size ? &Compress.m_Src[Start] : nullptr, static_cast<std::size_t>(Size), 0 };
+                const auto    rc = ZSTD_compressStream2(pCCTX, &Out, &in, End);
+                Consumed = in.pos;
+                return rc;
+            }
+
+            if (bPledge)
+            {
+                if (auto rc = ZSTD_CCtx_setPledgedSrcSize(pCCTX, Size); ZSTD_isError(rc))
+                    return rc;
+            }
+
+            // Move the cursor to the segment holding Start (the position only moves forward)
+            while (Compress.m_SegmentBase + Compress.m_Segments[Compress.m_iSegment].size() <= Start)
+                Compress.m_SegmentBase += Compress.m_Segments[Compress.m_iSegment++].size();
+
+            std::size_t   rc     = 0;
+            std::uint64_t Offset = Start - Compress.m_SegmentBase;
+            for (std::size_t i = Compress.m_iSegment; Consumed < Size; ++i, Offset = 0)
+            {
+                const auto&   Segment = Compress.m_Segments[i];
+                const auto    Piece   = std::min<std::uint64_t>(Segment.size() - Offset, Size - Consumed);
+                ZSTD_inBuffer in      = { Segment.data() + Offset, static_cast<std::size_t>(Piece), 0 };
+
+                rc = ZSTD_compressStream2(pCCTX, &Out, &in, Consumed + Piece == Size ? End : ZSTD_e_continue);
+                if (ZSTD_isError(rc)) return rc;
+
+                Consumed += in.pos;
+
+                // Output is full
+                if (in.pos < in.size) break;
+            }
+
+            return rc;
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        template< typename T_COMPRESS >
+        std::uint64_t CopySourceRange(const T_COMPRESS& Compress, std::span<std::byte> Destination, std::uint64_t Offset) noexcept
+        {
+            const auto Size = std::min<std::uint64_t>(Destination.size(), Compress.m_SourceSize - std::min(Offset, Compress.m_SourceSize));
+
+            if (Compress.m_Segments.empty())
+            {
+                if (Size) std::memcpy(Destination.data(), &Compress.m_Src[Offset], Size);
+                return Size;
             }
+
+            std::uint64_t Copied = 0;
+            std::uint64_t Base   = 0;
+            for (const auto& Segment : Compress.m_Segments)
+            {
+                if (Copied == Size) break;
+
+                if (Offset + Copied < Base + Segment.size())
+                {
+                    const auto Start = Offset + Copied - Base;
+                    const auto Piece = std::min<std::uint64_t>(Segment.size() - Start, Size - Copied);
+                    std::memcpy(Destination.data() + Copied, Segment.data() + Start, Piece);
+                    Copied += Piece;
+                }
+
+                Base += Segment.size();
+            }
+
+            return Copied;
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // Summarizes the input of a chunk that was just packed, scatter-gather input is gathered first
+        template< typename T_COMPRESS >
+        xerr IndexChunk(const T_COMPRESS& Compress, std::uint64_t Offset, std::uint64_t Size) noexcept
+        {
+            auto&               Index     = *Compress.m_pIndex;
+            const std::uint64_t Lookahead = std::min<std::uint64_t>(Index.m_Lookahead, Compress.m_SourceSize - (Offset + Size));
+
+            if (Compress.m_Segments.empty())
+            {
+                const auto Input = Compress.m_Src.subspan(static_cast<std::size_t>(Offset), static_cast<std::size_t>(Size + Lookahead));
+                return Index.Add(Input.first(static_cast<std::size_t>(Size)), Input.subspan(static_cast<std::size_t>(Size)), Offset);
+            }
+
+            Index.m_Scratch.resize(static_cast<std::size_t>(Size + Lookahead));
+            CopySourceRange(Compress, Index.m_Scratch, Offset);
+            return Index.Add(std::span(Index.m_Scratch).first(static_cast<std::size_t>(Size)), std::span(Index.m_Scratch).subspan(static_cast<std::size_t>(Size)), Offset);
+        }
+#endif
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+    xerr fixed_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel, std::uint32_t SyncInterval) noexcept
+    {
+        assert(SourceUncompress.data());
+        return Init(bBlockSizeIsOutputSize, BlockSize, std::span(&SourceUncompress, 1), CompressionLevel, SyncInterval);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    xerr fixed_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, level CompressionLevel, std::uint32_t SyncInterval) noexcept
+    {
+        assert(!m_pCCTX);
+        assert(BlockSize > 0);
+        assert(SyncInterval > 0);
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::INIT);
+        SetSource(*this, SourceSegments);
+
+        auto pCCTX = ZSTD_createCCtx();
+        if (!pCCTX) return xerr::create_f<state,"Error ZSTD_createCCtx">();
+
+        // Block mode targets BlockSize as the compressed block size
+        if (auto Err = SetupCompressContext(pCCTX, bBlockSizeIsOutputSize, BlockSize, m_SourceSize, ZstdLevel(CompressionLevel), nullptr, m_bChecksum); Err)
+        {
+            ZSTD_freeCCtx(pCCTX);
+            return Err;
         }
 
-        // Set source size hint
-        if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_srcSizeHint, static_cast<int>(SourceUncompress.size())); ZSTD_isError(err))
+        if (bBlockSizeIsOutputSize == false && SyncInterval > 1)
         {
-            PrintError(err);
-            ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(pCCTX));
-            return xerr::create_f<state, "Error setting source size hint">();
+            if (auto Err = LimitHistoryWindow(pCCTX, BlockSize * SyncInterval, m_SourceSize, ZstdLevel(CompressionLevel), nullptr); Err)
+            {
+                ZSTD_freeCCtx(pCCTX);
+                return Err;
+            }
         }
 
-        // Disable multi-threading for synchronous operation
-        if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_nbWorkers, 0); ZSTD_isError(err))
+        m_pCCTX = pCCTX;
+        m_BlockSize = BlockSize;
+        m_bBlockSizeIsOutputSize = bBlockSizeIsOutputSize;
+        m_Position = 0;
+        m_SyncInterval = SyncInterval;
+        m_ChunkIndex = 0;
+        m_DrainConsumed = 0;
+        m_DrainOutput = 0;
+        m_bDraining = false;
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    xerr fixed_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, std::span<std::byte> Workspace, level CompressionLevel, std::uint32_t SyncInterval) noexcept
+    {
+        assert(SourceUncompress.data());
+        return Init(bBlockSizeIsOutputSize, BlockSize, std::span(&SourceUncompress, 1), Workspace, CompressionLevel, SyncInterval);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    xerr fixed_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, std::span<std::byte> Workspace, level CompressionLevel, std::uint32_t SyncInterval) noexcept
+    {
+        assert(!m_pCCTX);
+        assert(BlockSize > 0);
+        assert(SyncInterval > 0);
+        assert(Workspace.data());
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::INIT);
+        SetSource(*this, SourceSegments);
+
+        ZSTD_compressionParameters CParams;
+        int                        cLevel = ZstdLevel(CompressionLevel);
+        if (false == FitCompressParams(CParams, cLevel, m_SourceSize, Workspace.size()))
+            return xerr::create_f<state, "Workspace too small">();
+
+        // Static contexts are never freed by zstd (ZSTD_freeCCtx refuses them), the workspace belongs to the caller
+        auto pCCTX = ZSTD_initStaticCCtx(Workspace.data(), Workspace.size());
+        if (!pCCTX) return xerr::create_f<state, "Error ZSTD_initStaticCCtx">();
+
+        // Block mode targets BlockSize as the compressed block size
+        if (auto Err = SetupCompressContext(pCCTX, bBlockSizeIsOutputSize, BlockSize, m_SourceSize, cLevel, &CParams, m_bChecksum); Err)
+            return Err;
+
+        if (bBlockSizeIsOutputSize == false && SyncInterval > 1)
         {
-            PrintError(err);
-            ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(pCCTX));
-            return xerr::create_f<state, "Error disabling multi-threading">();
+            if (auto Err = LimitHistoryWindow(pCCTX, BlockSize * SyncInterval, m_SourceSize, cLevel, &CParams); Err)
+                return Err;
         }
 
         m_pCCTX = pCCTX;
-        m_Src = SourceUncompress;
         m_BlockSize = BlockSize;
         m_bBlockSizeIsOutputSize = bBlockSizeIsOutputSize;
         m_Position = 0;
+        m_SyncInterval = SyncInterval;
+        m_ChunkIndex = 0;
+        m_DrainConsumed = 0;
+        m_DrainOutput = 0;
+        m_bDraining = false;
 
         return {};
     }
 
+    //-------------------------------------------------------------------------------------------------------
+    std::uint64_t fixed_block_compress::EstimateWorkspace(std::uint64_t SourceSize, level CompressionLevel) noexcept
+    {
+        return EstimateCompressWorkspace(SourceSize, ZstdLevel(CompressionLevel));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    std::uint64_t fixed_block_compress::CopySource(std::span<std::byte> Destination, std::uint64_t Offset) const noexcept
+    {
+        return CopySourceRange(*this, Destination, Offset);
+    }
+
     //-------------------------------------------------------------------------------------------------------
     fixed_block_compress::~fixed_block_compress(void) noexcept
     {
@@ -134,69 +580,120 @@ namespace xcompression
     {
         assert(m_pCCTX);
         assert(Destination.data());
-        assert(m_Position <= m_Src.size());
+        assert(m_Position <= m_SourceSize);
 
         CompressedSize = 0;
 
+        // Accounts for one call on the current frame (or chunk) of FrameInput bytes starting at m_Position.
+        // A destination that was too small leaves the frame open (isDraining), m_Position only moves once it is done
+        ZSTD_outBuffer out = { Destination.data(), Destination.size(), 0 };
+        auto Drain = [&](size_t rc, std::uint64_t Consumed, std::uint64_t FrameInput, bool bCanStore) noexcept
+        {
+            m_DrainConsumed += Consumed;
+            m_DrainOutput   += out.pos;
+            CompressedSize   = out.pos;
+
+            const bool bStored = bCanStore && m_DrainOutput >= FrameInput;
+            if (bStored == false && rc != 0)
+            {
+                m_bDraining = true;
+                return false;
+            }
+
+            // Stored chunks drop whatever zstd still holds for their frame
+            if (bStored && rc != 0) ZSTD_CCtx_reset(static_cast<ZSTD_CCtx*>(m_pCCTX), ZSTD_reset_session_only);
+
+            m_Position     += FrameInput;
+            m_bDraining     = false;
+            m_DrainConsumed = 0;
+            m_DrainOutput   = 0;
+            return true;
+        };
+
         if (m_bBlockSizeIsOutputSize)
         {
-            // Block mode: Ensure output buffer is at least input size
-            if (Destination.size() < m_Src.size())
-                return xerr::create_f<state, "Output buffer too small">();
+            // Block mode: the entire source is a single frame, once it is out there is nothing left (like streaming mode)
+            if (m_Position == m_SourceSize && m_bDraining == false)
+                return {};
 
-            // Compress entire source as a single frame
-            ZSTD_inBuffer in = { m_Src.data(), m_Src.size(), 0 };
-            ZSTD_outBuffer out = { Destination.data(), Destination.size(), 0 };
+            const auto     FrameInput = m_SourceSize - m_Position;
+            perf_counters::scope Perf(m_pPerf, perf_counters::stage::COMPRESS);
+            std::uint64_t  Consumed;
 
-            size_t rc = ZSTD_compressStream2(static_cast<ZSTD_CCtx*>(m_pCCTX), &out, &in, ZSTD_e_end);
+            size_t rc = CompressRange(*this, out, FrameInput - m_DrainConsumed, ZSTD_e_end, m_bDraining == false, Consumed, m_DrainConsumed);
             if (ZSTD_isError(rc))
             {
                 PrintError(rc);
                 return xerr::create_f<state, "Compression failed">();
             }
+            Perf.m_Bytes = Consumed;
+
+            const bool          bIncompressible = m_DrainOutput + out.pos >= FrameInput;
+            const std::uint64_t Offset          = m_Position;
+            if (Drain(rc, Consumed, FrameInput, true) == false)
+                return xerr::create<state::NOT_DONE, "More output to drain">();
+
+            if (m_pIndex)
+            {
+                if (auto Err = IndexChunk(*this, Offset, FrameInput); Err)
+                    return Err;
+            }
 
-            CompressedSize = out.pos;
-            if (CompressedSize >= m_Src.size())
+            if (bIncompressible)
                 return xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
 
-            m_Position = m_Src.size();
-            return rc == 0 ? xerr{} : xerr::create<state::NOT_DONE, "Waiting to flush">();
+            return {};
         }
 
         // Streaming mode
         size_t totalOutput = 0;
 
         // Process input chunk if available
-        if (m_Position < m_Src.size())
+        if (m_Position < m_SourceSize)
         {
-            const auto        Left   = m_Src.size() - m_Position;
-            const auto        InSize = Left > m_BlockSize ? m_BlockSize : Left;
-            ZSTD_EndDirective end    = ZSTD_e_end;
+            const auto        Left     = m_SourceSize - m_Position;
+            const auto        InSize   = Left > m_BlockSize ? m_BlockSize : Left;
+            const bool        bHistory = m_SyncInterval > 1;
+            ZSTD_EndDirective end      = ZSTD_e_end;
 
-            if (Destination.size() < InSize)
-                return xerr::create_f<state, "Output buffer too small">();
+            // History mode: only the last chunk of a group (or of the source) closes the frame,
+            // the others are flushed so each chunk can still be decoded as soon as it arrives
+            if (bHistory && Left > InSize && ((m_ChunkIndex + 1) % m_SyncInterval) != 0)
+                end = ZSTD_e_flush;
 
-            ZSTD_inBuffer  in  = { &m_Src[m_Position], InSize, 0 };
-            ZSTD_outBuffer out = { Destination.data(), Destination.size(), 0 };
+            perf_counters::scope Perf(m_pPerf, perf_counters::stage::COMPRESS);
+            const bool     bFrameStart = bHistory == false || (m_ChunkIndex % m_SyncInterval) == 0;
+            std::uint64_t  Consumed;
 
-            size_t rc = ZSTD_compressStream2(static_cast<ZSTD_CCtx*>(m_pCCTX), &out, &in, end);
+            size_t rc = CompressRange(*this, out, InSize - m_DrainConsumed, end, m_bDraining == false && bFrameStart && end == ZSTD_e_end, Consumed, m_DrainConsumed);
             if (ZSTD_isError(rc))
             {
                 PrintError(rc);
                 return xerr::create_f<state, "Compression failed">();
             }
+            Perf.m_Bytes = Consumed;
 
-            totalOutput += out.pos;
-            m_Position  += in.pos;
-            CompressedSize = totalOutput;
+            // A flushed chunk can not be replaced by its raw bytes (the frame depends on it), so history chunks are never stored
+            const bool          bIncompressible = bHistory == false && m_DrainOutput + out.pos >= InSize;
+            const std::uint64_t Offset          = m_Position;
+            if (Drain(rc, Consumed, InSize, bHistory == false) == false)
+                return xerr::create<state::NOT_DONE, "More output to drain">();
+
+            if (m_pIndex)
+            {
+                if (auto Err = IndexChunk(*this, Offset, InSize); Err)
+                    return Err;
+            }
 
-            if (totalOutput >= InSize)
+            if (bHistory) m_ChunkIndex++;
+            if (bIncompressible)
                 return xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
         }
 
         // Flush if all input processed and no error
-        else if (m_Position == m_Src.size())
+        else if (m_Position == m_SourceSize)
         {
+            perf_counters::scope Perf(m_pPerf, perf_counters::stage::FLUSH);
             while (true)
             {
                 ZSTD_inBuffer  in  = { nullptr, 0, 0 };
@@ -222,45 +719,65 @@ namespace xcompression
             return xerr::create<state::NOT_DONE, "More data to flush">();
         }
 
-        CompressedSize = totalOutput;
         return xerr::create<state::NOT_DONE, "More data to process">();
     }
+#endif
 
     //-------------------------------------------------------------------------------------------------------
-    xerr fixed_block_decompress::Init(bool bBlockIsOutputSize, std::uint64_t BlockSize) noexcept
+    xerr fixed_block_decompress::Init(bool bBlockIsOutputSize, std::uint64_t BlockSize, std::uint32_t SyncInterval) noexcept
     {
         assert(!m_pDCTX);
         assert(BlockSize > 0);
+        assert(SyncInterval > 0);
 
-        auto pDCTX = ZSTD_createDCtx();
-        if (!pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
-
-        // Reset context to ensure clean state
-        if (ZSTD_isError(ZSTD_DCtx_reset(pDCTX, ZSTD_reset_session_and_parameters)))
-        {
-            ZSTD_freeDCtx(pDCTX);
-            return xerr::create_f<state, "Error ZSTD_DCtx_reset">();
-        }
-
+        // The context is created by the first Unpack
         m_BlockSize = BlockSize;
+        m_SyncInterval = SyncInterval;
         m_bBlockIsOutputSize = bBlockIsOutputSize;
+        m_Position = 0;
+        m_OutputPosition = 0;
+        m_SourceOffset = 0;
 
-        // Set max window size to the next power of 2 >= BlockSize, clamped to valid range
-        const int windowLog = std::min(std::max(Log2IntRoundUp(static_cast<int>(BlockSize)), ZSTD_WINDOWLOG_MIN), ZSTD_WINDOWLOG_MAX);
-        if (ZSTD_isError(ZSTD_DCtx_setParameter(pDCTX, ZSTD_d_windowLogMax, windowLog)))
-        {
-            PrintError(windowLog);
-            ZSTD_freeDCtx(pDCTX);
-            return xerr::create_f<state, "Error setting windowLogMax">();
-        }
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    xerr fixed_block_decompress::Init(bool bBlockIsOutputSize, std::uint64_t BlockSize, std::span<std::byte> Workspace, std::uint32_t SyncInterval) noexcept
+    {
+        assert(!m_pDCTX);
+        assert(BlockSize > 0);
+        assert(SyncInterval > 0);
+        assert(Workspace.data());
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::INIT);
+
+        if (Workspace.size() < EstimateWorkspace(BlockSize, SyncInterval))
+            return xerr::create_f<state, "Workspace too small">();
+
+        // Static contexts are never freed by zstd (ZSTD_freeDCtx refuses them), the workspace belongs to the caller
+        auto pDCTX = ZSTD_initStaticDCtx(Workspace.data(), Workspace.size());
+        if (!pDCTX) return xerr::create_f<state, "Error ZSTD_initStaticDCtx">();
+
+        if (auto Err = SetupDecompressContext(pDCTX, BlockSize * SyncInterval, false); Err)
+            return Err;
 
         m_pDCTX = pDCTX;
+        m_BlockSize = BlockSize;
+        m_SyncInterval = SyncInterval;
+        m_bBlockIsOutputSize = bBlockIsOutputSize;
         m_Position = 0;
         m_OutputPosition = 0;
+        m_SourceOffset = 0;
 
         return {};
     }
 
+    //-------------------------------------------------------------------------------------------------------
+    std::uint64_t fixed_block_decompress::EstimateWorkspace(std::uint64_t BlockSize, std::uint32_t SyncInterval) noexcept
+    {
+        return ZSTD_estimateDStreamSize(std::size_t{ 1 } << DecompressWindowLog(BlockSize * SyncInterval));
+    }
+
     //-------------------------------------------------------------------------------------------------------
     fixed_block_decompress::~fixed_block_decompress(void) noexcept
     {
@@ -270,7 +787,7 @@ namespace xcompression
     //-------------------------------------------------------------------------------------------------------
     xerr fixed_block_decompress::Unpack(std::uint32_t& DecompressSize, std::span<std::byte> DestinationUncompress, const std::span<const std::byte> SourceCompressed) noexcept
     {
-        assert(m_pDCTX);
+        assert(m_BlockSize);
         assert(!DestinationUncompress.empty());
         assert(!SourceCompressed.empty());
 
@@ -278,6 +795,10 @@ namespace xcompression
             return xerr::create_f<state, "Output buffer size must equal BlockSize">();
 
         DecompressSize = 0;
+        if (auto Err = CreateDecompressContext(*this, m_BlockSize * m_SyncInterval, false); Err)
+            return Err;
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::DECOMPRESS);
 
         if (m_bBlockIsOutputSize)
         {
@@ -285,112 +806,150 @@ namespace xcompression
             size_t rc = ZSTD_decompressDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX), DestinationUncompress.data(), m_BlockSize, SourceCompressed.data(), SourceCompressed.size());
             if (ZSTD_isError(rc))
             {
-                PrintError(rc);
-                return xerr::create_f<state, "Decompression failed">();
+                return DecompressError(rc);
             }
 
             DecompressSize = static_cast<std::uint32_t>(rc);
+            Perf.m_Bytes   = DecompressSize;
             m_Position += SourceCompressed.size();
             m_OutputPosition += DecompressSize;
             return {};
         }
 
-        // Streaming mode
-        ZSTD_inBuffer in = { SourceCompressed.data(), SourceCompressed.size(), 0 };
+        // Streaming mode (resumes where the previous NOT_DONE call stopped reading SourceCompressed)
+        assert(m_SourceOffset <= SourceCompressed.size());
+        ZSTD_inBuffer in = { SourceCompressed.data(), SourceCompressed.size(), m_SourceOffset };
         ZSTD_outBuffer out = { DestinationUncompress.data(), m_BlockSize, 0 };
 
         size_t rc = ZSTD_decompressStream(static_cast<ZSTD_DCtx*>(m_pDCTX), &out, &in);
         if (ZSTD_isError(rc))
         {
-            PrintError(rc);
-            return xerr::create_f<state, "Decompression failed">();
+            m_SourceOffset = 0;
+            return DecompressError(rc);
         }
 
         DecompressSize = static_cast<std::uint32_t>(out.pos);
-        m_Position += in.pos;
+        Perf.m_Bytes   = DecompressSize;
+        m_Position += in.pos - m_SourceOffset;
         m_OutputPosition += DecompressSize;
-        return (in.pos < in.size || rc != 0) ? xerr::create<state::NOT_DONE, "More data to decompress">() : xerr{};
-    }
 
-    //-------------------------------------------------------------------------------------------------------
-    xerr dynamic_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel) noexcept
-    {
+        // A chunk is done once all its input is consumed and the decoder had room left to flush.
+        // rc != 0 then only means the frame continues in the next chunk (history mode)
+        if (in.pos < in.size || (rc != 0 && out.pos == out.size))
+        {
+            m_SourceOffset = in.pos;
+            return xerr::create<state::NOT_DONE, "More data to decompress">();
+        }
+
+        m_SourceOffset = 0;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    xerr fixed_block_decompress::ResetStream(void) noexcept
+    {
+        assert(m_BlockSize);
+
+        if (m_pDCTX && ZSTD_isError(ZSTD_DCtx_reset(static_cast<ZSTD_DCtx*>(m_pDCTX), ZSTD_reset_session_only)))
+            return xerr::create_f<state, "Error ZSTD_DCtx_reset">();
+
+        m_SourceOffset = 0;
+        return {};
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+    xerr dynamic_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel) noexcept
+    {
+        assert(SourceUncompress.data());
+        return Init(bBlockSizeIsOutputSize, BlockSize, std::span(&SourceUncompress, 1), CompressionLevel);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    xerr dynamic_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, level CompressionLevel) noexcept
+    {
         assert(!m_pCCTX);
         assert(BlockSize > 0);
-        assert(SourceUncompress.data());
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::INIT);
+        SetSource(*this, SourceSegments);
 
         auto pCCTX = ZSTD_createCCtx();
         if (!pCCTX) return xerr::create_f<state, "Error ZSTD_createCCtx">();
 
-        // Reset context to ensure clean state
-        if (ZSTD_isError(ZSTD_CCtx_reset(pCCTX, ZSTD_reset_session_and_parameters)))
+        // Streaming mode targets BlockSize as the compressed block size
+        if (auto Err = SetupCompressContext(pCCTX, bBlockSizeIsOutputSize == false, BlockSize, m_SourceSize, ZstdLevel(CompressionLevel), nullptr, m_bChecksum); Err)
         {
             ZSTD_freeCCtx(pCCTX);
-            return xerr::create_f<state, "Error ZSTD_CCtx_reset">();
+            return Err;
         }
 
-        // Set compression parameters
-        int cLevel;
-        switch (CompressionLevel)
-        {
-        case level::FAST: cLevel = 1; break;
-        case level::MEDIUM: cLevel = ZSTD_CLEVEL_DEFAULT; break;
-        case level::HIGH: cLevel = ZSTD_maxCLevel(); break;
-        default: cLevel = ZSTD_CLEVEL_DEFAULT; break;
-        }
-        if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_compressionLevel, cLevel); ZSTD_isError(err))
-        {
-            PrintError(err);
-            ZSTD_freeCCtx(pCCTX);
-            return xerr::create_f<state, "Error setting compression level">();
-        }
+        m_pCCTX                     = pCCTX;
+        m_BlockSize                 = BlockSize;
+        m_bBlockSizeIsOutputSize    = bBlockSizeIsOutputSize;
+        m_Position                  = 0;
+        m_CompressionLevel          = CompressionLevel;
+        m_DrainConsumed             = 0;
+        m_DrainOutput               = 0;
+        m_bDraining                 = false;
 
-        // Set block size for block mode
-        if ( bBlockSizeIsOutputSize == false )
-        {
-            if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_targetCBlockSize, static_cast<int>(BlockSize)); ZSTD_isError(err))
-            {
-                PrintError(err);
-                ZSTD_freeCCtx(pCCTX);
-                return xerr::create_f<state, "Error setting target block size">();
-            }
-        }
+        return {};
+    }
 
-        // Set source size hint
-        if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_srcSizeHint, static_cast<int>(SourceUncompress.size())); ZSTD_isError(err))
-        {
-            PrintError(err);
-            ZSTD_freeCCtx(pCCTX);
-            return xerr::create_f<state, "Error setting source size hint">();
-        }
+    //-------------------------------------------------------------------------------------------------------
+    xerr dynamic_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, std::span<std::byte> Workspace, level CompressionLevel) noexcept
+    {
+        assert(SourceUncompress.data());
+        return Init(bBlockSizeIsOutputSize, BlockSize, std::span(&SourceUncompress, 1), Workspace, CompressionLevel);
+    }
 
-        // Disable multi-threading for synchronous operation
-        if (auto err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_nbWorkers, 0); ZSTD_isError(err))
-        {
-            PrintError(err);
-            ZSTD_freeCCtx(pCCTX);
-            return xerr::create_f<state, "Error disabling multi-threading">();
-        }
+    //-------------------------------------------------------------------------------------------------------
+    xerr dynamic_block_compress::Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, std::span<std::byte> Workspace, level CompressionLevel) noexcept
+    {
+        assert(!m_pCCTX);
+        assert(BlockSize > 0);
+        assert(Workspace.data());
 
-        // Make sure that the check sum is turn off
-        if (auto Err = ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_checksumFlag, 0); ZSTD_isError(Err))
-        {
-            PrintError(Err);
-            ZSTD_freeCCtx(pCCTX);
-            return xerr::create_f<state, "Error setting forceIgnoreChecksum">();
-        }
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::INIT);
+        SetSource(*this, SourceSegments);
 
+        ZSTD_compressionParameters CParams;
+        int                        cLevel = ZstdLevel(CompressionLevel);
+        if (false == FitCompressParams(CParams, cLevel, m_SourceSize, Workspace.size()))
+            return xerr::create_f<state, "Workspace too small">();
+
+        // Static contexts are never freed by zstd (ZSTD_freeCCtx refuses them), the workspace belongs to the caller
+        auto pCCTX = ZSTD_initStaticCCtx(Workspace.data(), Workspace.size());
+        if (!pCCTX) return xerr::create_f<state, "Error ZSTD_initStaticCCtx">();
+
+        // Streaming mode targets BlockSize as the compressed block size
+        if (auto Err = SetupCompressContext(pCCTX, bBlockSizeIsOutputSize == false, BlockSize, m_SourceSize, cLevel, &CParams, m_bChecksum); Err)
+            return Err;
 
         m_pCCTX                     = pCCTX;
-        m_Src                       = SourceUncompress;
         m_BlockSize                 = BlockSize;
         m_bBlockSizeIsOutputSize    = bBlockSizeIsOutputSize;
         m_Position                  = 0;
         m_CompressionLevel          = CompressionLevel;
+        m_DrainConsumed             = 0;
+        m_DrainOutput               = 0;
+        m_bDraining                 = false;
 
         return {};
     }
 
+    //-------------------------------------------------------------------------------------------------------
+    std::uint64_t dynamic_block_compress::EstimateWorkspace(std::uint64_t SourceSize, level CompressionLevel) noexcept
+    {
+        return EstimateCompressWorkspace(SourceSize, ZstdLevel(CompressionLevel));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    std::uint64_t dynamic_block_compress::CopySource(std::span<std::byte> Destination, std::uint64_t Offset) const noexcept
+    {
+        return CopySourceRange(*this, Destination, Offset);
+    }
+
     //-------------------------------------------------------------------------------------------------------
     dynamic_block_compress::~dynamic_block_compress(void) noexcept
     {
@@ -403,47 +962,66 @@ namespace xcompression
     {
         assert(m_pCCTX);
         assert(Destination.data());
-        assert(m_Position <= m_Src.size());
+        assert(m_Position <= m_SourceSize);
 
         CompressedSize = 0;
 
         if (m_bBlockSizeIsOutputSize)
         {
-            // Block mode: Ensure output buffer is at least input size
-            if (Destination.size() < m_Src.size())
-                return xerr::create_f<state, "Output buffer too small">();
+            // Block mode: the entire source is a single frame, a destination smaller than it drains the frame over several calls
+            if (m_Position == m_SourceSize && m_bDraining == false)
+                return {};
 
-            // Compress entire source as a single frame
-            ZSTD_inBuffer in = { m_Src.data(), m_Src.size(), 0 };
+            const auto     FrameInput = m_SourceSize - m_Position;
+            perf_counters::scope Perf(m_pPerf, perf_counters::stage::COMPRESS);
             ZSTD_outBuffer out = { Destination.data(), Destination.size(), 0 };
+            std::uint64_t  Consumed;
 
-            size_t rc = ZSTD_compressStream2(static_cast<ZSTD_CCtx*>(m_pCCTX), &out, &in, ZSTD_e_end);
+            size_t rc = CompressRange(*this, out, FrameInput - m_DrainConsumed, ZSTD_e_end, m_bDraining == false, Consumed, m_DrainConsumed);
             if (ZSTD_isError(rc))
             {
                 PrintError(rc);
                 return xerr::create_f<state, "Compression failed">();
             }
+            Perf.m_Bytes = Consumed;
+
+            m_DrainConsumed += Consumed;
+            m_DrainOutput   += out.pos;
+            CompressedSize   = out.pos;
+
+            // Not smaller than the input: stop here, whatever zstd still holds for the frame is dropped
+            const bool bIncompressible = m_DrainOutput >= FrameInput;
+            if (bIncompressible == false && rc != 0)
+            {
+                m_bDraining = true;
+                return xerr::create<state::NOT_DONE, "More output to drain">();
+            }
+
+            if (rc != 0) ZSTD_CCtx_reset(static_cast<ZSTD_CCtx*>(m_pCCTX), ZSTD_reset_session_only);
+
+            m_Position      = m_SourceSize;
+            m_bDraining     = false;
+            m_DrainConsumed = 0;
+            m_DrainOutput   = 0;
 
-            CompressedSize = out.pos;
-            if (CompressedSize >= m_Src.size())
+            if (bIncompressible)
                 return xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
 
-            m_Position = m_Src.size();
-            return rc == 0 ? xerr{} : xerr::create<state::NOT_DONE, "Waiting to flush">();
+            return {};
         }
 
         // Streaming mode: Use binary search to find input size for compressed output ~ BlockSize
         size_t totalOutput = 0;
-        if (m_Position < m_Src.size())
+        if (m_Position < m_SourceSize)
         {
-            const auto          Left                 = m_Src.size() - m_Position;
+            const auto          Left                 = m_SourceSize - m_Position;
             const std::size_t   MaxSizeAllowed       = std::min(Left, m_BlockSize);
             std::size_t         low                  = MaxSizeAllowed;
             std::size_t         high                 = std::min( Left, MaxSizeAllowed*4 );
             std::size_t         optimalInSize        = 0;
             std::size_t         optimalCompressed    = 0;
 
-            ZSTD_inBuffer       in;
+            std::uint64_t       Consumed             = 0;
             ZSTD_outBuffer      out;
             bool                bLastWasOptimal      = false;
 
@@ -453,13 +1031,14 @@ namespace xcompression
             // Binary search for optimal input size
             while (low <= high && (--CountDown))
             {
+                size_t mid = low + (high - low) / 2;
+
+                perf_counters::scope Perf(m_pPerf, perf_counters::stage::SEARCH, mid);
                 ZSTD_CCtx_reset(static_cast<ZSTD_CCtx*>(m_pCCTX), ZSTD_reset_session_only);
 
-                size_t mid = low + (high - low) / 2;
-                in  = ZSTD_inBuffer { &m_Src[m_Position],  mid,            0 };
                 out = ZSTD_outBuffer{ Destination.data(),  MaxSizeAllowed, 0 };
 
-                size_t rc = ZSTD_compressStream2(static_cast<ZSTD_CCtx*>(m_pCCTX), &out, &in, ZSTD_e_end);
+                size_t rc = CompressRange(*this, out, mid, ZSTD_e_end, true, Consumed);
                 if (ZSTD_isError(rc))
                 {
                     PrintError(rc);
@@ -498,7 +1077,7 @@ namespace xcompression
                     out.pos = MaxSizeAllowed * 2;
                 }
 
-                if (out.pos >= MaxSizeAllowed || (in.pos != in.size))
+                if (out.pos >= MaxSizeAllowed || (Consumed != mid))
                 {
                     high = mid - 1;
                     bLastWasOptimal = false;
@@ -515,18 +1094,18 @@ namespace xcompression
             // Uncompressable...
             if (optimalInSize==0)
             {
-                out.pos = 0;
-                in.size = in.pos = MaxSizeAllowed;
+                out.pos  = 0;
+                Consumed = MaxSizeAllowed;
             }
             // Compress with optimal input size and finalize frame
             else if ( bLastWasOptimal == false)
             {
+                perf_counters::scope Perf(m_pPerf, perf_counters::stage::COMPRESS, optimalInSize);
                 ZSTD_CCtx_reset(static_cast<ZSTD_CCtx*>(m_pCCTX), ZSTD_reset_session_only);
 
-                in  = ZSTD_inBuffer{ &m_Src[m_Position],  optimalInSize,  0 };
                 out = ZSTD_outBuffer{ Destination.data(), MaxSizeAllowed, 0 };
 
-                size_t rc = ZSTD_compressStream2(static_cast<ZSTD_CCtx*>(m_pCCTX), &out, &in, ZSTD_e_end);
+                size_t rc = CompressRange(*this, out, optimalInSize, ZSTD_e_end, true, Consumed);
                 if (ZSTD_isError(rc))
                 {
                     PrintError(rc);
@@ -555,64 +1134,214 @@ namespace xcompression
             }
 
             totalOutput = out.pos;
-            m_Position += in.pos;
+            m_Position += Consumed;
             CompressedSize = totalOutput;
 
-            if (in.pos == MaxSizeAllowed)
+            if (Consumed == MaxSizeAllowed)
                 return xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
         }
 
         // we are done...
-        if (m_Position == m_Src.size()) 
+        if (m_Position == m_SourceSize) 
             return {};
 
         return xerr::create<state::NOT_DONE, "More data to process">();
     }
 
     //-------------------------------------------------------------------------------------------------------
-
-    xerr dynamic_block_decompress::Init(bool bBlockIsOutputSize, std::uint64_t BlockSize) noexcept
+    // Page mode helpers
+    //-------------------------------------------------------------------------------------------------------
+    namespace
     {
-        assert(!m_pDCTX);
-        assert(BlockSize > 0);
+        // Bytes reserved at the end of every page for the skippable frame header used as padding
+        constexpr std::size_t page_padding_header_v = ZSTD_SKIPPABLEHEADERSIZE;
 
-        auto pDCTX = ZSTD_createDCtx();
-        if (!pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+        //---------------------------------------------------------------------------------------------------
+        // Largest input size that zstd guarantees to fit in Capacity bytes (worst case stored as raw blocks)
+        std::size_t PageSafeInputSize(std::size_t Capacity) noexcept
+        {
+            std::size_t low  = 0;
+            std::size_t high = Capacity;
+            while (low < high)
+            {
+                const std::size_t mid = low + (high - low + 1) / 2;
+                if (ZSTD_COMPRESSBOUND(mid) <= Capacity) low  = mid;
+                else                                     high = mid - 1;
+            }
+            return low;
+        }
 
-        // Reset context to ensure clean state
-        if (ZSTD_isError(ZSTD_DCtx_reset(pDCTX, ZSTD_reset_session_and_parameters)))
+        //---------------------------------------------------------------------------------------------------
+        // Fills the rest of the page with a skippable frame so any zstd decoder will jump over it
+        void WritePagePadding(std::span<std::byte> Page, std::size_t Used) noexcept
         {
-            ZSTD_freeDCtx(pDCTX);
-            return xerr::create_f<state, "Error ZSTD_DCtx_reset">();
+            assert(Page.size() - Used >= page_padding_header_v);
+
+            const std::uint32_t Magic = ZSTD_MAGIC_SKIPPABLE_START;
+            const std::uint32_t Size  = static_cast<std::uint32_t>(Page.size() - Used - page_padding_header_v);
+            for (int i = 0; i < 4; ++i)
+            {
+                Page[Used + i]     = static_cast<std::byte>((Magic >> (i * 8)) & 0xff);
+                Page[Used + 4 + i] = static_cast<std::byte>((Size  >> (i * 8)) & 0xff);
+            }
+            std::memset(Page.data() + Used + page_padding_header_v, 0, Size);
         }
+    }
 
-        m_BlockSize = BlockSize;
-        m_bBlockIsOutputSize = bBlockIsOutputSize;
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr dynamic_block_compress::PackPage(std::uint64_t& CompressedSize, std::span<std::byte> DestinationPage) noexcept
+    {
+        assert(m_pCCTX);
+        assert(DestinationPage.data());
+        assert(m_Position <= m_SourceSize);
+
+        CompressedSize = 0;
+
+        if (m_bBlockSizeIsOutputSize)
+            return xerr::create_f<state, "Page mode requires streaming mode">();
+
+        if (DestinationPage.size() != m_BlockSize)
+            return xerr::create_f<state, "Page size must equal BlockSize">();
+
+        const std::size_t Capacity = static_cast<std::size_t>(m_BlockSize) - std::min<std::size_t>(static_cast<std::size_t>(m_BlockSize), page_padding_header_v);
+        const std::size_t SafeSize = PageSafeInputSize(Capacity);
+        if (SafeSize == 0)
+            return xerr::create_f<state, "BlockSize too small for page mode">();
+
+        // Nothing left to do
+        if (m_Position == m_SourceSize)
+            return {};
+
+        auto* pCCTX = static_cast<ZSTD_CCtx*>(m_pCCTX);
+        const auto Left = static_cast<std::size_t>(m_SourceSize - m_Position);
 
-        // Set max window size to the next power of 2 >= BlockSize, clamped to valid range
-        const int windowLog = std::min(std::max(Log2IntRoundUp(static_cast<int>(BlockSize)), ZSTD_WINDOWLOG_MIN), ZSTD_WINDOWLOG_MAX);
-        if (ZSTD_isError(ZSTD_DCtx_setParameter(pDCTX, ZSTD_d_windowLogMax, windowLog)))
+        // Compresses Size bytes from the current position into the page, returns true if the whole frame fits
+        ZSTD_outBuffer out;
+        auto Compress = [&](std::size_t Size, bool& bFits) noexcept -> xerr
         {
-            PrintError(windowLog);
-            ZSTD_freeDCtx(pDCTX);
-            return xerr::create_f<state, "Error setting windowLogMax">();
+            ZSTD_CCtx_reset(pCCTX, ZSTD_reset_session_only);
+
+            out = ZSTD_outBuffer{ DestinationPage.data(), Capacity, 0 };
+
+            std::uint64_t Consumed;
+            const size_t  rc = CompressRange(*this, out, Size, ZSTD_e_end, true, Consumed);
+            if (ZSTD_isError(rc))
+            {
+                PrintError(rc);
+                return xerr::create_f<state, "Compression failed">();
+            }
+
+            bFits = (rc == 0 && Consumed == Size);
+            return {};
+        };
+
+        // Binary search for the largest input that still fits in the page, starting from the guaranteed size
+        std::size_t optimalInSize   = std::min(Left, SafeSize);
+        bool        bLastWasOptimal = false;
+        std::size_t low             = optimalInSize + 1;
+        std::size_t high            = std::min(Left, Capacity * 4);
+
+        // Maximun number of searching steps...
+        int CountDown = m_CompressionLevel == level::HIGH ? 1000 : 15;
+
+        while (low <= high && (--CountDown))
+        {
+            const std::size_t mid = low + (high - low) / 2;
+
+            perf_counters::scope Perf(m_pPerf, perf_counters::stage::SEARCH, mid);
+
+            bool bFits;
+            if (auto Err = Compress(mid, bFits); Err) return Err;
+
+            if (bFits)
+            {
+                optimalInSize   = mid;
+                low             = mid + 1;
+                bLastWasOptimal = true;
+            }
+            else
+            {
+                high            = mid - 1;
+                bLastWasOptimal = false;
+            }
         }
 
-        // Reduce buffering by ignoring checksums (optional, for performance)
-        if (ZSTD_isError(ZSTD_DCtx_setParameter(pDCTX, ZSTD_d_forceIgnoreChecksum, 1)))
+        // Make sure the page holds the optimal frame
+        if (bLastWasOptimal == false)
         {
-            PrintError(1);
-            ZSTD_freeDCtx(pDCTX);
-            return xerr::create_f<state, "Error setting forceIgnoreChecksum">();
+            perf_counters::scope Perf(m_pPerf, perf_counters::stage::COMPRESS, optimalInSize);
+
+            bool bFits;
+            if (auto Err = Compress(optimalInSize, bFits); Err) return Err;
+            if (bFits == false)
+                return xerr::create_f<state, "Page compression failed to fit">();
         }
 
+        WritePagePadding(DestinationPage, out.pos);
+
+        m_Position    += optimalInSize;
+        CompressedSize = out.pos;
+
+        if (m_Position == m_SourceSize)
+            return {};
+
+        return xerr::create<state::NOT_DONE, "More pages to process">();
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr dynamic_block_decompress::Init(bool bBlockIsOutputSize, std::uint64_t BlockSize) noexcept
+    {
+        assert(!m_pDCTX);
+        assert(BlockSize > 0);
+
+        // The context is created by the first Unpack
+        m_BlockSize = BlockSize;
+        m_bBlockIsOutputSize = bBlockIsOutputSize;
+        m_Position = 0;
+        m_OutputPosition = 0;
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr dynamic_block_decompress::Init(bool bBlockIsOutputSize, std::uint64_t BlockSize, std::span<std::byte> Workspace) noexcept
+    {
+        assert(!m_pDCTX);
+        assert(BlockSize > 0);
+        assert(Workspace.data());
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::INIT);
+
+        if (Workspace.size() < EstimateWorkspace(BlockSize))
+            return xerr::create_f<state, "Workspace too small">();
+
+        // Static contexts are never freed by zstd (ZSTD_freeDCtx refuses them), the workspace belongs to the caller
+        auto pDCTX = ZSTD_initStaticDCtx(Workspace.data(), Workspace.size());
+        if (!pDCTX) return xerr::create_f<state, "Error ZSTD_initStaticDCtx">();
+
+        if (auto Err = SetupDecompressContext(pDCTX, BlockSize, m_bVerifyChecksum == false); Err)
+            return Err;
+
         m_pDCTX = pDCTX;
+        m_BlockSize = BlockSize;
+        m_bBlockIsOutputSize = bBlockIsOutputSize;
         m_Position = 0;
         m_OutputPosition = 0;
 
         return {};
     }
 
+    //-------------------------------------------------------------------------------------------------------
+
+    std::uint64_t dynamic_block_decompress::EstimateWorkspace(std::uint64_t BlockSize) noexcept
+    {
+        return ZSTD_estimateDStreamSize(std::size_t{ 1 } << DecompressWindowLog(BlockSize));
+    }
+
     //-------------------------------------------------------------------------------------------------------
     dynamic_block_decompress::~dynamic_block_decompress(void) noexcept
     {
@@ -624,11 +1353,15 @@ namespace xcompression
 
     xerr dynamic_block_decompress::Unpack(std::uint32_t& DecompressSize, std::span<std::byte> DestinationUncompress, const std::span<const std::byte> SourceCompressed) noexcept
     {
-        assert(m_pDCTX);
+        assert(m_BlockSize);
         assert(!DestinationUncompress.empty());
         assert(!SourceCompressed.empty());
 
         DecompressSize = 0;
+        if (auto Err = CreateDecompressContext(*this, m_BlockSize, m_bVerifyChecksum == false); Err)
+            return Err;
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::DECOMPRESS);
 
         if (m_bBlockIsOutputSize)
         {
@@ -636,11 +1369,11 @@ namespace xcompression
             size_t rc = ZSTD_decompressDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX), DestinationUncompress.data(), DestinationUncompress.size(), SourceCompressed.data(), SourceCompressed.size());
             if (ZSTD_isError(rc))
             {
-                PrintError(rc);
-                return xerr::create_f<state, "Decompression failed">();
+                return DecompressError(rc);
             }
 
             DecompressSize = static_cast<std::uint32_t>(rc);
+            Perf.m_Bytes   = DecompressSize;
             m_Position += SourceCompressed.size();
             m_OutputPosition += DecompressSize;
             return {};
@@ -653,13 +1386,4436 @@ namespace xcompression
         size_t rc = ZSTD_decompressStream(static_cast<ZSTD_DCtx*>(m_pDCTX), &out, &in);
         if (ZSTD_isError(rc))
         {
-            PrintError(rc);
-            return xerr::create_f<state, "Decompression failed">();
+            return DecompressError(rc);
         }
 
         DecompressSize = static_cast<std::uint32_t>(out.pos);
+        Perf.m_Bytes   = DecompressSize;
         m_Position       += in.pos;
         m_OutputPosition += DecompressSize;
         return (in.pos < in.size || rc != 0) ? xerr::create<state::NOT_DONE, "More data to decompress">() : xerr{};
     }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr dynamic_block_decompress::UnpackPage(std::uint32_t& DecompressSize, std::span<std::byte> DestinationUncompress, const std::span<const std::byte> SourcePage) noexcept
+    {
+        assert(m_BlockSize);
+        assert(!DestinationUncompress.empty());
+        assert(!SourcePage.empty());
+
+        DecompressSize = 0;
+        if (auto Err = CreateDecompressContext(*this, m_BlockSize, m_bVerifyChecksum == false); Err)
+            return Err;
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::DECOMPRESS);
+
+        if (SourcePage.size() != m_BlockSize)
+            return xerr::create_f<state, "Page size must equal BlockSize">();
+
+        // Only the first frame holds data, the rest of the page is padding
+        const size_t FrameSize = ZSTD_findFrameCompressedSize(SourcePage.data(), SourcePage.size());
+        if (ZSTD_isError(FrameSize))
+        {
+            PrintError(FrameSize);
+            return xerr::create_f<state, "Invalid page">();
+        }
+
+        size_t rc = ZSTD_decompressDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX), DestinationUncompress.data(), DestinationUncompress.size(), SourcePage.data(), FrameSize);
+        if (ZSTD_isError(rc))
+        {
+            return DecompressError(rc);
+        }
+
+        DecompressSize = static_cast<std::uint32_t>(rc);
+        Perf.m_Bytes   = DecompressSize;
+        m_Position       += SourcePage.size();
+        m_OutputPosition += DecompressSize;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // aligned_buffer
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr aligned_buffer::Init(std::uint64_t Size, std::uint64_t Alignment) noexcept
+    {
+        assert(!m_pData);
+        assert(Size > 0);
+        assert(Alignment > 0 && (Alignment & (Alignment - 1)) == 0);
+
+        // Round the size up so the whole buffer can be used for direct I/O
+        const std::uint64_t AlignedSize = (Size + Alignment - 1) & ~(Alignment - 1);
+
+        m_pData = static_cast<std::byte*>(::operator new(static_cast<std::size_t>(AlignedSize), std::align_val_t{ static_cast<std::size_t>(Alignment) }, std::nothrow));
+        if (!m_pData) return xerr::create_f<state, "Failed to allocate aligned buffer">();
+
+        m_Size      = AlignedSize;
+        m_Alignment = Alignment;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    aligned_buffer::~aligned_buffer(void) noexcept
+    {
+        if (m_pData) ::operator delete(m_pData, std::align_val_t{ static_cast<std::size_t>(m_Alignment) });
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // direct_file_writer
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr direct_file_writer::Open(const char* pFileName, std::uint64_t Alignment) noexcept
+    {
+        assert(m_Handle == -1);
+        assert(pFileName);
+        assert(Alignment > 0 && (Alignment & (Alignment - 1)) == 0);
+
+#ifdef _WIN32
+        HANDLE hFile = CreateFileA(pFileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr);
+        m_bDirectIO = hFile != INVALID_HANDLE_VALUE;
+        if (m_bDirectIO == false) hFile = CreateFileA(pFileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE) return xerr::create_f<state, "Failed to open file for writing">();
+        m_Handle = reinterpret_cast<std::intptr_t>(hFile);
+#else
+    #if defined(O_DIRECT)
+        int fd = ::open(pFileName, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        m_bDirectIO = fd != -1;
+        if (m_bDirectIO == false) fd = ::open(pFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    #else
+        int fd = ::open(pFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        #if defined(F_NOCACHE)
+        m_bDirectIO = fd != -1 && ::fcntl(fd, F_NOCACHE, 1) != -1;
+        #endif
+    #endif
+        if (fd == -1) return xerr::create_f<state, "Failed to open file for writing">();
+        m_Handle = fd;
+#endif
+
+        m_Alignment = Alignment;
+        m_Offset    = 0;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr direct_file_writer::Write(std::span<const std::byte> Pages) noexcept
+    {
+        assert(m_Handle != -1);
+
+        if ((reinterpret_cast<std::uintptr_t>(Pages.data()) & (m_Alignment - 1)) || (Pages.size() & (m_Alignment - 1)))
+            return xerr::create_f<state, "Pages must be aligned to the sector size">();
+
+        while (!Pages.empty())
+        {
+#ifdef _WIN32
+            const DWORD ToWrite = static_cast<DWORD>(std::min<std::size_t>(Pages.size(), 0x40000000));
+            DWORD       Written = 0;
+            if (FALSE == WriteFile(reinterpret_cast<HANDLE>(m_Handle), Pages.data(), ToWrite, &Written, nullptr) || Written == 0)
+                return xerr::create_f<state, "Failed to write pages">();
+#else
+            const ssize_t Written = ::write(static_cast<int>(m_Handle), Pages.data(), Pages.size());
+            if (Written <= 0)
+                return xerr::create_f<state, "Failed to write pages">();
+#endif
+            m_Offset += static_cast<std::uint64_t>(Written);
+            Pages     = Pages.subspan(static_cast<std::size_t>(Written));
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr direct_file_writer::Close(void) noexcept
+    {
+        if (m_Handle == -1) return {};
+
+        bool bOK;
+#ifdef _WIN32
+        bOK = FALSE != CloseHandle(reinterpret_cast<HANDLE>(m_Handle));
+#else
+        bOK = ::fsync(static_cast<int>(m_Handle)) == 0;
+        bOK = (::close(static_cast<int>(m_Handle)) == 0) && bOK;
+#endif
+        m_Handle = -1;
+
+        if (bOK == false) return xerr::create_f<state, "Failed to close file">();
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    direct_file_writer::~direct_file_writer(void) noexcept
+    {
+        Close();
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // archive
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // Zero is reserved to mark empty slots
+        std::uint64_t ArchiveNameHash(std::string_view Name) noexcept
+        {
+            const std::uint64_t Hash = XXH64(Name.data(), Name.size(), 0);
+            return Hash ? Hash : 1;
+        }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+        //---------------------------------------------------------------------------------------------------
+        constexpr std::uint64_t AlignUp(std::uint64_t Value, std::uint64_t Alignment) noexcept
+        {
+            return (Value + Alignment - 1) & ~(Alignment - 1);
+        }
+#endif
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr archive_writer::AddEntry(std::string_view Name, std::span<const std::byte> Data) noexcept
+    {
+        if (Name.size() > 0xffff)
+            return xerr::create_f<state, "Entry name is too long">();
+
+        if (Data.size() > 0xffffffff)
+            return xerr::create_f<state, "Entry is too large">();
+
+        m_Entries.push_back({ std::string(Name), Data });
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr archive_writer::Build(std::vector<std::byte>& Archive, level CompressionLevel, std::uint32_t nThreads) noexcept
+    {
+        const std::size_t nEntries = m_Entries.size();
+
+        //
+        // Compress all the entries
+        //
+        std::vector<std::vector<std::byte>> Blobs(nEntries);
+        std::vector<std::uint8_t>           Stored(nEntries, 0);
+        std::vector<xerr>                   Errors(nEntries);
+        std::atomic<std::size_t>            Next = 0;
+
+        auto Worker = [&]() noexcept
+        {
+            for (std::size_t i = Next++; i < nEntries; i = Next++)
+            {
+                const auto& Entry = m_Entries[i];
+                auto&       Blob  = Blobs[i];
+
+                if (Entry.m_Data.empty())
+                {
+                    Stored[i] = 1;
+                    continue;
+                }
+
+                // zstd does not accept target block sizes bigger than its maximum block size
+                fixed_block_compress Compressor;
+                if (auto Err = Compressor.Init(true, std::min<std::uint64_t>(Entry.m_Data.size(), ZSTD_BLOCKSIZE_MAX), Entry.m_Data, CompressionLevel); Err)
+                {
+                    Errors[i] = Err;
+                    continue;
+                }
+
+                Blob.resize(Entry.m_Data.size());
+
+                std::uint64_t CompressedSize;
+                if (auto Err = Compressor.Pack(CompressedSize, Blob); Err)
+                {
+                    const auto State = Err.getState<state>();
+                    if (State == state::INCOMPRESSIBLE || State == state::NOT_DONE)
+                    {
+                        Stored[i] = 1;
+                        Blob.clear();
+                        continue;
+                    }
+
+                    Errors[i] = Err;
+                    continue;
+                }
+
+                Blob.resize(static_cast<std::size_t>(CompressedSize));
+            }
+        };
+
+        if (nThreads == 0) nThreads = std::max(1u, std::thread::hardware_concurrency());
+        nThreads = static_cast<std::uint32_t>(std::min<std::size_t>(nThreads, std::max<std::size_t>(1, nEntries)));
+
+        {
+            std::vector<std::jthread> Threads;
+            for (std::uint32_t i = 1; i < nThreads; ++i) Threads.emplace_back(Worker);
+            Worker();
+        }
+
+        for (auto& Err : Errors)
+            if (Err) return Err;
+
+        //
+        // Build the TOC
+        //
+        std::uint32_t SlotCount = 1;
+        while (SlotCount < nEntries * 2) SlotCount <<= 1;
+
+        std::vector<archive::toc_entry> Slots(SlotCount, archive::toc_entry{});
+        std::vector<std::uint32_t>      EntrySlot(nEntries);
+        std::string                     Names;
+
+        std::uint64_t Offset = sizeof(archive::header);
+        for (std::size_t i = 0; i < nEntries; ++i)
+        {
+            const auto& Entry = m_Entries[i];
+            const auto  Hash  = ArchiveNameHash(Entry.m_Name);
+
+            std::uint32_t iSlot = static_cast<std::uint32_t>(Hash & (SlotCount - 1));
+            while (Slots[iSlot].m_NameHash)
+            {
+                const auto& Other = Slots[iSlot];
+                if (Other.m_NameHash == Hash && std::string_view(Names).substr(Other.m_NameOffset, Other.m_NameSize) == Entry.m_Name)
+                    return xerr::create_f<state, "Duplicated entry name">();
+                iSlot = (iSlot + 1) & (SlotCount - 1);
+            }
+
+            EntrySlot[i] = iSlot;
+
+            auto& Slot = Slots[iSlot];
+            Slot.m_NameHash         = Hash;
+            Slot.m_Offset           = Offset;
+            Slot.m_CompressedSize   = static_cast<std::uint32_t>(Stored[i] ? Entry.m_Data.size() : Blobs[i].size());
+            Slot.m_UncompressedSize = static_cast<std::uint32_t>(Entry.m_Data.size());
+            Slot.m_NameOffset       = static_cast<std::uint32_t>(Names.size());
+            Slot.m_NameSize         = static_cast<std::uint16_t>(Entry.m_Name.size());
+            Slot.m_Flags            = Stored[i] ? archive::toc_entry::FLAGS_STORED : 0;
+
+            Names  += Entry.m_Name;
+            Offset += Slot.m_CompressedSize;
+        }
+
+        //
+        // Write everything
+        //
+        const std::uint64_t TocOffset = AlignUp(Offset, 64);
+        const std::uint64_t SlotsSize = SlotCount * sizeof(archive::toc_entry);
+        const std::uint64_t TocSize   = SlotsSize + Names.size();
+
+        Archive.assign(static_cast<std::size_t>(TocOffset + TocSize), std::byte{ 0 });
+
+        for (std::size_t i = 0; i < nEntries; ++i)
+        {
+            const auto Data = Stored[i] ? m_Entries[i].m_Data : std::span<const std::byte>(Blobs[i]);
+            if (Data.empty()) continue;
+
+            std::memcpy(&Archive[static_cast<std::size_t>(Slots[EntrySlot[i]].m_Offset)], Data.data(), Data.size());
+        }
+
+        std::memcpy(&Archive[static_cast<std::size_t>(TocOffset)], Slots.data(), static_cast<std::size_t>(SlotsSize));
+        if (!Names.empty()) std::memcpy(&Archive[static_cast<std::size_t>(TocOffset + SlotsSize)], Names.data(), Names.size());
+
+        archive::header Header = {};
+        Header.m_Magic      = archive::magic_v;
+        Header.m_Version    = archive::version_v;
+        Header.m_EntryCount = static_cast<std::uint32_t>(nEntries);
+        Header.m_SlotCount  = SlotCount;
+        Header.m_TocOffset  = TocOffset;
+        Header.m_TocSize    = TocSize;
+        Header.m_TocHash    = XXH64(&Archive[static_cast<std::size_t>(TocOffset)], static_cast<std::size_t>(TocSize), 0);
+        Header.m_FileSize   = Archive.size();
+        std::memcpy(Archive.data(), &Header, sizeof(Header));
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr archive_writer::Save(const char* pFileName, level CompressionLevel, std::uint32_t nThreads) noexcept
+    {
+        assert(pFileName);
+
+        std::vector<std::byte> Archive;
+        if (auto Err = Build(Archive, CompressionLevel, nThreads); Err) return Err;
+
+        std::FILE* fp = std::fopen(pFileName, "wb");
+        if (!fp) return xerr::create_f<state, "Failed to open archive for writing">();
+
+        const bool bOK = std::fwrite(Archive.data(), 1, Archive.size(), fp) == Archive.size();
+        if (std::fclose(fp) != 0 || bOK == false)
+            return xerr::create_f<state, "Failed to write archive">();
+
+        return {};
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+
+    archive_reader::~archive_reader(void) noexcept
+    {
+        Close();
+        if (m_pDCTX) ZSTD_freeDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr archive_reader::Open(const char* pFileName) noexcept
+    {
+        assert(pFileName);
+        assert(!m_pMapping && !m_pHeader);
+
+#ifdef _WIN32
+        HANDLE hFile = CreateFileA(pFileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE) return xerr::create_f<state, "Failed to open archive">();
+
+        LARGE_INTEGER FileSize;
+        if (FALSE == GetFileSizeEx(hFile, &FileSize) || FileSize.QuadPart == 0)
+        {
+            CloseHandle(hFile);
+            return xerr::create_f<state, "Invalid archive size">();
+        }
+
+        // The view keeps the mapping alive so both handles can be closed right away
+        HANDLE hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(hFile);
+        if (!hMapping) return xerr::create_f<state, "Failed to map archive">();
+
+        void* pMapping = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+        if (!pMapping) return xerr::create_f<state, "Failed to map archive">();
+
+        const auto Size = static_cast<std::size_t>(FileSize.QuadPart);
+#else
+        const int fd = ::open(pFileName, O_RDONLY);
+        if (fd == -1) return xerr::create_f<state, "Failed to open archive">();
+
+        struct stat Stat;
+        if (::fstat(fd, &Stat) != 0 || Stat.st_size == 0)
+        {
+            ::close(fd);
+            return xerr::create_f<state, "Invalid archive size">();
+        }
+
+        // The mapping stays valid after the file is closed
+        const auto Size     = static_cast<std::size_t>(Stat.st_size);
+        void*      pMapping = ::mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (pMapping == MAP_FAILED) return xerr::create_f<state, "Failed to map archive">();
+#endif
+
+        m_pMapping    = pMapping;
+        m_MappingSize = Size;
+        if (auto Err = Init({ static_cast<const std::byte*>(pMapping), Size }); Err)
+        {
+            Close();
+            return Err;
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr archive_reader::Init(std::span<const std::byte> Archive) noexcept
+    {
+        assert(!m_pHeader);
+
+        if (Archive.size() < sizeof(archive::header) || (reinterpret_cast<std::uintptr_t>(Archive.data()) & (alignof(archive::header) - 1)))
+            return xerr::create_f<state, "Invalid archive">();
+
+        const auto* pHeader = reinterpret_cast<const archive::header*>(Archive.data());
+        if (pHeader->m_Magic != archive::magic_v)
+            return xerr::create_f<state, "Invalid archive magic">();
+
+        if (pHeader->m_Version != archive::version_v)
+            return xerr::create_f<state, "Unsupported archive version">();
+
+        const std::uint64_t SlotsSize = std::uint64_t{ pHeader->m_SlotCount } * sizeof(archive::toc_entry);
+        if (   pHeader->m_FileSize != Archive.size()
+            || pHeader->m_SlotCount == 0
+            || (pHeader->m_SlotCount & (pHeader->m_SlotCount - 1))
+            || pHeader->m_EntryCount >= pHeader->m_SlotCount
+            || (pHeader->m_TocOffset & 63)
+            || pHeader->m_TocOffset < sizeof(archive::header)
+            || pHeader->m_TocSize < SlotsSize
+            || pHeader->m_TocOffset > Archive.size()
+            || pHeader->m_TocSize > Archive.size() - pHeader->m_TocOffset)
+            return xerr::create_f<state, "Corrupted archive header">();
+
+        const auto Toc = Archive.subspan(static_cast<std::size_t>(pHeader->m_TocOffset), static_cast<std::size_t>(pHeader->m_TocSize));
+        if (XXH64(Toc.data(), Toc.size(), 0) != pHeader->m_TocHash)
+            return xerr::create_f<state, "Corrupted archive TOC">();
+
+        m_Archive   = Archive;
+        m_pHeader   = pHeader;
+        m_pSlots    = reinterpret_cast<const archive::toc_entry*>(Toc.data());
+        m_pNames    = reinterpret_cast<const char*>(Toc.data() + SlotsSize);
+        m_NamesSize = pHeader->m_TocSize - SlotsSize;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void archive_reader::Close(void) noexcept
+    {
+        if (m_pMapping)
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(m_pMapping);
+#else
+            ::munmap(m_pMapping, m_MappingSize);
+#endif
+        }
+
+        m_pMapping    = nullptr;
+        m_MappingSize = 0;
+        m_Archive   = {};
+        m_pHeader   = nullptr;
+        m_pSlots    = nullptr;
+        m_pNames    = nullptr;
+        m_NamesSize = 0;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    const archive::toc_entry* archive_reader::Find(std::string_view Name) const noexcept
+    {
+        assert(m_pHeader);
+
+        const auto          Hash = ArchiveNameHash(Name);
+        const std::uint32_t Mask = m_pHeader->m_SlotCount - 1;
+
+        std::uint32_t iSlot = static_cast<std::uint32_t>(Hash & Mask);
+        for (std::uint32_t i = 0; i < m_pHeader->m_SlotCount; ++i, iSlot = (iSlot + 1) & Mask)
+        {
+            const auto& Slot = m_pSlots[iSlot];
+            if (Slot.m_NameHash == 0) break;
+            if (Slot.m_NameHash == Hash && getName(Slot) == Name) return &Slot;
+        }
+
+        return nullptr;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::string_view archive_reader::getName(const archive::toc_entry& Entry) const noexcept
+    {
+        if (std::uint64_t{ Entry.m_NameOffset } + Entry.m_NameSize > m_NamesSize) return {};
+        return { m_pNames + Entry.m_NameOffset, Entry.m_NameSize };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::span<const std::byte> archive_reader::getCompressed(const archive::toc_entry& Entry) const noexcept
+    {
+        if (Entry.m_Offset > m_pHeader->m_TocOffset || Entry.m_CompressedSize > m_pHeader->m_TocOffset - Entry.m_Offset) return {};
+        return m_Archive.subspan(static_cast<std::size_t>(Entry.m_Offset), Entry.m_CompressedSize);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr archive_reader::Extract(std::span<std::byte> Destination, const archive::toc_entry& Entry) noexcept
+    {
+        assert(m_pHeader);
+
+        if (Destination.size() < Entry.m_UncompressedSize)
+            return xerr::create_f<state, "Output buffer too small">();
+
+        const auto Compressed = getCompressed(Entry);
+        if (Compressed.size() != Entry.m_CompressedSize)
+            return xerr::create_f<state, "Corrupted archive entry">();
+
+        if (Entry.m_Flags & archive::toc_entry::FLAGS_STORED)
+        {
+            if (Entry.m_CompressedSize != Entry.m_UncompressedSize)
+                return xerr::create_f<state, "Corrupted archive entry">();
+
+            if (!Compressed.empty()) std::memcpy(Destination.data(), Compressed.data(), Compressed.size());
+            return {};
+        }
+
+        // Create the context only when the first entry gets decompressed
+        if (!m_pDCTX)
+        {
+            m_pDCTX = ZSTD_createDCtx();
+            if (!m_pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+        }
+
+        const size_t rc = ZSTD_decompressDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX), Destination.data(), Entry.m_UncompressedSize, Compressed.data(), Compressed.size());
+        if (ZSTD_isError(rc))
+        {
+            return DecompressError(rc);
+        }
+
+        if (rc != Entry.m_UncompressedSize)
+            return xerr::create_f<state, "Corrupted archive entry">();
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // block_cache
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        struct block_cache_key_hash
+        {
+            std::size_t operator()(const block_cache::key& Key) const noexcept
+            {
+                // 64 bit mix (splitmix64 finalizer)
+                std::uint64_t x = Key.m_BlobID * 0x9E3779B97F4A7C15ull ^ Key.m_FrameIndex;
+                x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+                x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+                return static_cast<std::size_t>(x ^ (x >> 31));
+            }
+        };
+
+        struct block_cache_result
+        {
+            block_cache::block  m_Block;
+            xerr                m_Error;
+        };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // Each shard sits in its own cache lines so threads working on different shards don't fight over the mutex
+    struct alignas(64) block_cache::shard
+    {
+        struct entry
+        {
+            key     m_Key;
+            block   m_Block;
+        };
+
+        std::mutex                                                                              m_Mutex;
+        std::list<entry>                                                                        m_LRU;      // Front is the most recently used
+        std::unordered_map<key, std::list<entry>::iterator, block_cache_key_hash>               m_Map;
+        std::unordered_map<key, std::shared_future<block_cache_result>, block_cache_key_hash>   m_InFlight;
+        std::uint64_t                                                                           m_Bytes = 0;
+    };
+
+    //-------------------------------------------------------------------------------------------------------
+
+    block_cache::~block_cache(void) noexcept
+    {
+        delete[] m_pShards;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr block_cache::Init(std::uint64_t ByteBudget, std::uint64_t MaxBlockSize, std::uint32_t nShards) noexcept
+    {
+        assert(!m_pShards);
+        assert(ByteBudget > 0);
+        assert(MaxBlockSize > 0);
+        assert(nShards > 0);
+
+        std::uint32_t Count = 1;
+        while (Count < nShards) Count <<= 1;
+
+        m_pShards = new (std::nothrow) shard[Count];
+        if (!m_pShards) return xerr::create_f<state, "Failed to allocate the cache shards">();
+
+        m_ShardMask    = Count - 1;
+        m_ShardBudget  = std::max<std::uint64_t>(1, ByteBudget / Count);
+        m_MaxBlockSize = MaxBlockSize;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr block_cache::Get(block& Block, const key& Key, std::span<const std::byte> CompressedFrame, bool bStored) noexcept
+    {
+        assert(m_pShards);
+
+        // Use the high bits for the shard so the map inside the shard still gets well distributed buckets
+        auto& Shard = m_pShards[(block_cache_key_hash{}(Key) >> 40) & m_ShardMask];
+
+        std::promise<block_cache_result> Promise;
+        {
+            std::unique_lock Lock(Shard.m_Mutex);
+
+            if (auto It = Shard.m_Map.find(Key); It != Shard.m_Map.end())
+            {
+                Shard.m_LRU.splice(Shard.m_LRU.begin(), Shard.m_LRU, It->second);
+                Block = It->second->m_Block;
+                m_Hits.fetch_add(1, std::memory_order_relaxed);
+                return {};
+            }
+
+            // Someone else is already decompressing this frame, wait for it
+            if (auto It = Shard.m_InFlight.find(Key); It != Shard.m_InFlight.end())
+            {
+                auto Future = It->second;
+                Lock.unlock();
+
+                m_Coalesced.fetch_add(1, std::memory_order_relaxed);
+                const auto& Result = Future.get();
+                Block = Result.m_Block;
+                return Result.m_Error;
+            }
+
+            Shard.m_InFlight.emplace(Key, Promise.get_future().share());
+        }
+
+        m_Misses.fetch_add(1, std::memory_order_relaxed);
+
+        //
+        // Decompress outside the lock
+        //
+        block_cache_result Result;
+        [&]
+        {
+            std::size_t Size = CompressedFrame.size();
+            if (bStored == false)
+            {
+                const auto ContentSize = ZSTD_getFrameContentSize(CompressedFrame.data(), CompressedFrame.size());
+                if (ContentSize == ZSTD_CONTENTSIZE_ERROR)
+                {
+                    Result.m_Error = xerr::create_f<state, "Invalid frame">();
+                    return;
+                }
+
+                // The size comes from the frame header, do not trust it with an allocation
+                if (ContentSize != ZSTD_CONTENTSIZE_UNKNOWN && ContentSize > m_MaxBlockSize)
+                {
+                    Result.m_Error = xerr::create_f<state, "Frame is bigger than the maximum block size">();
+                    return;
+                }
+                Size = static_cast<std::size_t>(ContentSize == ZSTD_CONTENTSIZE_UNKNOWN ? m_MaxBlockSize : ContentSize);
+            }
+
+            auto Data = std::make_shared<std::vector<std::byte>>(Size);
+            if (bStored)
+            {
+                if (Size) std::memcpy(Data->data(), CompressedFrame.data(), Size);
+            }
+            else
+            {
+                auto* pDCTX = getThreadDCtx();
+                if (!pDCTX)
+                {
+                    Result.m_Error = xerr::create_f<state, "Failed to create decompression context">();
+                    return;
+                }
+
+                const size_t rc = ZSTD_decompressDCtx(pDCTX, Data->data(), Data->size(), CompressedFrame.data(), CompressedFrame.size());
+                if (ZSTD_isError(rc))
+                {
+                    Result.m_Error = DecompressError(rc);
+                    return;
+                }
+                Data->resize(rc);
+            }
+
+            Result.m_Block = std::move(Data);
+        }();
+
+        //
+        // Publish the block and make room for it
+        //
+        {
+            std::lock_guard Lock(Shard.m_Mutex);
+            Shard.m_InFlight.erase(Key);
+
+            if (!Result.m_Error)
+            {
+                const std::uint64_t Size = Result.m_Block->size();
+                Shard.m_LRU.push_front({ Key, Result.m_Block });
+                Shard.m_Map.emplace(Key, Shard.m_LRU.begin());
+                Shard.m_Bytes += Size;
+                m_BytesInUse.fetch_add(Size, std::memory_order_relaxed);
+
+                // Always keep the newest block even if it is bigger than the budget
+                while (Shard.m_Bytes > m_ShardBudget && Shard.m_LRU.size() > 1)
+                {
+                    auto& Victim = Shard.m_LRU.back();
+                    const std::uint64_t VictimSize = Victim.m_Block->size();
+
+                    Shard.m_Map.erase(Victim.m_Key);
+                    Shard.m_LRU.pop_back();
+                    Shard.m_Bytes -= VictimSize;
+                    m_BytesInUse.fetch_sub(VictimSize, std::memory_order_relaxed);
+                    m_Evictions.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        Promise.set_value(Result);
+
+        Block = std::move(Result.m_Block);
+        return Result.m_Error;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    block_cache::stats block_cache::getStats(void) const noexcept
+    {
+        return
+        { m_Hits.load(std::memory_order_relaxed)
+        , m_Misses.load(std::memory_order_relaxed)
+        , m_Coalesced.load(std::memory_order_relaxed)
+        , m_Evictions.load(std::memory_order_relaxed)
+        , m_BytesInUse.load(std::memory_order_relaxed)
+        };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // small_message
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        // Contexts configured once per thread for the small message frame format
+        struct small_message_contexts
+        {
+            ~small_message_contexts(void) noexcept
+            {
+#ifndef XCOMPRESSION_DECODE_ONLY
+                if (m_pCCTX) ZSTD_freeCCtx(m_pCCTX);
+#endif
+                if (m_pDCTX) ZSTD_freeDCtx(m_pDCTX);
+            }
+
+            ZSTD_CCtx*  m_pCCTX     = nullptr;
+            ZSTD_DCtx*  m_pDCTX     = nullptr;
+            int         m_cLevel    = 0;
+        };
+
+        thread_local small_message_contexts t_SmallMessage;
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+        //---------------------------------------------------------------------------------------------------
+        ZSTD_CCtx* getSmallMessageCCtx(int cLevel) noexcept
+        {
+            auto& Contexts = t_SmallMessage;
+            if (!Contexts.m_pCCTX)
+            {
+                auto pCCTX = ZSTD_createCCtx();
+                if (!pCCTX) return nullptr;
+
+                if (   ZSTD_isError(ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_format,          ZSTD_f_zstd1_magicless))
+                    || ZSTD_isError(ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_contentSizeFlag, 0))
+                    || ZSTD_isError(ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_checksumFlag,    0))
+                    || ZSTD_isError(ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_dictIDFlag,      0)))
+                {
+                    ZSTD_freeCCtx(pCCTX);
+                    return nullptr;
+                }
+
+                Contexts.m_pCCTX  = pCCTX;
+                Contexts.m_cLevel = 0;
+            }
+
+            // Only touch the level when it changes
+            if (Contexts.m_cLevel != cLevel)
+            {
+                if (ZSTD_isError(ZSTD_CCtx_setParameter(Contexts.m_pCCTX, ZSTD_c_compressionLevel, cLevel))) return nullptr;
+                Contexts.m_cLevel = cLevel;
+            }
+
+            return Contexts.m_pCCTX;
+        }
+#endif
+
+        //---------------------------------------------------------------------------------------------------
+        ZSTD_DCtx* getSmallMessageDCtx(void) noexcept
+        {
+            auto& Contexts = t_SmallMessage;
+            if (!Contexts.m_pDCTX)
+            {
+                auto pDCTX = ZSTD_createDCtx();
+                if (!pDCTX) return nullptr;
+
+                if (ZSTD_isError(ZSTD_DCtx_setParameter(pDCTX, ZSTD_d_format, ZSTD_f_zstd1_magicless)))
+                {
+                    ZSTD_freeDCtx(pDCTX);
+                    return nullptr;
+                }
+
+                Contexts.m_pDCTX = pDCTX;
+            }
+
+            return Contexts.m_pDCTX;
+        }
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr small_message::Pack(std::uint64_t& CompressedSize, std::span<std::byte> Destination, const std::span<const std::byte> Source, level CompressionLevel) noexcept
+    {
+        assert(Destination.data());
+        assert(Source.data());
+
+        CompressedSize = 0;
+
+        auto pCCTX = getSmallMessageCCtx(ZstdLevel(CompressionLevel));
+        if (!pCCTX) return xerr::create_f<state, "Error creating small message context">();
+
+        // Anything that does not fit in less than the source is not worth sending compressed
+        const size_t Capacity = std::min(Destination.size(), Source.size());
+        const size_t rc       = ZSTD_compress2(pCCTX, Destination.data(), Capacity, Source.data(), Source.size());
+        if (ZSTD_isError(rc))
+        {
+            if (ZSTD_getErrorCode(rc) == ZSTD_error_dstSize_tooSmall)
+                return xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
+
+            PrintError(rc);
+            return xerr::create_f<state, "Compression failed">();
+        }
+
+        CompressedSize = rc;
+        if (CompressedSize >= Source.size())
+            return xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
+
+        return {};
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr small_message::Unpack(std::span<std::byte> Destination, const std::span<const std::byte> Source) noexcept
+    {
+        assert(Destination.data());
+        assert(Source.data());
+
+        auto pDCTX = getSmallMessageDCtx();
+        if (!pDCTX) return xerr::create_f<state, "Error creating small message context">();
+
+        const size_t rc = ZSTD_decompressDCtx(pDCTX, Destination.data(), Destination.size(), Source.data(), Source.size());
+        if (ZSTD_isError(rc))
+        {
+            return DecompressError(rc);
+        }
+
+        if (rc != Destination.size())
+            return xerr::create_f<state, "Decompressed size does not match the expected size">();
+
+        return {};
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+    // job_service
+    //-------------------------------------------------------------------------------------------------------
+    struct job_service::queue
+    {
+        struct item
+        {
+            job                     m_Job;
+            std::promise<result>    m_Promise;
+        };
+
+        std::mutex                  m_Mutex;
+        std::condition_variable     m_NotEmpty;
+        std::condition_variable     m_NotFull;
+        std::deque<item>            m_Items[static_cast<int>(priority::COUNT)];
+        std::uint32_t               m_Count         = 0;
+        std::uint32_t               m_MaxDepth      = 0;
+        bool                        m_bShutdown     = false;
+    };
+
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // zstd contexts reused by a worker for all its jobs
+        struct job_worker_contexts
+        {
+            ~job_worker_contexts(void) noexcept
+            {
+                if (m_pCCTX) ZSTD_freeCCtx(m_pCCTX);
+                if (m_pDCTX) ZSTD_freeDCtx(m_pDCTX);
+            }
+
+            ZSTD_CCtx* m_pCCTX = nullptr;
+            ZSTD_DCtx* m_pDCTX = nullptr;
+        };
+
+        //---------------------------------------------------------------------------------------------------
+        xerr RunCompressJob(job_worker_contexts& Contexts, job_service::job& Job, job_service::result& Result) noexcept
+        {
+            if (!Contexts.m_pCCTX) Contexts.m_pCCTX = ZSTD_createCCtx();
+            if (!Contexts.m_pCCTX) return xerr::create_f<state, "Error ZSTD_createCCtx">();
+
+            ZSTD_CCtx_reset(Contexts.m_pCCTX, ZSTD_reset_session_and_parameters);
+            if (auto Err = ZSTD_CCtx_setParameter(Contexts.m_pCCTX, ZSTD_c_compressionLevel, ZstdLevel(Job.m_Level)); ZSTD_isError(Err))
+            {
+                PrintError(Err);
+                return xerr::create_f<state, "Error setting compression level">();
+            }
+
+            // Same rule as Pack: the output must be smaller than the input to be worth it
+            auto Destination = Job.m_Destination;
+            if (Destination.empty())
+            {
+                Result.m_Data.resize(Job.m_Source.size());
+                Destination = Result.m_Data;
+            }
+            Destination = Destination.first(std::min(Destination.size(), Job.m_Source.size()));
+
+            const size_t rc = ZSTD_compress2(Contexts.m_pCCTX, Destination.data(), Destination.size(), Job.m_Source.data(), Job.m_Source.size());
+            if (ZSTD_isError(rc) && ZSTD_getErrorCode(rc) != ZSTD_error_dstSize_tooSmall)
+            {
+                PrintError(rc);
+                return xerr::create_f<state, "Compression failed">();
+            }
+
+            if (ZSTD_isError(rc) || rc >= Job.m_Source.size())
+            {
+                Result.m_Data.clear();
+                return xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
+            }
+
+            Result.m_Size = rc;
+            if (!Result.m_Data.empty()) Result.m_Data.resize(rc);
+            return {};
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        xerr RunDecompressJob(job_worker_contexts& Contexts, job_service::job& Job, job_service::result& Result) noexcept
+        {
+            if (!Contexts.m_pDCTX) Contexts.m_pDCTX = ZSTD_createDCtx();
+            if (!Contexts.m_pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+
+            std::uint64_t Size = Job.m_DecompressedSize;
+            if (Size == 0)
+            {
+                const auto ContentSize = ZSTD_getFrameContentSize(Job.m_Source.data(), Job.m_Source.size());
+                if (ContentSize == ZSTD_CONTENTSIZE_ERROR || ContentSize == ZSTD_CONTENTSIZE_UNKNOWN)
+                    return xerr::create_f<state, "Unknown decompressed size">();
+                Size = ContentSize;
+            }
+
+            // The frame header is not trusted with an allocation
+            if (Size > Job.m_MaxDecompressedSize)
+                return xerr::create_f<state, "Frame is bigger than the maximum decompressed size">();
+
+            auto Destination = Job.m_Destination;
+            if (Destination.empty())
+            {
+                Result.m_Data.resize(static_cast<std::size_t>(Size));
+                Destination = Result.m_Data;
+            }
+
+            const size_t rc = ZSTD_decompressDCtx(Contexts.m_pDCTX, Destination.data(), Destination.size(), Job.m_Source.data(), Job.m_Source.size());
+            if (ZSTD_isError(rc))
+            {
+                return DecompressError(rc);
+            }
+
+            Result.m_Size = rc;
+            if (!Result.m_Data.empty()) Result.m_Data.resize(rc);
+            return {};
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    job_service::~job_service(void) noexcept
+    {
+        Shutdown();
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr job_service::Init(std::uint32_t nWorkers, std::uint32_t MaxQueueDepth) noexcept
+    {
+        assert(!m_pQueue);
+        assert(MaxQueueDepth > 0);
+
+        m_pQueue = new (std::nothrow) queue;
+        if (!m_pQueue) return xerr::create_f<state, "Failed to allocate the job queue">();
+        m_pQueue->m_MaxDepth = MaxQueueDepth;
+
+        if (nWorkers == 0) nWorkers = std::max(1u, std::thread::hardware_concurrency());
+
+        for (std::uint32_t i = 0; i < nWorkers; ++i)
+        {
+            m_Workers.emplace_back([&Queue = *m_pQueue]() noexcept
+            {
+                job_worker_contexts Contexts;
+                while (true)
+                {
+                    queue::item Item;
+                    {
+                        std::unique_lock Lock(Queue.m_Mutex);
+                        Queue.m_NotEmpty.wait(Lock, [&] { return Queue.m_Count || Queue.m_bShutdown; });
+
+                        // Shutting down only exits once the queue is drained
+                        if (Queue.m_Count == 0) return;
+
+                        for (int p = static_cast<int>(priority::COUNT) - 1; p >= 0; --p)
+                        {
+                            if (Queue.m_Items[p].empty()) continue;
+                            Item = std::move(Queue.m_Items[p].front());
+                            Queue.m_Items[p].pop_front();
+                            break;
+                        }
+                        Queue.m_Count--;
+                    }
+                    Queue.m_NotFull.notify_one();
+
+                    result Result;
+                    Result.m_Error = Item.m_Job.m_Operation == operation::COMPRESS
+                                   ? RunCompressJob(Contexts, Item.m_Job, Result)
+                                   : RunDecompressJob(Contexts, Item.m_Job, Result);
+
+                    if (Item.m_Job.m_Callback) Item.m_Job.m_Callback(std::move(Result));
+                    else                       Item.m_Promise.set_value(std::move(Result));
+                }
+            });
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr job_service::Submit(job&& Job, std::future<result>* pFuture, bool bWaitWhenFull) noexcept
+    {
+        assert(m_pQueue);
+        assert(Job.m_Source.data());
+        assert(Job.m_Priority < priority::COUNT);
+
+        {
+            std::unique_lock Lock(m_pQueue->m_Mutex);
+            if (m_pQueue->m_bShutdown)
+                return xerr::create_f<state, "Job service is shutting down">();
+
+            if (m_pQueue->m_Count >= m_pQueue->m_MaxDepth)
+            {
+                if (bWaitWhenFull == false)
+                    return xerr::create<state::NOT_DONE, "Job queue is full">();
+
+                m_pQueue->m_NotFull.wait(Lock, [&] { return m_pQueue->m_Count < m_pQueue->m_MaxDepth || m_pQueue->m_bShutdown; });
+                if (m_pQueue->m_bShutdown)
+                    return xerr::create_f<state, "Job service is shutting down">();
+            }
+
+            auto& Item = m_pQueue->m_Items[static_cast<int>(Job.m_Priority)].emplace_back(std::move(Job));
+            if (pFuture) *pFuture = Item.m_Promise.get_future();
+            m_pQueue->m_Count++;
+        }
+        m_pQueue->m_NotEmpty.notify_one();
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void job_service::Shutdown(void) noexcept
+    {
+        if (!m_pQueue) return;
+
+        {
+            std::lock_guard Lock(m_pQueue->m_Mutex);
+            m_pQueue->m_bShutdown = true;
+        }
+        m_pQueue->m_NotEmpty.notify_all();
+        m_pQueue->m_NotFull.notify_all();
+
+        m_Workers.clear();
+
+        delete m_pQueue;
+        m_pQueue = nullptr;
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+    // output sinks
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // Writes the buffers in batches through Func(std::span<const std::span<const std::byte>>) which returns
+        // the number of bytes written (may be partial) or a negative value on error.
+        template< typename T_FUNC >
+        xerr GatherWrite(std::span<const std::span<const std::byte>> Buffers, T_FUNC&& Func) noexcept
+        {
+            constexpr std::size_t       max_batch_v = 256;
+            std::span<const std::byte>  Batch[max_batch_v];
+
+            std::size_t iBuffer = 0;
+            std::size_t Offset  = 0;
+            while (true)
+            {
+                // Skip whatever is already written (and empty buffers)
+                while (iBuffer < Buffers.size() && Offset == Buffers[iBuffer].size())
+                {
+                    iBuffer++;
+                    Offset = 0;
+                }
+                if (iBuffer == Buffers.size()) return {};
+
+                std::size_t n = 0;
+                for (std::size_t i = iBuffer; i < Buffers.size() && n < max_batch_v; ++i)
+                {
+                    const auto Buffer = i == iBuffer ? Buffers[i].subspan(Offset) : Buffers[i];
+                    if (!Buffer.empty()) Batch[n++] = Buffer;
+                }
+
+                const std::int64_t Written = Func(std::span<const std::span<const std::byte>>(Batch, n));
+                if (Written <= 0) return xerr::create_f<state, "Failed to write to the sink">();
+
+                for (auto Left = static_cast<std::uint64_t>(Written); Left; )
+                {
+                    const std::uint64_t Available = Buffers[iBuffer].size() - Offset;
+                    if (Left >= Available)
+                    {
+                        Left   -= Available;
+                        Offset  = 0;
+                        iBuffer++;
+                    }
+                    else
+                    {
+                        Offset += static_cast<std::size_t>(Left);
+                        Left    = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr file_sink::Write(std::span<const std::span<const std::byte>> Buffers) noexcept
+    {
+        return GatherWrite(Buffers, [&](std::span<const std::span<const std::byte>> Batch) noexcept -> std::int64_t
+        {
+#ifdef _WIN32
+            // There is no gather write for regular (buffered) handles
+            std::int64_t Total = 0;
+            for (const auto& Buffer : Batch)
+            {
+                const DWORD ToWrite = static_cast<DWORD>(std::min<std::size_t>(Buffer.size(), 0x40000000));
+                DWORD       Written = 0;
+                if (FALSE == WriteFile(reinterpret_cast<HANDLE>(m_Handle), Buffer.data(), ToWrite, &Written, nullptr)) return Total ? Total : -1;
+                Total += Written;
+                if (Written != ToWrite) break;
+            }
+            return Total;
+#else
+            iovec Iov[256];
+            for (std::size_t i = 0; i < Batch.size(); ++i) Iov[i] = { const_cast<std::byte*>(Batch[i].data()), Batch[i].size() };
+
+            ssize_t Written;
+            do Written = ::writev(static_cast<int>(m_Handle), Iov, static_cast<int>(Batch.size()));
+            while (Written < 0 && errno == EINTR);
+            return Written;
+#endif
+        });
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr socket_sink::Write(std::span<const std::span<const std::byte>> Buffers) noexcept
+    {
+        return GatherWrite(Buffers, [&](std::span<const std::span<const std::byte>> Batch) noexcept -> std::int64_t
+        {
+#ifdef _WIN32
+            WSABUF Wsa[256];
+            for (std::size_t i = 0; i < Batch.size(); ++i) Wsa[i] = { static_cast<ULONG>(Batch[i].size()), reinterpret_cast<CHAR*>(const_cast<std::byte*>(Batch[i].data())) };
+
+            DWORD Sent = 0;
+            if (WSASend(static_cast<SOCKET>(m_Socket), Wsa, static_cast<DWORD>(Batch.size()), &Sent, 0, nullptr, nullptr) != 0) return -1;
+            return Sent;
+#else
+            iovec Iov[256];
+            for (std::size_t i = 0; i < Batch.size(); ++i) Iov[i] = { const_cast<std::byte*>(Batch[i].data()), Batch[i].size() };
+
+            msghdr Msg = {};
+            Msg.msg_iov    = Iov;
+            Msg.msg_iovlen = Batch.size();
+
+            // Don't let a closed connection kill the process with SIGPIPE
+    #ifdef MSG_NOSIGNAL
+            constexpr int Flags = MSG_NOSIGNAL;
+    #else
+            constexpr int Flags = 0;
+    #endif
+            ssize_t Sent;
+            do Sent = ::sendmsg(static_cast<int>(m_Socket), &Msg, Flags);
+            while (Sent < 0 && errno == EINTR);
+            return Sent;
+#endif
+        });
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr buffer_chain_sink::Write(std::span<const std::span<const std::byte>> Buffers) noexcept
+    {
+        assert(m_SegmentSize > 0);
+
+        for (auto Buffer : Buffers)
+        {
+            while (!Buffer.empty())
+            {
+                if (m_Segments.empty() || m_Segments.back().size() == m_SegmentSize)
+                {
+                    m_Segments.emplace_back().reserve(m_SegmentSize);
+                }
+
+                auto&             Segment = m_Segments.back();
+                const std::size_t Count   = std::min(Buffer.size(), m_SegmentSize - Segment.size());
+                Segment.insert(Segment.end(), Buffer.begin(), Buffer.begin() + Count);
+                Buffer  = Buffer.subspan(Count);
+                m_Size += Count;
+            }
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // sink_decompress
+    //-------------------------------------------------------------------------------------------------------
+
+    sink_decompress::~sink_decompress(void) noexcept
+    {
+        if (m_pDCTX) ZSTD_freeDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr sink_decompress::Init(output_sink& Sink, std::uint64_t BlockSize, std::uint32_t nBlocks) noexcept
+    {
+        assert(!m_pDCTX);
+        assert(BlockSize > 0);
+        assert(nBlocks > 0);
+
+        auto pDCTX = ZSTD_createDCtx();
+        if (!pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+
+        if (auto Err = SetupDecompressContext(pDCTX, BlockSize, false); Err)
+        {
+            ZSTD_freeDCtx(pDCTX);
+            return Err;
+        }
+
+        m_Arena.resize(static_cast<std::size_t>(BlockSize * nBlocks));
+        m_Pending.reserve(nBlocks * 2);
+
+        m_pDCTX          = pDCTX;
+        m_pSink          = &Sink;
+        m_BlockSize      = BlockSize;
+        m_ArenaUsed      = 0;
+        m_OutputPosition = 0;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr sink_decompress::Unpack(const std::span<const std::byte> SourceCompressed, bool bStored) noexcept
+    {
+        assert(m_pDCTX);
+
+        if (bStored)
+        {
+            if (!SourceCompressed.empty()) m_Pending.push_back(SourceCompressed);
+            return {};
+        }
+
+        ZSTD_inBuffer in = { SourceCompressed.data(), SourceCompressed.size(), 0 };
+        while (true)
+        {
+            if (m_ArenaUsed == m_Arena.size())
+            {
+                if (auto Err = Flush(); Err) return Err;
+            }
+
+            std::byte*     pOut = m_Arena.data() + m_ArenaUsed;
+            ZSTD_outBuffer out  = { pOut, static_cast<std::size_t>(m_Arena.size() - m_ArenaUsed), 0 };
+
+            const size_t rc = ZSTD_decompressStream(static_cast<ZSTD_DCtx*>(m_pDCTX), &out, &in);
+            if (ZSTD_isError(rc))
+            {
+                return DecompressError(rc);
+            }
+
+            if (out.pos)
+            {
+                // Consecutive blocks in the arena become a single buffer
+                if (!m_Pending.empty() && m_Pending.back().data() + m_Pending.back().size() == pOut)
+                    m_Pending.back() = { m_Pending.back().data(), m_Pending.back().size() + out.pos };
+                else
+                    m_Pending.emplace_back(pOut, out.pos);
+
+                m_ArenaUsed += out.pos;
+            }
+
+            // Done when all the input was consumed and the decoder had room to spare (nothing left buffered)
+            if (in.pos == in.size && out.pos < out.size) break;
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr sink_decompress::Flush(void) noexcept
+    {
+        assert(m_pSink);
+
+        if (m_Pending.empty()) return {};
+
+        if (auto Err = m_pSink->Write(m_Pending); Err) return Err;
+
+        for (const auto& Buffer : m_Pending) m_OutputPosition += Buffer.size();
+        m_Pending.clear();
+        m_ArenaUsed = 0;
+        return {};
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr fixed_block_pack_range::Init(fixed_block_compress& Compressor) noexcept
+    {
+        assert(Compressor.m_pCCTX);
+
+        if (Compressor.m_bBlockSizeIsOutputSize)
+            return xerr::create_f<state, "Pack range needs a streaming compressor">();
+
+        // Enough for any chunk, including the ones history mode can not give back as INCOMPRESSIBLE
+        m_Buffer.resize(ZSTD_COMPRESSBOUND(Compressor.m_BlockSize));
+
+        m_pCompressor = &Compressor;
+        m_Chunk       = {};
+        m_Error       = {};
+        m_bStarted    = false;
+        m_bFinished   = false;
+        m_bDone       = false;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    fixed_block_pack_range::iterator fixed_block_pack_range::begin(void) noexcept
+    {
+        assert(m_pCompressor);
+
+        if (m_bStarted == false)
+        {
+            m_bStarted = true;
+            Next();
+        }
+
+        return { this };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void fixed_block_pack_range::Next(void) noexcept
+    {
+        while (m_bFinished == false)
+        {
+            const auto      Offset = m_pCompressor->m_Position;
+            std::uint64_t   CompressedSize;
+            auto            Err    = m_pCompressor->Pack(CompressedSize, m_Buffer);
+            const auto      Size   = m_pCompressor->m_Position - Offset;
+
+            if (Err)
+            {
+                switch (Err.getState<state>())
+                {
+                case state::INCOMPRESSIBLE:
+                    // Raw input is handed out in place, scatter-gather input is gathered into the buffer first
+                    if (m_pCompressor->m_Segments.empty())
+                        m_Chunk = { m_pCompressor->m_Src.subspan(Offset, Size), Offset, Size, true };
+                    else
+                        m_Chunk = { std::span<const std::byte>(m_Buffer).first(m_pCompressor->CopySource(std::span(m_Buffer).first(Size), Offset)), Offset, Size, true };
+                    return;
+                case state::NOT_DONE:
+                    break;
+                default:
+                    m_Error = Err;
+                    m_bDone = true;
+                    return;
+                }
+            }
+            else m_bFinished = true;
+
+            // A call can only flush (no output), keep going until there is a chunk to hand out
+            if (CompressedSize > 0)
+            {
+                m_Chunk = { std::span<const std::byte>(m_Buffer).first(CompressedSize), Offset, Size, false };
+                return;
+            }
+        }
+
+        m_bDone = true;
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr fixed_block_unpack_range::Init(fixed_block_decompress& Decompressor, std::span<const stream_chunk> Chunks) noexcept
+    {
+        assert(Decompressor.m_BlockSize);
+
+        if (Decompressor.m_bBlockIsOutputSize)
+            return xerr::create_f<state, "Unpack range needs a streaming decompressor">();
+
+        for (auto& Buffer : m_Buffers) Buffer.resize(static_cast<std::size_t>(Decompressor.m_BlockSize));
+
+        m_pDecompressor = &Decompressor;
+        m_Chunks        = Chunks;
+        m_iChunk        = 0;
+        m_iBuffer       = 0;
+        m_Output        = {};
+        m_Error         = {};
+        m_bStarted      = false;
+        m_bPending      = false;
+        m_bDone         = false;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    fixed_block_unpack_range::iterator fixed_block_unpack_range::begin(void) noexcept
+    {
+        assert(m_pDecompressor);
+
+        if (m_bStarted == false)
+        {
+            m_bStarted = true;
+            Next();
+        }
+
+        return { this };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void fixed_block_unpack_range::Next(void) noexcept
+    {
+        while (m_bPending || m_iChunk < m_Chunks.size())
+        {
+            const auto& Chunk = m_Chunks[m_bPending ? m_iChunk - 1 : m_iChunk++];
+
+            // Stored chunks are handed out as they are
+            if (Chunk.m_bStored)
+            {
+                if (Chunk.m_Data.empty()) continue;
+                m_Output = Chunk.m_Data;
+                return;
+            }
+
+            auto&           Buffer = m_Buffers[m_iBuffer & 1];
+            std::uint32_t   DecompressSize;
+            auto            Err    = m_pDecompressor->Unpack(DecompressSize, Buffer, Chunk.m_Data);
+
+            m_bPending = false;
+            if (Err)
+            {
+                if (Err.getState<state>() != state::NOT_DONE)
+                {
+                    m_Error = Err;
+                    m_bDone = true;
+                    return;
+                }
+                m_bPending = true;
+            }
+
+            // Only switch buffers once this one is handed out, the other one may still be in use
+            if (DecompressSize > 0)
+            {
+                m_Output = std::span<const std::byte>(Buffer).first(DecompressSize);
+                m_iBuffer++;
+                return;
+            }
+        }
+
+        m_Output = {};
+        m_bDone  = true;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // Content-defined chunking and deduplication
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // Random 64 bit value per byte for the gear hash (splitmix64, so the table is the same everywhere)
+        constexpr auto gear_table_v = []() constexpr
+        {
+            std::array<std::uint64_t, 256> Table{};
+            std::uint64_t                  State = 0x9E3779B97F4A7C15ull;
+            for (auto& Entry : Table)
+            {
+                std::uint64_t Z = (State += 0x9E3779B97F4A7C15ull);
+                Z = (Z ^ (Z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                Z = (Z ^ (Z >> 27)) * 0x94D049BB133111EBull;
+                Entry = Z ^ (Z >> 31);
+            }
+            return Table;
+        }();
+
+        //---------------------------------------------------------------------------------------------------
+        // Gear hash bits only depend on the last 64 bytes and the top bits mix the most of them, so masks use the top bits
+        constexpr std::uint64_t GearMask(int nBits) noexcept
+        {
+            return nBits <= 0 ? 0 : (~std::uint64_t{ 0 }) << (64 - nBits);
+        }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+        //---------------------------------------------------------------------------------------------------
+        dedup::fingerprint Fingerprint(std::span<const std::byte> Chunk) noexcept
+        {
+            return { XXH64(Chunk.data(), Chunk.size(), 0), XXH64(Chunk.data(), Chunk.size(), 0x5851F42D4C957F2Dull) };
+        }
+#endif
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr cdc_chunker::Init(std::uint32_t MinSize, std::uint32_t AvgSize, std::uint32_t MaxSize) noexcept
+    {
+        if (MinSize == 0 || MinSize > AvgSize || AvgSize > MaxSize)
+            return xerr::create_f<state, "Chunk sizes must be 0 < MinSize <= AvgSize <= MaxSize">();
+
+        // Normalized chunking: one bit harder before the average size, one bit easier after it
+        const int nBits = Log2Int(static_cast<int>(AvgSize));
+        m_MaskSmall = GearMask(nBits + 1);
+        m_MaskLarge = GearMask(nBits - 1);
+        m_MinSize   = MinSize;
+        m_AvgSize   = 1u << nBits;
+        m_MaxSize   = MaxSize;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::size_t cdc_chunker::NextChunkSize(std::span<const std::byte> Data) const noexcept
+    {
+        assert(m_MaxSize);
+
+        const std::size_t Size = Data.size();
+        if (Size <= m_MinSize) return Size;
+
+        const std::size_t   Normal = std::min<std::size_t>(std::max(m_AvgSize, m_MinSize), Size);
+        const std::size_t   End    = std::min<std::size_t>(m_MaxSize, Size);
+        const auto*         pData  = reinterpret_cast<const std::uint8_t*>(Data.data());
+        std::uint64_t       Hash   = 0;
+        std::size_t         i      = m_MinSize;
+
+        // Cut-point skipping: no boundary can be placed before MinSize so those bytes are never hashed
+        for (; i < Normal; ++i)
+        {
+            Hash = (Hash << 1) + gear_table_v[pData[i]];
+            if ((Hash & m_MaskSmall) == 0) return i + 1;
+        }
+
+        for (; i < End; ++i)
+        {
+            Hash = (Hash << 1) + gear_table_v[pData[i]];
+            if ((Hash & m_MaskLarge) == 0) return i + 1;
+        }
+
+        return End;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::span<const std::byte> chunk_store::Find(const dedup::fingerprint& Fingerprint) const noexcept
+    {
+        if (auto It = m_Chunks.find(Fingerprint); It != m_Chunks.end()) return It->second;
+        return {};
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+
+    dedup_compress::~dedup_compress(void) noexcept
+    {
+        if (m_pCCTX) ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(m_pCCTX));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr dedup_compress::Init(level CompressionLevel, std::uint32_t MinSize, std::uint32_t AvgSize, std::uint32_t MaxSize) noexcept
+    {
+        assert(!m_pCCTX);
+
+        if (auto Err = m_Chunker.Init(MinSize, AvgSize, MaxSize); Err)
+            return Err;
+
+        auto pCCTX = ZSTD_createCCtx();
+        if (!pCCTX) return xerr::create_f<state, "Error ZSTD_createCCtx">();
+
+        m_pCCTX = pCCTX;
+        m_Level = ZstdLevel(CompressionLevel);
+        m_Known.clear();
+        m_Stats = {};
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr dedup_compress::Pack(std::vector<std::byte>& Output, const std::span<const std::byte> Source) noexcept
+    {
+        assert(m_pCCTX);
+
+        const auto  StartSize = Output.size();
+        std::size_t Position  = 0;
+        while (Position < Source.size())
+        {
+            const auto  Chunk = Source.subspan(Position, m_Chunker.NextChunkSize(Source.subspan(Position)));
+            const auto  Print = Fingerprint(Chunk);
+            Position += Chunk.size();
+
+            dedup::record Record = { Print, static_cast<std::uint32_t>(Chunk.size()), 0 };
+            const auto    Offset = Output.size();
+
+            m_Stats.m_nChunks++;
+            if (auto It = m_Known.find(Print); It != m_Known.end() && It->second == Record.m_Size)
+            {
+                // Already emitted, only the reference goes out
+                Output.resize(Offset + sizeof(Record));
+                std::memcpy(&Output[Offset], &Record, sizeof(Record));
+
+                m_Stats.m_nDuplicates++;
+                m_Stats.m_DuplicateBytes += Chunk.size();
+                continue;
+            }
+
+            // New chunk: compress it right after its record, keep it raw if zstd can not make it smaller
+            Output.resize(Offset + sizeof(Record) + ZSTD_compressBound(Chunk.size()));
+            const size_t rc = ZSTD_compressCCtx(static_cast<ZSTD_CCtx*>(m_pCCTX), &Output[Offset + sizeof(Record)], ZSTD_compressBound(Chunk.size()), Chunk.data(), Chunk.size(), m_Level);
+            if (ZSTD_isError(rc))
+            {
+                Output.resize(StartSize);
+                PrintError(rc);
+                return xerr::create_f<state, "Compression failed">();
+            }
+
+            if (rc < Chunk.size())
+            {
+                Record.m_PayloadSize = static_cast<std::uint32_t>(rc);
+            }
+            else
+            {
+                Record.m_PayloadSize = Record.m_Size;
+                std::memcpy(&Output[Offset + sizeof(Record)], Chunk.data(), Chunk.size());
+            }
+
+            std::memcpy(&Output[Offset], &Record, sizeof(Record));
+            Output.resize(Offset + sizeof(Record) + Record.m_PayloadSize);
+            m_Known.emplace(Print, Record.m_Size);
+        }
+
+        m_Stats.m_InputBytes  += Source.size();
+        m_Stats.m_OutputBytes += Output.size() - StartSize;
+        return {};
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr dedup_decompress::Unpack(std::vector<std::byte>& Output, chunk_store& Store, const std::span<const std::byte> Source, std::uint32_t MaxChunkSize) noexcept
+    {
+        auto pDCTX = getThreadDCtx();
+        if (!pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+
+        std::size_t Position = 0;
+        while (Position < Source.size())
+        {
+            dedup::record Record;
+            if (Source.size() - Position < sizeof(Record))
+                return xerr::create_f<state, "Corrupted dedup stream">();
+
+            std::memcpy(&Record, &Source[Position], sizeof(Record));
+            Position += sizeof(Record);
+
+            if (Record.m_Size == 0 || Record.m_Size > MaxChunkSize || Record.m_PayloadSize > Record.m_Size || Source.size() - Position < Record.m_PayloadSize)
+                return xerr::create_f<state, "Corrupted dedup stream">();
+
+            const auto Offset = Output.size();
+
+            // Reference to a chunk decoded before
+            if (Record.m_PayloadSize == 0)
+            {
+                const auto Chunk = Store.Find(Record.m_Fingerprint);
+                if (Chunk.size() != Record.m_Size)
+                    return xerr::create_f<state, "Missing chunk in store">();
+
+                Output.insert(Output.end(), Chunk.begin(), Chunk.end());
+                continue;
+            }
+
+            const auto Payload = Source.subspan(Position, Record.m_PayloadSize);
+            Position += Record.m_PayloadSize;
+
+            if (Record.m_PayloadSize == Record.m_Size)
+            {
+                Output.insert(Output.end(), Payload.begin(), Payload.end());
+            }
+            else
+            {
+                Output.resize(Offset + Record.m_Size);
+                const size_t rc = ZSTD_decompressDCtx(pDCTX, &Output[Offset], Record.m_Size, Payload.data(), Payload.size());
+                if (ZSTD_isError(rc) || rc != Record.m_Size)
+                {
+                    Output.resize(Offset);
+                    return DecompressError(rc);
+                }
+            }
+
+            if (auto [It, bNew] = Store.m_Chunks.try_emplace(Record.m_Fingerprint, Output.begin() + Offset, Output.end()); bNew)
+                Store.m_Bytes += Record.m_Size;
+        }
+
+        return {};
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+    // compress_memo
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        struct memo_key
+        {
+            dedup::fingerprint  m_Fingerprint;
+            std::uint64_t       m_SourceSize;
+            std::int32_t        m_Level;
+
+            bool operator == (const memo_key&) const noexcept = default;
+        };
+
+        struct memo_key_hash
+        {
+            std::size_t operator()(const memo_key& Key) const noexcept
+            {
+                return static_cast<std::size_t>(Key.m_Fingerprint.m_A ^ (Key.m_Fingerprint.m_B * 0x9E3779B97F4A7C15ull) ^ static_cast<std::uint64_t>(Key.m_Level));
+            }
+        };
+
+        struct memo_entry
+        {
+            compress_memo::block    m_Block;                // Empty when the source was incompressible
+            std::uint64_t           m_CompressNanoseconds;
+        };
+
+        //---------------------------------------------------------------------------------------------------
+        // Cache directory file: header followed by the frame
+        struct memo_file_header
+        {
+            enum flags : std::uint16_t
+            { FLAGS_STORED = 1 << 0             // Source was incompressible, there is no payload
+            };
+
+            std::uint32_t   m_Magic;
+            std::uint16_t   m_Version;
+            std::uint16_t   m_Flags;
+            std::uint64_t   m_FingerprintA;
+            std::uint64_t   m_FingerprintB;
+            std::uint64_t   m_SourceSize;
+            std::uint64_t   m_CompressNanoseconds;
+            std::uint64_t   m_PayloadSize;
+            std::uint64_t   m_PayloadHash;      // XXH64 of the payload, catches truncated or damaged files
+            std::int32_t    m_Level;
+            std::uint32_t   m_Reserved;
+        };
+        static_assert(sizeof(memo_file_header) == 64);
+
+        constexpr std::uint32_t memo_magic_v   = 0x4D4D4358; // 'XCMM'
+        constexpr std::uint16_t memo_version_v = 1;
+
+        //---------------------------------------------------------------------------------------------------
+        std::filesystem::path MemoFilePath(const std::string& Directory, const memo_key& Key) noexcept
+        {
+            char Name[64];
+            std::snprintf(Name, sizeof(Name), "%016llx%016llx-%llx-%d.xcm"
+                , static_cast<unsigned long long>(Key.m_Fingerprint.m_A)
+                , static_cast<unsigned long long>(Key.m_Fingerprint.m_B)
+                , static_cast<unsigned long long>(Key.m_SourceSize)
+                , static_cast<int>(Key.m_Level));
+            return std::filesystem::path(Directory) / Name;
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        bool ReadMemoFile(memo_entry& Entry, const std::string& Directory, const memo_key& Key) noexcept
+        {
+            std::ifstream File(MemoFilePath(Directory, Key), std::ios::binary);
+            if (!File) return false;
+
+            memo_file_header Header;
+            if (!File.read(reinterpret_cast<char*>(&Header), sizeof(Header))) return false;
+
+            if (Header.m_Magic        != memo_magic_v
+             || Header.m_Version      != memo_version_v
+             || Header.m_FingerprintA != Key.m_Fingerprint.m_A
+             || Header.m_FingerprintB != Key.m_Fingerprint.m_B
+             || Header.m_SourceSize   != Key.m_SourceSize
+             || Header.m_Level        != Key.m_Level
+             || Header.m_PayloadSize  >= Key.m_SourceSize)
+                return false;
+
+            Entry.m_CompressNanoseconds = Header.m_CompressNanoseconds;
+            if (Header.m_Flags & memo_file_header::FLAGS_STORED)
+            {
+                Entry.m_Block = {};
+                return true;
+            }
+
+            auto Data = std::make_shared<std::vector<std::byte>>(static_cast<std::size_t>(Header.m_PayloadSize));
+            if (!File.read(reinterpret_cast<char*>(Data->data()), static_cast<std::streamsize>(Data->size()))) return false;
+            if (XXH64(Data->data(), Data->size(), 0) != Header.m_PayloadHash) return false;
+
+            Entry.m_Block = std::move(Data);
+            return true;
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // Best effort: written to a temporary file and renamed, so readers never see a partial file
+        void WriteMemoFile(const std::string& Directory, const memo_key& Key, const memo_entry& Entry) noexcept
+        {
+            memo_file_header Header = {};
+            Header.m_Magic               = memo_magic_v;
+            Header.m_Version             = memo_version_v;
+            Header.m_Flags               = Entry.m_Block ? 0 : memo_file_header::FLAGS_STORED;
+            Header.m_FingerprintA        = Key.m_Fingerprint.m_A;
+            Header.m_FingerprintB        = Key.m_Fingerprint.m_B;
+            Header.m_SourceSize          = Key.m_SourceSize;
+            Header.m_CompressNanoseconds = Entry.m_CompressNanoseconds;
+            Header.m_PayloadSize         = Entry.m_Block ? Entry.m_Block->size() : 0;
+            Header.m_PayloadHash         = Entry.m_Block ? XXH64(Entry.m_Block->data(), Entry.m_Block->size(), 0) : 0;
+            Header.m_Level               = Key.m_Level;
+
+            const auto Path = MemoFilePath(Directory, Key);
+            auto       Temp = Path;
+            Temp += ".tmp" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+            {
+                std::ofstream File(Temp, std::ios::binary | std::ios::trunc);
+                if (!File) return;
+
+                File.write(reinterpret_cast<const char*>(&Header), sizeof(Header));
+                if (Entry.m_Block) File.write(reinterpret_cast<const char*>(Entry.m_Block->data()), static_cast<std::streamsize>(Entry.m_Block->size()));
+                if (!File) return;
+            }
+
+            std::error_code Error;
+            std::filesystem::rename(Temp, Path, Error);
+            if (Error) std::filesystem::remove(Temp, Error);
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    struct compress_memo::table
+    {
+        struct item
+        {
+            memo_key    m_Key;
+            memo_entry  m_Entry;
+        };
+
+        std::mutex                                                              m_Mutex;
+        std::list<item>                                                         m_LRU;      // Front is the most recently used
+        std::unordered_map<memo_key, std::list<item>::iterator, memo_key_hash>  m_Map;
+        std::uint64_t                                                           m_Bytes = 0;
+    };
+
+    //-------------------------------------------------------------------------------------------------------
+
+    compress_memo::~compress_memo(void) noexcept
+    {
+        delete m_pTable;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compress_memo::Init(std::uint64_t ByteBudget, std::string_view CacheDirectory) noexcept
+    {
+        assert(!m_pTable);
+        assert(ByteBudget > 0);
+
+        if (!CacheDirectory.empty())
+        {
+            std::error_code Error;
+            std::filesystem::create_directories(std::filesystem::path(CacheDirectory), Error);
+            if (Error) return xerr::create_f<state, "Failed to create the cache directory">();
+        }
+
+        m_pTable = new (std::nothrow) table;
+        if (!m_pTable) return xerr::create_f<state, "Failed to allocate the memo table">();
+
+        m_Directory  = CacheDirectory;
+        m_ByteBudget = ByteBudget;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compress_memo::Pack(block& Compressed, const std::span<const std::byte> Source, level CompressionLevel) noexcept
+    {
+        assert(m_pTable);
+        assert(Source.data());
+
+        const memo_key Key = { Fingerprint(Source), Source.size(), ZstdLevel(CompressionLevel) };
+
+        // Publishes an entry in the LRU and returns it to the caller
+        auto Publish = [&](memo_entry&& Entry) noexcept -> xerr
+        {
+            Compressed = Entry.m_Block;
+            const bool bStored = !Entry.m_Block;
+
+            std::lock_guard Lock(m_pTable->m_Mutex);
+            if (m_pTable->m_Map.find(Key) == m_pTable->m_Map.end())
+            {
+                m_pTable->m_Bytes += Entry.m_Block ? Entry.m_Block->size() : 0;
+                m_pTable->m_LRU.push_front({ Key, std::move(Entry) });
+                m_pTable->m_Map.emplace(Key, m_pTable->m_LRU.begin());
+
+                // Always keep the newest entry even if it is bigger than the budget
+                while (m_pTable->m_Bytes > m_ByteBudget && m_pTable->m_LRU.size() > 1)
+                {
+                    auto& Victim = m_pTable->m_LRU.back();
+                    m_pTable->m_Bytes -= Victim.m_Entry.m_Block ? Victim.m_Entry.m_Block->size() : 0;
+                    m_pTable->m_Map.erase(Victim.m_Key);
+                    m_pTable->m_LRU.pop_back();
+                }
+            }
+
+            return bStored ? xerr::create<state::INCOMPRESSIBLE, "Data incompressible">() : xerr{};
+        };
+
+        //
+        // Memory
+        //
+        {
+            std::lock_guard Lock(m_pTable->m_Mutex);
+            if (auto It = m_pTable->m_Map.find(Key); It != m_pTable->m_Map.end())
+            {
+                m_pTable->m_LRU.splice(m_pTable->m_LRU.begin(), m_pTable->m_LRU, It->second);
+
+                const auto& Entry = It->second->m_Entry;
+                Compressed = Entry.m_Block;
+                m_Hits.fetch_add(1, std::memory_order_relaxed);
+                m_SavedNanoseconds.fetch_add(Entry.m_CompressNanoseconds, std::memory_order_relaxed);
+                return Compressed ? xerr{} : xerr::create<state::INCOMPRESSIBLE, "Data incompressible">();
+            }
+        }
+
+        //
+        // Disk
+        //
+        if (!m_Directory.empty())
+        {
+            if (memo_entry Entry; ReadMemoFile(Entry, m_Directory, Key))
+            {
+                m_Hits.fetch_add(1, std::memory_order_relaxed);
+                m_DiskHits.fetch_add(1, std::memory_order_relaxed);
+                m_SavedNanoseconds.fetch_add(Entry.m_CompressNanoseconds, std::memory_order_relaxed);
+                return Publish(std::move(Entry));
+            }
+        }
+
+        //
+        // Compress (outside the lock, two threads missing the same key both compress it)
+        //
+        m_Misses.fetch_add(1, std::memory_order_relaxed);
+
+        const auto  Start = std::chrono::steady_clock::now();
+        memo_entry  Entry = {};
+        {
+            // zstd does not accept target block sizes bigger than its maximum block size
+            fixed_block_compress Compressor;
+            if (auto Err = Compressor.Init(true, std::min<std::uint64_t>(Source.size(), ZSTD_BLOCKSIZE_MAX), Source, CompressionLevel); Err)
+                return Err;
+
+            auto            Data = std::make_shared<std::vector<std::byte>>(Source.size());
+            std::uint64_t   CompressedSize;
+            if (auto Err = Compressor.Pack(CompressedSize, *Data); Err)
+            {
+                if (Err.getState<state>() != state::INCOMPRESSIBLE) return Err;
+            }
+            else
+            {
+                Data->resize(static_cast<std::size_t>(CompressedSize));
+                Entry.m_Block = std::move(Data);
+            }
+        }
+        Entry.m_CompressNanoseconds = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count());
+
+        if (!m_Directory.empty()) WriteMemoFile(m_Directory, Key, Entry);
+
+        return Publish(std::move(Entry));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    compress_memo::stats compress_memo::getStats(void) const noexcept
+    {
+        std::uint64_t Bytes = 0;
+        if (m_pTable)
+        {
+            std::lock_guard Lock(m_pTable->m_Mutex);
+            Bytes = m_pTable->m_Bytes;
+        }
+
+        return
+        { m_Hits.load(std::memory_order_relaxed)
+        , m_DiskHits.load(std::memory_order_relaxed)
+        , m_Misses.load(std::memory_order_relaxed)
+        , m_SavedNanoseconds.load(std::memory_order_relaxed)
+        , Bytes
+        };
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+    // Performance counters
+    //-------------------------------------------------------------------------------------------------------
+
+    double perf_counters::totals::getCyclesPerByte(void) const noexcept
+    {
+        return m_Bytes ? static_cast<double>(m_Sample.m_Counters[static_cast<int>(counter::CYCLES)]) / static_cast<double>(m_Bytes) : 0.0;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    double perf_counters::totals::getIPC(void) const noexcept
+    {
+        const auto Cycles = m_Sample.m_Counters[static_cast<int>(counter::CYCLES)];
+        return Cycles ? static_cast<double>(m_Sample.m_Counters[static_cast<int>(counter::INSTRUCTIONS)]) / static_cast<double>(Cycles) : 0.0;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    perf_counters::~perf_counters(void) noexcept
+    {
+    #if defined(__linux__)
+        for (int& FD : m_FDs)
+        {
+            if (FD >= 0) close(FD);
+            FD = -1;
+        }
+    #endif
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr perf_counters::Init(void) noexcept
+    {
+        assert(m_GroupFD < 0);
+
+    #if defined(__linux__)
+        constexpr std::array<std::uint64_t, static_cast<int>(counter::COUNT)> Configs
+        { PERF_COUNT_HW_CPU_CYCLES
+        , PERF_COUNT_HW_INSTRUCTIONS
+        , PERF_COUNT_HW_CACHE_MISSES
+        , PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        // All counters go in one group so they are scheduled together and read with a single syscall
+        for (int i = 0; i < static_cast<int>(counter::COUNT); ++i)
+        {
+            perf_event_attr Attr;
+            std::memset(&Attr, 0, sizeof(Attr));
+            Attr.type           = PERF_TYPE_HARDWARE;
+            Attr.size           = sizeof(Attr);
+            Attr.config         = Configs[i];
+            Attr.disabled       = m_GroupFD < 0 ? 1 : 0;
+            Attr.exclude_kernel = 1;
+            Attr.exclude_hv     = 1;
+            Attr.read_format    = PERF_FORMAT_GROUP;
+
+            const int FD = static_cast<int>(syscall(__NR_perf_event_open, &Attr, 0, -1, m_GroupFD, 0));
+            if (FD < 0) continue;
+
+            if (m_GroupFD < 0) m_GroupFD = FD;
+            m_FDs[i]   = FD;
+            m_Index[i] = m_nOpen++;
+        }
+
+        if (m_GroupFD >= 0)
+        {
+            ioctl(m_GroupFD, PERF_EVENT_IOC_RESET,  PERF_IOC_FLAG_GROUP);
+            ioctl(m_GroupFD, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    #endif
+
+        Reset();
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void perf_counters::Reset(void) noexcept
+    {
+        for (auto& T : m_Totals) T = {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void perf_counters::Read(sample& Sample) const noexcept
+    {
+        Sample = {};
+
+    #if defined(__linux__)
+        if (m_GroupFD >= 0)
+        {
+            // PERF_FORMAT_GROUP layout: { nr, value[nr] }
+            std::uint64_t Buffer[1 + static_cast<int>(counter::COUNT)] = {};
+            if (read(m_GroupFD, Buffer, sizeof(Buffer)) > 0)
+            {
+                for (int i = 0; i < static_cast<int>(counter::COUNT); ++i)
+                    if (m_Index[i] >= 0 && static_cast<std::uint64_t>(m_Index[i]) < Buffer[0])
+                        Sample.m_Counters[i] = Buffer[1 + m_Index[i]];
+            }
+        }
+    #endif
+
+        Sample.m_Nanoseconds = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void perf_counters::Add(stage Stage, const sample& Start, std::uint64_t Bytes) noexcept
+    {
+        sample End;
+        Read(End);
+
+        auto& T = m_Totals[static_cast<int>(Stage)];
+        for (int i = 0; i < static_cast<int>(counter::COUNT); ++i)
+            T.m_Sample.m_Counters[i] += End.m_Counters[i] - Start.m_Counters[i];
+
+        T.m_Sample.m_Nanoseconds += End.m_Nanoseconds - Start.m_Nanoseconds;
+        T.m_Bytes                += Bytes;
+        T.m_Calls                += 1;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::string perf_counters::getReport(void) const
+    {
+        constexpr std::array<const char*, static_cast<int>(stage::COUNT)> Names{ "INIT", "SEARCH", "COMPRESS", "FLUSH", "DECOMPRESS" };
+
+        std::string Report;
+        char        Line[256];
+
+        const auto Counter = [&](const totals& T, counter C, char(&Buffer)[32], bool bPerByte)
+        {
+            if (isAvailable(C) == false)                 std::snprintf(Buffer, sizeof(Buffer), "n/a");
+            else if (bPerByte)                           std::snprintf(Buffer, sizeof(Buffer), "%.2f", T.getCyclesPerByte());
+            else                                         std::snprintf(Buffer, sizeof(Buffer), "%llu", static_cast<unsigned long long>(T.m_Sample.m_Counters[static_cast<int>(C)]));
+        };
+
+        for (int i = 0; i < static_cast<int>(stage::COUNT); ++i)
+        {
+            const auto& T = m_Totals[i];
+            if (T.m_Calls == 0) continue;
+
+            char CPB[32], IPC[32], CacheMisses[32], BranchMisses[32];
+            Counter(T, counter::CYCLES,        CPB,          true);
+            Counter(T, counter::CACHE_MISSES,  CacheMisses,  false);
+            Counter(T, counter::BRANCH_MISSES, BranchMisses, false);
+
+            if (isAvailable(counter::CYCLES) && isAvailable(counter::INSTRUCTIONS)) std::snprintf(IPC, sizeof(IPC), "%.2f", T.getIPC());
+            else                                                                    std::snprintf(IPC, sizeof(IPC), "n/a");
+
+            std::snprintf(Line, sizeof(Line), "%-10s calls: %8llu bytes: %12llu time: %10.3fms cycles/byte: %8s IPC: %6s cache-misses: %12s branch-misses: %12s\n"
+                , Names[i]
+                , static_cast<unsigned long long>(T.m_Calls)
+                , static_cast<unsigned long long>(T.m_Bytes)
+                , static_cast<double>(T.m_Sample.m_Nanoseconds) / 1e6
+                , CPB, IPC, CacheMisses, BranchMisses);
+
+            Report += Line;
+        }
+
+        return Report;
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-------------------------------------------------------------------------------------------------------
+    // Recompressor
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // Re-encodes the frame at the start of Source. Pace() is called after every step and returns false to stop.
+        // Plain is the (reused) buffer for the decoded blocks, it is grown to ZSTD_BLOCKSIZE_MAX.
+        template< typename T_PACE >
+        xerr RecompressFrame(recompressor::frame& Frame, std::vector<std::byte>& Output, std::vector<std::byte>& Plain, ZSTD_CCtx* pCCTX, ZSTD_DCtx* pDCTX, int cLevel, std::span<const std::byte> Source, T_PACE&& Pace) noexcept
+        {
+            const size_t FrameSize = ZSTD_findFrameCompressedSize(Source.data(), Source.size());
+            if (ZSTD_isError(FrameSize))
+            {
+                PrintError(FrameSize);
+                return xerr::create_f<state, "Invalid frame">();
+            }
+
+            Frame.m_SourceSize = FrameSize;
+            Frame.m_Data       = Source.first(FrameSize);
+            Frame.m_bUpgraded  = false;
+
+            // Skippable frames and frames that need a dictionary are kept as they are
+            ZSTD_frameHeader Header;
+            if (ZSTD_isSkippableFrame(Source.data(), FrameSize)) return {};
+            if (ZSTD_getFrameHeader(&Header, Source.data(), FrameSize) != 0)
+                return xerr::create_f<state, "Invalid frame header">();
+            if (Header.dictID) return {};
+
+            // Keep the window the readers were sized for and the checksum if there was one
+            const int WindowLog = std::clamp(static_cast<int>(Log2IntRoundUp(Header.windowSize)), ZSTD_WINDOWLOG_MIN, ZSTD_WINDOWLOG_MAX);
+
+            ZSTD_DCtx_reset(pDCTX, ZSTD_reset_session_only);
+            ZSTD_CCtx_reset(pCCTX, ZSTD_reset_session_and_parameters);
+            if (   ZSTD_isError(ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_compressionLevel, cLevel))
+                || ZSTD_isError(ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_windowLog, WindowLog))
+                || ZSTD_isError(ZSTD_CCtx_setParameter(pCCTX, ZSTD_c_checksumFlag, Header.checksumFlag ? 1 : 0))
+                || (Header.frameContentSize != ZSTD_CONTENTSIZE_UNKNOWN && ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(pCCTX, Header.frameContentSize))))
+                return xerr::create_f<state, "Error setting recompression parameters">();
+
+            // The new frame must be smaller than the original to replace it, so the output never grows past FrameSize
+            ZSTD_inBuffer   In      = { Source.data(), FrameSize, 0 };
+            ZSTD_outBuffer  Out;
+
+            if (Plain.size() < ZSTD_BLOCKSIZE_MAX) Plain.resize(ZSTD_BLOCKSIZE_MAX);
+            Output.resize(FrameSize);
+            Out = { Output.data(), Output.size(), 0 };
+
+            size_t Remaining = 1;
+            while (Remaining)
+            {
+                ZSTD_outBuffer Decoded = { Plain.data(), Plain.size(), 0 };
+                Remaining = ZSTD_decompressStream(pDCTX, &Decoded, &In);
+                if (ZSTD_isError(Remaining))
+                {
+                    return DecompressError(Remaining);
+                }
+                if (Remaining && In.pos == In.size && Decoded.pos == 0)
+                    return xerr::create_f<state, "Truncated frame">();
+
+                ZSTD_inBuffer       Pending = { Plain.data(), Decoded.pos, 0 };
+                const auto          Mode    = Remaining ? ZSTD_e_continue : ZSTD_e_end;
+                while (true)
+                {
+                    const size_t rc = ZSTD_compressStream2(pCCTX, &Out, &Pending, Mode);
+                    if (ZSTD_isError(rc))
+                    {
+                        PrintError(rc);
+                        return xerr::create_f<state, "Compression failed">();
+                    }
+
+                    // Not smaller than the original, keep it
+                    if (Out.pos == Out.size) return {};
+
+                    if (Mode == ZSTD_e_end ? rc == 0 : Pending.pos == Pending.size) break;
+                }
+
+                if (Pace() == false)
+                    return xerr::create<state::NOT_DONE, "Recompression stopped">();
+            }
+
+            Frame.m_Data      = std::span(Output).first(Out.pos);
+            Frame.m_bUpgraded = true;
+            return {};
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    struct recompressor::worker
+    {
+        struct item
+        {
+            std::span<const std::byte>  m_Blob;
+            callback                    m_Callback;
+        };
+
+        std::mutex                  m_Mutex;
+        std::condition_variable     m_Wake;
+        std::condition_variable     m_Idle;
+        std::deque<item>            m_Items;
+        bool                        m_bBusy         = false;
+        bool                        m_bShutdown     = false;
+        std::jthread                m_Thread;                   // Last, so it is joined before anything else goes away
+    };
+
+    //-------------------------------------------------------------------------------------------------------
+
+    recompressor::~recompressor(void) noexcept
+    {
+        Shutdown();
+        if (m_pCCTX) ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(m_pCCTX));
+        if (m_pDCTX) ZSTD_freeDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr recompressor::Init(level Target, std::uint32_t CPUPercent) noexcept
+    {
+        assert(!m_pWorker);
+
+        // Pace divides by it
+        if (CPUPercent == 0 || CPUPercent > 100)
+            return xerr::create_f<state, "CPUPercent must be between 1 and 100">();
+
+        m_Level      = ZstdLevel(Target);
+        m_CPUPercent = CPUPercent;
+
+        m_pCCTX = ZSTD_createCCtx();
+        if (!m_pCCTX) return xerr::create_f<state, "Error ZSTD_createCCtx">();
+
+        m_pDCTX = ZSTD_createDCtx();
+        if (!m_pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+
+        m_pWorker = new (std::nothrow) worker;
+        if (!m_pWorker) return xerr::create_f<state, "Failed to allocate the recompression worker">();
+
+        m_pWorker->m_Thread = std::jthread([this, &Worker = *m_pWorker]() noexcept
+        {
+            // Background work should never compete with ingest
+        #if defined(_WIN32)
+            SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+        #elif defined(__linux__)
+            setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+        #endif
+
+            job_worker_contexts     Contexts;
+            std::vector<std::byte>  Output;
+            std::vector<std::byte>  Plain;      // Decoded blocks, on the heap to keep the thread stack small
+
+            Contexts.m_pCCTX = ZSTD_createCCtx();
+            Contexts.m_pDCTX = ZSTD_createDCtx();
+
+            // Sleeps long enough after each step for the busy time to be CPUPercent of the total
+            auto Last = std::chrono::steady_clock::now();
+            auto Pace = [&]() noexcept -> bool
+            {
+                const auto Now  = std::chrono::steady_clock::now();
+                const auto Busy = Now - Last;
+                m_BusyNanoseconds.fetch_add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Busy).count()), std::memory_order_relaxed);
+
+                bool bStop;
+                {
+                    std::unique_lock Lock(Worker.m_Mutex);
+                    if (m_CPUPercent < 100) bStop = Worker.m_Wake.wait_for(Lock, Busy * (100 - m_CPUPercent) / m_CPUPercent, [&] { return Worker.m_bShutdown; });
+                    else                    bStop = Worker.m_bShutdown;
+                }
+
+                Last = std::chrono::steady_clock::now();
+                m_ThrottledNanoseconds.fetch_add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Last - Now).count()), std::memory_order_relaxed);
+                return bStop == false;
+            };
+
+            while (true)
+            {
+                worker::item Item;
+                {
+                    std::unique_lock Lock(Worker.m_Mutex);
+                    Worker.m_bBusy = false;
+                    Worker.m_Idle.notify_all();
+                    Worker.m_Wake.wait(Lock, [&] { return Worker.m_Items.size() || Worker.m_bShutdown; });
+                    if (Worker.m_bShutdown) return;
+
+                    Item = std::move(Worker.m_Items.front());
+                    Worker.m_Items.pop_front();
+                    Worker.m_bBusy = true;
+                }
+
+                Last = std::chrono::steady_clock::now();
+                for (std::uint64_t Offset = 0; Offset < Item.m_Blob.size(); )
+                {
+                    frame Frame;
+                    Frame.m_SourceOffset = Offset;
+
+                    if (!Contexts.m_pCCTX || !Contexts.m_pDCTX) Frame.m_Error = xerr::create_f<state, "Failed to create the recompression contexts">();
+                    else                                        Frame.m_Error = RecompressFrame(Frame, Output, Plain, Contexts.m_pCCTX, Contexts.m_pDCTX, m_Level, Item.m_Blob.subspan(Offset), Pace);
+
+                    // Stopped in the middle of the frame: nothing to report, the frame stays as it was
+                    if (Frame.m_Error && Frame.m_Error.getState<state>() == state::NOT_DONE) break;
+
+                    if (Frame.m_Error == false)
+                    {
+                        m_nFrames.fetch_add(1, std::memory_order_relaxed);
+                        m_nUpgraded.fetch_add(Frame.m_bUpgraded ? 1 : 0, std::memory_order_relaxed);
+                        m_InputBytes.fetch_add(Frame.m_SourceSize, std::memory_order_relaxed);
+                        m_OutputBytes.fetch_add(Frame.m_Data.size(), std::memory_order_relaxed);
+                    }
+
+                    Item.m_Callback(Frame);
+                    if (Frame.m_Error) break;
+
+                    Offset += Frame.m_SourceSize;
+                }
+            }
+        });
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr recompressor::Upgrade(std::vector<std::byte>& Output, std::span<const std::byte> Blob) noexcept
+    {
+        assert(m_pCCTX && m_pDCTX);
+
+        std::vector<std::byte> Frame;
+
+        Output.clear();
+        Output.reserve(Blob.size());
+        for (std::uint64_t Offset = 0; Offset < Blob.size(); )
+        {
+            recompressor::frame Result;
+            if (auto Err = RecompressFrame(Result, Frame, m_Plain, static_cast<ZSTD_CCtx*>(m_pCCTX), static_cast<ZSTD_DCtx*>(m_pDCTX), m_Level, Blob.subspan(Offset), []() noexcept { return true; }); Err)
+                return Err;
+
+            Output.insert(Output.end(), Result.m_Data.begin(), Result.m_Data.end());
+            Offset += Result.m_SourceSize;
+
+            m_nFrames.fetch_add(1, std::memory_order_relaxed);
+            m_nUpgraded.fetch_add(Result.m_bUpgraded ? 1 : 0, std::memory_order_relaxed);
+            m_InputBytes.fetch_add(Result.m_SourceSize, std::memory_order_relaxed);
+            m_OutputBytes.fetch_add(Result.m_Data.size(), std::memory_order_relaxed);
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr recompressor::Submit(std::span<const std::byte> Blob, callback&& Callback) noexcept
+    {
+        assert(m_pWorker);
+        assert(Callback);
+
+        {
+            std::lock_guard Lock(m_pWorker->m_Mutex);
+            if (m_pWorker->m_bShutdown)
+                return xerr::create_f<state, "Recompressor is shutting down">();
+
+            m_pWorker->m_Items.push_back({ Blob, std::move(Callback) });
+        }
+        m_pWorker->m_Wake.notify_all();
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void recompressor::Wait(void) noexcept
+    {
+        if (!m_pWorker) return;
+
+        std::unique_lock Lock(m_pWorker->m_Mutex);
+        m_pWorker->m_Idle.wait(Lock, [&] { return (m_pWorker->m_Items.empty() && m_pWorker->m_bBusy == false) || m_pWorker->m_bShutdown; });
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void recompressor::Shutdown(void) noexcept
+    {
+        if (!m_pWorker) return;
+
+        {
+            std::lock_guard Lock(m_pWorker->m_Mutex);
+            m_pWorker->m_bShutdown = true;
+        }
+        m_pWorker->m_Wake.notify_all();
+        m_pWorker->m_Idle.notify_all();
+
+        m_pWorker->m_Thread = {};
+
+        delete m_pWorker;
+        m_pWorker = nullptr;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    recompressor::stats recompressor::getStats(void) const noexcept
+    {
+        return
+        { m_nFrames.load(std::memory_order_relaxed)
+        , m_nUpgraded.load(std::memory_order_relaxed)
+        , m_InputBytes.load(std::memory_order_relaxed)
+        , m_OutputBytes.load(std::memory_order_relaxed)
+        , m_BusyNanoseconds.load(std::memory_order_relaxed)
+        , m_ThrottledNanoseconds.load(std::memory_order_relaxed)
+        };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // Parallel fixed block streaming
+    //-------------------------------------------------------------------------------------------------------
+
+    struct fixed_block_parallel_compress::pool
+    {
+        struct slot
+        {
+            std::vector<std::byte>  m_Data;
+            std::uint64_t           m_Size      = 0;
+            xerr                    m_Error     = {};
+            bool                    m_bDone     = false;
+        };
+
+        struct worker
+        {
+            fixed_block_compress        m_Compressor;
+            std::mutex                  m_Mutex;        // Guards m_Chunks
+            std::deque<std::uint64_t>   m_Chunks;       // Lowest index first
+        };
+
+        // Takes the lowest chunk inside the window: from its own queue first, otherwise from the front of the
+        // worker that is furthest behind. Returns false when nothing can be taken right now.
+        bool Take(std::size_t iSelf, std::uint64_t Limit, std::uint64_t& Chunk, bool& bAllEmpty) noexcept
+        {
+            bAllEmpty = true;
+
+            std::size_t   iBest = m_nWorkers;
+            std::uint64_t Best  = Limit;
+            for (std::size_t n = 0; n < m_nWorkers; ++n)
+            {
+                const std::size_t i = (iSelf + n) % m_nWorkers;
+                std::lock_guard   Lock(m_pWorkers[i].m_Mutex);
+
+                auto& Chunks = m_pWorkers[i].m_Chunks;
+                if (Chunks.empty()) continue;
+                bAllEmpty = false;
+
+                if (Chunks.front() < Best)
+                {
+                    Best  = Chunks.front();
+                    iBest = i;
+                }
+
+                // Our own chunk is always the first choice when it is allowed
+                if (i == iSelf && iBest == iSelf) break;
+            }
+
+            if (iBest == m_nWorkers) return false;
+
+            std::lock_guard Lock(m_pWorkers[iBest].m_Mutex);
+            auto& Chunks = m_pWorkers[iBest].m_Chunks;
+            if (Chunks.empty() || Chunks.front() >= Limit) return false;
+
+            Chunk = Chunks.front();
+            Chunks.pop_front();
+            return true;
+        }
+
+        std::unique_ptr<worker[]>   m_pWorkers;
+        std::size_t                 m_nWorkers      = 0;
+        std::vector<slot>           m_Slots;                    // Chunk i goes to m_Slots[i % m_Slots.size()]
+        std::mutex                  m_Mutex;
+        std::condition_variable     m_Ready;                    // A chunk was compressed
+        std::condition_variable     m_Room;                     // Pack released a slot
+        std::uint64_t               m_Consumed      = 0;        // Chunks returned by Pack
+        bool                        m_bShutdown     = false;
+        std::vector<std::jthread>   m_Threads;                  // Last, so they are joined before anything else goes away
+    };
+
+    //-------------------------------------------------------------------------------------------------------
+
+    fixed_block_parallel_compress::~fixed_block_parallel_compress(void) noexcept
+    {
+        Shutdown();
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr fixed_block_parallel_compress::Init(std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel, std::uint32_t nThreads, std::uint32_t MaxChunksAhead) noexcept
+    {
+        assert(SourceUncompress.data());
+        return Init(BlockSize, std::span(&SourceUncompress, 1), CompressionLevel, nThreads, MaxChunksAhead);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr fixed_block_parallel_compress::Init(std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, level CompressionLevel, std::uint32_t nThreads, std::uint32_t MaxChunksAhead) noexcept
+    {
+        assert(!m_pPool);
+        assert(BlockSize > 0);
+
+        m_SourceSize = 0;
+        for (const auto& Segment : SourceSegments) m_SourceSize += Segment.size();
+
+        m_BlockSize  = BlockSize;
+        m_Position   = 0;
+        m_ChunkIndex = 0;
+        m_nChunks    = (m_SourceSize + BlockSize - 1) / BlockSize;
+
+        if (nThreads == 0)       nThreads       = std::max(1u, std::thread::hardware_concurrency());
+        nThreads = static_cast<std::uint32_t>(std::min<std::uint64_t>(nThreads, std::max<std::uint64_t>(1, m_nChunks)));
+        if (MaxChunksAhead == 0) MaxChunksAhead = nThreads * 4;
+
+        m_pPool = new (std::nothrow) pool;
+        if (!m_pPool) return xerr::create_f<state, "Failed to allocate the compression pool">();
+
+        m_pPool->m_pWorkers.reset(new (std::nothrow) pool::worker[nThreads]);
+        if (!m_pPool->m_pWorkers) return xerr::create_f<state, "Failed to allocate the compression workers">();
+        m_pPool->m_nWorkers = nThreads;
+        m_pPool->m_Slots.resize(MaxChunksAhead);
+
+        // Every worker gets an identical context, that is what makes the output independent of who compresses what
+        for (std::uint32_t i = 0; i < nThreads; ++i)
+        {
+            if (auto Err = m_pPool->m_pWorkers[i].m_Compressor.Init(false, BlockSize, SourceSegments, CompressionLevel); Err)
+                return Err;
+        }
+
+        for (std::uint64_t i = 0; i < m_nChunks; ++i)
+            m_pPool->m_pWorkers[i % nThreads].m_Chunks.push_back(i);
+
+        for (std::uint32_t i = 0; i < nThreads; ++i)
+        {
+            m_pPool->m_Threads.emplace_back([this, &Pool = *m_pPool, iSelf = i]() noexcept
+            {
+                auto& Compressor = Pool.m_pWorkers[iSelf].m_Compressor;
+                while (true)
+                {
+                    std::uint64_t Seen;
+                    {
+                        std::lock_guard Lock(Pool.m_Mutex);
+                        if (Pool.m_bShutdown) return;
+                        Seen = Pool.m_Consumed;
+                    }
+
+                    std::uint64_t Chunk;
+                    bool          bAllEmpty;
+                    if (Pool.Take(iSelf, Seen + Pool.m_Slots.size(), Chunk, bAllEmpty) == false)
+                    {
+                        if (bAllEmpty) return;
+
+                        std::unique_lock Lock(Pool.m_Mutex);
+                        Pool.m_Room.wait(Lock, [&] { return Pool.m_Consumed != Seen || Pool.m_bShutdown; });
+                        continue;
+                    }
+
+                    // The slot is free: its previous chunk was returned before Chunk entered the window
+                    auto&       Slot   = Pool.m_Slots[Chunk % Pool.m_Slots.size()];
+                    const auto  Offset = Chunk * m_BlockSize;
+                    const auto  InSize = std::min(m_BlockSize, m_SourceSize - Offset);
+
+                    // The segment cursor only moves forward, restart it when going back
+                    if (Offset < Compressor.m_Position)
+                    {
+                        Compressor.m_iSegment    = 0;
+                        Compressor.m_SegmentBase = 0;
+                    }
+                    Compressor.m_Position = Offset;
+
+                    Slot.m_Data.resize(static_cast<std::size_t>(InSize));
+                    Slot.m_Error = Compressor.Pack(Slot.m_Size, Slot.m_Data);
+                    if (Slot.m_Error && Slot.m_Error.getState<state>() == state::NOT_DONE) Slot.m_Error = {};
+
+                    {
+                        std::lock_guard Lock(Pool.m_Mutex);
+                        Slot.m_bDone = true;
+                    }
+                    Pool.m_Ready.notify_all();
+                }
+            });
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr fixed_block_parallel_compress::Pack(std::uint64_t& CompressedSize, std::span<std::byte> Destination) noexcept
+    {
+        assert(m_pPool);
+        assert(Destination.data());
+
+        CompressedSize = 0;
+
+        // Everything was returned, same as the final flush of the single thread version
+        if (m_ChunkIndex == m_nChunks) return {};
+
+        const auto InSize = std::min(m_BlockSize, m_SourceSize - m_Position);
+        if (Destination.size() < InSize)
+            return xerr::create_f<state, "Output buffer too small">();
+
+        auto& Slot = m_pPool->m_Slots[m_ChunkIndex % m_pPool->m_Slots.size()];
+        {
+            std::unique_lock Lock(m_pPool->m_Mutex);
+            m_pPool->m_Ready.wait(Lock, [&] { return Slot.m_bDone; });
+        }
+
+        if (Slot.m_Error && Slot.m_Error.getState<state>() != state::INCOMPRESSIBLE)
+            return Slot.m_Error;
+
+        xerr Result = Slot.m_Error ? Slot.m_Error : xerr::create<state::NOT_DONE, "More data to process">();
+
+        CompressedSize = Slot.m_Size;
+        if (Slot.m_Error == false) std::memcpy(Destination.data(), Slot.m_Data.data(), static_cast<std::size_t>(Slot.m_Size));
+
+        m_Position += InSize;
+        m_ChunkIndex++;
+
+        {
+            std::lock_guard Lock(m_pPool->m_Mutex);
+            Slot.m_bDone = false;
+            m_pPool->m_Consumed++;
+        }
+        m_pPool->m_Room.notify_all();
+
+        return Result;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::uint64_t fixed_block_parallel_compress::CopySource(std::span<std::byte> Destination, std::uint64_t Offset) const noexcept
+    {
+        assert(m_pPool);
+        return m_pPool->m_pWorkers[0].m_Compressor.CopySource(Destination, Offset);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void fixed_block_parallel_compress::Shutdown(void) noexcept
+    {
+        if (!m_pPool) return;
+
+        {
+            std::lock_guard Lock(m_pPool->m_Mutex);
+            m_pPool->m_bShutdown = true;
+        }
+        m_pPool->m_Room.notify_all();
+
+        m_pPool->m_Threads.clear();
+
+        delete m_pPool;
+        m_pPool = nullptr;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // Latency bounded streaming
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // Feeds In to the compressor with Mode and writes whatever comes out to the sink. Returns when the input
+        // is consumed and, for flush and end, once zstd has nothing left.
+        xerr LatencyCompress(latency_compress& Stream, ZSTD_inBuffer& In, ZSTD_EndDirective Mode) noexcept
+        {
+            while (true)
+            {
+                ZSTD_outBuffer Out = { Stream.m_Buffer.data(), Stream.m_Buffer.size(), 0 };
+                const size_t   rc  = ZSTD_compressStream2(static_cast<ZSTD_CCtx*>(Stream.m_pCCTX), &Out, &In, Mode);
+                if (ZSTD_isError(rc))
+                {
+                    PrintError(rc);
+                    return xerr::create_f<state, "Compression failed">();
+                }
+
+                if (Out.pos)
+                {
+                    const std::span<const std::byte> Buffer(Stream.m_Buffer.data(), Out.pos);
+                    if (auto Err = Stream.m_pSink->Write(std::span(&Buffer, 1)); Err) return Err;
+                    Stream.m_Stats.m_OutputBytes += Out.pos;
+                }
+
+                if (Mode == ZSTD_e_continue ? In.pos == In.size : rc == 0) return {};
+            }
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        xerr LatencyFlush(latency_compress& Stream, ZSTD_EndDirective Mode, latency_compress::clock::time_point Now, bool bDeadline) noexcept
+        {
+            ZSTD_inBuffer In = { nullptr, 0, 0 };
+            if (auto Err = LatencyCompress(Stream, In, Mode); Err) return Err;
+
+            if (Stream.m_Pending)
+            {
+                auto&       Stats        = Stream.m_Stats;
+                const auto  Microseconds = static_cast<std::uint64_t>(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(Now - Stream.m_Oldest).count()));
+
+                Stats.m_Histogram[std::min<std::uint64_t>(Log2Int(Microseconds), latency_compress::stats::histogram_size_v - 1)]++;
+                Stats.m_nFlushes++;
+                Stats.m_nDeadlineFlushes += bDeadline ? 1 : 0;
+                Stats.m_MaxMicroseconds   = std::max(Stats.m_MaxMicroseconds, Microseconds);
+            }
+
+            Stream.m_Pending = 0;
+            return {};
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::uint64_t latency_compress::stats::getPercentileMicroseconds(double Percentile) const noexcept
+    {
+        if (m_nFlushes == 0) return 0;
+
+        const auto    Target = static_cast<std::uint64_t>(std::ceil(static_cast<double>(m_nFlushes) * std::clamp(Percentile, 0.0, 100.0) / 100.0));
+        std::uint64_t Count  = 0;
+        for (int i = 0; i < histogram_size_v; ++i)
+        {
+            Count += m_Histogram[i];
+            if (Count >= Target && Count) return std::min((std::uint64_t{ 2 } << i) - 1, m_MaxMicroseconds);
+        }
+
+        return m_MaxMicroseconds;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    latency_compress::~latency_compress(void) noexcept
+    {
+        if (m_pCCTX) ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(m_pCCTX));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr latency_compress::Init(output_sink& Sink, clock::duration MaxDelay, std::uint64_t MinFlushSize, level CompressionLevel, std::uint64_t HistorySize) noexcept
+    {
+        assert(!m_pCCTX);
+
+        auto pCCTX = ZSTD_createCCtx();
+        if (!pCCTX) return xerr::create_f<state, "Error ZSTD_createCCtx">();
+
+        // The total size is never known (0), the frame grows for as long as data arrives
+        const int cLevel = ZstdLevel(CompressionLevel);
+        if (auto Err = SetupCompressContext(pCCTX, false, 0, 0, cLevel, nullptr); Err)
+        {
+            ZSTD_freeCCtx(pCCTX);
+            return Err;
+        }
+
+        if (HistorySize)
+        {
+            if (auto Err = LimitHistoryWindow(pCCTX, HistorySize, 0, cLevel, nullptr); Err)
+            {
+                ZSTD_freeCCtx(pCCTX);
+                return Err;
+            }
+        }
+
+        m_pCCTX        = pCCTX;
+        m_pSink        = &Sink;
+        m_Buffer.resize(ZSTD_CStreamOutSize());
+        m_MaxDelay     = MaxDelay;
+        m_MinFlushSize = MinFlushSize;
+        m_Pending      = 0;
+        m_Stats        = {};
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr latency_compress::Write(std::span<const std::byte> Data, clock::time_point Now) noexcept
+    {
+        assert(m_pCCTX);
+
+        if (Data.empty()) return Poll(Now);
+
+        if (m_Pending == 0) m_Oldest = Now;
+        m_Pending              += Data.size();
+        m_Stats.m_InputBytes   += Data.size();
+
+        ZSTD_inBuffer In = { Data.data(), Data.size(), 0 };
+        if (auto Err = LatencyCompress(*this, In, ZSTD_e_continue); Err) return Err;
+
+        if (m_MinFlushSize && m_Pending >= m_MinFlushSize)
+            return LatencyFlush(*this, ZSTD_e_flush, Now, false);
+
+        return Poll(Now);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr latency_compress::Poll(clock::time_point Now) noexcept
+    {
+        assert(m_pCCTX);
+
+        if (m_Pending && Now >= getDeadline())
+            return LatencyFlush(*this, ZSTD_e_flush, Now, true);
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    latency_compress::clock::time_point latency_compress::getDeadline(void) const noexcept
+    {
+        return m_Pending ? m_Oldest + m_MaxDelay : clock::time_point::max();
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr latency_compress::Close(clock::time_point Now) noexcept
+    {
+        assert(m_pCCTX);
+        return LatencyFlush(*this, ZSTD_e_end, Now, false);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // Ring buffer front end
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // Every record in the ring starts with this header, storing m_State (with std::atomic_ref) publishes it
+        struct ring_record
+        {
+            enum : std::uint32_t
+            { STATE_FREE
+            , STATE_COMMITTED
+            , STATE_PADDING                         // Rest of the ring before wrapping around
+            };
+
+            std::uint32_t   m_Stride;               // Bytes to the next record, header included
+            std::uint32_t   m_Size;                 // Committed payload bytes
+            std::uint32_t   m_State;
+            std::uint32_t   m_Pad;
+        };
+        static_assert(sizeof(ring_record) == 16);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    struct ring_compress::consumer
+    {
+        fixed_block_compress                        m_Compressor;
+        callback                                    m_Callback;
+        std::uint64_t                               m_BlockSize     = 0;
+        std::vector<std::span<const std::byte>>     m_Segments;                 // Payloads of the chunk being built, inside the ring
+        std::vector<std::byte>                      m_Output;
+        std::atomic<bool>                           m_bStop         = false;
+        std::atomic<std::uint64_t>                  m_nChunks       = 0;
+        std::atomic<std::uint64_t>                  m_nStored       = 0;
+        std::atomic<std::uint64_t>                  m_InputBytes    = 0;
+        std::atomic<std::uint64_t>                  m_OutputBytes   = 0;
+        std::jthread                                m_Thread;                   // Last, so it is joined before anything else goes away
+    };
+
+    //-------------------------------------------------------------------------------------------------------
+
+    ring_compress::~ring_compress(void) noexcept
+    {
+        Shutdown();
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr ring_compress::Init(std::uint64_t Capacity, std::uint64_t BlockSize, callback&& Callback, producers Producers, level CompressionLevel) noexcept
+    {
+        assert(!m_pBuffer);
+        assert(BlockSize > 0);
+        assert(Callback);
+
+        // Strides are 32 bits
+        if (Capacity < 2 * sizeof(ring_record) || Capacity > (std::uint64_t{ 1 } << 31))
+            return xerr::create_f<state, "Ring capacity out of range">();
+
+        m_Capacity = std::uint64_t{ 1 } << Log2IntRoundUp(Capacity);
+        m_bMultipleProducers = Producers == producers::MULTIPLE;
+
+        m_pBuffer = new (std::nothrow) std::byte[m_Capacity]();
+        if (!m_pBuffer) return xerr::create_f<state, "Failed to allocate the ring">();
+
+        m_pConsumer = new (std::nothrow) consumer;
+        if (!m_pConsumer) return xerr::create_f<state, "Failed to allocate the ring consumer">();
+
+        auto& C = *m_pConsumer;
+        C.m_Callback  = std::move(Callback);
+        C.m_BlockSize = BlockSize;
+        C.m_Output.resize(BlockSize);
+
+        // The source is set for each chunk
+        if (auto Err = C.m_Compressor.Init(false, BlockSize, std::span<const std::span<const std::byte>>{}, CompressionLevel); Err)
+            return Err;
+
+        C.m_Thread = std::jthread([this, &C]() noexcept
+        {
+            const std::uint64_t Mask         = m_Capacity - 1;
+            std::uint64_t       Tail         = 0;       // Everything before is free
+            std::uint64_t       Cursor       = 0;       // Next record to look at
+            std::uint64_t       RecordOffset = 0;       // Payload of the record at Cursor that is already in the chunk
+            std::uint64_t       ChunkSize    = 0;
+            std::uint64_t       SourceOffset = 0;
+            int                 nIdle        = 0;
+
+            // Hands the chunk to the callback and frees the records it finished
+            auto Emit = [&]() noexcept
+            {
+                if (ChunkSize)
+                {
+                    stream_chunk  Chunk = { {}, SourceOffset, ChunkSize, false };
+                    std::uint64_t Size;
+
+                    SetSource(C.m_Compressor, C.m_Segments);
+                    C.m_Compressor.m_Position = 0;
+
+                    auto Err = C.m_Compressor.Pack(Size, C.m_Output);
+                    if (Err && Err.getState<state>() != state::NOT_DONE)
+                    {
+                        // Incompressible (or a failure): the chunk goes out as it is
+                        Chunk.m_Data    = std::span(C.m_Output).first(static_cast<std::size_t>(C.m_Compressor.CopySource(C.m_Output, 0)));
+                        Chunk.m_bStored = true;
+                        C.m_nStored.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    else Chunk.m_Data = std::span(C.m_Output).first(static_cast<std::size_t>(Size));
+
+                    C.m_Callback(Chunk);
+
+                    C.m_nChunks.fetch_add(1, std::memory_order_relaxed);
+                    C.m_InputBytes.fetch_add(ChunkSize, std::memory_order_relaxed);
+                    C.m_OutputBytes.fetch_add(Chunk.m_Data.size(), std::memory_order_relaxed);
+
+                    SourceOffset += ChunkSize;
+                    ChunkSize     = 0;
+                    C.m_Segments.clear();
+                }
+
+                // Freed space goes back to zero, so old payload bytes never look like a committed header
+                if (Cursor != Tail)
+                {
+                    const auto Begin = Tail & Mask;
+                    const auto Size  = Cursor - Tail;
+                    const auto First = std::min(Size, m_Capacity - Begin);
+                    std::memset(m_pBuffer + Begin, 0, static_cast<std::size_t>(First));
+                    std::memset(m_pBuffer, 0, static_cast<std::size_t>(Size - First));
+
+                    Tail = Cursor;
+                    m_Tail.m_Value.store(Tail, std::memory_order_release);
+                }
+            };
+
+            while (true)
+            {
+                // Read the requests first: whatever was committed before them is visible to the scan below
+                const auto FlushRequest = m_FlushRequest.m_Value.load(std::memory_order_acquire);
+                const bool bStop        = C.m_bStop.load(std::memory_order_acquire);
+
+                // Collect committed records, without holding more than half the ring so producers always have room
+                bool bProgress = false;
+                while (ChunkSize < C.m_BlockSize && Cursor - Tail < m_Capacity / 2)
+                {
+                    auto&      Record = *reinterpret_cast<ring_record*>(m_pBuffer + (Cursor & Mask));
+                    const auto State  = std::atomic_ref(Record.m_State).load(std::memory_order_acquire);
+                    if (State == ring_record::STATE_FREE) break;
+
+                    bProgress = true;
+                    if (State == ring_record::STATE_PADDING)
+                    {
+                        Cursor += Record.m_Stride;
+                        continue;
+                    }
+
+                    const auto Take = std::min<std::uint64_t>(Record.m_Size - RecordOffset, C.m_BlockSize - ChunkSize);
+                    if (Take) C.m_Segments.emplace_back(reinterpret_cast<const std::byte*>(&Record + 1) + RecordOffset, static_cast<std::size_t>(Take));
+
+                    ChunkSize    += Take;
+                    RecordOffset += Take;
+                    if (RecordOffset == Record.m_Size)
+                    {
+                        Cursor      += Record.m_Stride;
+                        RecordOffset = 0;
+                    }
+                }
+
+                if (ChunkSize == C.m_BlockSize || Cursor - Tail >= m_Capacity / 2)
+                {
+                    Emit();
+                    nIdle = 0;
+                    continue;
+                }
+
+                // Everything committed is in hand
+                if (FlushRequest != m_FlushDone.m_Value.load(std::memory_order_relaxed) || bStop)
+                {
+                    Emit();
+                    m_FlushDone.m_Value.store(FlushRequest, std::memory_order_release);
+                    if (bStop) return;
+                    continue;
+                }
+
+                // Producers never wake us up, back off while the ring is quiet
+                if (bProgress)          nIdle = 0;
+                else if (++nIdle < 64)  std::this_thread::yield();
+                else                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        });
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::size_t ring_compress::getMaxRecordSize(void) const noexcept
+    {
+        // A record must fit even after the padding of a wrap around
+        return static_cast<std::size_t>(m_Capacity / 2 - sizeof(ring_record));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::span<std::byte> ring_compress::Reserve(std::size_t Size) noexcept
+    {
+        assert(m_pBuffer);
+
+        if (Size > getMaxRecordSize()) return {};
+
+        const std::uint64_t Stride = sizeof(ring_record) + ((Size + sizeof(ring_record) - 1) & ~std::uint64_t{ sizeof(ring_record) - 1 });
+
+        std::uint64_t Head = m_Head.m_Value.load(std::memory_order_relaxed);
+        std::uint64_t Offset;
+        std::uint64_t Room;
+        while (true)
+        {
+            Offset = Head & (m_Capacity - 1);
+            Room   = m_Capacity - Offset;
+
+            const std::uint64_t Total = Stride <= Room ? Stride : Room + Stride;
+            if (Head + Total - m_Tail.m_Value.load(std::memory_order_acquire) > m_Capacity)
+            {
+                m_nFull.m_Value.fetch_add(1, std::memory_order_relaxed);
+                return {};
+            }
+
+            if (m_bMultipleProducers == false)
+            {
+                m_Head.m_Value.store(Head + Total, std::memory_order_relaxed);
+                break;
+            }
+
+            if (m_Head.m_Value.compare_exchange_weak(Head, Head + Total, std::memory_order_relaxed))
+                break;
+        }
+
+        if (Stride > Room)
+        {
+            auto& Padding = *reinterpret_cast<ring_record*>(m_pBuffer + Offset);
+            Padding.m_Stride = static_cast<std::uint32_t>(Room);
+            std::atomic_ref(Padding.m_State).store(ring_record::STATE_PADDING, std::memory_order_release);
+            Offset = 0;
+        }
+
+        auto& Record = *reinterpret_cast<ring_record*>(m_pBuffer + Offset);
+        Record.m_Stride = static_cast<std::uint32_t>(Stride);
+        return { reinterpret_cast<std::byte*>(&Record + 1), Size };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void ring_compress::Commit(std::span<std::byte> Reservation, std::size_t Size) noexcept
+    {
+        assert(Reservation.data());
+        assert(Size <= Reservation.size());
+
+        auto& Record = reinterpret_cast<ring_record*>(Reservation.data())[-1];
+        Record.m_Size = static_cast<std::uint32_t>(Size);
+        std::atomic_ref(Record.m_State).store(ring_record::STATE_COMMITTED, std::memory_order_release);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr ring_compress::Write(std::span<const std::byte> Data) noexcept
+    {
+        if (Data.size() > getMaxRecordSize())
+            return xerr::create_f<state, "Record bigger than the ring allows">();
+
+        auto Reservation = Reserve(Data.size());
+        if (!Reservation.data()) return xerr::create<state::NOT_DONE, "Ring is full">();
+
+        if (Data.size()) std::memcpy(Reservation.data(), Data.data(), Data.size());
+        Commit(Reservation);
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void ring_compress::Flush(void) noexcept
+    {
+        assert(m_pConsumer);
+
+        const auto Ticket = m_FlushRequest.m_Value.fetch_add(1, std::memory_order_acq_rel) + 1;
+        while (m_FlushDone.m_Value.load(std::memory_order_acquire) < Ticket)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void ring_compress::Shutdown(void) noexcept
+    {
+        if (m_pConsumer)
+        {
+            m_pConsumer->m_bStop.store(true, std::memory_order_release);
+            m_pConsumer->m_Thread = {};
+
+            delete m_pConsumer;
+            m_pConsumer = nullptr;
+        }
+
+        delete[] m_pBuffer;
+        m_pBuffer = nullptr;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    ring_compress::stats ring_compress::getStats(void) const noexcept
+    {
+        if (!m_pConsumer) return { 0, 0, 0, 0, m_nFull.m_Value.load(std::memory_order_relaxed) };
+
+        return
+        { m_pConsumer->m_nChunks.load(std::memory_order_relaxed)
+        , m_pConsumer->m_nStored.load(std::memory_order_relaxed)
+        , m_pConsumer->m_InputBytes.load(std::memory_order_relaxed)
+        , m_pConsumer->m_OutputBytes.load(std::memory_order_relaxed)
+        , m_nFull.m_Value.load(std::memory_order_relaxed)
+        };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // compressed_log
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        //---------------------------------------------------------------------------------------------------
+        // Compresses Data (which starts at m_TailOffset) into a new frame at the end of the log.
+        // The content size goes in the frame header, that is what lets Load rebuild the offsets.
+        xerr AppendLogFrame(compressed_log& Log, std::span<const std::byte> Data) noexcept
+        {
+            const size_t rc = ZSTD_compress2(static_cast<ZSTD_CCtx*>(Log.m_pCCTX), Log.m_Scratch.data(), Log.m_Scratch.size(), Data.data(), Data.size());
+            if (ZSTD_isError(rc))
+            {
+                PrintError(rc);
+                return xerr::create_f<state, "Compression failed">();
+            }
+
+            // Exact size copy, the log keeps its frames for a long time
+            Log.m_Frames.push_back({ Log.m_TailOffset, Data.size(), { Log.m_Scratch.begin(), Log.m_Scratch.begin() + rc } });
+            Log.m_TailOffset     += Data.size();
+            Log.m_CompressedSize += rc;
+            return {};
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    compressed_log::~compressed_log(void) noexcept
+    {
+        if (m_pCCTX) ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(m_pCCTX));
+        if (m_pDCTX) ZSTD_freeDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compressed_log::Init(std::uint64_t FrameSize, level CompressionLevel) noexcept
+    {
+        assert(!m_pCCTX);
+        assert(FrameSize > 0);
+
+        auto pCCTX = ZSTD_createCCtx();
+        if (!pCCTX) return xerr::create_f<state, "Failed to create compression context">();
+
+        if (auto Err = SetupCompressContext(pCCTX, false, FrameSize, FrameSize, ZstdLevel(CompressionLevel), nullptr); Err)
+        {
+            ZSTD_freeCCtx(pCCTX);
+            return Err;
+        }
+
+        m_pCCTX          = pCCTX;
+        m_FrameSize      = FrameSize;
+        m_TailOffset     = 0;
+        m_CompressedSize = 0;
+        m_Frames.clear();
+        m_Tail.clear();
+        m_Tail.reserve(FrameSize);
+        m_Scratch.resize(ZSTD_compressBound(FrameSize));
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compressed_log::Load(std::span<const std::byte> Frames, std::uint64_t BaseOffset, std::uint64_t MaxFrameSize) noexcept
+    {
+        assert(m_pCCTX);
+        assert(m_Frames.empty() && m_Tail.empty());
+
+        if (MaxFrameSize == 0) MaxFrameSize = m_FrameSize;
+
+        m_TailOffset = BaseOffset;
+        while (Frames.size())
+        {
+            const size_t FrameSize = ZSTD_findFrameCompressedSize(Frames.data(), Frames.size());
+            if (ZSTD_isError(FrameSize))
+            {
+                PrintError(FrameSize);
+                return xerr::create_f<state, "Invalid frame in the log">();
+            }
+
+            if (ZSTD_isSkippableFrame(Frames.data(), Frames.size()) == 0)
+            {
+                const auto ContentSize = ZSTD_getFrameContentSize(Frames.data(), Frames.size());
+                if (ContentSize == ZSTD_CONTENTSIZE_UNKNOWN || ContentSize == ZSTD_CONTENTSIZE_ERROR)
+                    return xerr::create_f<state, "Frame without content size in the log">();
+
+                if (ContentSize > MaxFrameSize)
+                    return xerr::create_f<state, "Frame bigger than the maximum frame size in the log">();
+
+                m_Frames.push_back({ m_TailOffset, ContentSize, { Frames.begin(), Frames.begin() + FrameSize } });
+                m_TailOffset     += ContentSize;
+                m_CompressedSize += FrameSize;
+            }
+
+            Frames = Frames.subspan(FrameSize);
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compressed_log::Append(std::span<const std::byte> Data) noexcept
+    {
+        assert(m_pCCTX);
+
+        while (Data.size())
+        {
+            // Whole frames skip the tail
+            if (m_Tail.empty() && Data.size() >= m_FrameSize)
+            {
+                if (auto Err = AppendLogFrame(*this, Data.first(m_FrameSize)); Err)
+                    return Err;
+
+                Data = Data.subspan(m_FrameSize);
+                continue;
+            }
+
+            const auto Size = std::min<std::uint64_t>(m_FrameSize - std::min(m_FrameSize, m_Tail.size()), Data.size());
+            m_Tail.insert(m_Tail.end(), Data.begin(), Data.begin() + Size);
+            Data = Data.subspan(Size);
+
+            // A tail taken from another log may already be larger than FrameSize
+            if (m_Tail.size() >= m_FrameSize)
+            {
+                if (auto Err = Flush(); Err)
+                    return Err;
+            }
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compressed_log::Flush(void) noexcept
+    {
+        assert(m_pCCTX);
+
+        if (m_Tail.empty()) return {};
+
+        if (m_Scratch.size() < ZSTD_compressBound(m_Tail.size()))
+            m_Scratch.resize(ZSTD_compressBound(m_Tail.size()));
+
+        if (auto Err = AppendLogFrame(*this, m_Tail); Err)
+            return Err;
+
+        m_Tail.clear();
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void compressed_log::TruncateFront(std::uint64_t Offset) noexcept
+    {
+        while (m_Frames.size() && m_Frames.front().m_Offset + m_Frames.front().m_Size <= Offset)
+        {
+            m_CompressedSize -= m_Frames.front().m_Data.size();
+            m_Frames.pop_front();
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compressed_log::Concatenate(compressed_log& Other) noexcept
+    {
+        assert(&Other != this);
+
+        if (auto Err = Flush(); Err)
+            return Err;
+
+        // Only the offsets change, the frames themselves are moved as they are
+        const std::uint64_t End = getEnd();
+        const std::uint64_t Begin = Other.getBegin();
+        for (auto& Frame : Other.m_Frames)
+        {
+            m_Frames.push_back({ Frame.m_Offset - Begin + End, Frame.m_Size, std::move(Frame.m_Data) });
+        }
+
+        m_TailOffset      = Other.m_TailOffset - Begin + End;
+        m_Tail            = std::move(Other.m_Tail);
+        m_CompressedSize += Other.m_CompressedSize;
+
+        Other.m_Frames.clear();
+        Other.m_Tail.clear();
+        Other.m_TailOffset     = 0;
+        Other.m_CompressedSize = 0;
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compressed_log::Read(std::span<std::byte> Destination, std::uint64_t Offset) noexcept
+    {
+        if (Offset < getBegin() || Offset + Destination.size() > getEnd())
+            return xerr::create_f<state, "Range outside of the log">();
+
+        if (Destination.empty()) return {};
+
+        if (!m_pDCTX)
+        {
+            m_pDCTX = ZSTD_createDCtx();
+            if (!m_pDCTX) return xerr::create_f<state, "Failed to create decompression context">();
+        }
+
+        // Last frame that starts at or before Offset
+        auto It = std::upper_bound(m_Frames.begin(), m_Frames.end(), Offset, [](std::uint64_t O, const frame& F) { return O < F.m_Offset; });
+        if (It != m_Frames.begin()) --It;
+
+        for (; Destination.size() && It != m_Frames.end() && Offset < It->m_Offset + It->m_Size; ++It)
+        {
+            const auto Skip = Offset - It->m_Offset;
+            const auto Size = std::min<std::uint64_t>(It->m_Size - Skip, Destination.size());
+
+            // Frames read whole go straight to the destination
+            std::span<std::byte> Out = Destination.first(static_cast<std::size_t>(Size));
+            if (Size != It->m_Size)
+            {
+                if (m_Scratch.size() < It->m_Size) m_Scratch.resize(static_cast<std::size_t>(It->m_Size));
+                Out = std::span(m_Scratch).first(static_cast<std::size_t>(It->m_Size));
+            }
+
+            const size_t rc = ZSTD_decompressDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX), Out.data(), Out.size(), It->m_Data.data(), It->m_Data.size());
+            if (ZSTD_isError(rc))
+            {
+                return DecompressError(rc);
+            }
+
+            if (rc != It->m_Size)
+                return xerr::create_f<state, "Frame size does not match the log">();
+
+            if (Size != It->m_Size)
+                std::memcpy(Destination.data(), &Out[static_cast<std::size_t>(Skip)], static_cast<std::size_t>(Size));
+
+            Destination = Destination.subspan(static_cast<std::size_t>(Size));
+            Offset     += Size;
+        }
+
+        // What is left is in the tail
+        if (Destination.size())
+        {
+            assert(Offset >= m_TailOffset);
+            std::memcpy(Destination.data(), &m_Tail[static_cast<std::size_t>(Offset - m_TailOffset)], Destination.size());
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr compressed_log::Write(output_sink& Sink) const noexcept
+    {
+        std::vector<std::span<const std::byte>> Buffers;
+        Buffers.reserve(m_Frames.size());
+        for (const auto& Frame : m_Frames) Buffers.emplace_back(Frame.m_Data);
+
+        if (Buffers.empty()) return {};
+        return Sink.Write(Buffers);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // autotuner
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        using tune_clock = std::chrono::steady_clock;
+
+        struct tune_chunk
+        {
+            std::vector<std::byte>  m_Data;
+            bool                    m_bStored;
+        };
+
+        //---------------------------------------------------------------------------------------------------
+        // Packs File the way a user of T_COMPRESS would, Seconds only counts the Pack calls
+        template< typename T_COMPRESS >
+        xerr TuneCompress(std::vector<tune_chunk>& Chunks, double& Seconds, const autotuner::config& Config, std::span<const std::byte> File, std::vector<std::byte>& Buffer) noexcept
+        {
+            T_COMPRESS Compressor;
+            if (auto Err = Config.Init(Compressor, File); Err)
+                return Err;
+
+            Buffer.resize(ZSTD_compressBound(Config.m_bBlockSizeIsOutputSize ? File.size() : Config.m_BlockSize * 4));
+            Chunks.clear();
+            Seconds = 0;
+
+            while (true)
+            {
+                const auto      Position = Compressor.m_Position;
+                std::uint64_t   Size;
+
+                const auto Start = tune_clock::now();
+                xerr       Err   = Compressor.Pack(Size, Buffer);
+                Seconds += std::chrono::duration<double>(tune_clock::now() - Start).count();
+
+                // Block mode frames that did not finish in one call are kept as they are too
+                const bool bStored = Err && (Err.getState<state>() == state::INCOMPRESSIBLE || Config.m_bBlockSizeIsOutputSize);
+                if (bStored)
+                {
+                    const auto End = Config.m_bBlockSizeIsOutputSize ? File.size() : Compressor.m_Position;
+                    Chunks.push_back({ { File.begin() + Position, File.begin() + End }, true });
+                    if (Config.m_bBlockSizeIsOutputSize) break;
+                    continue;
+                }
+
+                if (Err && Err.getState<state>() != state::NOT_DONE)
+                    return Err;
+
+                if (Size) Chunks.push_back({ { Buffer.begin(), Buffer.begin() + Size }, false });
+                if (!Err) break;
+            }
+
+            return {};
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // Decodes the chunks of TuneCompress, Seconds only counts the Unpack calls (and the copies of stored chunks)
+        template< typename T_DECOMPRESS >
+        xerr TuneDecompress(std::vector<std::byte>& Output, double& Seconds, const autotuner::config& Config, const std::vector<tune_chunk>& Chunks, std::uint64_t FileSize, std::vector<std::byte>& Buffer) noexcept
+        {
+            T_DECOMPRESS Decompressor;
+            if (auto Err = Config.Init(Decompressor, FileSize); Err)
+                return Err;
+
+            // Fixed decompressors want exactly BlockSize, dynamic streaming chunks can hold up to 4 times BlockSize
+            if (Config.m_bBlockSizeIsOutputSize)               Buffer.resize(static_cast<std::size_t>(FileSize));
+            else if (Config.m_Family == autotuner::family::FIXED) Buffer.resize(static_cast<std::size_t>(Config.m_BlockSize));
+            else                                                Buffer.resize(static_cast<std::size_t>(Config.m_BlockSize * 4));
+
+            Output.clear();
+            Seconds = 0;
+
+            for (const auto& Chunk : Chunks)
+            {
+                const auto Start = tune_clock::now();
+                if (Chunk.m_bStored)
+                {
+                    Output.insert(Output.end(), Chunk.m_Data.begin(), Chunk.m_Data.end());
+                }
+                else while (true)
+                {
+                    std::uint32_t Size;
+                    xerr Err = Decompressor.Unpack(Size, Buffer, Chunk.m_Data);
+                    if (Err && Err.getState<state>() != state::NOT_DONE)
+                        return Err;
+
+                    Output.insert(Output.end(), Buffer.begin(), Buffer.begin() + Size);
+                    if (!Err || Config.m_bBlockSizeIsOutputSize) break;
+                }
+                Seconds += std::chrono::duration<double>(tune_clock::now() - Start).count();
+            }
+
+            return {};
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // Round trips every file with Config, keeping the fastest of nRepeats runs
+        template< typename T_COMPRESS, typename T_DECOMPRESS >
+        xerr TuneMeasure(autotuner::result& Result, std::span<const std::span<const std::byte>> Files, std::uint32_t nRepeats) noexcept
+        {
+            std::vector<tune_chunk> Chunks;
+            std::vector<std::byte>  Buffer;
+            std::vector<std::byte>  Output;
+            std::uint64_t           InputBytes      = 0;
+            std::uint64_t           OutputBytes     = 0;
+            double                  CompressTime    = 0;
+            double                  DecompressTime  = 0;
+
+            for (const auto& File : Files)
+            {
+                double BestCompress   = 0;
+                double BestDecompress = 0;
+                for (std::uint32_t i = 0; i < std::max(nRepeats, 1u); ++i)
+                {
+                    double Compress, Decompress;
+                    if (auto Err = TuneCompress<T_COMPRESS>(Chunks, Compress, Result.m_Config, File, Buffer); Err)
+                        return Err;
+
+                    if (auto Err = TuneDecompress<T_DECOMPRESS>(Output, Decompress, Result.m_Config, Chunks, File.size(), Buffer); Err)
+                        return Err;
+
+                    if (Output.size() != File.size() || false == std::equal(Output.begin(), Output.end(), File.begin()))
+                        return xerr::create_f<state, "Tuning round trip does not match the corpus">();
+
+                    BestCompress   = i ? std::min(BestCompress, Compress)     : Compress;
+                    BestDecompress = i ? std::min(BestDecompress, Decompress) : Decompress;
+                }
+
+                InputBytes     += File.size();
+                CompressTime   += BestCompress;
+                DecompressTime += BestDecompress;
+                for (const auto& Chunk : Chunks) OutputBytes += Chunk.m_Data.size();
+            }
+
+            constexpr double MinTime = 1e-9;
+            Result.m_Ratio         = static_cast<double>(InputBytes) / static_cast<double>(std::max<std::uint64_t>(OutputBytes, 1));
+            Result.m_CompressMBs   = static_cast<double>(InputBytes) / std::max(CompressTime, MinTime) / 1e6;
+            Result.m_DecompressMBs = static_cast<double>(InputBytes) / std::max(DecompressTime, MinTime) / 1e6;
+            return {};
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        xerr TuneMeasure(autotuner::result& Result, std::span<const std::span<const std::byte>> Files, std::uint32_t nRepeats) noexcept
+        {
+            return Result.m_Config.m_Family == autotuner::family::FIXED
+                ? TuneMeasure<fixed_block_compress, fixed_block_decompress>(Result, Files, nRepeats)
+                : TuneMeasure<dynamic_block_compress, dynamic_block_decompress>(Result, Files, nRepeats);
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        // A is better than B by Margin at everything (with no margin, also strictly better at something)
+        bool TuneDominates(const autotuner::result& A, const autotuner::result& B, double Margin) noexcept
+        {
+            const double F = 1 + Margin;
+            if (A.m_Ratio < B.m_Ratio * F || A.m_CompressMBs < B.m_CompressMBs * F || A.m_DecompressMBs < B.m_DecompressMBs * F)
+                return false;
+
+            return Margin > 0 || A.m_Ratio > B.m_Ratio || A.m_CompressMBs > B.m_CompressMBs || A.m_DecompressMBs > B.m_DecompressMBs;
+        }
+
+        constexpr std::array<std::string_view, 2> tune_family_names_v   = { "fixed", "dynamic" };
+        constexpr std::array<std::string_view, 2> tune_mode_names_v     = { "streaming", "block" };
+        constexpr std::array<std::string_view, 3> tune_level_names_v    = { "fast", "medium", "high" };
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr autotuner::config::Init(fixed_block_compress& Compressor, std::span<const std::byte> Source) const noexcept
+    {
+        return Compressor.Init(m_bBlockSizeIsOutputSize, m_BlockSize, Source, m_Level);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr autotuner::config::Init(dynamic_block_compress& Compressor, std::span<const std::byte> Source) const noexcept
+    {
+        return Compressor.Init(m_bBlockSizeIsOutputSize, m_BlockSize, Source, static_cast<dynamic_block_compress::level>(m_Level));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr autotuner::config::Init(fixed_block_decompress& Decompressor, std::uint64_t SourceSize) const noexcept
+    {
+        return Decompressor.Init(m_bBlockSizeIsOutputSize, m_bBlockSizeIsOutputSize ? SourceSize : m_BlockSize);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr autotuner::config::Init(dynamic_block_decompress& Decompressor, std::uint64_t SourceSize) const noexcept
+    {
+        return Decompressor.Init(m_bBlockSizeIsOutputSize, m_bBlockSizeIsOutputSize ? SourceSize : m_BlockSize);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::string autotuner::config::toString(void) const noexcept
+    {
+        std::string Text;
+        Text += tune_family_names_v[static_cast<std::size_t>(m_Family)];
+        Text += ' ';
+        Text += tune_mode_names_v[m_bBlockSizeIsOutputSize];
+        Text += ' ';
+        Text += tune_level_names_v[static_cast<std::size_t>(m_Level)];
+        Text += ' ';
+        Text += std::to_string(m_BlockSize);
+        return Text;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr autotuner::config::fromString(std::string_view Text) noexcept
+    {
+        // Next word of Text, words are separated by spaces
+        auto Next = [&]() noexcept
+        {
+            while (Text.size() && Text.front() == ' ') Text.remove_prefix(1);
+            const auto Word = Text.substr(0, Text.find(' '));
+            Text.remove_prefix(Word.size());
+            return Word;
+        };
+
+        auto Find = [](const auto& Names, std::string_view Word) noexcept
+        {
+            return static_cast<std::size_t>(std::find(Names.begin(), Names.end(), Word) - Names.begin());
+        };
+
+        const auto iFamily = Find(tune_family_names_v, Next());
+        const auto iMode   = Find(tune_mode_names_v,   Next());
+        const auto iLevel  = Find(tune_level_names_v,  Next());
+        const auto Size    = Next();
+
+        std::uint64_t BlockSize = 0;
+        const auto [pEnd, ec] = std::from_chars(Size.data(), Size.data() + Size.size(), BlockSize);
+
+        if (iFamily == tune_family_names_v.size() || iMode == tune_mode_names_v.size() || iLevel == tune_level_names_v.size()
+            || ec != std::errc{} || pEnd != Size.data() + Size.size() || BlockSize == 0 || Next().size())
+            return xerr::create_f<state, "Invalid config">();
+
+        m_Family                 = static_cast<family>(iFamily);
+        m_bBlockSizeIsOutputSize = iMode == 1;
+        m_Level                  = static_cast<level>(iLevel);
+        m_BlockSize              = BlockSize;
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr autotuner::Run(std::span<const std::span<const std::byte>> Corpus, const options& Options) noexcept
+    {
+        m_Results.clear();
+
+        // The sample is an even share of every file (its first bytes), the probe an eighth of that
+        std::vector<std::span<const std::byte>> Sample;
+        std::vector<std::span<const std::byte>> Probe;
+        const std::uint64_t Share = std::max<std::uint64_t>(Options.m_MaxSampleBytes / std::max<std::size_t>(Corpus.size(), 1), 1);
+        for (const auto& File : Corpus)
+        {
+            if (File.empty()) continue;
+            Sample.push_back(File.first(static_cast<std::size_t>(std::min<std::uint64_t>(File.size(), Share))));
+            Probe.push_back(Sample.back().first(std::max<std::size_t>(Sample.back().size() / 8, 1)));
+        }
+
+        if (Sample.empty())
+            return xerr::create_f<state, "Empty corpus">();
+
+        static constexpr std::uint64_t DefaultBlockSizes[] = { 4 * 1024, 16 * 1024, 64 * 1024, 128 * 1024 };
+        const auto BlockSizes = Options.m_BlockSizes.empty() ? std::span<const std::uint64_t>(DefaultBlockSizes) : Options.m_BlockSizes;
+
+        // Faster levels go first, so the configs they beat at everything get pruned on the probe
+        std::vector<result> Probes;
+        for (auto Family : { family::FIXED, family::DYNAMIC })
+        for (bool bBlock : { false, true })
+        for (auto Level : { level::FAST, level::MEDIUM, level::HIGH })
+        for (auto BlockSize : BlockSizes)
+        {
+            // Block mode targets a compressed block size, zstd only accepts so much
+            if (BlockSize == 0 || (bBlock && (BlockSize < ZSTD_TARGETCBLOCKSIZE_MIN || BlockSize > ZSTD_BLOCKSIZE_MAX)))
+                continue;
+
+            result ProbeResult;
+            ProbeResult.m_Config = { Family, bBlock, Level, BlockSize };
+            if (auto Err = TuneMeasure(ProbeResult, Probe, 1); Err)
+                return Err;
+
+            result Result = ProbeResult;
+            for (std::size_t i = 0; i < Probes.size(); ++i)
+            {
+                if (m_Results[i].m_bPruned == false && TuneDominates(Probes[i], ProbeResult, Options.m_PruneMargin))
+                {
+                    Result.m_bPruned = true;
+                    break;
+                }
+            }
+
+            if (Result.m_bPruned == false)
+            {
+                if (auto Err = TuneMeasure(Result, Sample, Options.m_nRepeats); Err)
+                    return Err;
+            }
+
+            m_Results.push_back(Result);
+            Probes.push_back(ProbeResult);
+        }
+
+        for (auto& R : m_Results)
+        {
+            R.m_bPareto = R.m_bPruned == false && std::none_of(m_Results.begin(), m_Results.end(), [&](const result& Other)
+            {
+                return Other.m_bPruned == false && TuneDominates(Other, R, 0);
+            });
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    std::vector<autotuner::result> autotuner::getParetoFront(void) const noexcept
+    {
+        std::vector<result> Front;
+        for (const auto& R : m_Results)
+        {
+            if (R.m_bPareto) Front.push_back(R);
+        }
+        return Front;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr autotuner::Recommend(config& Config, const constraint& Constraint) const noexcept
+    {
+        auto Score = [&](const result& R) noexcept
+        {
+            switch (Constraint.m_Objective)
+            {
+            case objective::COMPRESS_SPEED:     return R.m_CompressMBs;
+            case objective::DECOMPRESS_SPEED:   return R.m_DecompressMBs;
+            default:                            return R.m_Ratio;
+            }
+        };
+
+        // Only the front is looked at, a dominated config always has one on the front that qualifies and scores as high
+        const result* pBest = nullptr;
+        for (const auto& R : m_Results)
+        {
+            if (R.m_bPareto == false
+                || R.m_Ratio         < Constraint.m_MinRatio
+                || R.m_CompressMBs   < Constraint.m_MinCompressMBs
+                || R.m_DecompressMBs < Constraint.m_MinDecompressMBs)
+                continue;
+
+            if (!pBest || Score(R) > Score(*pBest)) pBest = &R;
+        }
+
+        if (!pBest)
+            return xerr::create_f<state, "No configuration meets the constraints">();
+
+        Config = pBest->m_Config;
+        return {};
+    }
+#endif
+
+    //-------------------------------------------------------------------------------------------------------
+    // Incremental decompress
+    //-------------------------------------------------------------------------------------------------------
+
+    incremental_decompress::~incremental_decompress(void) noexcept
+    {
+        if (m_pDCTX) ZSTD_freeDCtx(static_cast<ZSTD_DCtx*>(m_pDCTX));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr incremental_decompress::Init(std::span<const stream_chunk> Chunks, std::span<std::byte> Destination, std::uint64_t WindowSize) noexcept
+    {
+        assert(WindowSize > 0);
+
+        std::uint64_t Size = 0;
+        for (const auto& Chunk : Chunks)
+        {
+            if (Chunk.m_SourceOffset != Size)
+                return xerr::create_f<state, "Chunks must be contiguous and in order">();
+            if (Chunk.m_bStored && Chunk.m_Data.size() != Chunk.m_SourceSize)
+                return xerr::create_f<state, "Stored chunk size does not match its range">();
+            Size += Chunk.m_SourceSize;
+        }
+
+        if (Size > Destination.size())
+            return xerr::create_f<state, "Destination is smaller than the decompressed chunks">();
+
+        // A context that is already there (the object is reused) keeps its allocation
+        if (m_pDCTX && ZSTD_isError(ZSTD_DCtx_reset(static_cast<ZSTD_DCtx*>(m_pDCTX), ZSTD_reset_session_only)))
+            return xerr::create_f<state, "Error ZSTD_DCtx_reset">();
+
+        if (m_pDCTX && WindowSize != m_WindowSize)
+        {
+            if (auto Err = SetupDecompressContext(static_cast<ZSTD_DCtx*>(m_pDCTX), WindowSize, false); Err)
+                return Err;
+        }
+
+        m_Chunks            = Chunks;
+        m_Destination       = Destination;
+        m_WindowSize        = WindowSize;
+        m_Size              = Size;
+        m_iChunk            = 0;
+        m_InputOffset       = 0;
+        m_OutputPosition    = 0;
+
+        // Empty chunks have nothing to decode
+        while (m_iChunk < m_Chunks.size() && m_Chunks[m_iChunk].m_SourceSize == 0 && m_Chunks[m_iChunk].m_Data.empty())
+            m_iChunk++;
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr incremental_decompress::Unpack(std::uint64_t& DecompressSize, const budget& Budget) noexcept
+    {
+        assert(m_WindowSize);
+        assert(m_SliceSize > 0);
+
+        DecompressSize = 0;
+        if (isDone()) return {};
+
+        if (auto Err = CreateDecompressContext(*this, m_WindowSize, false); Err)
+            return Err;
+
+        perf_counters::scope Perf(m_pPerf, perf_counters::stage::DECOMPRESS);
+
+        const bool              bTimed      = Budget.m_Time > clock::duration::zero();
+        const auto              Deadline    = bTimed ? clock::now() + Budget.m_Time : clock::time_point::max();
+        std::uint64_t           BytesLeft   = Budget.m_Bytes ? Budget.m_Bytes : ~std::uint64_t{ 0 };
+
+        while (m_iChunk < m_Chunks.size() && BytesLeft > 0)
+        {
+            // Every call does at least one slice so it always makes progress
+            if (bTimed && DecompressSize > 0 && clock::now() >= Deadline)
+                break;
+
+            const auto&         Chunk   = m_Chunks[m_iChunk];
+            const std::uint64_t End     = Chunk.m_SourceOffset + Chunk.m_SourceSize;
+            const std::uint64_t Slice   = std::min({ m_SliceSize, BytesLeft, End - m_OutputPosition });
+            std::uint64_t       Output;
+
+            if (Chunk.m_bStored)
+            {
+                std::memcpy(m_Destination.data() + m_OutputPosition, Chunk.m_Data.data() + m_InputOffset, static_cast<std::size_t>(Slice));
+                m_InputOffset += Slice;
+                Output         = Slice;
+            }
+            else
+            {
+                // Once the chunk has all its output the decoder still reads what is left of it (the checksum,
+                // an empty last block), so the output buffer can be empty
+                ZSTD_inBuffer   in  = { Chunk.m_Data.data(), Chunk.m_Data.size(), static_cast<std::size_t>(m_InputOffset) };
+                ZSTD_outBuffer  out = { m_Destination.data() + m_OutputPosition, static_cast<std::size_t>(Slice), 0 };
+
+                size_t rc = ZSTD_decompressStream(static_cast<ZSTD_DCtx*>(m_pDCTX), &out, &in);
+                if (ZSTD_isError(rc))
+                {
+                    return DecompressError(rc);
+                }
+
+                if (in.pos == m_InputOffset && out.pos == 0)
+                    return xerr::create_f<state, "Chunk data does not match its decompressed size">();
+
+                m_InputOffset = in.pos;
+                Output        = out.pos;
+            }
+
+            m_OutputPosition    += Output;
+            DecompressSize      += Output;
+            BytesLeft           -= Output;
+
+            if (m_OutputPosition == End && m_InputOffset == Chunk.m_Data.size())
+            {
+                m_InputOffset = 0;
+                do m_iChunk++; while (m_iChunk < m_Chunks.size() && m_Chunks[m_iChunk].m_SourceSize == 0 && m_Chunks[m_iChunk].m_Data.empty());
+            }
+        }
+
+        Perf.m_Bytes = DecompressSize;
+
+        if (isDone()) return {};
+        return xerr::create<state::NOT_DONE, "More data to decompress">();
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // Decompress scheduler
+    //-------------------------------------------------------------------------------------------------------
+
+    void decompress_scheduler::Add(incremental_decompress& Stream, std::uint32_t Priority) noexcept
+    {
+        assert(Priority > 0);
+        assert(std::find_if(m_Streams.begin(), m_Streams.end(), [&](const entry& E) { return E.m_pStream == &Stream; }) == m_Streams.end());
+
+        // After the streams of the same priority, so equal streams are served in the order they came
+        const auto It = std::find_if(m_Streams.begin(), m_Streams.end(), [&](const entry& E) { return E.m_Priority < Priority; });
+        m_Streams.insert(It, entry{ &Stream, Priority });
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void decompress_scheduler::Remove(incremental_decompress& Stream) noexcept
+    {
+        std::erase_if(m_Streams, [&](const entry& E) { return E.m_pStream == &Stream; });
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr decompress_scheduler::Run(const budget& Budget) noexcept
+    {
+        const bool      bTimed      = Budget.m_Time > clock::duration::zero();
+        const auto      Deadline    = bTimed ? clock::now() + Budget.m_Time : clock::time_point::max();
+        const bool      bBytes      = Budget.m_Bytes > 0;
+        std::uint64_t   BytesLeft   = Budget.m_Bytes;
+
+        m_pFailed   = nullptr;
+        m_LastBytes = 0;
+
+        while (m_Streams.empty() == false)
+        {
+            if (bBytes && BytesLeft == 0) break;
+
+            const auto PassStart = clock::now();
+            if (PassStart >= Deadline) break;
+
+            std::uint64_t TotalPriority = 0;
+            for (const auto& E : m_Streams) TotalPriority += E.m_Priority;
+
+            // The shares of this pass come from what was left when it started
+            const std::uint64_t PassBytes = BytesLeft;
+            const auto          PassTime  = Deadline - PassStart;
+
+            for (std::size_t i = 0; i < m_Streams.size(); )
+            {
+                if (bBytes && BytesLeft == 0) break;
+                if (bTimed && clock::now() >= Deadline) break;
+
+                auto&   E       = m_Streams[i];
+                budget  Share   = {};
+
+                if (bBytes) Share.m_Bytes = std::min(BytesLeft, std::max<std::uint64_t>(1, PassBytes / TotalPriority * E.m_Priority + (PassBytes % TotalPriority) * E.m_Priority / TotalPriority));
+                if (bTimed) Share.m_Time  = std::max(clock::duration{ 1 }, PassTime / static_cast<clock::rep>(TotalPriority) * static_cast<clock::rep>(E.m_Priority));
+
+                std::uint64_t   Decoded;
+                auto            Err = E.m_pStream->Unpack(Decoded, Share);
+
+                m_LastBytes += Decoded;
+                if (bBytes) BytesLeft -= Decoded;
+
+                if (Err && Err.getState<state>() != state::NOT_DONE)
+                {
+                    m_pFailed = E.m_pStream;
+                    m_Streams.erase(m_Streams.begin() + i);
+                    return Err;
+                }
+
+                if (!Err) m_Streams.erase(m_Streams.begin() + i);
+                else      i++;
+            }
+        }
+
+        if (m_Streams.empty()) return {};
+        return xerr::create<state::NOT_DONE, "Streams left to decompress">();
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+    // Block index
+    //-------------------------------------------------------------------------------------------------------
+    namespace
+    {
+        constexpr std::uint32_t index_skippable_magic_v = 0x184D2A5B;     // ZSTD_MAGIC_SKIPPABLE_START + 11
+        constexpr std::uint32_t index_magic_v           = 0x49424358;     // 'XCBI'
+        constexpr std::uint16_t index_version_v         = 1;
+
+        struct index_header
+        {
+            std::uint32_t   m_SkippableMagic;
+            std::uint32_t   m_FrameSize;            // Bytes after these two fields
+            std::uint32_t   m_Magic;
+            std::uint16_t   m_Version;
+            std::uint16_t   m_nHashes;
+            std::uint32_t   m_BitsPerKey;
+            std::uint32_t   m_Pad;
+            std::uint64_t   m_nBlocks;
+            std::uint64_t   m_nWords;
+        };
+        static_assert(sizeof(index_header) == 40);
+
+        //---------------------------------------------------------------------------------------------------
+        // Double hashing (Kirsch-Mitzenmacher): the probes are h1 + i * h2 with both halves of one XXH64
+        template< typename T_FUNCTION >
+        void BloomProbes(std::uint64_t Hash, std::uint32_t nHashes, std::uint64_t nBits, T_FUNCTION&& Function) noexcept
+        {
+            const std::uint64_t H1 = static_cast<std::uint32_t>(Hash);
+            const std::uint64_t H2 = static_cast<std::uint32_t>(Hash >> 32) | 1;
+            for (std::uint32_t i = 0; i < nHashes; ++i)
+                Function((H1 + i * H2) % nBits);
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        bool BloomTest(const block_index& Index, const block_index::summary& Summary, std::uint64_t Hash) noexcept
+        {
+            if (Summary.m_BloomWords == 0) return false;
+
+            const std::uint64_t* pWords = &Index.m_Bloom[static_cast<std::size_t>(Summary.m_BloomOffset)];
+            bool                 bAll   = true;
+            BloomProbes(Hash, Index.m_nHashes, Summary.m_BloomWords * 64, [&](std::uint64_t Bit) noexcept
+            {
+                bAll = bAll && (pWords[Bit >> 6] >> (Bit & 63) & 1);
+            });
+            return bAll;
+        }
+
+        //---------------------------------------------------------------------------------------------------
+        bool isTokenByte(std::byte b) noexcept
+        {
+            const auto c = static_cast<unsigned char>(b);
+            return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_';
+        }
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr block_index::Init(extractor Extractor, std::uint32_t BitsPerKey, std::uint32_t Lookahead) noexcept
+    {
+        if (BitsPerKey == 0 || BitsPerKey > 64)
+            return xerr::create_f<state, "BitsPerKey must be between 1 and 64">();
+
+        // The number of probes that gives the lowest false positive rate for the size, ln(2) * bits per key
+        m_Extractor     = std::move(Extractor);
+        m_BitsPerKey    = BitsPerKey;
+        m_nHashes       = std::max(1u, static_cast<std::uint32_t>(BitsPerKey * 0.693 + 0.5));
+        m_Lookahead     = Lookahead;
+        m_Summaries.clear();
+        m_Bloom.clear();
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void block_index::AddKey(std::span<const std::byte> Key) noexcept
+    {
+        m_Pending.push_back(XXH64(Key.data(), Key.size(), 0));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    void block_index::AddValue(std::int64_t Value) noexcept
+    {
+        m_Current.m_Min = m_Current.m_nValues ? std::min(m_Current.m_Min, Value) : Value;
+        m_Current.m_Max = m_Current.m_nValues ? std::max(m_Current.m_Max, Value) : Value;
+        m_Current.m_nValues++;
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr block_index::Add(std::span<const std::byte> Block, std::span<const std::byte> Following, std::uint64_t SourceOffset) noexcept
+    {
+        m_Pending.clear();
+        m_Current = { .m_SourceOffset = SourceOffset, .m_SourceSize = Block.size() };
+
+        if (m_Extractor)
+        {
+            m_Extractor(Block, Following, *this);
+        }
+        else
+        {
+            for (std::size_t i = 0; i < Block.size(); )
+            {
+                if (isTokenByte(Block[i]) == false) { ++i; continue; }
+
+                const auto Start = i;
+                while (i < Block.size() && isTokenByte(Block[i])) ++i;
+
+                // The last word may go on in the next block
+                if (i == Block.size())
+                {
+                    std::size_t Extra = 0;
+                    while (Extra < Following.size() && isTokenByte(Following[Extra])) ++Extra;
+                    if (Extra)
+                    {
+                        // Same hash as AddKey of the whole word, without copying it together
+                        XXH64_state_t State;
+                        XXH64_reset(&State, 0);
+                        XXH64_update(&State, Block.data() + Start, i - Start);
+                        XXH64_update(&State, Following.data(), Extra);
+                        m_Pending.push_back(XXH64_digest(&State));
+                        break;
+                    }
+                }
+
+                AddKey(Block.subspan(Start, i - Start));
+            }
+        }
+
+        // The filter is sized for the distinct keys, repeated keys would only make it bigger
+        std::sort(m_Pending.begin(), m_Pending.end());
+        m_Pending.erase(std::unique(m_Pending.begin(), m_Pending.end()), m_Pending.end());
+
+        if (m_Pending.size())
+        {
+            m_Current.m_BloomOffset = m_Bloom.size();
+            m_Current.m_BloomWords  = std::max<std::uint64_t>(1, (m_Pending.size() * m_BitsPerKey + 63) / 64);
+            m_Bloom.resize(static_cast<std::size_t>(m_Current.m_BloomOffset + m_Current.m_BloomWords), 0);
+
+            std::uint64_t* pWords = &m_Bloom[static_cast<std::size_t>(m_Current.m_BloomOffset)];
+            for (const auto Hash : m_Pending)
+            {
+                BloomProbes(Hash, m_nHashes, m_Current.m_BloomWords * 64, [&](std::uint64_t Bit) noexcept
+                {
+                    pWords[Bit >> 6] |= std::uint64_t{ 1 } << (Bit & 63);
+                });
+            }
+        }
+
+        m_Summaries.push_back(m_Current);
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    bool block_index::mayContain(std::size_t iBlock, std::string_view Key) const noexcept
+    {
+        assert(iBlock < m_Summaries.size());
+        return BloomTest(*this, m_Summaries[iBlock], XXH64(Key.data(), Key.size(), 0));
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    bool block_index::isCandidate(std::size_t iBlock, const query& Query) const noexcept
+    {
+        assert(iBlock < m_Summaries.size());
+        const auto& Summary = m_Summaries[iBlock];
+
+        if (Query.m_bRange && (Summary.m_nValues == 0 || Summary.m_Max < Query.m_Min || Summary.m_Min > Query.m_Max))
+            return false;
+
+        if (Query.m_Keys.empty()) return true;
+
+        return std::any_of(Query.m_Keys.begin(), Query.m_Keys.end(), [&](std::string_view Key) { return mayContain(iBlock, Key); });
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr block_index::Query(stats& Stats, fixed_block_decompress& Decompressor, std::span<const stream_chunk> Chunks, const query& Query, const callback& Callback) const noexcept
+    {
+        assert(Decompressor.m_BlockSize);
+
+        Stats           = {};
+        Stats.m_nBlocks = m_Summaries.size();
+
+        if (Chunks.size() != m_Summaries.size())
+            return xerr::create_f<state, "The chunks do not match the index">();
+
+        for (std::size_t i = 0; i < Chunks.size(); ++i)
+        {
+            if (Chunks[i].m_SourceOffset != m_Summaries[i].m_SourceOffset || Chunks[i].m_SourceSize != m_Summaries[i].m_SourceSize)
+                return xerr::create_f<state, "The chunks do not match the index">();
+        }
+
+        std::vector<bool> Candidates(Chunks.size());
+        for (std::size_t i = 0; i < Chunks.size(); ++i)
+        {
+            Candidates[i] = isCandidate(i, Query);
+            Stats.m_nCandidates += Candidates[i];
+        }
+
+        std::vector<std::byte>  Buffer(static_cast<std::size_t>(Decompressor.m_BlockSize));
+        const std::size_t       GroupSize = Decompressor.m_bBlockIsOutputSize ? 1 : Decompressor.m_SyncInterval;
+
+        for (std::size_t iGroup = 0; iGroup < Chunks.size(); iGroup += GroupSize)
+        {
+            // A history mode frame is decoded from its first chunk up to its last candidate
+            const std::size_t End   = std::min(iGroup + GroupSize, Chunks.size());
+            std::size_t       iLast = End;
+            for (std::size_t i = iGroup; i < End; ++i) if (Candidates[i]) iLast = i;
+            if (iLast == End) continue;
+
+            if (Decompressor.m_bBlockIsOutputSize == false)
+            {
+                if (auto Err = Decompressor.ResetStream(); Err)
+                    return Err;
+            }
+
+            for (std::size_t i = iGroup; i <= iLast; ++i)
+            {
+                const auto&                 Chunk = Chunks[i];
+                std::span<const std::byte>  Block = Chunk.m_Data;
+
+                if (Chunk.m_bStored == false)
+                {
+                    std::uint32_t       DecompressSize;
+                    auto                Err  = Decompressor.Unpack(DecompressSize, Buffer, Chunk.m_Data);
+                    const std::uint64_t Size = DecompressSize;
+
+                    // A chunk never holds more than BlockSize, the calls after a full buffer only finish reading it
+                    while (Err && Err.getState<state>() == state::NOT_DONE)
+                    {
+                        Err = Decompressor.Unpack(DecompressSize, Buffer, Chunk.m_Data);
+                        if (DecompressSize) return xerr::create_f<state, "Chunk larger than BlockSize">();
+                    }
+                    if (Err) return Err;
+
+                    Block = std::span<const std::byte>(Buffer).first(static_cast<std::size_t>(Size));
+                    Stats.m_nDecoded++;
+                    Stats.m_DecodedBytes += Size;
+                }
+
+                if (Candidates[i] && Callback(Block, Chunk.m_SourceOffset) == false)
+                    return {};
+            }
+        }
+
+        return {};
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr block_index::Write(output_sink& Sink) const noexcept
+    {
+        const std::uint64_t PayloadSize = sizeof(index_header) - 8 + m_Summaries.size() * sizeof(summary) + m_Bloom.size() * sizeof(std::uint64_t);
+        if (PayloadSize > 0xFFFFFFFFu)
+            return xerr::create_f<state, "Index too large for a skippable frame">();
+
+        const index_header Header =
+        { .m_SkippableMagic = index_skippable_magic_v
+        , .m_FrameSize      = static_cast<std::uint32_t>(PayloadSize)
+        , .m_Magic          = index_magic_v
+        , .m_Version        = index_version_v
+        , .m_nHashes        = static_cast<std::uint16_t>(m_nHashes)
+        , .m_BitsPerKey     = m_BitsPerKey
+        , .m_Pad            = 0
+        , .m_nBlocks        = m_Summaries.size()
+        , .m_nWords         = m_Bloom.size()
+        };
+
+        const std::span<const std::byte> Buffers[] =
+        { std::as_bytes(std::span(&Header, 1))
+        , std::as_bytes(std::span(m_Summaries))
+        , std::as_bytes(std::span(m_Bloom))
+        };
+        return Sink.Write(Buffers);
+    }
+
+    //-------------------------------------------------------------------------------------------------------
+
+    xerr block_index::Load(std::span<const std::byte> Frame) noexcept
+    {
+        index_header Header;
+        if (Frame.size() < sizeof(Header))
+            return xerr::create_f<state, "Index frame too small">();
+
+        std::memcpy(&Header, Frame.data(), sizeof(Header));
+        if (Header.m_SkippableMagic != index_skippable_magic_v || Header.m_Magic != index_magic_v)
+            return xerr::create_f<state, "Not an index frame">();
+
+        if (Header.m_Version != index_version_v)
+            return xerr::create_f<state, "Unsupported index version">();
+
+        const std::uint64_t ArraysSize = Header.m_FrameSize - (sizeof(index_header) - 8);
+        if (Header.m_FrameSize < sizeof(index_header) - 8 || Frame.size() < 8 + std::uint64_t{ Header.m_FrameSize }
+            || Header.m_nBlocks > ArraysSize / sizeof(summary) || Header.m_nWords > ArraysSize / sizeof(std::uint64_t)
+            || Header.m_nBlocks * sizeof(summary) + Header.m_nWords * sizeof(std::uint64_t) != ArraysSize
+            || Header.m_nHashes == 0)
+            return xerr::create_f<state, "Corrupted index frame">();
+
+        std::vector<summary>        Summaries(static_cast<std::size_t>(Header.m_nBlocks));
+        std::vector<std::uint64_t>  Bloom(static_cast<std::size_t>(Header.m_nWords));
+
+        const auto* pData = Frame.data() + sizeof(Header);
+        if (Summaries.size()) std::memcpy(Summaries.data(), pData, Summaries.size() * sizeof(summary));
+        if (Bloom.size())     std::memcpy(Bloom.data(), pData + Summaries.size() * sizeof(summary), Bloom.size() * sizeof(std::uint64_t));
+
+        for (const auto& Summary : Summaries)
+        {
+            if (Summary.m_BloomOffset > Bloom.size() || Summary.m_BloomWords > Bloom.size() - Summary.m_BloomOffset)
+                return xerr::create_f<state, "Corrupted index frame">();
+        }
+
+        m_Extractor     = {};
+        m_BitsPerKey    = Header.m_BitsPerKey;
+        m_nHashes       = Header.m_nHashes;
+        m_Summaries     = std::move(Summaries);
+        m_Bloom         = std::move(Bloom);
+        return {};
+    }
 }
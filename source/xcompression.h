@@ -7,6 +7,18 @@
 #include <memory>
 #include <span>
 #include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <thread>
+#include <iterator>
+#include <unordered_map>
+#include <chrono>
+#include <deque>
 
 namespace xcompression
 {
@@ -17,6 +29,16 @@ namespace xcompression
     , INCOMPRESSIBLE
     };
 
+    // Decoder only builds: define XCOMPRESSION_DECODE_ONLY for xcompression.cpp and its users. Everything that
+    // compresses is left out, so the program can link a zstd built without its compressor (ZSTD_LIB_COMPRESSION=0).
+
+    // Default alignment for page buffers and direct (unbuffered) file I/O
+    constexpr std::uint64_t page_alignment_v = 4096;
+
+    struct perf_counters;
+    struct block_index;
+
+#ifndef XCOMPRESSION_DECODE_ONLY
     //-----------------------------------------------------------------------------------------------------
     struct fixed_block_compress
     {
@@ -34,21 +56,61 @@ namespace xcompression
         // If false, uses streaming mode with BlockSize as the maximum input chunk size per Pack call (last chunk may be smaller).
         // SourceUncompress: The input data to compress.
         // CompressionLevel: The desired compression level (FAST, MEDIUM, HIGH).
-        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel = level::HIGH) noexcept;
+        // SyncInterval: (streaming mode) number of chunks that share one frame, so later chunks can match against earlier ones.
+        // Chunks inside a group end with a flush, a new independent frame (a sync point) starts every SyncInterval chunks.
+        // 1 keeps every chunk an independent frame. The decompressor must be initialized with the same SyncInterval.
+        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel = level::HIGH, std::uint32_t SyncInterval = 1) noexcept;
+
+        // Same as Init but builds the context inside Workspace (8 byte aligned), so there are no heap allocations.
+        // If the parameters need more memory than Workspace.size() the level (and then the window) is lowered until they fit.
+        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, std::span<std::byte> Workspace, level CompressionLevel = level::HIGH, std::uint32_t SyncInterval = 1) noexcept;
+
+        // Scatter-gather versions: SourceSegments are read in order as one logical input, without copying them together.
+        // Chunks (and frames) freely cross segment boundaries. Both the segments and the list must stay valid while packing.
+        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, level CompressionLevel = level::HIGH, std::uint32_t SyncInterval = 1) noexcept;
+        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, std::span<std::byte> Workspace, level CompressionLevel = level::HIGH, std::uint32_t SyncInterval = 1) noexcept;
+
+        // Bytes of workspace needed to compress SourceSize bytes at CompressionLevel without lowering any parameter.
+        static std::uint64_t EstimateWorkspace(std::uint64_t SourceSize, level CompressionLevel = level::HIGH) noexcept;
 
         // Compresses data into DestinationCompress, updating CompressedSize with bytes written.
-        // DestinationCompress must be at least SourceUncompress.size() in block mode, or BlockSize (or remaining input size) in streaming mode.
-        // Returns err::state::INCOMPRESSIBLE if the compressed size is not smaller than the input size,
-        // in which case DestinationCompress is unchanged and the user should fall back to the original data.
+        // DestinationCompress can have any size. When the frame (block mode) or chunk (streaming mode) does not fit, it is filled,
+        // isDraining() becomes true and err::state::NOT_DONE is returned: call Pack again to get the rest. m_Position only moves
+        // once the frame or chunk is complete. In block mode, calls after the frame is complete return no error and CompressedSize 0.
+        // Returns err::state::INCOMPRESSIBLE if the compressed size is not smaller than the input size (this can happen while
+        // draining), in which case the user should drop what this frame or chunk produced and fall back to the original data.
+        // With SyncInterval > 1 chunks are never INCOMPRESSIBLE (the frame needs them), zstd stores them as raw blocks instead.
         // Returns err::state::NOT_DONE in streaming mode if more data needs to be processed.
         xerr Pack(std::uint64_t& CompressedSize, std::span<std::byte> DestinationCompress) noexcept;
 
+        // True if the next chunk Pack produces starts a new frame, so a decoder can start (or seek) there.
+        bool isSyncPoint(void) const noexcept { return (m_ChunkIndex % m_SyncInterval) == 0; }
+
+        // True if the last Pack only returned part of the current frame or chunk.
+        bool isDraining(void) const noexcept { return m_bDraining; }
+
+        // Copies input bytes starting at Offset (for example an INCOMPRESSIBLE chunk of a scatter-gather input), returns the bytes copied.
+        std::uint64_t CopySource(std::span<std::byte> Destination, std::uint64_t Offset) const noexcept;
+
         void* m_pCCTX = nullptr;
         std::uint64_t m_Position = 0;
-        std::span<const std::byte> m_Src = {};
+        std::span<const std::byte> m_Src = {}; // Contiguous input (empty when reading from m_Segments)
+        std::span<const std::span<const std::byte>> m_Segments = {}; // Scatter-gather input
+        std::uint64_t m_SourceSize = 0;
+        std::size_t m_iSegment = 0; // Segment holding m_Position
+        std::uint64_t m_SegmentBase = 0; // Input offset where m_iSegment starts
         std::uint64_t m_BlockSize = 0;
         bool m_bBlockSizeIsOutputSize = false;
+        std::uint32_t m_SyncInterval = 1; // Chunks per frame in streaming mode
+        std::uint64_t m_ChunkIndex = 0; // Chunks produced so far in streaming mode
+        std::uint64_t m_DrainConsumed = 0; // Input of the current frame or chunk zstd already took while draining
+        std::uint64_t m_DrainOutput = 0; // Output of the current frame or chunk returned so far
+        bool m_bDraining = false;
+        bool m_bChecksum = false; // Set it before Init to end every frame with a checksum of its content (4 bytes, hashed while compressing)
+        block_index* m_pIndex = nullptr; // Optional, Pack adds a summary of every chunk (the whole input in block mode) to it
+        perf_counters* m_pPerf = nullptr; // Optional instrumentation, set it before Init to include the setup
     };
+#endif
 
     //-----------------------------------------------------------------------------------------------------
     struct fixed_block_decompress
@@ -56,24 +118,40 @@ namespace xcompression
         fixed_block_decompress() = default;
         ~fixed_block_decompress(void) noexcept;
 
-        // Initializes decompression context.
+        // Initializes decompression context. The zstd context itself is created by the first Unpack.
         // bBlockIsOutputSize: If true, decompresses entire input as a single frame, expecting output size == BlockSize.
         // If false, uses streaming mode with BlockSize as the maximum decompressed block size (last block may be smaller).
-        xerr Init(bool bBlockIsOutputSize, std::uint64_t BlockSize) noexcept;
+        // SyncInterval: the value given to fixed_block_compress::Init, it sizes the window the decoder accepts.
+        xerr Init(bool bBlockIsOutputSize, std::uint64_t BlockSize, std::uint32_t SyncInterval = 1) noexcept;
+
+        // Same as Init but builds the context inside Workspace (8 byte aligned, at least EstimateWorkspace(BlockSize, SyncInterval)), so there are no heap allocations.
+        xerr Init(bool bBlockIsOutputSize, std::uint64_t BlockSize, std::span<std::byte> Workspace, std::uint32_t SyncInterval = 1) noexcept;
+
+        // Bytes of workspace needed to decompress with the given BlockSize.
+        static std::uint64_t EstimateWorkspace(std::uint64_t BlockSize, std::uint32_t SyncInterval = 1) noexcept;
 
         // Decompresses into DestinationUncompress, updating DecompressSize with bytes written.
         // DestinationUncompress must be exactly BlockSize in both block and streaming modes.
         // In streaming mode, DecompressSize may be less than BlockSize for the last block; users should advance their cursor by DecompressSize.
-        // Returns err::state::NOT_DONE in streaming mode if more data needs to be processed.
+        // Returns err::state::NOT_DONE in streaming mode if more data needs to be processed,
+        // call it again with the same SourceCompressed (and a drained buffer) to continue.
+        // Frames that carry a checksum (fixed_block_compress::m_bChecksum) are always verified, a mismatch fails the call.
         xerr Unpack(std::uint32_t& DecompressSize, std::span<std::byte> DestinationUncompress, const std::span<const std::byte> SourceCompressed) noexcept;
 
+        // Drops any partially decoded frame so decoding can restart at a sync point (see fixed_block_compress::isSyncPoint).
+        xerr ResetStream(void) noexcept;
+
         void* m_pDCTX = nullptr;
         std::uint64_t m_Position = 0; // Tracks input progress
         std::uint64_t m_OutputPosition = 0; // Tracks output progress
         std::uint64_t m_BlockSize = 0;
+        std::uint64_t m_SourceOffset = 0; // Bytes of the current SourceCompressed already consumed (after NOT_DONE)
+        std::uint32_t m_SyncInterval = 1;
         bool m_bBlockIsOutputSize = false;
+        perf_counters* m_pPerf = nullptr; // Optional instrumentation
     };
 
+#ifndef XCOMPRESSION_DECODE_ONLY
     //-----------------------------------------------------------------------------------------------------
     struct dynamic_block_compress
     {
@@ -94,20 +172,60 @@ namespace xcompression
         // CompressionLevel: The desired compression level (FAST, MEDIUM, HIGH).
         xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel = level::HIGH) noexcept;
 
+        // Same as Init but builds the context inside Workspace (8 byte aligned), so there are no heap allocations.
+        // If the parameters need more memory than Workspace.size() the level (and then the window) is lowered until they fit.
+        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, std::span<std::byte> Workspace, level CompressionLevel = level::HIGH) noexcept;
+
+        // Scatter-gather versions: SourceSegments are read in order as one logical input, without copying them together.
+        // The size search (and pages) freely cross segment boundaries. Both the segments and the list must stay valid while packing.
+        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, level CompressionLevel = level::HIGH) noexcept;
+        xerr Init(bool bBlockSizeIsOutputSize, std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, std::span<std::byte> Workspace, level CompressionLevel = level::HIGH) noexcept;
+
+        // Bytes of workspace needed to compress SourceSize bytes at CompressionLevel without lowering any parameter.
+        static std::uint64_t EstimateWorkspace(std::uint64_t SourceSize, level CompressionLevel = level::HIGH) noexcept;
+
         // Compresses data into DestinationCompress, updating CompressedSize with bytes written.
-        // DestinationCompress must be at least SourceUncompress.size() in block mode, or BlockSize (or remaining input size) in streaming mode.
-        // Returns err::state::INCOMPRESSIBLE if the compressed size is not smaller than the input size,
-        // in which case DestinationCompress is unchanged and the user should fall back to the original data.
+        // Block mode: DestinationCompress can have any size. When the frame does not fit it is filled, isDraining() becomes true
+        // and err::state::NOT_DONE is returned: call Pack again to get the rest. Once the frame is complete Pack returns no error
+        // and CompressedSize 0.
+        // Streaming mode: DestinationCompress must be at least BlockSize (or the remaining input size), the chunk size search
+        // picks the input that fits in it so a chunk is never drained.
+        // Returns err::state::INCOMPRESSIBLE if the compressed size is not smaller than the input size (in block mode this can
+        // happen while draining), in which case the user should drop what was produced and fall back to the original data.
         // Returns err::state::NOT_DONE in streaming mode if more data needs to be processed.
         xerr Pack(std::uint64_t& CompressedSize, std::span<std::byte> DestinationCompress) noexcept;
 
-        void*                       m_pCCTX                     = nullptr;
-        std::uint64_t               m_Position                  = 0;
-        std::span<const std::byte>  m_Src                       = {};
-        std::uint64_t               m_BlockSize                 = 0;
-        level                       m_CompressionLevel          = {};
-        bool                        m_bBlockSizeIsOutputSize    = false;
+        // True if the last block mode Pack only returned part of the frame.
+        bool isDraining(void) const noexcept { return m_bDraining; }
+
+        // Copies input bytes starting at Offset (for example an INCOMPRESSIBLE chunk of a scatter-gather input), returns the bytes copied.
+        std::uint64_t CopySource(std::span<std::byte> Destination, std::uint64_t Offset) const noexcept;
+
+        // Page mode (streaming mode only): compresses the next chunk into DestinationPage, which must be exactly BlockSize.
+        // The page is always filled completely, the compressed frame is followed by a zstd skippable frame as padding.
+        // Pages never come back INCOMPRESSIBLE, incompressible data is stored as zstd raw blocks instead,
+        // so every page can be written with direct I/O and decoded with dynamic_block_decompress::UnpackPage.
+        // CompressedSize is set to the size of the frame without the padding.
+        // Returns err::state::NOT_DONE if more pages need to be produced.
+        xerr PackPage(std::uint64_t& CompressedSize, std::span<std::byte> DestinationPage) noexcept;
+
+        void*                                       m_pCCTX                     = nullptr;
+        std::uint64_t                               m_Position                  = 0;
+        std::span<const std::byte>                  m_Src                       = {};   // Contiguous input (empty when reading from m_Segments)
+        std::span<const std::span<const std::byte>> m_Segments                  = {};   // Scatter-gather input
+        std::uint64_t                               m_SourceSize                = 0;
+        std::size_t                                 m_iSegment                  = 0;    // Segment holding m_Position
+        std::uint64_t                               m_SegmentBase               = 0;    // Input offset where m_iSegment starts
+        std::uint64_t                               m_BlockSize                 = 0;
+        level                                       m_CompressionLevel          = {};
+        bool                                        m_bBlockSizeIsOutputSize    = false;
+        std::uint64_t                               m_DrainConsumed             = 0;        // Input of the block mode frame zstd already took while draining
+        std::uint64_t                               m_DrainOutput               = 0;        // Output of the block mode frame returned so far
+        bool                                        m_bDraining                 = false;
+        bool                                        m_bChecksum                 = false;    // Set it before Init to end every frame with a checksum of its content
+        perf_counters*                              m_pPerf                     = nullptr;  // Optional instrumentation, set it before Init to include the setup
     };
+#endif
 
     //-----------------------------------------------------------------------------------------------------
     struct dynamic_block_decompress
@@ -115,22 +233,1274 @@ namespace xcompression
         dynamic_block_decompress() = default;
         ~dynamic_block_decompress(void) noexcept;
 
-        // Initializes decompression context.
+        // Initializes decompression context. The zstd context itself is created by the first Unpack.
         // bBlockSizeIsOutputSize: If true, decompresses entire input as a single frame, expecting output size == BlockSize.
         // If false, uses streaming mode with BlockSize as the maximum input chunk size per Unpack call (last chunk may be smaller).
         xerr Init(bool bBlockIsOutputSize, std::uint64_t BlockSize) noexcept;
 
+        // Same as Init but builds the context inside Workspace (8 byte aligned, at least EstimateWorkspace(BlockSize)), so there are no heap allocations.
+        xerr Init(bool bBlockIsOutputSize, std::uint64_t BlockSize, std::span<std::byte> Workspace) noexcept;
+
+        // Bytes of workspace needed to decompress with the given BlockSize.
+        static std::uint64_t EstimateWorkspace(std::uint64_t BlockSize) noexcept;
+
         // Decompresses into DestinationUncompress, updating DecompressSize with bytes written.
         // DestinationUncompress must be at least BlockSize in both block and streaming modes.
         // In streaming mode, DecompressSize may be less than BlockSize for the last block; users should advance their cursor by DecompressSize.
         // Returns err::state::NOT_DONE in streaming mode if more data needs to be processed.
         xerr Unpack(std::uint32_t& DecompressSize, std::span<std::byte> DestinationUncompress, const std::span<const std::byte> SourceCompressed) noexcept;
 
+        // Decompresses a page produced by dynamic_block_compress::PackPage, skipping its padding.
+        // SourcePage must be exactly BlockSize. DestinationUncompress must hold the page content (at most 4 * BlockSize).
+        xerr UnpackPage(std::uint32_t& DecompressSize, std::span<std::byte> DestinationUncompress, const std::span<const std::byte> SourcePage) noexcept;
+
         void*           m_pDCTX = nullptr;
         std::uint64_t   m_Position = 0; // Tracks input progress
         std::uint64_t   m_OutputPosition = 0; // Tracks output progress
         std::uint64_t   m_BlockSize = 0;
         bool            m_bBlockIsOutputSize = false;
+        bool            m_bVerifyChecksum = false; // Check the frame checksums (m_bChecksum of the compressor), set it before the first Unpack or the Init with a Workspace
+        perf_counters*  m_pPerf = nullptr; // Optional instrumentation
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    struct aligned_buffer
+    {
+        aligned_buffer() = default;
+        ~aligned_buffer(void) noexcept;
+
+        // Allocates Size bytes aligned to Alignment (must be a power of two), suitable for direct I/O.
+        xerr Init(std::uint64_t Size, std::uint64_t Alignment = page_alignment_v) noexcept;
+
+        std::span<std::byte> getSpan(void) noexcept { return { m_pData, static_cast<std::size_t>(m_Size) }; }
+
+        std::byte*      m_pData     = nullptr;
+        std::uint64_t   m_Size      = 0;
+        std::uint64_t   m_Alignment = 0;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    struct direct_file_writer
+    {
+        direct_file_writer() = default;
+        ~direct_file_writer(void) noexcept;
+
+        // Creates (or truncates) the file for unbuffered writes (O_DIRECT / FILE_FLAG_NO_BUFFERING).
+        // If the file system does not support direct I/O the file is opened buffered and m_bDirectIO is false.
+        // Alignment is the sector granularity every write must respect, for address, size and file offset.
+        xerr Open(const char* pFileName, std::uint64_t Alignment = page_alignment_v) noexcept;
+
+        // Appends the pages at the end of the file. Pages data pointer and size must be multiples of Alignment.
+        xerr Write(std::span<const std::byte> Pages) noexcept;
+
+        // Flushes and closes the file. Called by the destructor if needed.
+        xerr Close(void) noexcept;
+
+        std::intptr_t   m_Handle    = -1;
+        std::uint64_t   m_Alignment = 0;
+        std::uint64_t   m_Offset    = 0;
+        bool            m_bDirectIO = false;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Archive file layout (little endian):
+    //      archive_header  | entry data ... | toc_entry[SlotCount] (64 byte aligned) | entry names
+    // The TOC is an open addressing hash table (linear probing) keyed by the XXH64 of the entry name,
+    // so a lookup touches one or two cache lines and never scans the archive.
+    //-----------------------------------------------------------------------------------------------------
+    namespace archive
+    {
+        constexpr std::uint32_t magic_v   = 0x52414358; // 'XCAR'
+        constexpr std::uint16_t version_v = 1;
+
+        struct header
+        {
+            std::uint32_t   m_Magic;
+            std::uint16_t   m_Version;
+            std::uint16_t   m_Flags;
+            std::uint32_t   m_EntryCount;
+            std::uint32_t   m_SlotCount;        // Power of two
+            std::uint64_t   m_TocOffset;
+            std::uint64_t   m_TocSize;          // Slots plus names
+            std::uint64_t   m_TocHash;          // XXH64 of the TOC
+            std::uint64_t   m_FileSize;
+            std::uint64_t   m_Reserved[2];
+        };
+        static_assert(sizeof(header) == 64);
+
+        struct toc_entry
+        {
+            enum flags : std::uint16_t
+            { FLAGS_STORED = 1 << 0             // Data was incompressible and is stored as is
+            };
+
+            std::uint64_t   m_NameHash;         // 0 means empty slot
+            std::uint64_t   m_Offset;
+            std::uint32_t   m_CompressedSize;
+            std::uint32_t   m_UncompressedSize;
+            std::uint32_t   m_NameOffset;       // Offset from the start of the names
+            std::uint16_t   m_NameSize;
+            std::uint16_t   m_Flags;
+        };
+        static_assert(sizeof(toc_entry) == 32);
+    }
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-----------------------------------------------------------------------------------------------------
+    struct archive_writer
+    {
+        using level = fixed_block_compress::level;
+
+        // Adds an entry. The data is not copied, it must stay alive until Build/Save returns.
+        // Names must be unique and entries are limited to 4GB.
+        xerr AddEntry(std::string_view Name, std::span<const std::byte> Data) noexcept;
+
+        // Compresses all the entries (in parallel with nThreads workers, 0 means one per hardware thread) and builds the archive.
+        xerr Build(std::vector<std::byte>& Archive, level CompressionLevel = level::HIGH, std::uint32_t nThreads = 1) noexcept;
+
+        // Same as Build but writes the archive to a file.
+        xerr Save(const char* pFileName, level CompressionLevel = level::HIGH, std::uint32_t nThreads = 1) noexcept;
+
+        struct entry
+        {
+            std::string                 m_Name;
+            std::span<const std::byte>  m_Data;
+        };
+
+        std::vector<entry> m_Entries = {};
+    };
+#endif
+
+    //-----------------------------------------------------------------------------------------------------
+    struct archive_reader
+    {
+        archive_reader() = default;
+        ~archive_reader(void) noexcept;
+
+        // Memory maps the file and validates the TOC. Nothing else is read until entries are extracted.
+        xerr Open(const char* pFileName) noexcept;
+
+        // Uses an archive that is already in memory. The memory must stay alive while the reader is used.
+        xerr Init(std::span<const std::byte> Archive) noexcept;
+
+        // Unmaps the file. Called by the destructor if needed.
+        void Close(void) noexcept;
+
+        // O(1) lookup by name, returns nullptr if the entry does not exist. Thread safe.
+        const archive::toc_entry* Find(std::string_view Name) const noexcept;
+
+        // Decompresses an entry. Destination must be at least m_UncompressedSize.
+        // Uses the reader's decompression context so it is not thread safe, use one reader per thread.
+        xerr Extract(std::span<std::byte> Destination, const archive::toc_entry& Entry) noexcept;
+
+        std::string_view            getName         (const archive::toc_entry& Entry) const noexcept;
+        std::span<const std::byte>  getCompressed   (const archive::toc_entry& Entry) const noexcept;
+
+        std::span<const std::byte>  m_Archive   = {};
+        const archive::header*      m_pHeader   = nullptr;
+        const archive::toc_entry*   m_pSlots    = nullptr;
+        const char*                 m_pNames    = nullptr;
+        std::uint64_t               m_NamesSize = 0;
+        void*                       m_pDCTX     = nullptr;
+        void*                       m_pMapping  = nullptr;  // Base of the file mapping when opened from a file
+        std::size_t                 m_MappingSize = 0;      // Length of the file mapping (it may outlive a failed Init)
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Cache of decompressed frames for random reads, keyed by (blob id, frame index).
+    // The keys are spread over independently locked shards (LRU each) to keep contention low,
+    // and concurrent misses on the same key are coalesced so the frame only gets decompressed once.
+    //-----------------------------------------------------------------------------------------------------
+    struct block_cache
+    {
+        struct key
+        {
+            std::uint64_t m_BlobID;
+            std::uint64_t m_FrameIndex;
+            bool operator == (const key&) const noexcept = default;
+        };
+
+        using block = std::shared_ptr<const std::vector<std::byte>>;
+
+        struct stats
+        {
+            std::uint64_t m_Hits;
+            std::uint64_t m_Misses;
+            std::uint64_t m_Coalesced;          // Misses that waited for another thread's decompression
+            std::uint64_t m_Evictions;
+            std::uint64_t m_BytesInUse;
+        };
+
+        block_cache() = default;
+        ~block_cache(void) noexcept;
+
+        // ByteBudget: maximum number of decompressed bytes kept, split evenly among the shards.
+        // MaxBlockSize: BlockSize used for compression, needed when a frame does not record its decompressed size.
+        // nShards: rounded up to a power of two.
+        xerr Init(std::uint64_t ByteBudget, std::uint64_t MaxBlockSize, std::uint32_t nShards = 16) noexcept;
+
+        // Returns the decompressed frame for Key, decompressing CompressedFrame on a miss. Thread safe.
+        // bStored: the frame holds raw data (the compressor returned INCOMPRESSIBLE for that chunk).
+        // Blocks stay valid while referenced, even after they are evicted.
+        xerr Get(block& Block, const key& Key, std::span<const std::byte> CompressedFrame, bool bStored = false) noexcept;
+
+        stats getStats(void) const noexcept;
+
+        struct shard;
+
+        shard*                          m_pShards       = nullptr;
+        std::uint32_t                   m_ShardMask     = 0;
+        std::uint64_t                   m_ShardBudget   = 0;
+        std::uint64_t                   m_MaxBlockSize  = 0;
+        std::atomic<std::uint64_t>      m_Hits          = 0;
+        std::atomic<std::uint64_t>      m_Misses        = 0;
+        std::atomic<std::uint64_t>      m_Coalesced     = 0;
+        std::atomic<std::uint64_t>      m_Evictions     = 0;
+        std::atomic<std::uint64_t>      m_BytesInUse    = 0;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // One-shot compression for small messages (RPC payloads of a few hundred bytes).
+    // Frames are magicless and carry neither content size, checksum nor dictionary ID,
+    // so the receiver must know the decompressed size. Uses contexts owned by the calling thread.
+    //-----------------------------------------------------------------------------------------------------
+    struct small_message
+    {
+#ifndef XCOMPRESSION_DECODE_ONLY
+        using level = fixed_block_compress::level;
+
+        // Compresses Source into Destination, updating CompressedSize with bytes written.
+        // Returns err::state::INCOMPRESSIBLE if the compressed size is not smaller than the input size,
+        // in which case the message should be sent as is.
+        static xerr Pack(std::uint64_t& CompressedSize, std::span<std::byte> Destination, const std::span<const std::byte> Source, level CompressionLevel = level::FAST) noexcept;
+#endif
+
+        // Decompresses Source into Destination, Destination.size() must be the exact decompressed size.
+        static xerr Unpack(std::span<std::byte> Destination, const std::span<const std::byte> Source) noexcept;
+    };
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-----------------------------------------------------------------------------------------------------
+    // Worker pool that runs compression/decompression jobs off the caller's thread.
+    // Each worker owns its zstd contexts and reuses them for every job.
+    // Every job is a single frame, compatible with fixed_block_compress/fixed_block_decompress block mode.
+    //-----------------------------------------------------------------------------------------------------
+    struct job_service
+    {
+        using level = fixed_block_compress::level;
+
+        enum class operation : std::uint8_t
+        { COMPRESS
+        , DECOMPRESS
+        };
+
+        enum class priority : std::uint8_t
+        { LOW
+        , NORMAL
+        , HIGH
+        , COUNT
+        };
+
+        struct result
+        {
+            xerr                    m_Error     = {};   // INCOMPRESSIBLE works the same as in Pack: use the original data
+            std::uint64_t           m_Size      = 0;    // Bytes written to the destination
+            std::vector<std::byte>  m_Data      = {};   // Output when the job did not provide a destination
+        };
+
+        using callback = std::function<void(result&&)>;
+
+        struct job
+        {
+            operation                   m_Operation             = operation::COMPRESS;
+            priority                    m_Priority              = priority::NORMAL;
+            level                       m_Level                 = level::MEDIUM;
+            std::span<const std::byte>  m_Source                = {};                   // Must stay alive until the job completes
+            std::span<std::byte>        m_Destination           = {};                   // Optional, when empty the output goes to result::m_Data
+            std::uint64_t               m_DecompressedSize      = 0;                    // Decompression only, 0 reads it from the frame
+            std::uint64_t               m_MaxDecompressedSize   = 64 * 1024 * 1024;     // Decompression only, bigger frames fail instead of allocating
+            callback                    m_Callback              = {};                   // Optional, called from the worker thread instead of fulfilling a future
+        };
+
+        job_service() = default;
+        ~job_service(void) noexcept;
+
+        // Starts nWorkers threads (0 means one per hardware thread).
+        // MaxQueueDepth is the number of jobs that can wait in the queue before Submit applies back-pressure.
+        xerr Init(std::uint32_t nWorkers, std::uint32_t MaxQueueDepth = 256) noexcept;
+
+        // Queues a job. Jobs with higher priority are picked first, FIFO within the same priority.
+        // pFuture receives the result unless the job has a callback.
+        // When the queue is full it blocks if bWaitWhenFull, otherwise it returns err::state::NOT_DONE and the job is not queued.
+        xerr Submit(job&& Job, std::future<result>* pFuture = nullptr, bool bWaitWhenFull = true) noexcept;
+
+        // Finishes all queued jobs and stops the workers. Called by the destructor if needed.
+        void Shutdown(void) noexcept;
+
+        struct queue;
+
+        queue*                      m_pQueue    = nullptr;
+        std::vector<std::jthread>   m_Workers   = {};
+    };
+#endif
+
+    //-----------------------------------------------------------------------------------------------------
+    // Output sinks receive decompressed data as a list of buffers so they can write it with a single
+    // vectored call (writev/sendmsg/WSASend) instead of one call and one copy per block.
+    //-----------------------------------------------------------------------------------------------------
+    struct output_sink
+    {
+        virtual ~output_sink(void) noexcept = default;
+
+        // Writes all the buffers, in order. The buffers are only valid during the call.
+        virtual xerr Write(std::span<const std::span<const std::byte>> Buffers) noexcept = 0;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Writes to a file descriptor (a HANDLE in windows). The handle is not owned.
+    struct file_sink final : output_sink
+    {
+        explicit file_sink(std::intptr_t Handle) noexcept : m_Handle{ Handle } {}
+        xerr Write(std::span<const std::span<const std::byte>> Buffers) noexcept override;
+
+        std::intptr_t m_Handle;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Writes to a connected stream socket. The socket is not owned.
+    struct socket_sink final : output_sink
+    {
+        explicit socket_sink(std::intptr_t Socket) noexcept : m_Socket{ Socket } {}
+        xerr Write(std::span<const std::span<const std::byte>> Buffers) noexcept override;
+
+        std::intptr_t m_Socket;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Collects the data in a list of fixed size segments, so it never reallocates or moves what it already has.
+    struct buffer_chain_sink final : output_sink
+    {
+        explicit buffer_chain_sink(std::size_t SegmentSize = 64 * 1024) noexcept : m_SegmentSize{ SegmentSize } {}
+        xerr Write(std::span<const std::span<const std::byte>> Buffers) noexcept override;
+
+        std::vector<std::vector<std::byte>> m_Segments      = {};   // Only the last segment may be partially filled
+        std::size_t                         m_SegmentSize;
+        std::uint64_t                       m_Size          = 0;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Streaming decompression (fixed_block_compress streaming mode) that writes to an output_sink.
+    // Decompressed data is accumulated in an internal arena of nBlocks * BlockSize bytes and handed to the
+    // sink with one vectored write when the arena is full or on Flush.
+    //-----------------------------------------------------------------------------------------------------
+    struct sink_decompress
+    {
+        sink_decompress() = default;
+        ~sink_decompress(void) noexcept;
+
+        xerr Init(output_sink& Sink, std::uint64_t BlockSize, std::uint32_t nBlocks = 16) noexcept;
+
+        // Decompresses the next chunk. bStored means the chunk was returned INCOMPRESSIBLE by the compressor
+        // and holds raw data: it is not copied, so it must stay valid until the next Flush.
+        xerr Unpack(const std::span<const std::byte> SourceCompressed, bool bStored = false) noexcept;
+
+        // Writes everything accumulated so far to the sink. Call it once the last chunk was unpacked.
+        xerr Flush(void) noexcept;
+
+        void*                                   m_pDCTX             = nullptr;
+        output_sink*                            m_pSink             = nullptr;
+        std::vector<std::byte>                  m_Arena             = {};
+        std::uint64_t                           m_ArenaUsed         = 0;
+        std::vector<std::span<const std::byte>> m_Pending           = {};   // Buffers waiting for the next vectored write
+        std::uint64_t                           m_BlockSize         = 0;
+        std::uint64_t                           m_OutputPosition    = 0;    // Bytes handed to the sink
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // One chunk of a fixed_block_compress stream.
+    // m_Data is the compressed chunk, or the raw input itself when m_bStored (Pack returned INCOMPRESSIBLE).
+    //-----------------------------------------------------------------------------------------------------
+    struct stream_chunk
+    {
+        std::span<const std::byte>  m_Data          = {};
+        std::uint64_t               m_SourceOffset  = 0;    // Input range the chunk covers
+        std::uint64_t               m_SourceSize    = 0;
+        bool                        m_bStored       = false;
+    };
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-----------------------------------------------------------------------------------------------------
+    // Input range over the chunks of a streaming fixed_block_compress, so callers iterate instead of
+    // looping on NOT_DONE. A chunk stays valid until the iterator is incremented.
+    // Real failures stop the iteration and are reported by getError().
+    //-----------------------------------------------------------------------------------------------------
+    struct fixed_block_pack_range
+    {
+        struct iterator
+        {
+            using iterator_concept  = std::input_iterator_tag;
+            using difference_type   = std::ptrdiff_t;
+            using value_type        = stream_chunk;
+
+            const stream_chunk& operator*   (void) const noexcept { return m_pRange->m_Chunk; }
+            const stream_chunk* operator->  (void) const noexcept { return &m_pRange->m_Chunk; }
+            iterator&           operator++  (void) noexcept { m_pRange->Next(); return *this; }
+            void                operator++  (int) noexcept { m_pRange->Next(); }
+            bool                operator==  (std::default_sentinel_t) const noexcept { return m_pRange->m_bDone; }
+
+            fixed_block_pack_range* m_pRange = nullptr;
+        };
+
+        // Compressor must be initialized in streaming mode and must outlive the range.
+        xerr Init(fixed_block_compress& Compressor) noexcept;
+
+        iterator                begin   (void) noexcept;
+        std::default_sentinel_t end     (void) const noexcept { return {}; }
+
+        // Why the iteration stopped early, empty if every chunk was produced.
+        const xerr& getError(void) const noexcept { return m_Error; }
+
+        void Next(void) noexcept;
+
+        fixed_block_compress*   m_pCompressor   = nullptr;
+        std::vector<std::byte>  m_Buffer        = {};
+        stream_chunk            m_Chunk         = {};
+        xerr                    m_Error         = {};
+        bool                    m_bStarted      = false;
+        bool                    m_bFinished     = false;    // Pack returned OK, nothing left to produce
+        bool                    m_bDone         = false;
+    };
+#endif
+
+    //-----------------------------------------------------------------------------------------------------
+    // Input range over the decoded data of a sequence of stream_chunk, using two BlockSize buffers in turn.
+    // Each element is the next piece of the output: a span of one of the buffers, or the chunk itself when it is stored.
+    // A span stays valid until the iterator is incremented twice (the other buffer is filled in between).
+    //-----------------------------------------------------------------------------------------------------
+    struct fixed_block_unpack_range
+    {
+        struct iterator
+        {
+            using iterator_concept  = std::input_iterator_tag;
+            using difference_type   = std::ptrdiff_t;
+            using value_type        = std::span<const std::byte>;
+
+            std::span<const std::byte>  operator*   (void) const noexcept { return m_pRange->m_Output; }
+            iterator&                   operator++  (void) noexcept { m_pRange->Next(); return *this; }
+            void                        operator++  (int) noexcept { m_pRange->Next(); }
+            bool                        operator==  (std::default_sentinel_t) const noexcept { return m_pRange->m_bDone; }
+
+            fixed_block_unpack_range* m_pRange = nullptr;
+        };
+
+        // Decompressor must be initialized in streaming mode, it and the chunks must outlive the range.
+        xerr Init(fixed_block_decompress& Decompressor, std::span<const stream_chunk> Chunks) noexcept;
+
+        iterator                begin   (void) noexcept;
+        std::default_sentinel_t end     (void) const noexcept { return {}; }
+
+        // Why the iteration stopped early, empty if every chunk was decoded.
+        const xerr& getError(void) const noexcept { return m_Error; }
+
+        void Next(void) noexcept;
+
+        fixed_block_decompress*         m_pDecompressor = nullptr;
+        std::span<const stream_chunk>   m_Chunks        = {};
+        std::size_t                     m_iChunk        = 0;
+        std::vector<std::byte>          m_Buffers[2]    = {};
+        std::uint32_t                   m_iBuffer       = 0;
+        std::span<const std::byte>      m_Output        = {};
+        xerr                            m_Error         = {};
+        bool                            m_bStarted      = false;
+        bool                            m_bPending      = false;    // Current chunk returned NOT_DONE
+        bool                            m_bDone         = false;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Content-defined chunking (FastCDC style gear hash with normalized chunking).
+    // Boundaries depend on the content around them, so inserting or removing bytes only changes the chunks
+    // next to the edit and the rest of the data still splits the same way.
+    //-----------------------------------------------------------------------------------------------------
+    struct cdc_chunker
+    {
+        // AvgSize is rounded down to a power of two. MinSize <= AvgSize <= MaxSize.
+        xerr Init(std::uint32_t MinSize = 2 * 1024, std::uint32_t AvgSize = 8 * 1024, std::uint32_t MaxSize = 64 * 1024) noexcept;
+
+        // Size of the chunk that starts at Data[0] (all of Data if it is no larger than MinSize).
+        std::size_t NextChunkSize(std::span<const std::byte> Data) const noexcept;
+
+        std::uint64_t   m_MaskSmall = 0;    // Harder to match, used before AvgSize
+        std::uint64_t   m_MaskLarge = 0;    // Easier to match, used after AvgSize
+        std::uint32_t   m_MinSize   = 0;
+        std::uint32_t   m_AvgSize   = 0;
+        std::uint32_t   m_MaxSize   = 0;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Deduplicated stream format: one record per chunk, followed by its payload.
+    // m_PayloadSize == 0 is a reference to a chunk already in the store, == m_Size means the chunk is stored raw,
+    // anything else is a zstd frame.
+    //-----------------------------------------------------------------------------------------------------
+    namespace dedup
+    {
+        struct fingerprint
+        {
+            std::uint64_t   m_A;
+            std::uint64_t   m_B;
+
+            bool operator == (const fingerprint&) const noexcept = default;
+        };
+
+        struct fingerprint_hash
+        {
+            std::size_t operator()(const fingerprint& F) const noexcept { return static_cast<std::size_t>(F.m_A); }
+        };
+
+        struct record
+        {
+            fingerprint     m_Fingerprint;      // 128 bits: XXH64 of the chunk with two seeds
+            std::uint32_t   m_Size;             // Decompressed size of the chunk
+            std::uint32_t   m_PayloadSize;
+        };
+        static_assert(sizeof(record) == 24);
+    }
+
+    //-----------------------------------------------------------------------------------------------------
+    // Chunks known to a decoder, keyed by fingerprint. Keep it alive across snapshots: a stream can only
+    // be decoded if the chunks it references were added (by decoding earlier streams) before.
+    //-----------------------------------------------------------------------------------------------------
+    struct chunk_store
+    {
+        // Returns an empty span if the chunk is unknown.
+        std::span<const std::byte> Find(const dedup::fingerprint& Fingerprint) const noexcept;
+
+        std::unordered_map<dedup::fingerprint, std::vector<std::byte>, dedup::fingerprint_hash> m_Chunks = {};
+        std::uint64_t                                                                           m_Bytes  = 0;
+    };
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-----------------------------------------------------------------------------------------------------
+    // Splits the input with a cdc_chunker and only compresses chunks it has not seen before,
+    // repeated chunks (in the same input or in earlier ones) become references.
+    // Use one object for the whole series of snapshots so it remembers their chunks.
+    //-----------------------------------------------------------------------------------------------------
+    struct dedup_compress
+    {
+        using level = fixed_block_compress::level;
+
+        struct stats
+        {
+            std::uint64_t   m_InputBytes        = 0;
+            std::uint64_t   m_DuplicateBytes    = 0;    // Input bytes emitted as references
+            std::uint64_t   m_OutputBytes       = 0;
+            std::uint64_t   m_nChunks           = 0;
+            std::uint64_t   m_nDuplicates       = 0;
+        };
+
+        dedup_compress() = default;
+        ~dedup_compress(void) noexcept;
+
+        xerr Init(level CompressionLevel = level::MEDIUM, std::uint32_t MinSize = 2 * 1024, std::uint32_t AvgSize = 8 * 1024, std::uint32_t MaxSize = 64 * 1024) noexcept;
+
+        // Appends the deduplicated stream of Source to Output.
+        xerr Pack(std::vector<std::byte>& Output, const std::span<const std::byte> Source) noexcept;
+
+        const stats& getStats(void) const noexcept { return m_Stats; }
+
+        void*                                                                           m_pCCTX     = nullptr;
+        cdc_chunker                                                                     m_Chunker   = {};
+        std::unordered_map<dedup::fingerprint, std::uint32_t, dedup::fingerprint_hash>  m_Known     = {};   // Chunks already emitted, with their size
+        stats                                                                           m_Stats     = {};
+        int                                                                             m_Level     = 0;
+    };
+#endif
+
+    //-----------------------------------------------------------------------------------------------------
+    struct dedup_decompress
+    {
+        // Appends the data of a dedup_compress stream to Output, resolving references from Store
+        // and adding the new chunks to it. MaxChunkSize is the MaxSize the stream was compressed with,
+        // records claiming bigger chunks are rejected as corrupted.
+        static xerr Unpack(std::vector<std::byte>& Output, chunk_store& Store, const std::span<const std::byte> Source, std::uint32_t MaxChunkSize = 64 * 1024) noexcept;
+    };
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-----------------------------------------------------------------------------------------------------
+    // Memoizes compression results by content: the same bytes at the same level are compressed once and
+    // served from an in-memory LRU (and optionally a cache directory shared between runs and machines).
+    // Results are fixed_block_compress block mode frames, decode them with fixed_block_decompress block mode.
+    //-----------------------------------------------------------------------------------------------------
+    struct compress_memo
+    {
+        using level = fixed_block_compress::level;
+        using block = std::shared_ptr<const std::vector<std::byte>>;
+
+        struct stats
+        {
+            std::uint64_t m_Hits;
+            std::uint64_t m_DiskHits;               // Hits served from the cache directory (included in m_Hits)
+            std::uint64_t m_Misses;
+            std::uint64_t m_SavedNanoseconds;       // Compression time the hits would have cost
+            std::uint64_t m_BytesInUse;
+        };
+
+        compress_memo() = default;
+        ~compress_memo(void) noexcept;
+
+        // ByteBudget: maximum number of compressed bytes kept in memory.
+        // CacheDirectory: where results are also kept on disk, empty for memory only. It is created if needed.
+        xerr Init(std::uint64_t ByteBudget, std::string_view CacheDirectory = {}) noexcept;
+
+        // Sets Compressed to the frame for Source at CompressionLevel, compressing only on a miss. Thread safe.
+        // Returns err::state::INCOMPRESSIBLE (also remembered) when Source should be stored as is, Compressed is then empty.
+        xerr Pack(block& Compressed, const std::span<const std::byte> Source, level CompressionLevel = level::HIGH) noexcept;
+
+        stats getStats(void) const noexcept;
+
+        struct table;
+
+        table*                          m_pTable            = nullptr;
+        std::string                     m_Directory         = {};
+        std::uint64_t                   m_ByteBudget        = 0;
+        std::atomic<std::uint64_t>      m_Hits              = 0;
+        std::atomic<std::uint64_t>      m_DiskHits          = 0;
+        std::atomic<std::uint64_t>      m_Misses            = 0;
+        std::atomic<std::uint64_t>      m_SavedNanoseconds  = 0;
+    };
+#endif
+
+    //-----------------------------------------------------------------------------------------------------
+    // Hardware performance counters (Linux perf_event_open) per Pack/Unpack stage, to tell whether time goes
+    // to the memory subsystem or to the algorithm. Point a compressor's or decompressor's m_pPerf at it.
+    // Counts the thread that called Init, so use one per thread. Counters the kernel refuses (no permission,
+    // virtual machines, other platforms) are reported as unavailable, wall time is always recorded.
+    //-----------------------------------------------------------------------------------------------------
+    struct perf_counters
+    {
+        enum class stage : std::uint8_t
+        { INIT                                  // Context setup
+        , SEARCH                                // Dynamic block size search probes
+        , COMPRESS                              // Final compression of a block/chunk/page
+        , FLUSH                                 // Streaming flushes
+        , DECOMPRESS
+        , COUNT
+        };
+
+        enum class counter : std::uint8_t
+        { CYCLES
+        , INSTRUCTIONS
+        , CACHE_MISSES
+        , BRANCH_MISSES
+        , COUNT
+        };
+
+        struct sample
+        {
+            std::uint64_t m_Counters[static_cast<int>(counter::COUNT)] = {};
+            std::uint64_t m_Nanoseconds = 0;
+        };
+
+        struct totals
+        {
+            sample          m_Sample    = {};
+            std::uint64_t   m_Bytes     = 0;        // Input bytes for compression stages, output bytes for DECOMPRESS
+            std::uint64_t   m_Calls     = 0;
+
+            double getCyclesPerByte (void) const noexcept;
+            double getIPC           (void) const noexcept;
+        };
+
+        // Measures one region, does nothing when pPerf is null. m_Bytes can be set before the scope ends.
+        struct scope
+        {
+            scope(perf_counters* pPerf, stage Stage, std::uint64_t Bytes = 0) noexcept : m_pPerf(pPerf), m_Stage(Stage), m_Bytes(Bytes) { if (m_pPerf) m_pPerf->Read(m_Start); }
+           ~scope(void) noexcept { if (m_pPerf) m_pPerf->Add(m_Stage, m_Start, m_Bytes); }
+
+            perf_counters*  m_pPerf;
+            stage           m_Stage;
+            std::uint64_t   m_Bytes;
+            sample          m_Start;
+        };
+
+        perf_counters() = default;
+        ~perf_counters(void) noexcept;
+
+        // Opens and starts the counters. Only fails on invalid use, missing counters are not an error.
+        xerr Init(void) noexcept;
+
+        bool isAvailable(counter Counter) const noexcept { return m_Index[static_cast<int>(Counter)] >= 0; }
+
+        const totals& getTotals(stage Stage) const noexcept { return m_Totals[static_cast<int>(Stage)]; }
+
+        // One line per stage with calls, bytes, time, cycles/byte, IPC and miss counts ("n/a" when unavailable).
+        std::string getReport(void) const;
+
+        void Reset(void) noexcept;
+        void Read(sample& Sample) const noexcept;
+        void Add(stage Stage, const sample& Start, std::uint64_t Bytes) noexcept;
+
+        int             m_GroupFD                                       = -1;
+        int             m_FDs[static_cast<int>(counter::COUNT)]         = { -1, -1, -1, -1 };
+        int             m_Index[static_cast<int>(counter::COUNT)]       = { -1, -1, -1, -1 };  // Position in the group read, -1 if unavailable
+        int             m_nOpen                                         = 0;
+        totals          m_Totals[static_cast<int>(stage::COUNT)]        = {};
+    };
+
+#ifndef XCOMPRESSION_DECODE_ONLY
+    //-----------------------------------------------------------------------------------------------------
+    // Upgrades data that was compressed at a low level on ingest to a higher level later on. A blob is any
+    // sequence of zstd frames (block mode frames back to back, sync groups, archive payloads...). Each frame
+    // is streamed through decode and re-encode with fixed size buffers, and only replaces the original when
+    // it came out smaller, so memory stays within the frame size plus the contexts and a blob stays readable
+    // after any number of frames were upgraded. The window and checksum flag of the original frame are kept.
+    //-----------------------------------------------------------------------------------------------------
+    struct recompressor
+    {
+        using level = fixed_block_compress::level;
+
+        struct frame
+        {
+            xerr                        m_Error         = {};       // The blob is left as it is from this frame on
+            std::uint64_t               m_SourceOffset  = 0;        // Where the original frame starts in the blob
+            std::uint64_t               m_SourceSize    = 0;        // Size of the original frame
+            std::span<const std::byte>  m_Data          = {};       // What to store in its place, only valid during the callback
+            bool                        m_bUpgraded     = false;    // false when m_Data is the original frame
+        };
+
+        // Called from the background thread once per frame, in order
+        using callback = std::function<void(const frame&)>;
+
+        struct stats
+        {
+            std::uint64_t   m_nFrames               = 0;
+            std::uint64_t   m_nUpgraded             = 0;
+            std::uint64_t   m_InputBytes            = 0;
+            std::uint64_t   m_OutputBytes           = 0;
+            std::uint64_t   m_BusyNanoseconds       = 0;    // Background thread only
+            std::uint64_t   m_ThrottledNanoseconds  = 0;    // Time the background thread slept to respect the CPU cap
+        };
+
+        recompressor() = default;
+        ~recompressor(void) noexcept;
+
+        // Target level and the share of one core the background thread may use (1 to 100).
+        // The background thread also runs at the lowest OS priority.
+        xerr Init(level Target = level::HIGH, std::uint32_t CPUPercent = 25) noexcept;
+
+        // Upgrades all the frames of Blob on the calling thread (no CPU cap) and writes the new blob to Output.
+        xerr Upgrade(std::vector<std::byte>& Output, std::span<const std::byte> Blob) noexcept;
+
+        // Queues a blob for the background thread, Callback tells where each frame goes. Blob must stay alive
+        // until Wait returns or the recompressor shuts down.
+        xerr Submit(std::span<const std::byte> Blob, callback&& Callback) noexcept;
+
+        // Blocks until all the submitted blobs are done.
+        void Wait(void) noexcept;
+
+        // Stops the background thread at the next step. Frames already reported stay valid, the rest are untouched.
+        void Shutdown(void) noexcept;
+
+        stats getStats(void) const noexcept;
+
+        struct worker;
+
+        worker*                         m_pWorker               = nullptr;
+        void*                           m_pCCTX                 = nullptr;  // Contexts for Upgrade, the background thread has its own
+        void*                           m_pDCTX                 = nullptr;
+        std::vector<std::byte>          m_Plain                 = {};       // Decoded blocks for Upgrade, reused between calls
+        int                             m_Level                 = 0;
+        std::uint32_t                   m_CPUPercent            = 100;
+        std::atomic<std::uint64_t>      m_nFrames               = 0;
+        std::atomic<std::uint64_t>      m_nUpgraded             = 0;
+        std::atomic<std::uint64_t>      m_InputBytes            = 0;
+        std::atomic<std::uint64_t>      m_OutputBytes           = 0;
+        std::atomic<std::uint64_t>      m_BusyNanoseconds       = 0;
+        std::atomic<std::uint64_t>      m_ThrottledNanoseconds  = 0;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // fixed_block_compress streaming mode (SyncInterval 1) spread over a pool of threads. Every chunk is an
+    // independent frame, so the workers compress them in any order with one context each, and Pack hands
+    // them back in source order: same chunks, same bytes and same INCOMPRESSIBLE results as the single
+    // thread version, whatever the thread count. Chunks are dealt round robin to per worker queues, a worker
+    // that runs out steals from the others. Workers never run more than MaxChunksAhead past Pack.
+    //-----------------------------------------------------------------------------------------------------
+    struct fixed_block_parallel_compress
+    {
+        using level = fixed_block_compress::level;
+
+        fixed_block_parallel_compress() = default;
+        ~fixed_block_parallel_compress(void) noexcept;
+
+        // nThreads 0 means one per hardware thread, MaxChunksAhead 0 means four per thread.
+        xerr Init(std::uint64_t BlockSize, const std::span<const std::byte> SourceUncompress, level CompressionLevel = level::HIGH, std::uint32_t nThreads = 0, std::uint32_t MaxChunksAhead = 0) noexcept;
+
+        // Scatter-gather version, same rules as fixed_block_compress.
+        xerr Init(std::uint64_t BlockSize, const std::span<const std::span<const std::byte>> SourceSegments, level CompressionLevel = level::HIGH, std::uint32_t nThreads = 0, std::uint32_t MaxChunksAhead = 0) noexcept;
+
+        // Same contract as fixed_block_compress::Pack in streaming mode: one chunk per call (NOT_DONE),
+        // INCOMPRESSIBLE for chunks to store as they are, no error once everything was returned.
+        // Except that chunks are never drained: the workers compress ahead, so Destination must hold a whole chunk,
+        // at least BlockSize (or the remaining input size) bytes.
+        xerr Pack(std::uint64_t& CompressedSize, std::span<std::byte> Destination) noexcept;
+
+        std::uint64_t CopySource(std::span<std::byte> Destination, std::uint64_t Offset) const noexcept;
+
+        // Stops the workers. Called by the destructor if needed.
+        void Shutdown(void) noexcept;
+
+        struct pool;
+
+        pool*           m_pPool         = nullptr;
+        std::uint64_t   m_Position      = 0;        // Source bytes returned so far
+        std::uint64_t   m_SourceSize    = 0;
+        std::uint64_t   m_BlockSize     = 0;
+        std::uint64_t   m_ChunkIndex    = 0;        // Next chunk Pack returns
+        std::uint64_t   m_nChunks       = 0;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Streaming compression for data that arrives a little at a time (live telemetry, replays). Input is
+    // compressed into one open frame as it is written. It goes to the output_sink with ZSTD_e_flush once the
+    // oldest unflushed byte is MaxDelay old, or right away when MinFlushSize bytes are waiting. The frame
+    // stays open across flushes so new data keeps matching against the old. Read the output with
+    // fixed_block_decompress streaming mode, with BlockSize * SyncInterval covering HistorySize.
+    //-----------------------------------------------------------------------------------------------------
+    struct latency_compress
+    {
+        using level = fixed_block_compress::level;
+        using clock = std::chrono::steady_clock;
+
+        struct stats
+        {
+            static constexpr int histogram_size_v = 32;
+
+            std::uint64_t   m_Histogram[histogram_size_v]   = {};   // Flush delays, bucket i holds [2^i, 2^(i+1)) microseconds (bucket 0 from 0)
+            std::uint64_t   m_nFlushes                      = 0;
+            std::uint64_t   m_nDeadlineFlushes              = 0;    // Flushes forced by MaxDelay, the others by MinFlushSize or Close
+            std::uint64_t   m_MaxMicroseconds               = 0;
+            std::uint64_t   m_InputBytes                    = 0;
+            std::uint64_t   m_OutputBytes                   = 0;
+
+            // Delay that Percentile % (0 to 100) of the flushes stayed under, rounded up to its histogram bucket
+            std::uint64_t getPercentileMicroseconds(double Percentile) const noexcept;
+        };
+
+        latency_compress() = default;
+        ~latency_compress(void) noexcept;
+
+        // HistorySize caps the window (what the decoder must keep), 0 uses the window of the level.
+        xerr Init(output_sink& Sink, clock::duration MaxDelay, std::uint64_t MinFlushSize = 64 * 1024, level CompressionLevel = level::MEDIUM, std::uint64_t HistorySize = 1024 * 1024) noexcept;
+
+        // Compresses Data, which arrived at Now, and flushes if the policy says so.
+        xerr Write(std::span<const std::byte> Data, clock::time_point Now = clock::now()) noexcept;
+
+        // Flushes if the deadline passed. Call it from a timer armed with getDeadline when input may stop.
+        xerr Poll(clock::time_point Now = clock::now()) noexcept;
+
+        // When the waiting input has to be flushed, clock::time_point::max() when nothing is waiting.
+        clock::time_point getDeadline(void) const noexcept;
+
+        // Flushes everything and ends the frame. The next Write starts a new frame.
+        xerr Close(clock::time_point Now = clock::now()) noexcept;
+
+        const stats& getStats(void) const noexcept { return m_Stats; }
+
+        void*                   m_pCCTX         = nullptr;
+        output_sink*            m_pSink         = nullptr;
+        std::vector<std::byte>  m_Buffer        = {};       // Compressed output on its way to the sink
+        clock::duration         m_MaxDelay      = {};
+        std::uint64_t           m_MinFlushSize  = 0;
+        std::uint64_t           m_Pending       = 0;        // Input bytes written since the last flush
+        clock::time_point       m_Oldest        = {};       // Arrival of the oldest of them
+        stats                   m_Stats         = {};
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Lock-free front end between threads that produce bytes (logging, event capture) and a compressor.
+    // Producers Reserve space in a ring, write in place and Commit: a compare-and-swap on the head index (a plain
+    // store with a single producer) and a release store, never a lock or a syscall. The compressor thread owned
+    // by the ring collects committed records in order into BlockSize chunks, compresses them straight out of the
+    // ring (scatter-gather, no copies) the same way as fixed_block_compress streaming mode, and hands them to
+    // the callback. Decode the chunks like fixed_block_compress streaming chunks.
+    //-----------------------------------------------------------------------------------------------------
+    struct ring_compress
+    {
+        using level     = fixed_block_compress::level;
+        using callback  = std::function<void(const stream_chunk&)>;    // Called on the compressor thread, m_Data is only valid during the call
+
+        enum class producers : std::uint8_t
+        { SINGLE
+        , MULTIPLE
+        };
+
+        struct stats
+        {
+            std::uint64_t   m_nChunks       = 0;
+            std::uint64_t   m_nStored       = 0;    // Chunks handed out as raw data (INCOMPRESSIBLE)
+            std::uint64_t   m_InputBytes    = 0;
+            std::uint64_t   m_OutputBytes   = 0;
+            std::uint64_t   m_nFull         = 0;    // Reservations refused because the ring was full
+        };
+
+        struct alignas(64) padded_index
+        {
+            std::atomic<std::uint64_t> m_Value = 0;
+        };
+
+        ring_compress() = default;
+        ~ring_compress(void) noexcept;
+
+        // Capacity (bytes) is rounded up to a power of two, every record takes 16 bytes of header plus its size rounded to 16.
+        // A record can use at most half the ring, see getMaxRecordSize().
+        xerr Init(std::uint64_t Capacity, std::uint64_t BlockSize, callback&& Callback, producers Producers = producers::MULTIPLE, level CompressionLevel = level::MEDIUM) noexcept;
+
+        // Largest record Reserve and Write accept (Capacity / 2 - 16).
+        std::size_t getMaxRecordSize(void) const noexcept;
+
+        // Reserves Size bytes to write in place, or a span with a null data() when the ring is full (nothing is reserved then).
+        // Sizes above getMaxRecordSize() never fit and always return a null span, check them before retrying.
+        // Every reservation must be committed: the compressor thread takes records in reservation order.
+        std::span<std::byte> Reserve(std::size_t Size) noexcept;
+
+        // Publishes the first Size bytes of a reservation.
+        void Commit(std::span<std::byte> Reservation, std::size_t Size) noexcept;
+        void Commit(std::span<std::byte> Reservation) noexcept { Commit(Reservation, Reservation.size()); }
+
+        // Reserve, copy and Commit. Returns err::state::NOT_DONE when the ring is full (retry later),
+        // and a plain error when the record is bigger than getMaxRecordSize() (it will never fit).
+        xerr Write(std::span<const std::byte> Data) noexcept;
+
+        // Blocks until everything committed so far went to the callback, the last chunk may be partial.
+        void Flush(void) noexcept;
+
+        // Compresses what was committed and stops the compressor thread. Called by the destructor if needed.
+        void Shutdown(void) noexcept;
+
+        stats getStats(void) const noexcept;
+
+        struct consumer;
+
+        // Read only after Init, shared by everyone
+        std::byte*                  m_pBuffer               = nullptr;  // Free space is kept zeroed
+        std::uint64_t               m_Capacity              = 0;
+        bool                        m_bMultipleProducers    = true;
+        consumer*                   m_pConsumer             = nullptr;
+
+        // One cache line each
+        padded_index                m_Head;                             // Written by producers
+        padded_index                m_Tail;                             // Written by the compressor thread, the ring is free up to m_Head - m_Tail
+        padded_index                m_nFull;
+        padded_index                m_FlushRequest;
+        padded_index                m_FlushDone;
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Append-only compressed log made of independent frames (one every FrameSize bytes of input).
+    // Offsets are log offsets: they never change, truncating the front only moves getBegin() forward.
+    // Append compresses the new bytes only, TruncateFront and Concatenate move whole frames without
+    // decoding them. The frames written one after the other are a regular zstd stream.
+    //-----------------------------------------------------------------------------------------------------
+    struct compressed_log
+    {
+        using level = fixed_block_compress::level;
+
+        struct frame
+        {
+            std::uint64_t           m_Offset;           // Log offset of its first decompressed byte
+            std::uint64_t           m_Size;             // Decompressed size
+            std::vector<std::byte>  m_Data;             // Complete zstd frame
+        };
+
+        compressed_log() = default;
+        compressed_log(const compressed_log&) = delete;
+        compressed_log& operator = (const compressed_log&) = delete;
+        ~compressed_log(void) noexcept;
+
+        xerr Init(std::uint64_t FrameSize = 64 * 1024, level CompressionLevel = level::MEDIUM) noexcept;
+
+        // Rebuilds a log from frames written by Write (or any zstd stream whose frames record their content size).
+        // Only the frame headers are read. BaseOffset is the log offset of the first frame.
+        // Frames whose content size is bigger than MaxFrameSize (FrameSize when 0) are rejected, Read would have to allocate it.
+        xerr Load(std::span<const std::byte> Frames, std::uint64_t BaseOffset = 0, std::uint64_t MaxFrameSize = 0) noexcept;
+
+        // Every FrameSize bytes make a new frame, the rest waits in the tail (readable, not compressed yet).
+        xerr Append(std::span<const std::byte> Data) noexcept;
+
+        // Compresses the tail into a (short) frame.
+        xerr Flush(void) noexcept;
+
+        // Drops the frames that end at or before Offset. The tail is never dropped.
+        void TruncateFront(std::uint64_t Offset) noexcept;
+
+        // Flushes this log and moves the frames of Other after them, their offsets follow getEnd().
+        // The tail of Other becomes the tail of this log and Other is left empty.
+        xerr Concatenate(compressed_log& Other) noexcept;
+
+        // Decompresses Destination.size() bytes starting at log offset Offset, only the frames that overlap are decoded.
+        xerr Read(std::span<std::byte> Destination, std::uint64_t Offset) noexcept;
+
+        // Sends every frame, in order, to the sink. Call Flush first to include the tail.
+        xerr Write(output_sink& Sink) const noexcept;
+
+        std::uint64_t getBegin              (void) const noexcept { return m_Frames.empty() ? m_TailOffset : m_Frames.front().m_Offset; }
+        std::uint64_t getEnd                (void) const noexcept { return m_TailOffset + m_Tail.size(); }
+        std::uint64_t getCompressedSize     (void) const noexcept { return m_CompressedSize; }
+
+        std::deque<frame>           m_Frames            = {};
+        std::vector<std::byte>      m_Tail              = {};
+        std::vector<std::byte>      m_Scratch           = {};       // Frames only partially read
+        std::uint64_t               m_TailOffset        = 0;
+        std::uint64_t               m_CompressedSize    = 0;
+        std::uint64_t               m_FrameSize         = 0;
+        void*                       m_pCCTX             = nullptr;
+        void*                       m_pDCTX             = nullptr;  // Created on the first Read
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Offline tuning: measures ratio and compress/decompress speed of fixed/dynamic, block/streaming,
+    // every level and a list of BlockSizes on a sample of a corpus, keeps the Pareto front and
+    // recommends the config that best meets a set of constraints. Configs save to a line of text
+    // and Init the compressors and decompressors with the chosen parameters.
+    //-----------------------------------------------------------------------------------------------------
+    struct autotuner
+    {
+        using level = fixed_block_compress::level;
+
+        enum class family : std::uint8_t
+        { FIXED
+        , DYNAMIC
+        };
+
+        struct config
+        {
+            family          m_Family                    = family::FIXED;
+            bool            m_bBlockSizeIsOutputSize    = false;
+            level           m_Level                     = level::HIGH;
+            std::uint64_t   m_BlockSize                 = 64 * 1024;
+
+            // Same as calling Init on the object with the tuned parameters. Block mode decompressors take the size of the source.
+            xerr Init(fixed_block_compress& Compressor, std::span<const std::byte> Source) const noexcept;
+            xerr Init(dynamic_block_compress& Compressor, std::span<const std::byte> Source) const noexcept;
+            xerr Init(fixed_block_decompress& Decompressor, std::uint64_t SourceSize) const noexcept;
+            xerr Init(dynamic_block_decompress& Decompressor, std::uint64_t SourceSize) const noexcept;
+
+            // One line of text, for example "fixed streaming medium 65536"
+            std::string toString(void) const noexcept;
+            xerr        fromString(std::string_view Text) noexcept;
+
+            bool operator == (const config&) const noexcept = default;
+        };
+
+        struct result
+        {
+            config          m_Config;
+            double          m_Ratio             = 0;        // Input / output
+            double          m_CompressMBs       = 0;
+            double          m_DecompressMBs     = 0;
+            bool            m_bPruned           = false;    // Only measured on the probe, another config was better at everything
+            bool            m_bPareto           = false;    // No other config is at least as good at everything
+        };
+
+        struct options
+        {
+            std::span<const std::uint64_t>  m_BlockSizes;                       // Empty means 4K, 16K, 64K and 128K
+            std::uint64_t                   m_MaxSampleBytes    = 8 * 1024 * 1024;  // Split evenly among the corpus files
+            std::uint32_t                   m_nRepeats          = 1;            // Fastest of n runs
+            double                          m_PruneMargin       = 0.10;         // Probe results this much worse at everything are pruned
+        };
+
+        enum class objective : std::uint8_t
+        { RATIO
+        , COMPRESS_SPEED
+        , DECOMPRESS_SPEED
+        };
+
+        struct constraint
+        {
+            double          m_MinRatio          = 0;
+            double          m_MinCompressMBs    = 0;
+            double          m_MinDecompressMBs  = 0;
+            objective       m_Objective         = objective::RATIO;     // What to maximize among the configs that qualify
+        };
+
+        // Measures the configuration space on a sample of Corpus (each span is a file), the results go to m_Results.
+        xerr Run(std::span<const std::span<const std::byte>> Corpus, const options& Options) noexcept;
+        xerr Run(std::span<const std::span<const std::byte>> Corpus) noexcept { return Run(Corpus, options{}); }
+
+        // The results that are not pruned and not dominated.
+        std::vector<result> getParetoFront(void) const noexcept;
+
+        // Best measured config under the constraints.
+        xerr Recommend(config& Config, const constraint& Constraint) const noexcept;
+
+        std::vector<result> m_Results = {};
+    };
+#endif
+
+    //-----------------------------------------------------------------------------------------------------
+    // Decompression that does a bounded amount of work per call, for callers with a fixed budget per frame
+    // (a game loop streaming assets). The stream is a list of stream_chunk in order, from fixed_block_compress
+    // or dynamic_block_compress streaming mode, or a single chunk holding a block mode frame. Each Unpack decodes
+    // up to the budget straight into the destination and stops in the middle of a chunk if it has to, the next
+    // call carries on from the exact byte where it stopped.
+    //-----------------------------------------------------------------------------------------------------
+    struct incremental_decompress
+    {
+        using clock = std::chrono::steady_clock;
+
+        // Zero means no limit. When both are set the first one reached ends the call.
+        struct budget
+        {
+            std::uint64_t   m_Bytes = 0;            // Decompressed bytes
+            clock::duration m_Time  = {};
+        };
+
+        incremental_decompress() = default;
+        ~incremental_decompress(void) noexcept;
+
+        // Chunks must be contiguous in output order (m_SourceOffset/m_SourceSize) and Destination must hold all of them.
+        // WindowSize is the history the frames need: BlockSize * SyncInterval for fixed_block_compress streaming,
+        // BlockSize for dynamic_block_compress streaming, the decompressed size for a block mode frame.
+        // The chunks and Destination must stay valid until the stream is done.
+        xerr Init(std::span<const stream_chunk> Chunks, std::span<std::byte> Destination, std::uint64_t WindowSize) noexcept;
+
+        // Decodes until the budget is spent or the stream is done, DecompressSize gets the bytes decoded by this call.
+        // The byte budget is never exceeded. The time is checked every m_SliceSize bytes, so a call can go over it by
+        // one slice, and it always decodes at least one slice so every call makes progress.
+        // Returns err::state::NOT_DONE while there is more to decode.
+        xerr Unpack(std::uint64_t& DecompressSize, const budget& Budget) noexcept;
+
+        bool            isDone      (void) const noexcept { return m_iChunk == m_Chunks.size(); }
+        std::uint64_t   getPosition (void) const noexcept { return m_OutputPosition; }   // Bytes of Destination decoded so far
+        std::uint64_t   getSize     (void) const noexcept { return m_Size; }
+
+        void*                           m_pDCTX             = nullptr;
+        std::span<const stream_chunk>   m_Chunks            = {};
+        std::span<std::byte>            m_Destination       = {};
+        std::uint64_t                   m_WindowSize        = 0;
+        std::uint64_t                   m_Size              = 0;        // Decompressed size of all the chunks
+        std::size_t                     m_iChunk            = 0;        // Chunk being decoded
+        std::uint64_t                   m_InputOffset       = 0;        // Bytes of the current chunk already consumed
+        std::uint64_t                   m_OutputPosition    = 0;
+        std::uint64_t                   m_SliceSize         = 32 * 1024; // Most output per zstd call, the time budget granularity
+        perf_counters*                  m_pPerf             = nullptr;  // Optional instrumentation
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Spreads one budget (per frame) over many incremental_decompress streams. Each pass gives every stream a share
+    // of what is left in proportion to its priority, highest priority first. A stream that finishes early leaves
+    // its share to the next pass, so the budget is used as long as any stream has work.
+    //-----------------------------------------------------------------------------------------------------
+    struct decompress_scheduler
+    {
+        using budget = incremental_decompress::budget;
+        using clock  = incremental_decompress::clock;
+
+        struct entry
+        {
+            incremental_decompress* m_pStream   = nullptr;
+            std::uint32_t           m_Priority  = 1;
+        };
+
+        // The stream must be initialized and outlive its time in the scheduler. Priority is a weight (> 0).
+        void Add(incremental_decompress& Stream, std::uint32_t Priority = 1) noexcept;
+
+        // Removes a stream before it is done (the asset is no longer needed). It can be added again later to continue.
+        void Remove(incremental_decompress& Stream) noexcept;
+
+        // Spends Budget on the streams. Finished streams are removed. A stream that fails is removed, stored in
+        // m_pFailed and its error returned. Returns err::state::NOT_DONE while streams are left.
+        xerr Run(const budget& Budget) noexcept;
+
+        bool empty(void) const noexcept { return m_Streams.empty(); }
+
+        std::vector<entry>          m_Streams   = {};       // Highest priority first
+        incremental_decompress*     m_pFailed   = nullptr;
+        std::uint64_t               m_LastBytes = 0;        // Decoded by the last Run
+    };
+
+    //-----------------------------------------------------------------------------------------------------
+    // Per-block summaries of a fixed_block_compress stream, so a scan only decompresses the blocks that can hold
+    // what it looks for. Point fixed_block_compress::m_pIndex at one and every chunk Pack produces (the whole
+    // input in block mode) gets a summary while its input is still in cache: a bloom filter of its keys, sized to
+    // m_BitsPerKey bits per distinct key, and the min/max of a field. The extractor finds both in the input,
+    // without one every run of letters, digits and '_' is a key. Chunks are cut at fixed sizes, so a record that
+    // starts in a block belongs to it and the extractor sees up to m_Lookahead bytes past the block to finish it.
+    // Write saves the index as a zstd skippable frame, so it can sit next to (or after) the compressed data and
+    // zstd decoders ignore it.
+    //-----------------------------------------------------------------------------------------------------
+    struct block_index
+    {
+        // Called with the input of each block and the input that follows it, reports the content of the records
+        // that start in Block with AddKey and AddValue.
+        using extractor = std::function<void(std::span<const std::byte> Block, std::span<const std::byte> Following, block_index& Index)>;
+
+        // Called with the decompressed data of each candidate block and where it starts in the input. Return false to stop.
+        // The last record of the block may continue in the next one.
+        using callback  = std::function<bool(std::span<const std::byte> Block, std::uint64_t SourceOffset)>;
+
+        struct summary
+        {
+            std::uint64_t   m_SourceOffset  = 0;
+            std::uint64_t   m_SourceSize    = 0;
+            std::int64_t    m_Min           = 0;        // Field range, only valid when m_nValues > 0
+            std::int64_t    m_Max           = 0;
+            std::uint64_t   m_nValues       = 0;
+            std::uint64_t   m_BloomOffset   = 0;        // First word of the filter in m_Bloom
+            std::uint64_t   m_BloomWords    = 0;        // 0 when the block has no keys
+        };
+
+        // A block is a candidate when it may hold any of the keys (if there are keys) and its range overlaps [m_Min, m_Max] (if m_bRange).
+        struct query
+        {
+            std::span<const std::string_view>   m_Keys      = {};
+            bool                                m_bRange    = false;
+            std::int64_t                        m_Min       = 0;
+            std::int64_t                        m_Max       = 0;
+        };
+
+        struct stats
+        {
+            std::uint64_t   m_nBlocks           = 0;
+            std::uint64_t   m_nCandidates       = 0;
+            std::uint64_t   m_nDecoded          = 0;    // Candidates plus the chunks before them in their history mode frame
+            std::uint64_t   m_DecodedBytes      = 0;
+        };
+
+        xerr Init(extractor Extractor = {}, std::uint32_t BitsPerKey = 10, std::uint32_t Lookahead = 1024) noexcept;
+
+        // For the extractor, they apply to the block being added.
+        void AddKey     (std::span<const std::byte> Key) noexcept;
+        void AddKey     (std::string_view Key) noexcept { AddKey(std::as_bytes(std::span(Key))); }
+        void AddValue   (std::int64_t Value) noexcept;
+
+        // Summarizes the next block, called by fixed_block_compress::Pack. Following is the input after it, up to m_Lookahead bytes.
+        xerr Add(std::span<const std::byte> Block, std::span<const std::byte> Following, std::uint64_t SourceOffset) noexcept;
+
+        bool mayContain (std::size_t iBlock, std::string_view Key) const noexcept;
+        bool isCandidate(std::size_t iBlock, const query& Query) const noexcept;
+
+        // Decompresses the candidate blocks of Chunks (the chunks of the indexed stream, in order) and hands them to Callback.
+        // Decompressor must be initialized like the stream was compressed (block or streaming mode, BlockSize, SyncInterval).
+        // In history mode a candidate is decoded from the start of its frame, the chunks before it are not handed out.
+        xerr Query(stats& Stats, fixed_block_decompress& Decompressor, std::span<const stream_chunk> Chunks, const query& Query, const callback& Callback) const noexcept;
+
+        // Saves the index as one zstd skippable frame.
+        xerr Write(output_sink& Sink) const noexcept;
+
+        // Reads an index saved by Write. The extractor is not saved, call Init before adding more blocks.
+        xerr Load(std::span<const std::byte> Frame) noexcept;
+
+        extractor                   m_Extractor     = {};
+        std::uint32_t               m_BitsPerKey    = 10;
+        std::uint32_t               m_nHashes       = 7;
+        std::uint32_t               m_Lookahead     = 1024;
+        std::vector<summary>        m_Summaries     = {};
+        std::vector<std::uint64_t>  m_Bloom         = {};       // Filters of every block back to back
+        std::vector<std::uint64_t>  m_Pending       = {};       // Key hashes of the block being added
+        summary                     m_Current       = {};
+        std::vector<std::byte>      m_Scratch       = {};       // Gathered input of a scatter-gather block and its lookahead
     };
 }
 